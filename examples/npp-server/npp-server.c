@@ -81,7 +81,7 @@ static void *
 com_android_npp_thread(void *arg)
 {
   struct llc_connection *connection = (struct llc_connection *) arg;
-  uint8_t buffer[1024];
+  uint8_t buffer[LLCP_MAX_MIU];
 
   int len;
   if ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) < 0)
@@ -96,19 +96,25 @@ static void *
 com_android_snep_service(void *arg)
 {
   struct llc_connection *connection = (struct llc_connection *) arg;
-  uint8_t frame[] = {
-    0x10, 0x02,
-    0x00, 0x00, 0x00, 33,
+  uint8_t ndef[] = {
     0xd1, 0x02, 0x1c, 0x53, 0x70, 0x91, 0x01, 0x09, 0x54, 0x02,
     0x65, 0x6e, 0x4c, 0x69, 0x62, 0x6e, 0x66, 0x63, 0x51, 0x01,
     0x0b, 0x55, 0x03, 0x6c, 0x69, 0x62, 0x6e, 0x66, 0x63, 0x2e,
     0x6f, 0x72, 0x67
   };
-  uint8_t buf[1024];
+  uint8_t header[] = {
+    0x10, 0x02,
+    0x00, 0x00, 0x00, sizeof(ndef)
+  };
+  struct iovec frame[] = {
+    { header, sizeof(header) },
+    { ndef, sizeof(ndef) },
+  };
+  uint8_t buf[LLCP_MAX_MIU];
   int ret;
   uint8_t ssap;
 
-  llc_connection_send(connection, frame, sizeof(frame));
+  llc_connection_sendv(connection, frame, 2);
 
   ret = llc_connection_recv(connection, buf, sizeof(buf), &ssap);
   if(ret>0){
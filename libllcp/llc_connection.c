@@ -40,12 +40,66 @@
 #include "llcp_log.h"
 #include "llcp_pdu.h"
 #include "llcp_parameters.h"
+#include "llcp_probes.h"
+#include "llcp_queue.h"
+#include "llcp_stats.h"
+#include "llcp_trace.h"
 
 #define LOG_LLC_CONNECTION "libllcp.llc.connection"
 #define LLC_CONNECTION_MSG(priority, message) llcp_log_log (LOG_LLC_CONNECTION, priority, "%s", message)
 #define LLC_CONNECTION_LOG(priority, format, ...) llcp_log_log (LOG_LLC_CONNECTION, priority, format, __VA_ARGS__)
 
 struct llc_connection *llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap);
+static void llc_connection_destroy(struct llc_connection *connection);
+
+/*
+ * Reset the state of a connection, but not its message queues nor its
+ * receive buffer.
+ */
+static void
+llc_connection_reset(struct llc_connection *connection)
+{
+  connection->thread = 0;
+  connection->thread_exited = 0;
+  connection->status = DLC_DISCONNECTED;
+  connection->pool_next = NULL;
+  free(connection->remote_uri);
+  connection->remote_uri = NULL;
+
+  connection->state.s  = 0;
+  connection->state.sa = 0;
+  connection->state.r  = 0;
+  connection->state.ra = 0;
+  connection->remote_miu = LLCP_DEFAULT_MIU;
+  connection->rwr = LLCP_DEFAULT_RW;
+
+  connection->user_data = NULL;
+
+  memset(&connection->stats, 0, sizeof(connection->stats));
+  connection->rx_queued = connection->rx_dequeued = 0;
+  connection->rx_bytes_queued = connection->rx_bytes_dequeued = 0;
+  connection->tx_queued = connection->tx_dequeued = 0;
+  connection->setup_start = 0;
+  connection->teardown_start = 0;
+  memset(&connection->up_stamps, 0, sizeof(connection->up_stamps));
+  connection->request_origin = 0;
+  memset(connection->sent_at, 0, sizeof(connection->sent_at));
+  connection->window_since = 0;
+  llcp_histogram_reset(&connection->rtt);
+  connection->rx_borrowed = 0;
+  connection->rx_waiters = 0;
+  connection->rx_busy = 0;
+  connection->rx_busy_sent = 0;
+  connection->tx_peer_busy = 0;
+  connection->tx_timeout = 0;
+  connection->tx_waiters = 0;
+  free(connection->tx_buffer);
+  connection->tx_buffer = NULL;
+  connection->tx_length = 0;
+  connection->tx_coalescing = 0;
+  connection->tx_delay_ns = 0;
+  connection->tx_deadline = 0;
+}
 
 struct llc_connection *
 llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap) {
@@ -55,20 +109,13 @@ llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap)
 
   if ((res = malloc(sizeof *res))) {
     res->link = link;
-    res->thread = 0;
+    res->type = LLC_DATA_LINK_CONNECTION;
     res->service_sap = local_sap;
     res->local_sap = local_sap;
     res->remote_sap = remote_sap;
     res->remote_uri = NULL;
-    res->status = DLC_DISCONNECTED;
-
-    res->state.s  = 0;
-    res->state.sa = 0;
-    res->state.r  = 0;
-    res->state.ra = 0;
+    res->tx_buffer = NULL;
     res->local_miu  = LLCP_DEFAULT_MIU;
-    res->remote_miu = LLCP_DEFAULT_MIU;
-    res->rwr = LLCP_DEFAULT_RW;
     res->rwl = LLCP_DEFAULT_RW;
 
     res->mq_up_name   = NULL;
@@ -76,7 +123,18 @@ llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap)
     res->llc_up   = (mqd_t) - 1;
     res->llc_down = (mqd_t) - 1;
 
-    res->user_data = NULL;
+    res->rx_buffer = NULL;
+    res->rx_buffer_size = 0;
+    res->rx_budget = 0;
+    res->rx_slots = 0;
+    pthread_mutex_init(&res->tx_mutex, NULL);
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&res->tx_cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    llc_connection_reset(res);
   } else {
     LLC_CONNECTION_MSG(LLC_PRIORITY_FATAL, "Cannot allocate memory");
   }
@@ -84,46 +142,305 @@ llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap)
   return res;
 }
 
+/*
+ * Depth of a queue of the connection: enough for two windows of rw PDUs, so
+ * that a full window can wait for the service (or the LLC Link) while the
+ * next one is on its way.
+ */
+static long
+llc_connection_queue_depth(const struct llc_connection *connection, uint8_t rw)
+{
+  const struct llc_service *service = connection->link->available_services[connection->service_sap];
+
+  if (service && service->queue_depth)
+    return service->queue_depth;
+
+  return 2 * MAX(rw, 1);
+}
+
+/*
+ * (Re)open the down queue, sized after the remote receive window.
+ */
+static int
+llc_connection_open_down(struct llc_connection *connection)
+{
+  long wanted = llc_connection_queue_depth(connection, connection->rwr);
+  long depth = wanted;
+
+  llcp_queue_close(connection->llc_down, connection->mq_down_name);
+  connection->llc_down = llcp_queue_open(connection->mq_down_name, O_RDWR | O_NONBLOCK, &depth, 3 + connection->remote_miu);
+  if (connection->llc_down == (mqd_t) - 1)
+    return -1;
+  if (depth < wanted)
+    STATS_INC(connection->stats.queue_limited);
+
+  return 0;
+}
+
 int
 llc_connection_start(struct llc_connection *connection)
 {
   assert(connection);
 
-  struct mq_attr attr_up = {
-    .mq_msgsize = 3 + connection->local_miu,
-    .mq_maxmsg  = 2,
-  };
+  if (connection->llc_up != (mqd_t) - 1) {
+    /* A pooled connection: only the down queue may not fit */
+    struct mq_attr attr;
+    if ((mq_getattr(connection->llc_down, &attr) == 0) &&
+        (attr.mq_msgsize == 3 + connection->remote_miu) &&
+        (attr.mq_maxmsg == llc_connection_queue_depth(connection, connection->rwr)))
+      return 0;
+    return llc_connection_open_down(connection);
+  }
 
   if (asprintf(&connection->mq_up_name, "/libllcp-%d-%p-%s", getpid(), (void *) connection, "up") < 0) {
     LLC_CONNECTION_MSG(LLC_PRIORITY_FATAL, "Cannot print to allocated string");
     return -1;
   }
-  connection->llc_up = mq_open(connection->mq_up_name, O_RDWR | O_CREAT, 0666, &attr_up);
-  if (connection->llc_up == (mqd_t) - 1) {
-    LLC_CONNECTION_LOG(LLC_PRIORITY_FATAL, "Cannot open message queue '%s'", connection->mq_up_name);
-    llc_connection_free(connection);
-    return -1;
-  }
 
-  struct mq_attr attr_down = {
-    .mq_msgsize = 3 + connection->remote_miu,
-    .mq_maxmsg  = 2,
-  };
+  long wanted = llc_connection_queue_depth(connection, connection->rwl);
+  long depth = wanted;
+
+  connection->llc_up = llcp_queue_open(connection->mq_up_name, O_RDWR, &depth, 3 + connection->local_miu);
+  if (connection->llc_up == (mqd_t) - 1)
+    return -1;
+  if (depth < wanted)
+    STATS_INC(connection->stats.queue_limited);
+  connection->rx_slots = depth;
+  connection->rx_budget = depth * (3 + connection->local_miu);
 
   if (asprintf(&connection->mq_down_name, "/libllcp-%d-%p-%s", getpid(), (void *) connection, "down") < 0) {
     LLC_CONNECTION_MSG(LLC_PRIORITY_FATAL, "Cannot print to allocated string");
     return -1;
   }
-  connection->llc_down = mq_open(connection->mq_down_name, O_RDWR | O_CREAT | O_NONBLOCK, 0666, &attr_down);
-  if (connection->llc_down == (mqd_t) - 1) {
-    LLC_CONNECTION_LOG(LLC_PRIORITY_FATAL, "Cannot open message queue '%s'", connection->mq_down_name);
-    llc_connection_free(connection);
+
+  return llc_connection_open_down(connection);
+}
+
+/*
+ * Connection pools (see llc_service_set_pool_size()) hold started data link
+ * connections which are not registered with their link.  Pooled connections
+ * of a service are taken by its new connections when their up queue fits,
+ * the down queue being reopened if the peer parameters require it.
+ */
+static int
+llc_connection_pool_fits(const struct llc_connection *connection, const struct llc_service *service)
+{
+  const struct llc_link *link = connection->link;
+
+  return (connection->local_miu == MIN(service->miu, link->local_miu)) && (connection->rwl == service->rw);
+}
+
+static unsigned
+llc_connection_pool_count(const struct llc_link *link, uint8_t service_sap)
+{
+  unsigned count = 0;
+
+  for (const struct llc_connection *c = link->pool; c; c = c->pool_next)
+    if (c->service_sap == service_sap)
+      count++;
+
+  return count;
+}
+
+static struct llc_connection *
+llc_connection_pool_take(struct llc_link *link, uint8_t service_sap) {
+  const struct llc_service *service = link->available_services[service_sap];
+  struct llc_connection **p, *res = NULL;
+
+  if (!service || !service->pool_size)
+    return NULL;
+
+  pthread_mutex_lock(&link->pool_mutex);
+  for (p = &link->pool; *p; p = &(*p)->pool_next) {
+    if (((*p)->service_sap == service_sap) && llc_connection_pool_fits(*p, service)) {
+      res = *p;
+      *p = res->pool_next;
+      res->pool_next = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&link->pool_mutex);
+
+  if (res)
+    STATS_INC(link->stats.pool_hits);
+  else
+    STATS_INC(link->stats.pool_misses);
+
+  return res;
+}
+
+/*
+ * Reset a terminated connection and return it to the pool of its service.
+ * Fails when the connection cannot be reused or the pool is full.
+ */
+static int
+llc_connection_pool_put(struct llc_connection *connection)
+{
+  struct llc_link *link = connection->link;
+  const struct llc_service *service = link->available_services[connection->service_sap];
+
+  if ((connection->type != LLC_DATA_LINK_CONNECTION) ||
+      (connection->llc_up == (mqd_t) - 1) || (connection->llc_down == (mqd_t) - 1) ||
+      !service || !llc_connection_pool_fits(connection, service))
     return -1;
+
+  pthread_mutex_lock(&link->pool_mutex);
+  int full = llc_connection_pool_count(link, connection->service_sap) >= service->pool_size;
+  if (!full) {
+    /* Nothing else references the connection: empty its queues */
+    uint8_t buffer[LLCP_MAX_PDU_SIZE];
+    struct timespec past = { 0, 0 };
+    while (mq_timedreceive(connection->llc_up, (char *) buffer, sizeof(buffer), NULL, &past) >= 0);
+    while (mq_timedreceive(connection->llc_down, (char *) buffer, sizeof(buffer), NULL, &past) >= 0);
+
+    llc_connection_reset(connection);
+    connection->pool_next = link->pool;
+    link->pool = connection;
+  }
+  pthread_mutex_unlock(&link->pool_mutex);
+
+  return full ? -1 : 0;
+}
+
+/*
+ * Start connections until the pool of the service bound to service_sap
+ * holds as many as it should.  Pooled connections which do not fit the
+ * service anymore are freed.
+ */
+int
+llc_connection_pool_fill(struct llc_link *link, uint8_t service_sap)
+{
+  assert(link);
+
+  const struct llc_service *service = link->available_services[service_sap];
+  struct llc_connection **p, *stale = NULL;
+  unsigned count;
+
+  if (!service)
+    return 0;
+
+  pthread_mutex_lock(&link->pool_mutex);
+  for (p = &link->pool; *p;) {
+    if (((*p)->service_sap == service_sap) && !llc_connection_pool_fits(*p, service)) {
+      struct llc_connection *connection = *p;
+      *p = connection->pool_next;
+      connection->pool_next = stale;
+      stale = connection;
+    } else {
+      p = &(*p)->pool_next;
+    }
+  }
+  count = llc_connection_pool_count(link, service_sap);
+  pthread_mutex_unlock(&link->pool_mutex);
+
+  while (stale) {
+    struct llc_connection *connection = stale;
+    stale = connection->pool_next;
+    llc_connection_destroy(connection);
+  }
+
+  for (; count < service->pool_size; count++) {
+    struct llc_connection *connection;
+
+    if (!(connection = llc_connection_new(link, service_sap, 0)))
+      return -1;
+    connection->local_miu = MIN(service->miu, link->local_miu);
+    connection->rwl = service->rw;
+    if (llc_connection_start(connection) < 0) {
+      llc_connection_destroy(connection);
+      return -1;
+    }
+    if ((connection->rx_buffer = malloc(3 + connection->local_miu)))
+      connection->rx_buffer_size = 3 + connection->local_miu;
+    if (llc_connection_pool_put(connection) < 0) {
+      llc_connection_destroy(connection);
+      return -1;
+    }
   }
 
   return 0;
 }
 
+/*
+ * Free the pooled connections of the service bound to service_sap, or of
+ * every service if service_sap is MAX_LLC_LINK_SERVICE + 1.
+ */
+void
+llc_connection_pool_flush(struct llc_link *link, uint8_t service_sap)
+{
+  assert(link);
+
+  struct llc_connection **p, *flushed = NULL;
+
+  pthread_mutex_lock(&link->pool_mutex);
+  for (p = &link->pool; *p;) {
+    if ((service_sap > MAX_LLC_LINK_SERVICE) || ((*p)->service_sap == service_sap)) {
+      struct llc_connection *connection = *p;
+      *p = connection->pool_next;
+      connection->pool_next = flushed;
+      flushed = connection;
+    } else {
+      p = &(*p)->pool_next;
+    }
+  }
+  pthread_mutex_unlock(&link->pool_mutex);
+
+  while (flushed) {
+    struct llc_connection *connection = flushed;
+    flushed = connection->pool_next;
+    llc_connection_destroy(connection);
+  }
+}
+
+/*
+ * A new data link connection of the service bound to service_sap, taken
+ * from its pool when possible.
+ */
+static struct llc_connection *
+llc_connection_acquire(struct llc_link *link, uint8_t service_sap, uint8_t local_sap, uint8_t remote_sap) {
+  struct llc_connection *res;
+
+  if ((res = llc_connection_pool_take(link, service_sap))) {
+    res->local_sap = local_sap;
+    res->remote_sap = remote_sap;
+    return res;
+  }
+
+  return llc_connection_new(link, local_sap, remote_sap);
+}
+
+/*
+ * The peer accepted the connection with a CC PDU: apply its parameters
+ * before the service thread starts.
+ */
+int
+llc_connection_complete(struct llc_connection *connection, const uint8_t *parameters, size_t len)
+{
+  assert(connection);
+
+  struct parameters p;
+  int res;
+
+  if ((res = parameters_decode(parameters, len, &p)) < 0) {
+    LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Invalid parameters list: %s", parameter_strerror(res));
+    return -1;
+  }
+
+  uint16_t miu = connection->remote_miu;
+  uint8_t rw = connection->rwr;
+
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_MIUX))
+    miu = MIN(128 + p.miux, connection->link->remote_miu);
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_RW))
+    rw = p.rw;
+  if ((miu == connection->remote_miu) && (rw == connection->rwr))
+    return 0;
+
+  connection->remote_miu = miu;
+  connection->rwr = rw;
+  return llc_connection_open_down(connection);
+}
+
 struct llc_connection *
 llc_data_link_connection_new(struct llc_link *link, const struct pdu *pdu, int *reason) {
   assert(link);
@@ -132,57 +449,32 @@ llc_data_link_connection_new(struct llc_link *link, const struct pdu *pdu, int *
 
   struct llc_connection *res;
 
-  char sn[BUFSIZ];
+  struct parameters p;
   int8_t service_sap = pdu->dsap;
-  uint16_t miux, miu = LLCP_DEFAULT_MIU;
-  uint8_t rw = 2;
+  uint16_t miu = LLCP_DEFAULT_MIU;
+  uint8_t rw = LLCP_DEFAULT_RW;
+  int res_decode;
 
   *reason = -1;
 
-  size_t offset = 0;
-  while (offset < pdu->information_size) {
-    if (offset > pdu->information_size - 2) {
-      LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Incomplete TLV field in parameters list");
-      return NULL;
-    }
-    if (offset + 2 + pdu->information[offset + 1] > pdu->information_size) {
-      LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Incomplete TLV value in parameters list (expected %d bytes but only %d left)", pdu->information[offset + 1], pdu->information_size - (offset + 2));
-      return NULL;
-    }
-    switch (pdu->information[offset]) {
-      case LLCP_PARAMETER_MIUX:
-        if (parameter_decode_miux(pdu->information + offset, 2 + pdu->information[offset + 1], &miux) < 0) {
-          LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Invalid MIUX parameter");
-          return NULL;
-        }
-        miu = 128 + miux;
-        break;
-      case LLCP_PARAMETER_RW:
-        if (parameter_decode_rw(pdu->information + offset, 2 + pdu->information[offset + 1], &rw) < 0) {
-          LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Invalid RW parameter");
-          return NULL;
-        }
-        break;
-      case LLCP_PARAMETER_SN:
-        if (parameter_decode_sn(pdu->information + offset, 2 + pdu->information[offset + 1], sn, sizeof(sn)) < 0) {
-          LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Invalid SN parameter");
-          return NULL;
-        }
-        if (pdu->dsap == 0x01) {
-          service_sap = llc_link_find_sap_by_uri(link, sn);
-          if (!service_sap) {
-            *reason = 0x02;
-            return NULL;
-          }
-        } else {
-          LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Ignoring SN parameter (DSAP is %d, not 1)", pdu->dsap);
-        }
-        break;
-      default:
-        LLC_CONNECTION_LOG(LLC_PRIORITY_INFO, "Unknown TLV Field 0x%02x (length: %d)",
-                           pdu->information[offset], pdu->information[offset + 1]);
+  if ((res_decode = parameters_decode(pdu->information, pdu->information_size, &p)) < 0) {
+    LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Invalid parameters list: %s", parameter_strerror(res_decode));
+    return NULL;
+  }
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_MIUX))
+    miu = 128 + p.miux;
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_RW))
+    rw = p.rw;
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_SN)) {
+    if (pdu->dsap == 0x01) {
+      service_sap = llc_link_find_sap_by_sn(link, p.sn, p.sn_len);
+      if (!service_sap) {
+        *reason = 0x02;
+        return NULL;
+      }
+    } else {
+      LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Ignoring SN parameter (DSAP is %d, not 1)", pdu->dsap);
     }
-    offset += 2 + pdu->information[offset + 1];
   }
 
   if (!link->available_services[service_sap]) {
@@ -190,23 +482,34 @@ llc_data_link_connection_new(struct llc_link *link, const struct pdu *pdu, int *
     return NULL;
   }
 
+  /*
+   * Further connections to the service use the next SAPs which are neither
+   * used by another connection nor bound to another service, so that they
+   * never take the SAP of a service establishing connections of its own.
+   */
   int8_t connection_dsap = service_sap;
 
-  while (link->transmission_handlers[connection_dsap] && (connection_dsap <= MAX_LLC_LINK_SERVICE))
+  while ((connection_dsap <= MAX_LLC_LINK_SERVICE) &&
+         (llc_link_find_connection(link, connection_dsap) ||
+          ((connection_dsap != service_sap) && link->available_services[connection_dsap])))
     connection_dsap++;
 
   if (connection_dsap > MAX_LLC_LINK_SERVICE) {
     return NULL;
   }
 
-  if ((res = llc_connection_new(link, connection_dsap, pdu->ssap))) {
-    assert(!link->transmission_handlers[connection_dsap]);
-    link->transmission_handlers[connection_dsap] = res;
+  if ((res = llc_connection_acquire(link, service_sap, connection_dsap, pdu->ssap))) {
+    if (llc_link_add_connection(link, res) < 0) {
+      llc_connection_free(res);
+      return NULL;
+    }
     res->service_sap = service_sap;
     res->status = DLC_NEW;
+    res->setup_start = stats_now();
     res->rwr = rw;
-    res->remote_miu = miu;
-    res->local_miu  = link->available_services[service_sap]->miu;
+    res->remote_miu = MIN(miu, link->remote_miu);
+    res->local_miu  = MIN(link->available_services[service_sap]->miu, link->local_miu);
+    res->rwl = link->available_services[service_sap]->rw;
 
     if (llc_connection_start(res) < 0) {
       llc_connection_free(res);
@@ -221,13 +524,17 @@ struct llc_connection *
 llc_outgoing_data_link_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap) {
   struct llc_connection *res;
 
-  if ((res = llc_connection_new(link, local_sap, remote_sap))) {
-    link->transmission_handlers[local_sap] = res;
+  if ((res = llc_connection_acquire(link, local_sap, local_sap, remote_sap))) {
+    if (llc_link_add_connection(link, res) < 0) {
+      llc_connection_free(res);
+      return NULL;
+    }
     res->service_sap = local_sap;
     res->status = DLC_NEW;
     //res->rwr = rw;
     //res->remote_miu = miu;
-    res->local_miu  = link->available_services[local_sap]->miu;
+    res->local_miu  = MIN(link->available_services[local_sap]->miu, link->local_miu);
+    res->rwl = link->available_services[local_sap]->rw;
 
     if (llc_connection_start(res) < 0) {
       llc_connection_free(res);
@@ -241,14 +548,23 @@ llc_outgoing_data_link_connection_new(struct llc_link *link, uint8_t local_sap,
 struct llc_connection *
 llc_outgoing_data_link_connection_new_by_uri(struct llc_link *link, uint8_t local_sap, const char *remote_uri) {
   struct llc_connection *res;
+  int remote_sap;
 
-  if ((res = llc_connection_new(link, local_sap, 1))) {
-    link->transmission_handlers[local_sap] = res;
+  /* Skip the name lookup when the peer SDP already resolved this URI */
+  if ((remote_sap = llc_link_resolve_cached(link, remote_uri)) > 0)
+    return llc_outgoing_data_link_connection_new(link, local_sap, remote_sap);
+
+  if ((res = llc_connection_acquire(link, local_sap, local_sap, 1))) {
+    if (llc_link_add_connection(link, res) < 0) {
+      llc_connection_free(res);
+      return NULL;
+    }
     res->service_sap = local_sap;
     res->status = DLC_NEW;
     //res->rwr = rw;
     //res->remote_miu = miu;
-    res->local_miu  = link->available_services[local_sap]->miu;
+    res->local_miu  = MIN(link->available_services[local_sap]->miu, link->local_miu);
+    res->rwl = link->available_services[local_sap]->rw;
     res->remote_uri = strdup(remote_uri);
 
     if (llc_connection_start(res) < 0) {
@@ -266,22 +582,32 @@ llc_logical_data_link_new(struct llc_link *link, const struct pdu *pdu) {
   assert(pdu);
 
   struct llc_connection *res;
-  uint8_t sap = 0;
+  int logical_data_links = 0;
 
   if (!link->available_services[pdu->dsap]) {
     return NULL;
   }
 
-  while (link->datagram_handlers[sap] && (sap <= MAX_LOGICAL_DATA_LINK))
-    sap++;
+  pthread_mutex_lock(&link->connections_mutex);
+  for (int i = 0; i < link->connection_count; i++)
+    if (link->connections[i]->type == LLC_LOGICAL_DATA_LINK)
+      logical_data_links++;
+  pthread_mutex_unlock(&link->connections_mutex);
 
-  if (sap > MAX_LOGICAL_DATA_LINK) {
+  if (logical_data_links >= MAX_LOGICAL_DATA_LINK) {
     LLC_CONNECTION_MSG(LLC_PRIORITY_CRIT, "No place left for new Logical Data Link");
     return NULL;
   }
 
   if ((res = llc_connection_new(link, pdu->dsap, pdu->ssap))) {
-    link->datagram_handlers[sap] = res;
+    res->type = LLC_LOGICAL_DATA_LINK;
+    if (llc_link_add_connection(link, res) < 0) {
+      llc_connection_free(res);
+      return NULL;
+    }
+    /* UI PDUs are only limited by the link MIU */
+    res->local_miu  = link->local_miu;
+    res->remote_miu = link->remote_miu;
 
     if (llc_connection_start(res) < 0) {
       llc_connection_free(res);
@@ -298,21 +624,31 @@ llc_connection_connect(struct llc_connection *connection)
   assert(connection);
   assert(connection->link);
 
-  uint8_t buffer[BUFSIZ];
-  size_t len = 0;
-  if (connection->remote_uri) {
-    int r = parameter_encode_sn(buffer, sizeof(buffer) - len, connection->remote_uri);
-    if (r >= 0)
-      len += r;
+  /* Don't wait for a DM PDU from a peer known not to provide the service */
+  if ((connection->remote_uri && (0 == llc_link_resolve_cached(connection->link, connection->remote_uri))) ||
+      ((connection->remote_sap > LLCP_SDP_SAP) && (0 == llc_link_peer_provides_sap(connection->link, connection->remote_sap)))) {
+    LLC_CONNECTION_LOG(LLC_PRIORITY_INFO, "Peer does not provide the service [%d -> %d]", connection->local_sap, connection->remote_sap);
+    connection->status = DLC_REJECTED;
+    return LLC_CONNECTION_NO_SERVICE;
   }
 
-  struct pdu *pdu = pdu_new(connection->remote_sap, PDU_CONNECT, connection->local_sap, 0, 0, buffer, len);
-  int res = llc_link_send_pdu(connection->link, pdu);
-  pdu_free(pdu);
+  /* Header, MIUX, RW and SN parameters (at most 255 bytes) */
+  uint8_t buffer[2 + 4 + 3 + 2 + UINT8_MAX];
+  struct pdu_builder connect;
+
+  pdu_builder_begin(&connect, buffer, sizeof(buffer), connection->remote_sap, PDU_CONNECT, connection->local_sap, 0, 0);
+  if (connection->local_miu > LLCP_DEFAULT_MIU)
+    pdu_builder_tlv_miux(&connect, connection->local_miu - LLCP_DEFAULT_MIU);
+  pdu_builder_tlv_rw(&connect, connection->rwl);
+  if (connection->remote_uri)
+    pdu_builder_tlv_sn(&connect, connection->remote_uri);
+
+  connection->setup_start = stats_now();
+  int res = llc_link_send_packed(connection->link, buffer, pdu_builder_commit(&connect));
 
   if (res >= 0) {
-    connection->link->transmission_handlers[connection->local_sap] = connection;
     connection->status = DLC_NEW;
+    LLCP_PROBE4(connection__state, connection, connection->local_sap, connection->remote_sap, DLC_NEW);
     res = llc_connection_start(connection);
   }
 
@@ -327,6 +663,8 @@ llc_connection_accept(struct llc_connection *connection)
   LLC_CONNECTION_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accepted", connection->local_sap, connection->remote_sap);
 
   connection->status = DLC_ACCEPTED;
+  llcp_trace(LLCP_TRACE_CONNECTION_STATE, connection->remote_sap, connection->local_sap, DLC_ACCEPTED);
+  LLCP_PROBE4(connection__state, connection, connection->local_sap, connection->remote_sap, DLC_ACCEPTED);
   connection->thread = 0;
   pthread_exit(NULL);
 }
@@ -339,10 +677,29 @@ llc_connection_reject(struct llc_connection *connection)
   LLC_CONNECTION_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] rejected", connection->local_sap, connection->remote_sap);
 
   connection->status = DLC_REJECTED;
+  llcp_trace(LLCP_TRACE_CONNECTION_STATE, connection->remote_sap, connection->local_sap, DLC_REJECTED);
+  LLCP_PROBE4(connection__state, connection, connection->local_sap, connection->remote_sap, DLC_REJECTED);
   connection->thread = 0;
   pthread_exit(NULL);
 }
 
+static int
+llc_connection_send_packed(struct llc_connection *connection, const uint8_t *buffer, size_t len)
+{
+  if (mq_send(connection->llc_down, (const char *) buffer, len, 0) < 0) {
+    int error = errno;
+    /* A full queue is the caller's business (see llc_connection_set_send_timeout()) */
+    if (error != EAGAIN)
+      LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Error enqueuing PDU");
+    errno = error;
+    return -1;
+  }
+  STATS_INC(connection->tx_queued);
+  stats_max(&connection->stats.tx_queue_hwm, connection->tx_queued - STATS_GET(connection->tx_dequeued));
+
+  return 0;
+}
+
 int
 llc_connection_send_pdu(struct llc_connection *connection, const struct pdu *pdu)
 {
@@ -354,48 +711,510 @@ llc_connection_send_pdu(struct llc_connection *connection, const struct pdu *pdu
     return -1;
   }
 
-  uint8_t buffer[BUFSIZ];
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
   int len = pdu_pack(pdu, buffer, sizeof(buffer));
+  if (len < 0)
+    return -1;
+
+  return llc_connection_send_packed(connection, buffer, len);
+}
+
+int
+llc_connection_send(struct llc_connection *connection, const uint8_t *data, size_t len)
+{
+  struct iovec iov = { (void *) data, len };
 
-  if (mq_send(connection->llc_down, (char *) buffer, len, 0) < 0) {
-    LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Error enqueuing PDU");
+  return llc_connection_sendv(connection, &iov, 1);
+}
+
+static int
+llc_connection_sendv_packed(struct llc_connection *connection, const struct iovec *iov, int iovcnt)
+{
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
+  struct pdu_builder i;
+
+  /* N(S) and N(R) are assigned when the LLC Link actually sends the PDU */
+  pdu_builder_begin(&i, buffer, 3 + connection->remote_miu, connection->remote_sap, PDU_I, connection->local_sap, 0, 0);
+  for (int n = 0; n < iovcnt; n++) {
+    if (pdu_builder_bytes(&i, iov[n].iov_base, iov[n].iov_len) < 0)
+      return -1;
+  }
+
+  return llc_connection_send_packed(connection, buffer, pdu_builder_commit(&i));
+}
+
+/*
+ * Enqueue the coalesced I PDU, if any.  Called with tx_mutex held.
+ */
+static int
+llc_connection_flush_locked(struct llc_connection *connection)
+{
+  if (connection->tx_length <= 3)
+    return 0;
+
+  if (llc_connection_send_packed(connection, connection->tx_buffer, connection->tx_length) < 0)
     return -1;
+  connection->tx_length = 3;
+
+  return 0;
+}
+
+static int
+llc_connection_sendv_once(struct llc_connection *connection, const struct iovec *iov, int iovcnt)
+{
+  if (!connection->tx_buffer)
+    return llc_connection_sendv_packed(connection, iov, iovcnt);
+
+  size_t len = 0;
+  for (int n = 0; n < iovcnt; n++)
+    len += iov[n].iov_len;
+
+  int res = 0;
+  int old_cancelstate;
+
+  /* Don't leave tx_mutex locked if the service thread gets cancelled */
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
+  pthread_mutex_lock(&connection->tx_mutex);
+
+  /* Keep the data in order: what is pending goes first */
+  if (!connection->tx_coalescing || (connection->tx_length + len > 3 + connection->remote_miu))
+    res = llc_connection_flush_locked(connection);
+
+  if (res < 0) {
+    /* NOOP */
+  } else if (!connection->tx_coalescing || (len > connection->remote_miu)) {
+    res = llc_connection_sendv_packed(connection, iov, iovcnt);
+  } else if (len) {
+    if (connection->tx_length == 3)
+      connection->tx_deadline = stats_now() + connection->tx_delay_ns;
+    else
+      STATS_INC(connection->stats.tx_coalesced);
+    for (int n = 0; n < iovcnt; n++) {
+      memcpy(connection->tx_buffer + connection->tx_length, iov[n].iov_base, iov[n].iov_len);
+      connection->tx_length += iov[n].iov_len;
+    }
+    /* A full I PDU does not need to wait: if the queue is full, the LLC Link will pick it up */
+    if (connection->tx_length == 3 + connection->remote_miu)
+      llc_connection_flush_locked(connection);
   }
 
+  pthread_mutex_unlock(&connection->tx_mutex);
+  pthread_setcancelstate(old_cancelstate, NULL);
+
+  return res;
+}
+
+/*
+ * Set how long llc_connection_send() and llc_connection_sendv() wait for
+ * room in the connection down queue, in milliseconds: 0 (the default) fails
+ * immediately with errno set to EAGAIN, a negative timeout waits forever.
+ * The queue fills up when the peer is busy or the send window is full, so
+ * this is how the peer pushes back on senders.
+ */
+int
+llc_connection_set_send_timeout(struct llc_connection *connection, int timeout)
+{
+  assert(connection);
+
+  connection->tx_timeout = timeout;
   return 0;
 }
 
+static void
+llc_connection_wait_writable_cleanup(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+
+  __atomic_sub_fetch(&connection->tx_waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&connection->tx_mutex);
+}
+
+/*
+ * Wait until the connection down queue has room for a PDU, for at most
+ * timeout milliseconds (same values as llc_connection_set_send_timeout()).
+ * Fails with errno set to EAGAIN or ETIMEDOUT.
+ */
 int
-llc_connection_send(struct llc_connection *connection, const uint8_t *data, size_t len)
+llc_connection_wait_writable(struct llc_connection *connection, int timeout)
+{
+  assert(connection);
+
+  struct timespec ts;
+  struct mq_attr attr;
+  int res = 0;
+
+  if (timeout > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec  += timeout / 1000;
+    ts.tv_nsec += (timeout % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&connection->tx_mutex);
+  pthread_cleanup_push(llc_connection_wait_writable_cleanup, connection);
+  /* Registered before looking at the queue, see llc_connection_tx_dequeued() */
+  __atomic_add_fetch(&connection->tx_waiters, 1, __ATOMIC_SEQ_CST);
+  while (res == 0) {
+    if (mq_getattr(connection->llc_down, &attr) < 0) {
+      res = -1;
+    } else if (attr.mq_curmsgs < attr.mq_maxmsg) {
+      break;
+    } else if (timeout == 0) {
+      errno = EAGAIN;
+      res = -1;
+    } else if (timeout < 0) {
+      pthread_cond_wait(&connection->tx_cond, &connection->tx_mutex);
+    } else if (pthread_cond_timedwait(&connection->tx_cond, &connection->tx_mutex, &ts) == ETIMEDOUT) {
+      errno = ETIMEDOUT;
+      res = -1;
+    }
+  }
+  pthread_cleanup_pop(1);
+
+  return res;
+}
+
+/*
+ * The connection down queue is full: wait for room in it until the send
+ * timeout started at deadline - tx_timeout expires.
+ */
+static int
+llc_connection_wait_send(struct llc_connection *connection, uint64_t deadline)
+{
+  int timeout = -1;
+
+  if (connection->tx_timeout > 0) {
+    uint64_t now = stats_now();
+    if (now >= deadline) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    timeout = (deadline - now + 999999) / 1000000;
+  }
+
+  return llc_connection_wait_writable(connection, timeout);
+}
+
+/*
+ * Send the iovcnt buffers described by iov as a single I PDU.  They are
+ * gathered directly in the PDU enqueued for the LLC Link.
+ *
+ * When coalescing is enabled, the data is appended to the I PDU being
+ * coalesced instead (see llc_connection_set_coalescing()).
+ *
+ * When the connection down queue is full, waits for the LLC Link as long as
+ * the send timeout allows (see llc_connection_set_send_timeout()).
+ */
+int
+llc_connection_sendv(struct llc_connection *connection, const struct iovec *iov, int iovcnt)
 {
-  struct pdu *pdu = pdu_new_i(connection->remote_sap, connection->local_sap, connection, data, len);
-  int res = llc_connection_send_pdu(connection, pdu);
-  pdu_free(pdu);
+  assert(connection);
+  assert(connection->status == DLC_CONNECTED);
+
+  int res = llc_connection_sendv_once(connection, iov, iovcnt);
+  if ((res == 0) || (errno != EAGAIN) || !connection->tx_timeout)
+    return res;
+
+  STATS_INC(connection->stats.tx_blocked);
+  uint64_t deadline = stats_now() + (uint64_t) connection->tx_timeout * 1000000;
+  do {
+    if (llc_connection_wait_send(connection, deadline) < 0)
+      return -1;
+  } while (((res = llc_connection_sendv_once(connection, iov, iovcnt)) < 0) && (errno == EAGAIN));
 
   return res;
 }
 
+/*
+ * The LLC Link thread dequeued a PDU from the connection down queue: wake up
+ * the threads waiting for room in it.
+ */
+void
+llc_connection_tx_dequeued(struct llc_connection *connection)
+{
+  STATS_INC(connection->tx_dequeued);
+  if (__atomic_load_n(&connection->tx_waiters, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&connection->tx_mutex);
+    pthread_cond_broadcast(&connection->tx_cond);
+    pthread_mutex_unlock(&connection->tx_mutex);
+  }
+}
+
+/*
+ * The service thread of the connection, if any, can only go on once the LLC
+ * Link has a turn: it terminated, waits for a PDU in an empty llc_up, or
+ * waits for room in a full llc_down.
+ */
+int
+llc_connection_idle(struct llc_connection *connection)
+{
+  struct mq_attr attr;
+
+  if (!connection->thread || (connection->status == DLC_DISCONNECTED) ||
+      __atomic_load_n(&connection->thread_exited, __ATOMIC_ACQUIRE))
+    return 1;
+
+  if (__atomic_load_n(&connection->rx_waiters, __ATOMIC_SEQ_CST) &&
+      (STATS_GET(connection->rx_queued) == STATS_GET(connection->rx_dequeued)))
+    return 1;
+
+  if (__atomic_load_n(&connection->tx_waiters, __ATOMIC_SEQ_CST) &&
+      (mq_getattr(connection->llc_down, &attr) == 0) && (attr.mq_curmsgs == attr.mq_maxmsg))
+    return 1;
+
+  return 0;
+}
+
+/*
+ * Update the local busy condition from the data waiting in llc_up: the
+ * connection gets busy when llc_up cannot hold one more PDU, and ready again
+ * once half of it is free.  The LLC Link thread sends a RNR or RR PDU when
+ * the condition changes.
+ */
+int
+llc_connection_rx_busy(struct llc_connection *connection)
+{
+  uint64_t pdus = connection->rx_queued - STATS_GET(connection->rx_dequeued);
+  uint64_t bytes = connection->rx_bytes_queued - STATS_GET(connection->rx_bytes_dequeued);
+
+  if (!connection->rx_busy) {
+    if ((pdus >= (uint64_t) connection->rx_slots) || (bytes + 3 + connection->local_miu > connection->rx_budget)) {
+      connection->rx_busy = 1;
+      STATS_INC(connection->stats.rx_budget_full);
+    }
+  } else if ((pdus <= (uint64_t) connection->rx_slots / 2) && (bytes <= connection->rx_budget / 2)) {
+    connection->rx_busy = 0;
+  }
+
+  return connection->rx_busy;
+}
+
+/*
+ * Enable or disable write coalescing.  While enabled, small sends are
+ * appended to a single I PDU of at most remote_miu bytes, which is handed
+ * to the LLC Link when:
+ *  - it is full;
+ *  - llc_connection_flush() is called;
+ *  - no I PDU of the connection is waiting for an acknowledgement;
+ *  - delay_us elapsed since its first byte was written.
+ * The delay is only checked when the LLC Link has a turn, and the send
+ * window must be open in all cases.
+ *
+ * Disabling coalescing flushes the pending data.  The I PDU header and
+ * size are fixed on first use, so the Data Link Connection must be
+ * connected.
+ */
+int
+llc_connection_set_coalescing(struct llc_connection *connection, int enable, uint32_t delay_us)
+{
+  assert(connection);
+  assert(connection->status == DLC_CONNECTED);
+
+  int res = 0;
+
+  pthread_mutex_lock(&connection->tx_mutex);
+  if (enable && !connection->tx_buffer) {
+    struct pdu_builder i;
+
+    if (!(connection->tx_buffer = malloc(3 + connection->remote_miu))) {
+      LLC_CONNECTION_MSG(LLC_PRIORITY_FATAL, "Cannot allocate memory");
+      res = -1;
+    } else {
+      pdu_builder_begin(&i, connection->tx_buffer, 3 + connection->remote_miu, connection->remote_sap, PDU_I, connection->local_sap, 0, 0);
+      connection->tx_length = pdu_builder_commit(&i);
+    }
+  }
+  if (res == 0) {
+    connection->tx_coalescing = enable;
+    connection->tx_delay_ns = (uint64_t) delay_us * 1000;
+    if (!enable && connection->tx_buffer)
+      llc_connection_flush_locked(connection);
+  }
+  pthread_mutex_unlock(&connection->tx_mutex);
+
+  return res;
+}
+
+static int
+llc_connection_flush_once(struct llc_connection *connection)
+{
+  int res;
+  int old_cancelstate;
+
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
+  pthread_mutex_lock(&connection->tx_mutex);
+  res = llc_connection_flush_locked(connection);
+  pthread_mutex_unlock(&connection->tx_mutex);
+  pthread_setcancelstate(old_cancelstate, NULL);
+
+  return res;
+}
+
+/*
+ * Hand the coalesced data to the LLC Link now.  Like llc_connection_send(),
+ * waits for room in the connection down queue as long as the send timeout
+ * allows, and fails with errno set to EAGAIN or ETIMEDOUT.
+ */
+int
+llc_connection_flush(struct llc_connection *connection)
+{
+  assert(connection);
+
+  if (!connection->tx_buffer)
+    return 0;
+
+  int res = llc_connection_flush_once(connection);
+  if ((res == 0) || (errno != EAGAIN) || !connection->tx_timeout)
+    return res;
+
+  STATS_INC(connection->stats.tx_blocked);
+  uint64_t deadline = stats_now() + (uint64_t) connection->tx_timeout * 1000000;
+  do {
+    if (llc_connection_wait_send(connection, deadline) < 0)
+      return -1;
+  } while (((res = llc_connection_flush_once(connection)) < 0) && (errno == EAGAIN));
+
+  return res;
+}
+
+/*
+ * Called by the LLC Link thread when the connection down queue is empty and
+ * I PDUs can be sent: copy the coalesced I PDU to buffer if it is due.  Returns the PDU length,
+ * or -1 with errno set to EAGAIN if there is nothing to send.
+ */
+ssize_t
+llc_connection_coalesced(struct llc_connection *connection, uint8_t *buffer, size_t len)
+{
+  ssize_t res = -1;
+  struct mq_attr attr;
+
+  pthread_mutex_lock(&connection->tx_mutex);
+  if ((connection->tx_length > 3) && (connection->tx_length <= len) &&
+      (!connection->tx_coalescing || !connection->thread ||
+       (connection->state.s == connection->state.sa) || (stats_now() >= connection->tx_deadline)) &&
+      /* The service may have enqueued PDUs since the queue was found empty */
+      (mq_getattr(connection->llc_down, &attr) == 0) && (attr.mq_curmsgs == 0)) {
+    memcpy(buffer, connection->tx_buffer, connection->tx_length);
+    res = connection->tx_length;
+    connection->tx_length = 3;
+    STATS_INC(connection->tx_queued);
+  }
+  pthread_mutex_unlock(&connection->tx_mutex);
+
+  if (res < 0)
+    errno = EAGAIN;
+  return res;
+}
+
+/*
+ * Receive the information field of a PDU in data.  Returns the number of
+ * bytes copied: a longer information field is truncated to len bytes (see
+ * llc_connection_recvv()).
+ */
 int
 llc_connection_recv(struct llc_connection *connection, uint8_t *data, size_t len, uint8_t *ssap)
 {
+  struct iovec iov = { data, len };
+
+  return llc_connection_recvv(connection, &iov, 1, ssap, NULL);
+}
+
+/*
+ * Receive the information field of a PDU, scattered over the iovcnt buffers
+ * described by iov.  Returns the number of bytes copied.  When the buffers
+ * cannot hold the whole information field, they are filled, the remaining
+ * data is discarded, the rx_truncated counter is incremented and
+ * *truncated, if truncated is not NULL, is set to 1 (0 otherwise).
+ */
+int
+llc_connection_recvv(struct llc_connection *connection, const struct iovec *iov, int iovcnt, uint8_t *ssap, int *truncated)
+{
+  const uint8_t *data;
   int res;
 
-  uint8_t buffer[BUFSIZ];
-  res = mq_receive(connection->llc_up, (char *) buffer, sizeof(buffer), 0);
+  if ((res = llc_connection_recv_borrow(connection, &data, ssap)) < 0)
+    return res;
+
+  size_t received = 0;
+  for (int n = 0; (n < iovcnt) && (received < (size_t) res); n++) {
+    size_t len = MIN(iov[n].iov_len, res - received);
+    memcpy(iov[n].iov_base, data + received, len);
+    received += len;
+  }
+  llc_connection_release(connection);
+
+  if (truncated)
+    *truncated = (received < (size_t) res);
+  if (received < (size_t) res) {
+    LLC_CONNECTION_LOG(LLC_PRIORITY_WARN, "Data Link Connection [%d -> %d]: %zu bytes discarded", connection->local_sap, connection->remote_sap, res - received);
+    STATS_INC(connection->stats.rx_truncated);
+  }
+
+  return received;
+}
+
+/*
+ * Receive a PDU and lend its information field to the caller without
+ * copying it.  *data is valid until llc_connection_release() is called, and
+ * a single PDU can be borrowed at a time.  Returns the length of the
+ * information field.
+ */
+int
+llc_connection_recv_borrow(struct llc_connection *connection, const uint8_t **data, uint8_t *ssap)
+{
+  assert(connection);
+  assert(data);
+
+  if (connection->rx_borrowed) {
+    LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Previous PDU not released");
+    return -1;
+  }
+
+  if (!connection->rx_buffer) {
+    struct mq_attr attr;
+    if (mq_getattr(connection->llc_up, &attr) < 0) {
+      LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "mq_getattr: %s", strerror(errno));
+      return -1;
+    }
+    if (!(connection->rx_buffer = malloc(attr.mq_msgsize))) {
+      LLC_CONNECTION_MSG(LLC_PRIORITY_FATAL, "Cannot allocate memory");
+      return -1;
+    }
+    connection->rx_buffer_size = attr.mq_msgsize;
+  }
+
+  __atomic_add_fetch(&connection->rx_waiters, 1, __ATOMIC_SEQ_CST);
+  int res = mq_receive(connection->llc_up, (char *) connection->rx_buffer, connection->rx_buffer_size, 0);
+  __atomic_sub_fetch(&connection->rx_waiters, 1, __ATOMIC_SEQ_CST);
   if (res < 0) {
     LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "mq_receive: %s", strerror(errno));
     return -1;
   }
+  STATS_INC(connection->rx_dequeued);
+  STATS_ADD(connection->rx_bytes_dequeued, res);
+  llc_link_stats_pickup(connection);
 
-  struct pdu *pdu = pdu_unpack(buffer, res);
-  len = MIN(pdu->information_size, len);
-  memcpy(data, pdu->information, len);
+  struct pdu pdu;
+  if (pdu_view(&pdu, connection->rx_buffer, res) < 0)
+    return -1;
 
+  *data = connection->rx_buffer + res - pdu.information_size;
   if (ssap)
-    *ssap = pdu->ssap;
+    *ssap = pdu.ssap;
+  connection->rx_borrowed = 1;
+
+  return pdu.information_size;
+}
+
+void
+llc_connection_release(struct llc_connection *connection)
+{
+  assert(connection);
 
-  pdu_free(pdu);
-  return len;
+  connection->rx_borrowed = 0;
 }
 
 int
@@ -405,10 +1224,15 @@ llc_connection_stop(struct llc_connection *connection)
 
   LLC_CONNECTION_LOG(LLC_PRIORITY_TRACE, "Stopping Data Link Connection [%d -> %d]", connection->local_sap, connection->remote_sap);
 
+  if ((connection->status == DLC_CONNECTED) && !connection->teardown_start)
+    connection->teardown_start = stats_now();
+
   if (connection->thread == pthread_self()) {
     connection->status = DLC_DISCONNECTED;
+    llcp_trace(LLCP_TRACE_CONNECTION_STATE, connection->remote_sap, connection->local_sap, DLC_DISCONNECTED);
+    LLCP_PROBE4(connection__state, connection, connection->local_sap, connection->remote_sap, DLC_DISCONNECTED);
     pthread_exit(NULL);
-  } else {
+  } else if (connection->thread) {
     llcp_threadslayer(connection->thread);
     connection->thread = 0;
   }
@@ -441,24 +1265,119 @@ llc_connection_wait(struct llc_connection *connection, void **value_ptr)
   }
 }
 
+void
+llc_connection_get_stats(const struct llc_connection *connection, struct llc_connection_stats *stats)
+{
+  assert(connection);
+  assert(stats);
+
+  stats_copy(stats, &connection->stats, sizeof(*stats));
+}
+
+void
+llc_connection_get_rtt_histogram(const struct llc_connection *connection, struct llcp_histogram *histogram)
+{
+  assert(connection);
+  assert(histogram);
+
+  llcp_histogram_copy(histogram, &connection->rtt);
+}
+
+/*
+ * Integrate the number of unacknowledged I PDUs over time.  Called by the LLC
+ * Link thread before V(S) or V(SA) change.
+ */
+static void
+llc_connection_stats_window(struct llc_connection *connection, uint64_t now)
+{
+  if (connection->window_since) {
+    uint64_t elapsed = now - connection->window_since;
+    uint8_t outstanding = (connection->state.s - connection->state.sa) & 0x0F;
+
+    STATS_ADD(connection->stats.window_ns, elapsed);
+    STATS_ADD(connection->stats.window_occupancy_ns, outstanding * elapsed);
+    if (outstanding >= connection->rwr)
+      STATS_ADD(connection->stats.window_full_ns, elapsed);
+  }
+  connection->window_since = now;
+}
+
+/*
+ * An I PDU with N(S) = V(S) is about to be sent.
+ */
+void
+llc_connection_stats_sent(struct llc_connection *connection)
+{
+  uint64_t now = stats_now();
+
+  llc_connection_stats_window(connection, now);
+  connection->sent_at[connection->state.s] = now;
+}
+
+/*
+ * The peer acknowledged the I PDUs up to N(R) - 1.  Called before V(SA) is
+ * updated.
+ */
+void
+llc_connection_stats_ack(struct llc_connection *connection, uint8_t nr)
+{
+  uint8_t acknowledged = (nr - connection->state.sa) & 0x0F;
+  uint8_t outstanding = (connection->state.s - connection->state.sa) & 0x0F;
+
+  if (!acknowledged || (acknowledged > outstanding))
+    return;
+
+  uint64_t now = stats_now();
+  llc_connection_stats_window(connection, now);
+
+  for (uint8_t ns = connection->state.sa; ns != nr; ns = (ns + 1) & 0x0F) {
+    if (!connection->sent_at[ns])
+      continue;
+
+    uint64_t rtt = now - connection->sent_at[ns];
+    uint64_t ewma = STATS_GET(connection->stats.rtt_ewma_ns);
+    connection->sent_at[ns] = 0;
+
+    /* Same gain as TCP's SRTT */
+    if (ewma)
+      ewma = ewma - ewma / 8 + rtt / 8;
+    else
+      ewma = rtt;
+    __atomic_store_n(&connection->stats.rtt_ewma_ns, ewma, __ATOMIC_RELAXED);
+
+    llcp_histogram_record(&connection->rtt, rtt);
+    STATS_INC(connection->stats.rtt_samples);
+  }
+}
+
+/*
+ * Free a connection, or return it to the pool of its service (see
+ * llc_service_set_pool_size()).
+ */
 void
 llc_connection_free(struct llc_connection *connection)
 {
   assert(connection);
 
+  llc_link_remove_connection(connection->link, connection);
+  if (llc_connection_pool_put(connection) < 0)
+    llc_connection_destroy(connection);
+}
+
+static void
+llc_connection_destroy(struct llc_connection *connection)
+{
   LLC_CONNECTION_LOG(LLC_PRIORITY_TRACE, "Freeing Data Link Connection [%d -> %d]", connection->local_sap, connection->remote_sap);
 
-  if (connection->llc_up != (mqd_t) - 1)
-    mq_close(connection->llc_up);
-  if (connection->llc_down != (mqd_t) - 1)
-    mq_close(connection->llc_down);
-  if (connection->mq_up_name)
-    mq_unlink(connection->mq_up_name);
-  if (connection->mq_down_name)
-    mq_unlink(connection->mq_down_name);
+  llcp_queue_close(connection->llc_up, connection->mq_up_name);
+  llcp_queue_close(connection->llc_down, connection->mq_down_name);
 
   free(connection->mq_up_name);
   free(connection->mq_down_name);
   free(connection->remote_uri);
+  free(connection->rx_buffer);
+  free(connection->tx_buffer);
+  pthread_cond_destroy(&connection->tx_cond);
+  pthread_mutex_destroy(&connection->tx_mutex);
   free(connection);
 }
@@ -23,11 +23,14 @@
 #define _LLC_CONNECTION_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <mqueue.h>
 #include <pthread.h>
 #include <stdint.h>
 
+#include "llcp_histogram.h"
+
 #ifdef __cplusplus
 extern  "C" {
 #endif /* __cplusplus */
@@ -35,11 +38,49 @@ extern  "C" {
 struct pdu;
 struct llc_link;
 
+/* llc_connection_connect() failure when the peer is known not to provide the service */
+#define LLC_CONNECTION_NO_SERVICE -2
+
+struct llc_connection_stats {
+  uint64_t rx_pdus;		/* I PDUs received */
+  uint64_t rx_bytes;		/* Information bytes received */
+  uint64_t tx_pdus;		/* I PDUs sent */
+  uint64_t tx_bytes;		/* Information bytes sent */
+  uint64_t rr_sent;
+  uint64_t rr_received;
+  uint64_t rnr_sent;
+  uint64_t rnr_received;
+  uint64_t window_full;		/* I PDUs postponed (send window full) */
+  uint64_t frmr_sent;
+  uint64_t frmr_received;
+  uint64_t rx_queue_hwm;	/* Most PDUs waiting for llc_connection_recv() */
+  uint64_t tx_queue_hwm;	/* Most PDUs waiting for the LLC Link */
+  uint64_t setup_ns;		/* Time spent establishing the connection */
+  uint64_t rtt_samples;		/* I PDUs acknowledged */
+  uint64_t rtt_ewma_ns;		/* Smoothed acknowledgement round-trip time */
+  uint64_t window_ns;		/* Time elapsed since the first I PDU was sent */
+  uint64_t window_occupancy_ns;	/* Unacknowledged I PDUs integrated over window_ns */
+  uint64_t window_full_ns;	/* Part of window_ns spent with a full send window */
+  uint64_t rx_truncated;	/* PDUs too large for the llc_connection_recv() buffer */
+  uint64_t tx_coalesced;	/* Sends appended to a pending I PDU */
+  uint64_t rx_budget_full;	/* Times the receive budget ran out (RNR) */
+  uint64_t tx_blocked;		/* Sends which waited for the LLC Link */
+  uint64_t queue_limited;	/* Queues shorter than two windows (see llcp_queue.h) */
+};
+
+/*
+ * The fields the LLC Link thread reads on every turn come first, so that
+ * walking the active connections touches the first cache lines of each of
+ * them only.  The other ones are used when a PDU is actually exchanged, or
+ * by the service thread.
+ */
 struct llc_connection {
-  uint8_t service_sap;
-  uint8_t remote_sap;
-  uint8_t local_sap;
-  char *remote_uri;
+  /* Hot */
+  struct llc_link *link;
+  enum {
+    LLC_DATA_LINK_CONNECTION,
+    LLC_LOGICAL_DATA_LINK
+  } type;
   enum {
     DLC_NEW,
     DLC_ACCEPTED,
@@ -50,10 +91,12 @@ struct llc_connection {
     DLC_TERMINATED
   } status;
   pthread_t thread;
-  char *mq_up_name;
-  char *mq_down_name;
+  int thread_exited;		/* The Logical Data Link thread terminated */
   mqd_t llc_up;
   mqd_t llc_down;
+  uint8_t service_sap;
+  uint8_t remote_sap;
+  uint8_t local_sap;
   struct {
     uint8_t s;	    /* Send State Variable */
     uint8_t sa;	    /* Send Acknowledgement State Variable */
@@ -64,8 +107,43 @@ struct llc_connection {
   uint16_t remote_miu;    /* Maximum Information Unit Size for I PDUs */
   uint8_t rwl;    /* Local Receive Window Size */
   uint8_t rwr;    /* Remote Receive Window Size */
-  struct llc_link *link;
+  int rx_busy;			/* Local busy condition */
+  int rx_busy_sent;		/* Local busy condition last notified to the peer */
+  int tx_peer_busy;		/* The peer sent a RNR PDU */
+  long rx_slots;		/* PDUs llc_up can hold */
+  size_t rx_budget;		/* Bytes llc_up can hold */
+  uint64_t rx_queued, rx_dequeued;
+  uint64_t rx_bytes_queued, rx_bytes_dequeued;
+  uint8_t *tx_buffer;		/* I PDU being coalesced, NULL if never enabled */
+
+  /* Cold */
+  struct llc_connection *pool_next;
+  char *remote_uri;
+  char *mq_up_name;
+  char *mq_down_name;
   void *user_data;
+
+  struct llc_connection_stats stats;
+  uint64_t tx_queued, tx_dequeued;
+  uint64_t setup_start;		/* ns, CLOCK_MONOTONIC */
+  uint64_t teardown_start;
+  struct llcp_stamps up_stamps;
+  uint64_t request_origin;	/* Oldest unanswered I PDU */
+  uint64_t sent_at[16];		/* Send time of I PDUs, by N(S) */
+  uint64_t window_since;	/* Last change of the send window */
+  struct llcp_histogram rtt;	/* Acknowledgement round-trip times */
+  uint8_t *rx_buffer;		/* Last received PDU */
+  size_t rx_buffer_size;
+  int rx_borrowed;		/* rx_buffer is lent to the service */
+  unsigned rx_waiters;		/* Threads blocked on llc_up */
+  int tx_timeout;		/* ms, see llc_connection_set_send_timeout() */
+  pthread_cond_t tx_cond;	/* Signaled when the LLC Link dequeues a PDU */
+  unsigned tx_waiters;
+  pthread_mutex_t tx_mutex;	/* Protects tx_buffer and the fields below */
+  size_t tx_length;
+  int tx_coalescing;
+  uint64_t tx_delay_ns;
+  uint64_t tx_deadline;		/* ns, CLOCK_MONOTONIC */
 };
 
 struct llc_connection *llc_data_link_connection_new(struct llc_link *link, const struct pdu *pdu, int *reason);
@@ -73,15 +151,33 @@ struct llc_connection *llc_logical_data_link_new(struct llc_link *link, const st
 struct llc_connection *llc_outgoing_data_link_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap);
 struct llc_connection *llc_outgoing_data_link_connection_new_by_uri(struct llc_link *link, uint8_t local_sap, const char *remote_uri);
 int		 llc_connection_connect(struct llc_connection *connection);
+int		 llc_connection_complete(struct llc_connection *connection, const uint8_t *parameters, size_t len);
 void		 llc_connection_accept(struct llc_connection *connection);
 void		 llc_connection_reject(struct llc_connection *connection);
 int		 llc_connection_send_pdu(struct llc_connection *connection, const struct pdu *pdu);
 int		 llc_connection_send(struct llc_connection *connection, const uint8_t *data, size_t len);
+int		 llc_connection_sendv(struct llc_connection *connection, const struct iovec *iov, int iovcnt);
+int		 llc_connection_set_send_timeout(struct llc_connection *connection, int timeout);
+int		 llc_connection_wait_writable(struct llc_connection *connection, int timeout);
+int		 llc_connection_set_coalescing(struct llc_connection *connection, int enable, uint32_t delay_us);
+int		 llc_connection_flush(struct llc_connection *connection);
+ssize_t		 llc_connection_coalesced(struct llc_connection *connection, uint8_t *buffer, size_t len);
+void		 llc_connection_tx_dequeued(struct llc_connection *connection);
+int		 llc_connection_rx_busy(struct llc_connection *connection);
+int		 llc_connection_idle(struct llc_connection *connection);
 int		 llc_connection_recv(struct llc_connection *connection, uint8_t *data, size_t len, uint8_t *ssap);
+int		 llc_connection_recvv(struct llc_connection *connection, const struct iovec *iov, int iovcnt, uint8_t *ssap, int *truncated);
+int		 llc_connection_recv_borrow(struct llc_connection *connection, const uint8_t **data, uint8_t *ssap);
+void		 llc_connection_release(struct llc_connection *connection);
 int		 llc_connection_stop(struct llc_connection *connection);
 int		 llc_connection_wait(struct llc_connection *connection, void **value_ptr);
+void		 llc_connection_get_stats(const struct llc_connection *connection, struct llc_connection_stats *stats);
+void		 llc_connection_get_rtt_histogram(const struct llc_connection *connection, struct llcp_histogram *histogram);
 void		 llc_connection_free(struct llc_connection *connection);
 
+int		 llc_connection_pool_fill(struct llc_link *link, uint8_t service_sap);
+void		 llc_connection_pool_flush(struct llc_link *link, uint8_t service_sap);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
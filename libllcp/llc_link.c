@@ -21,22 +21,29 @@
 
 #include "config.h"
 
+#include <sys/param.h>
 #include <sys/types.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #if defined(HAVE_PTHREAD_NP_H)
 #  include <pthread_np.h>
 #endif
+#include <sched.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "llc_connection.h"
 #include "llcp_log.h"
 #include "llcp_parameters.h"
 #include "llcp_pdu.h"
+#include "llcp_probes.h"
+#include "llcp_stats.h"
 #include "llc_link.h"
 #include "llc_service.h"
 #include "llc_service_llc.h"
@@ -58,12 +65,41 @@ llc_link_new(void) {
     link->opt = LINK_SERVICE_CLASS_3;
     for (size_t i = 0; i < sizeof(link->available_services) / sizeof(*link->available_services); i++) {
       link->available_services[i] = NULL;
-      link->datagram_handlers[i] = NULL;
-      link->transmission_handlers[i] = NULL;
+      link->connection_index[i] = -1;
     }
+    link->connection_count = 0;
+    memset(link->connections, 0, sizeof(link->connections));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&link->connections_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&link->pool_mutex, NULL);
+    link->pool = NULL;
+    link->sdp = NULL;
+    link->remote_wks_received = 0;
+    memset(link->uri_index, 0, sizeof(link->uri_index));
+    link->uri_index_full = 0;
+    memset(link->peer_nfcid3, 0, sizeof(link->peer_nfcid3));
+    pthread_mutex_init(&link->resolve_mutex, NULL);
+    pthread_cond_init(&link->resolve_cond, NULL);
+    link->resolve_requests = NULL;
+    link->resolve_tid = 0;
+    link->resolve_cache_mode = LLC_RESOLVE_CACHE_LINK;
+    memset(link->resolve_cache, 0, sizeof(link->resolve_cache));
+    link->resolve_cache_next = 0;
     link->cut_test_context = NULL;
     link->mac_link = NULL;
     link->local_miu = LLCP_DEFAULT_MIU;
+    link->remote_miu = LLCP_DEFAULT_MIU;
+    memset(&link->stats, 0, sizeof(link->stats));
+    for (int i = 0; i < LLC_STAGES; i++)
+      llcp_histogram_reset(&link->histograms[i]);
+    memset(&link->up_stamps, 0, sizeof(link->up_stamps));
+    memset(&link->down_stamps, 0, sizeof(link->down_stamps));
+    link->mac_received = 0;
+    link->first_data = 0;
+    link->last_data = 0;
 
     if ((asprintf(&link->mq_up_name, "/libllcp-%d-%p-up", getpid(), (void *) link) < 0) ||
         (asprintf(&link->mq_down_name, "/libllcp-%d-%p-down", getpid(), (void *) link) < 0)) {
@@ -71,6 +107,8 @@ llc_link_new(void) {
     }
     link->llc_up   = (mqd_t) - 1;
     link->llc_down = (mqd_t) - 1;
+    link->down_waiters = 0;
+    link->settle_timeout = 0;
 
     struct llc_service *sdp_service = llc_service_new_with_uri(NULL, llc_service_sdp_thread, LLCP_SDP_URI, NULL);
 
@@ -84,6 +122,94 @@ llc_link_new(void) {
   return link;
 }
 
+/* FNV-1a */
+static uint32_t
+llc_link_uri_hash(const char *uri, size_t len)
+{
+  uint32_t hash = 2166136261u;
+
+  while (len--) {
+    hash ^= (uint8_t) *uri++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static int
+llc_link_uri_equal(const char *uri, const char *sn, size_t len)
+{
+  return (0 == strncmp(uri, sn, len)) && (uri[len] == '\0');
+}
+
+/*
+ * Return the index entry of a URI, interning it if create is set.  Only one
+ * thread may bind or unbind services at a time.
+ */
+static struct llc_link_uri *
+llc_link_uri_entry(struct llc_link *link, const char *uri, int create)
+{
+  uint32_t hash = llc_link_uri_hash(uri, strlen(uri));
+
+  for (size_t i = 0; i < LLC_LINK_URI_INDEX_SIZE; i++) {
+    struct llc_link_uri *entry = &link->uri_index[(hash + i) & (LLC_LINK_URI_INDEX_SIZE - 1)];
+
+    if (!entry->uri) {
+      if (!create)
+        return NULL;
+
+      char *interned;
+      if (!(interned = strdup(uri)))
+        break;
+      entry->hash = hash;
+      entry->sap = 0;
+      __atomic_store_n(&entry->uri, interned, __ATOMIC_RELEASE);
+      return entry;
+    }
+    if ((entry->hash == hash) && (0 == strcmp(entry->uri, uri)))
+      return entry;
+  }
+
+  if (create) {
+    LLC_LINK_LOG(LLC_PRIORITY_WARN, "Cannot index service '%s'", uri);
+    link->uri_index_full = 1;
+  }
+  return NULL;
+}
+
+static void
+llc_link_uri_index_bind(struct llc_link *link, const struct llc_service *service, uint8_t sap)
+{
+  struct llc_link_uri *entry;
+
+  if (!service->uri || (sap > MAX_LLC_LINK_ADVERTISED_SERVICE))
+    return;
+
+  /* When a URI is bound to several SAPs, the lowest one is used */
+  if ((entry = llc_link_uri_entry(link, service->uri, 1)) && (!entry->sap || (sap < entry->sap)))
+    __atomic_store_n(&entry->sap, sap, __ATOMIC_RELEASE);
+}
+
+static void
+llc_link_uri_index_unbind(struct llc_link *link, const struct llc_service *service, uint8_t sap)
+{
+  struct llc_link_uri *entry;
+
+  if (!service->uri || (sap > MAX_LLC_LINK_ADVERTISED_SERVICE))
+    return;
+
+  if (!(entry = llc_link_uri_entry(link, service->uri, 0)) || (entry->sap != sap))
+    return;
+
+  uint8_t next = 0;
+  for (int i = 1; !next && (i <= MAX_LLC_LINK_ADVERTISED_SERVICE); i++) {
+    if ((i != sap) && link->available_services[i] && link->available_services[i]->uri &&
+        (0 == strcmp(link->available_services[i]->uri, service->uri)))
+      next = i;
+  }
+  __atomic_store_n(&entry->sap, next, __ATOMIC_RELEASE);
+}
+
 int
 llc_link_free_sap(struct llc_link *link)
 {
@@ -114,6 +240,10 @@ llc_link_service_bind(struct llc_link *link, struct llc_service *service, int8_t
 
   service->sap = sap;
   link->available_services[sap] = service;
+  llc_link_uri_index_bind(link, service, sap);
+
+  if (llc_connection_pool_fill(link, sap) < 0)
+    LLC_LINK_LOG(LLC_PRIORITY_WARN, "Cannot fill connection pool of SAP %d", sap);
 
   LLC_LINK_LOG(LLC_PRIORITY_TRACE, "service %p bound to SAP %d", (void *) service, sap);
 
@@ -124,8 +254,11 @@ void
 llc_link_service_unbind(struct llc_link *link, uint8_t sap)
 {
   if (link->available_services[sap]) {
-    link->available_services[sap]->sap = -1;
+    struct llc_service *service = link->available_services[sap];
+    llc_connection_pool_flush(link, sap);
+    service->sap = -1;
     link->available_services[sap] = NULL;
+    llc_link_uri_index_unbind(link, service, sap);
   }
 }
 
@@ -149,15 +282,17 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
   link->role = flags & 0x01;
   link->version.major = LLCP_VERSION_MAJOR;
   link->version.minor = LLCP_VERSION_MINOR;
-  link->local_miu  = LLCP_DEFAULT_MIU;
   link->remote_miu = LLCP_DEFAULT_MIU;
   link->remote_wks = 0x0001;
+  link->remote_wks_received = 0;
   link->local_lto.tv_sec  = 1;
   link->local_lto.tv_usec = 0;
   link->remote_lto.tv_sec  = 0;
   link->remote_lto.tv_usec = 100000;
   link->local_lsc  = 3;
   link->remote_lsc = 3;
+  link->first_data = 0;
+  link->last_data = 0;
 
   if (llc_link_configure(link, parameters, length) < 0) {
     LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Link configuration failed");
@@ -175,6 +310,12 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
     /* FIXME: Exchange PAX PDU */
   }
 
+  /* The local MIU may have changed since the pools were filled */
+  for (int i = 0; i <= MAX_LLC_LINK_SERVICE; i++) {
+    if (link->available_services[i] && (llc_connection_pool_fill(link, i) < 0))
+      LLC_LINK_LOG(LLC_PRIORITY_WARN, "Cannot fill connection pool of SAP %d", i);
+  }
+
   /*
    * Start link
    */
@@ -199,6 +340,7 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
     LLC_LINK_LOG(LLC_PRIORITY_ERROR, "mq_open(%s)", link->mq_down_name);
     return -1;
   }
+  link->down_waiters = 0;
 
   if ((pthread_create(&link->thread, NULL, llc_service_llc_thread, link)) == 0) {
 #if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
@@ -210,6 +352,7 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
   }
 
   link->status = LL_ACTIVATED;
+  LLCP_PROBE2(link__activate, link, link->role);
 
   return 0;
 }
@@ -217,78 +360,43 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
 int
 llc_link_configure(struct llc_link *link, const uint8_t *parameters, size_t length)
 {
-  struct llcp_version version;
-  uint16_t miux;
-  uint8_t lto;
-  uint8_t opt;
+  struct parameters p;
+  int res;
 
   LLC_LINK_LOG(LLC_PRIORITY_TRACE, "llc_link_configure (%p, %p, %d)", (void *)link, (void *) parameters, length);
 
-  size_t offset = 0;
-  while (offset < length) {
-    if (offset > length - 2) {
-      LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Incomplete TLV field in parameters list");
-      return -1;
-    }
-    if (offset + 2 + parameters[offset + 1] > length) {
-      LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Incomplete TLV value in parameters list (expected %d bytes but only %d left)", parameters[offset + 1], length - (offset + 2));
+  if ((res = parameters_decode(parameters, length, &p)) < 0) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Invalid parameters list: %s", parameter_strerror(res));
+    return -1;
+  }
+
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_VERSION)) {
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "Version: %d.%d (remote)", p.version.major, p.version.minor);
+    if (llcp_version_agreement(link, p.version) < 0) {
+      LLC_LINK_MSG(LLC_PRIORITY_WARN, "LLCP Version Agreement Procedure failed");
       return -1;
     }
-    switch (parameters[offset]) {
-      case LLCP_PARAMETER_VERSION:
-        if (parameter_decode_version(parameters + offset, 2 + parameters[offset + 1], &version) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid Version TLV parameter");
-          return -1;
-        }
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "Version: %d.%d (remote)", version.major, version.minor);
-        if (llcp_version_agreement(link, version) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_WARN, "LLCP Version Agreement Procedure failed");
-          return -1;
-        }
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "Version: %d.%d (agreed)", version.major, version.minor);
-        break;
-      case LLCP_PARAMETER_MIUX:
-        if (parameter_decode_miux(parameters + offset, 2 + parameters[offset + 1], &miux) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid MIUX TLV parameter");
-          return -1;
-        }
-        link->remote_miu = miux + 128;
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "MIUX: %d (0x%02x)", miux + 128, miux);
-        break;
-      case LLCP_PARAMETER_WKS:
-        if (parameter_decode_wks(parameters + offset, 2 + parameters[offset + 1], &link->remote_wks) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid WKS TLV parameter");
-          return -1;
-        }
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "WKS: 0x%04x", link->remote_wks);
-        break;
-      case LLCP_PARAMETER_LTO:
-        if (parameter_decode_lto(parameters + offset, 2 + parameters[offset + 1], &lto) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid LTO TLV parameter");
-          return -1;
-        }
-        link->remote_lto.tv_sec = (lto * 10 * 1000) / 1000000;
-        link->remote_lto.tv_usec = (lto * 10 * 1000) % 1000000;
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "LTO: %d ms (0x%02x)", 10 * lto, lto);
-        break;
-      case LLCP_PARAMETER_OPT:
-        if (parameter_decode_opt(parameters + offset, 2 + parameters[offset + 1], &opt) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid OPT TLV parameter");
-          return -1;
-        }
-        link->remote_lsc = opt & 0x03;
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "OPT: 0x%02x", opt);
-        break;
-      default:
-        LLC_LINK_LOG(LLC_PRIORITY_INFO, "Unknown TLV Field 0x%02x (length: %d)",
-                     parameters[offset], parameters[offset + 1]);
-    }
-    offset += 2 + parameters[offset + 1];
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "Version: %d.%d (agreed)", p.version.major, p.version.minor);
   }
-  if (offset != length) {
-    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Unprocessed TLV parameters");
-    return -1;
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_MIUX)) {
+    link->remote_miu = p.miux + 128;
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "MIUX: %d (0x%02x)", p.miux + 128, p.miux);
+  }
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_WKS)) {
+    link->remote_wks = p.wks;
+    link->remote_wks_received = 1;
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "WKS: 0x%04x", link->remote_wks);
+  }
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_LTO)) {
+    link->remote_lto.tv_sec = (p.lto * 10 * 1000) / 1000000;
+    link->remote_lto.tv_usec = (p.lto * 10 * 1000) % 1000000;
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "LTO: %d ms (0x%02x)", 10 * p.lto, p.lto);
+  }
+  if (PARAMETER_PRESENT(&p, LLCP_PARAMETER_OPT)) {
+    link->remote_lsc = p.opt & 0x03;
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "OPT: 0x%02x", p.opt);
   }
+
   return 0;
 }
 
@@ -303,7 +411,7 @@ llc_link_encode_parameters(const struct llc_link *link, uint8_t *parameters, siz
   parameter += n;
   length -= n;
 
-  if ((n = parameter_encode_miux(parameter, length, link->local_miu)) < 0)
+  if ((n = parameter_encode_miux(parameter, length, link->local_miu - LLCP_DEFAULT_MIU)) < 0)
     return -1;
   parameter += n;
   length -= n;
@@ -330,25 +438,501 @@ llc_link_encode_parameters(const struct llc_link *link, uint8_t *parameters, siz
 uint8_t
 llc_link_find_sap_by_uri(const struct llc_link *link, const char *uri)
 {
-  LLC_LINK_LOG(LLC_PRIORITY_TRACE, "Searching SAP for service '%s'", uri);
-  int8_t res = 0;
+  return llc_link_find_sap_by_sn(link, uri, strlen(uri));
+}
+
+/*
+ * Same as llc_link_find_sap_by_uri() for a service name which is not
+ * NUL-terminated, e.g. an SN parameter.
+ */
+uint8_t
+llc_link_find_sap_by_sn(const struct llc_link *link, const char *sn, size_t len)
+{
+  uint32_t hash = llc_link_uri_hash(sn, len);
+
+  for (size_t i = 0; i < LLC_LINK_URI_INDEX_SIZE; i++) {
+    const struct llc_link_uri *entry = &link->uri_index[(hash + i) & (LLC_LINK_URI_INDEX_SIZE - 1)];
+    const char *entry_uri = __atomic_load_n(&entry->uri, __ATOMIC_ACQUIRE);
+
+    if (!entry_uri)
+      break;
+    if ((entry->hash == hash) && llc_link_uri_equal(entry_uri, sn, len))
+      return __atomic_load_n(&entry->sap, __ATOMIC_ACQUIRE);
+  }
+
+  if (!__atomic_load_n(&link->uri_index_full, __ATOMIC_RELAXED))
+    return 0;
+
+  /* Some URIs are not indexed */
   for (int i = 1; i <= MAX_LLC_LINK_ADVERTISED_SERVICE; i++) {
-    if (link->available_services[i]) {
-      if (link->available_services[i]->uri &&
-          (0 == strcmp(link->available_services[i]->uri, uri))) {
-        LLC_LINK_LOG(LLC_PRIORITY_INFO, "Service '%s' is bound to SAP '%d'", uri, i);
-        res = i;
-        break;
+    const struct llc_service *service = link->available_services[i];
+    if (service && service->uri && llc_link_uri_equal(service->uri, sn, len))
+      return i;
+  }
+
+  return 0;
+}
+
+/*
+ * Service name resolution
+ */
+
+struct llc_link_resolve_request {
+  struct llc_link_resolve_request *next;
+  const char *uri;
+  uint8_t tid;
+  int sap;			/* -1 until answered, -2 if not requested */
+};
+
+static int
+llc_link_peer_known(const uint8_t nfcid3[10])
+{
+  for (int i = 0; i < 10; i++)
+    if (nfcid3[i])
+      return 1;
+  return 0;
+}
+
+static struct llc_link_resolution *
+llc_link_resolve_cache_entry(struct llc_link *link, const char *uri)
+{
+  for (size_t i = 0; i < LLC_LINK_RESOLVE_CACHE_SIZE; i++) {
+    struct llc_link_resolution *entry = &link->resolve_cache[i];
+    if (entry->uri && (0 == memcmp(entry->nfcid3, link->peer_nfcid3, sizeof(entry->nfcid3))) &&
+        (0 == strcmp(entry->uri, uri)))
+      return entry;
+  }
+
+  return NULL;
+}
+
+static void
+llc_link_resolve_cache_store(struct llc_link *link, const char *uri, uint8_t sap)
+{
+  struct llc_link_resolution *entry;
+
+  if (!(entry = llc_link_resolve_cache_entry(link, uri))) {
+    char *copy;
+    if (!(copy = strdup(uri)))
+      return;
+    entry = &link->resolve_cache[link->resolve_cache_next++ % LLC_LINK_RESOLVE_CACHE_SIZE];
+    free(entry->uri);
+    entry->uri = copy;
+    memcpy(entry->nfcid3, link->peer_nfcid3, sizeof(entry->nfcid3));
+  }
+  entry->sap = sap;
+}
+
+static void
+llc_link_resolve_cache_prune(struct llc_link *link, int keep_known_peers)
+{
+  pthread_mutex_lock(&link->resolve_mutex);
+  for (size_t i = 0; i < LLC_LINK_RESOLVE_CACHE_SIZE; i++) {
+    struct llc_link_resolution *entry = &link->resolve_cache[i];
+    if (entry->uri && !(keep_known_peers && entry->sap && llc_link_peer_known(entry->nfcid3))) {
+      free(entry->uri);
+      entry->uri = NULL;
+    }
+  }
+  pthread_mutex_unlock(&link->resolve_mutex);
+}
+
+static int
+llc_link_resolve_tid_used(const struct llc_link *link, uint8_t tid)
+{
+  for (const struct llc_link_resolve_request *r = link->resolve_requests; r; r = r->next)
+    if (r->tid == tid)
+      return 1;
+  return 0;
+}
+
+/*
+ * Return a transaction identifier no pending request uses, or -1 if all 256
+ * of them are taken.
+ */
+static int
+llc_link_resolve_tid_next(struct llc_link *link)
+{
+  for (int tries = 0; tries <= UINT8_MAX; tries++) {
+    uint8_t tid = link->resolve_tid++;
+    if (!llc_link_resolve_tid_used(link, tid))
+      return tid;
+  }
+  return -1;
+}
+
+/*
+ * Resolve the SAP of each of the count URIs through the peer SDP.  Cached
+ * URIs are not looked up again; the others are requested in as few SNL PDUs
+ * as the link MIU allows.  saps[i] is set to the SAP of uris[i], to 0 if the
+ * peer does not provide this service or to -1 if it did not answer in time.
+ *
+ * Return 0 if all URIs were answered, -1 otherwise.
+ */
+int
+llc_link_resolve_many(struct llc_link *link, const char *uris[], int saps[], size_t count)
+{
+  assert(link);
+  assert(uris);
+  assert(saps);
+
+  if (count > LLC_LINK_RESOLVE_BATCH) {
+    int res = 0;
+    for (size_t i = 0; i < count; i += LLC_LINK_RESOLVE_BATCH) {
+      if (llc_link_resolve_many(link, uris + i, saps + i, MIN(count - i, LLC_LINK_RESOLVE_BATCH)) < 0)
+        res = -1;
+    }
+    return res;
+  }
+
+  struct llc_link_resolve_request requests[LLC_LINK_RESOLVE_BATCH];
+  size_t pending = 0;
+
+  pthread_mutex_lock(&link->resolve_mutex);
+  for (size_t i = 0; i < count; i++) {
+    struct llc_link_resolution *entry;
+    if ((entry = llc_link_resolve_cache_entry(link, uris[i]))) {
+      saps[i] = entry->sap;
+      continue;
+    }
+    saps[i] = -1;
+
+    struct llc_link_resolve_request *request = &requests[pending++];
+    int tid;
+    request->uri = uris[i];
+    if ((tid = llc_link_resolve_tid_next(link)) < 0) {
+      LLC_LINK_LOG(LLC_PRIORITY_ERROR, "No transaction identifier left to request '%s'", uris[i]);
+      request->sap = -2;
+      continue;
+    }
+    request->tid = tid;
+    request->sap = -1;
+    request->next = link->resolve_requests;
+    link->resolve_requests = request;
+  }
+  pthread_mutex_unlock(&link->resolve_mutex);
+
+  if (!pending)
+    return 0;
+
+  /* The SNL PDUs are sent without holding the lock the SDP needs to answer */
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
+  struct pdu_builder snl;
+  int res = 0;
+
+  pdu_builder_begin(&snl, buffer, MIN(2 + link->remote_miu, sizeof(buffer)), LLCP_SDP_SAP, PDU_SNL, LLCP_SDP_SAP, 0, 0);
+  for (size_t i = 0; (res == 0) && (i < pending); i++) {
+    if (requests[i].sap != -1)
+      continue;
+    if ((snl.length + 3 + strlen(requests[i].uri) > snl.size) && (snl.length > 2)) {
+      res = llc_link_send_packed(link, buffer, pdu_builder_commit(&snl));
+      pdu_builder_begin(&snl, buffer, snl.size, LLCP_SDP_SAP, PDU_SNL, LLCP_SDP_SAP, 0, 0);
+    }
+    if (pdu_builder_tlv_sdreq(&snl, requests[i].tid, requests[i].uri) < 0) {
+      LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Cannot request '%s'", requests[i].uri);
+      requests[i].sap = -2;
+    }
+  }
+  if ((res == 0) && (snl.length > 2))
+    res = llc_link_send_packed(link, buffer, pdu_builder_commit(&snl));
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += LLC_LINK_RESOLVE_TIMEOUT / 1000;
+  deadline.tv_nsec += (LLC_LINK_RESOLVE_TIMEOUT % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&link->resolve_mutex);
+  for (;;) {
+    size_t answered = 0;
+    for (size_t i = 0; i < pending; i++)
+      if (requests[i].sap != -1)
+        answered++;
+    if ((res < 0) || (answered == pending) || (link->status != LL_ACTIVATED))
+      break;
+    if (pthread_cond_timedwait(&link->resolve_cond, &link->resolve_mutex, &deadline) == ETIMEDOUT)
+      break;
+  }
+
+  /* Collect the answers and forget about the requests */
+  for (struct llc_link_resolve_request **r = &link->resolve_requests; *r; ) {
+    if ((*r >= requests) && (*r < requests + pending))
+      *r = (*r)->next;
+    else
+      r = &(*r)->next;
+  }
+  res = 0;
+  for (size_t i = 0, j = 0; i < count; i++) {
+    if (saps[i] < 0) {
+      if ((saps[i] = requests[j++].sap) < 0) {
+        saps[i] = -1;
+        res = -1;
       }
     }
   }
+  pthread_mutex_unlock(&link->resolve_mutex);
+
+  return res;
+}
+
+/*
+ * Return the SAP of the service provided by the peer under uri, 0 if the
+ * peer does not provide it, or -1 if it could not be resolved.
+ */
+int
+llc_link_resolve(struct llc_link *link, const char *uri)
+{
+  int sap;
+
+  if (llc_link_resolve_many(link, &uri, &sap, 1) < 0)
+    return -1;
+
+  return sap;
+}
+
+/*
+ * Return the cached SAP of uri on the peer, 0 if the peer is known not to
+ * provide it, or -1 if it was not resolved.
+ */
+int
+llc_link_resolve_cached(struct llc_link *link, const char *uri)
+{
+  struct llc_link_resolution *entry;
+  int res = -1;
+
+  assert(link);
+  assert(uri);
+
+  pthread_mutex_lock(&link->resolve_mutex);
+  if ((entry = llc_link_resolve_cache_entry(link, uri)))
+    res = entry->sap;
+  pthread_mutex_unlock(&link->resolve_mutex);
+
+  return res;
+}
+
+/*
+ * Called by the SDP for each SDRES parameter it receives.
+ */
+void
+llc_link_resolved(struct llc_link *link, uint8_t tid, uint8_t sap)
+{
+  pthread_mutex_lock(&link->resolve_mutex);
+  for (struct llc_link_resolve_request *r = link->resolve_requests; r; r = r->next) {
+    if ((r->tid == tid) && (r->sap == -1)) {
+      r->sap = sap;
+      llc_link_resolve_cache_store(link, r->uri, sap);
+      pthread_cond_broadcast(&link->resolve_cond);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&link->resolve_mutex);
+}
+
+/*
+ * Peer capabilities
+ */
+
+static const struct {
+  const char *uri;
+  uint8_t sap;
+} well_known_services[] = {
+  { LLCP_SDP_URI,  LLCP_SDP_SAP },
+  { LLCP_IP_URI,   LLCP_IP_SAP },
+  { LLCP_OBEX_URI, LLCP_OBEX_SAP },
+  { LLCP_SNEP_URI, LLCP_SNEP_SAP },
+};
+
+/*
+ * Return 1 if the peer advertised the well-known sap in its WKS parameter, 0
+ * if it did not, or -1 if this is unknown (no WKS parameter, or sap is not a
+ * well-known SAP).
+ */
+int
+llc_link_peer_provides_sap(const struct llc_link *link, uint8_t sap)
+{
+  assert(link);
+
+  if ((sap > 15) || !link->remote_wks_received)
+    return -1;
+
+  return (link->remote_wks & (1 << sap)) ? 1 : 0;
+}
+
+/*
+ * Return 1 if the peer provides the service uri, 0 if it does not, or -1 if
+ * this could not be determined.  Well-known services are checked against
+ * the peer WKS parameter, other services are resolved through the peer SDP
+ * (see llc_link_resolve()).
+ */
+int
+llc_link_peer_provides(struct llc_link *link, const char *uri)
+{
+  assert(link);
+  assert(uri);
+
+  for (size_t i = 0; i < sizeof(well_known_services) / sizeof(*well_known_services); i++) {
+    int res;
+    if ((0 == strcmp(well_known_services[i].uri, uri)) &&
+        ((res = llc_link_peer_provides_sap(link, well_known_services[i].sap)) >= 0))
+      return res;
+  }
+
+  int sap = llc_link_resolve(link, uri);
+  if (sap < 0)
+    return -1;
+
+  return sap ? 1 : 0;
+}
+
+void
+llc_link_set_resolve_cache(struct llc_link *link, int mode)
+{
+  assert(link);
+  assert((mode == LLC_RESOLVE_CACHE_LINK) || (mode == LLC_RESOLVE_CACHE_PEER));
+
+  link->resolve_cache_mode = mode;
+}
+
+void
+llc_link_resolve_flush(struct llc_link *link)
+{
+  assert(link);
+
+  llc_link_resolve_cache_prune(link, 0);
+}
+
+/*
+ * Register a new connection of the link.  A data link connection gets the
+ * local SAP it was created with, which must not be used by another one.
+ */
+int
+llc_link_add_connection(struct llc_link *link, struct llc_connection *connection)
+{
+  assert(link);
+  assert(connection);
+
+  int res = -1;
+
+  pthread_mutex_lock(&link->connections_mutex);
+  if (link->connection_count == LLC_LINK_MAX_CONNECTIONS) {
+    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Too many connections");
+  } else if ((connection->type == LLC_DATA_LINK_CONNECTION) && (link->connection_index[connection->local_sap] >= 0)) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "SAP %d already used by a Data Link Connection", connection->local_sap);
+  } else {
+    if (connection->type == LLC_DATA_LINK_CONNECTION)
+      link->connection_index[connection->local_sap] = link->connection_count;
+    link->connections[link->connection_count++] = connection;
+    res = 0;
+  }
+  pthread_mutex_unlock(&link->connections_mutex);
+
+  return res;
+}
+
+/*
+ * Forget a connection of the link, if it was registered.
+ */
+void
+llc_link_remove_connection(struct llc_link *link, struct llc_connection *connection)
+{
+  assert(link);
+  assert(connection);
+
+  int i = -1;
+
+  pthread_mutex_lock(&link->connections_mutex);
+  if (connection->type == LLC_DATA_LINK_CONNECTION) {
+    i = link->connection_index[connection->local_sap];
+  } else {
+    for (int j = 0; j < link->connection_count; j++)
+      if (link->connections[j] == connection)
+        i = j;
+  }
+  if ((i >= 0) && (link->connections[i] == connection)) {
+    if (connection->type == LLC_DATA_LINK_CONNECTION)
+      link->connection_index[connection->local_sap] = -1;
+
+    struct llc_connection *last = link->connections[--link->connection_count];
+    link->connections[link->connection_count] = NULL;
+    if (last != connection) {
+      link->connections[i] = last;
+      if (last->type == LLC_DATA_LINK_CONNECTION)
+        link->connection_index[last->local_sap] = i;
+    }
+  }
+  pthread_mutex_unlock(&link->connections_mutex);
+}
 
-  if (!res)
-    LLC_LINK_LOG(LLC_PRIORITY_INFO, "Service '%s' not available", uri);
+/*
+ * Data link connection bound to local_sap, or NULL.
+ */
+struct llc_connection *
+llc_link_find_connection(struct llc_link *link, uint8_t local_sap) {
+  assert(link);
+
+  struct llc_connection *res = NULL;
+
+  if (local_sap > MAX_LLC_LINK_SERVICE)
+    return NULL;
+
+  pthread_mutex_lock(&link->connections_mutex);
+  if (link->connection_index[local_sap] >= 0)
+    res = link->connections[link->connection_index[local_sap]];
+  pthread_mutex_unlock(&link->connections_mutex);
 
   return res;
 }
 
+/*
+ * The services of the link can only go on once the LLC Link has a turn (see
+ * llc_connection_idle()).
+ */
+int
+llc_link_idle(struct llc_link *link)
+{
+  assert(link);
+
+  int res = 1;
+
+  pthread_mutex_lock(&link->connections_mutex);
+  for (int i = 0; res && (i < link->connection_count); i++)
+    res = llc_connection_idle(link->connections[i]);
+  pthread_mutex_unlock(&link->connections_mutex);
+
+  return res;
+}
+
+/*
+ * Wait up to timeout_us for the services of the link to be idle.  A
+ * simulated MAC Link sets link->settle_timeout so that the LLC thread lets
+ * the services react to a PDU before picking the next one to send, as they
+ * would with an infinitely fast host: the exchanged PDUs then do not depend
+ * on thread scheduling.
+ *
+ * Returns 0 once the services are idle, -1 on timeout.
+ */
+int
+llc_link_settle(struct llc_link *link, uint32_t timeout_us)
+{
+  static const struct timespec delay = { 0, 10000 };
+  uint64_t deadline = stats_now() + (uint64_t) timeout_us * 1000;
+
+  for (unsigned spins = 0; !llc_link_idle(link); spins++) {
+    if (stats_now() >= deadline)
+      return -1;
+    if (spins < 100)
+      sched_yield();
+    else
+      nanosleep(&delay, NULL);
+  }
+
+  return 0;
+}
+
 int
 llc_link_send_pdu(struct llc_link *link, const struct pdu *pdu)
 {
@@ -359,13 +943,30 @@ llc_link_send_pdu(struct llc_link *link, const struct pdu *pdu)
     return -1;
   }
 
-  uint8_t buffer[BUFSIZ];
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
   int len = pdu_pack(pdu, buffer, sizeof(buffer));
+  if (len < 0)
+    return -1;
 
-  if (mq_send(link->llc_down, (char *) buffer, len, 0) < 0) {
+  return llc_link_send_packed(link, buffer, len);
+}
+
+/*
+ * Enqueue a PDU already packed by pdu_pack() or a struct pdu_builder.
+ */
+int
+llc_link_send_packed(struct llc_link *link, const uint8_t *buffer, size_t len)
+{
+  assert(link);
+  assert(link->status == LL_ACTIVATED);
+
+  int stamp = llc_link_stats_respond(link, 0);
+  if (mq_send(link->llc_down, (const char *) buffer, len, 0) < 0) {
     LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Error enqueuing PDU");
+    stamps_void(&link->down_stamps, stamp);
     return -1;
   }
+  llc_link_stats_tx(link, buffer, len);
 
   return 0;
 }
@@ -380,6 +981,214 @@ llc_link_send_data(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap,
   return res;
 }
 
+void
+llc_link_get_stats(const struct llc_link *link, struct llc_link_stats *stats)
+{
+  assert(link);
+  assert(stats);
+
+  stats_copy(stats, &link->stats, sizeof(*stats));
+}
+
+const char *stage_names[] = {
+  "mac-turnaround",
+  "llc-dispatch",
+  "service-pickup",
+  "response",
+};
+
+const char *
+llc_link_stage_name(enum llc_link_stage stage)
+{
+  assert(stage < LLC_STAGES);
+
+  return stage_names[stage];
+}
+
+void
+llc_link_get_histogram(const struct llc_link *link, enum llc_link_stage stage, struct llcp_histogram *histogram)
+{
+  assert(link);
+  assert(stage < LLC_STAGES);
+  assert(histogram);
+
+  llcp_histogram_copy(histogram, &link->histograms[stage]);
+}
+
+int
+llc_link_dump_histograms(const struct llc_link *link, const char *filename)
+{
+  struct llcp_histogram_header header = {
+    .magic = LLCP_HISTOGRAM_MAGIC,
+    .version = LLCP_HISTOGRAM_VERSION,
+    .buckets = LLCP_HISTOGRAM_BUCKETS,
+    .count = LLC_STAGES,
+  };
+  struct llcp_histogram_record record;
+  FILE *f;
+
+  if (!(f = fopen(filename, "wb"))) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Cannot open '%s'", filename);
+    return -1;
+  }
+
+  int res = (fwrite(&header, sizeof(header), 1, f) == 1) ? 0 : -1;
+  for (int i = 0; (0 == res) && (i < LLC_STAGES); i++) {
+    memset(&record, 0, sizeof(record));
+    strncpy(record.name, stage_names[i], sizeof(record.name) - 1);
+    llc_link_get_histogram(link, i, &record.histogram);
+    if (fwrite(&record, sizeof(record), 1, f) != 1)
+      res = -1;
+  }
+
+  if ((fclose(f) != 0) || (res < 0)) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Cannot write '%s'", filename);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Record when the first and last I or UI PDUs of the activation went through.
+ */
+static void
+llc_link_stats_data(struct llc_link *link, uint8_t ptype)
+{
+  if ((ptype != PDU_I) && (ptype != PDU_UI))
+    return;
+
+  uint64_t now = stats_now();
+  uint64_t none = 0;
+
+  __atomic_compare_exchange_n(&link->first_data, &none, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  stats_max(&link->last_data, now);
+}
+
+void
+llc_link_stats_rx(struct llc_link *link, const uint8_t *pdu, size_t len)
+{
+  uint8_t ptype = ((pdu[0] & 0x03) << 2) | (pdu[1] >> 6);
+
+  STATS_INC(link->stats.rx_pdus[ptype]);
+  STATS_ADD(link->stats.rx_bytes[ptype], len);
+  llc_link_stats_data(link, ptype);
+}
+
+void
+llc_link_stats_tx(struct llc_link *link, const uint8_t *pdu, size_t len)
+{
+  uint8_t ptype = ((pdu[0] & 0x03) << 2) | (pdu[1] >> 6);
+
+  STATS_INC(link->stats.tx_pdus[ptype]);
+  STATS_ADD(link->stats.tx_bytes[ptype], len);
+  llc_link_stats_data(link, ptype);
+}
+
+/*
+ * Record the time elapsed since the connection establishment started.
+ */
+void
+llc_link_stats_setup(struct llc_link *link, struct llc_connection *connection)
+{
+  if (!connection->setup_start)
+    return;
+
+  uint64_t elapsed = stats_now() - connection->setup_start;
+  STATS_ADD(connection->stats.setup_ns, elapsed);
+
+  STATS_INC(link->stats.connections);
+  STATS_ADD(link->stats.setup_ns, elapsed);
+  stats_max(&link->stats.setup_ns_max, elapsed);
+}
+
+/*
+ * Record the time elapsed since the connection teardown started.
+ */
+void
+llc_link_stats_teardown(struct llc_link *link, struct llc_connection *connection)
+{
+  if (!connection->teardown_start)
+    return;
+
+  uint64_t elapsed = stats_now() - connection->teardown_start;
+
+  STATS_INC(link->stats.disconnections);
+  STATS_ADD(link->stats.teardown_ns, elapsed);
+  stats_max(&link->stats.teardown_ns_max, elapsed);
+}
+
+/*
+ * Stage latency
+ *
+ * The MAC Link calls llc_link_stats_mac_receive() before handing a PDU to
+ * the LLC Link, and llc_link_stats_mac_send() before sending the next one.
+ * The LLC Link thread calls llc_link_stats_dispatch() for each PDU it
+ * dequeues, llc_link_stats_deliver() before handing a PDU to a service and
+ * llc_link_stats_respond() before handing a PDU to the MAC Link.  Services
+ * call llc_link_stats_pickup() for each PDU they dequeue.
+ */
+void
+llc_link_stats_mac_receive(struct llc_link *link)
+{
+  uint64_t now = stats_now();
+
+  link->mac_received = now;
+  stamps_push(&link->up_stamps, now, now);
+}
+
+void
+llc_link_stats_mac_send(struct llc_link *link, int dequeued)
+{
+  uint64_t now = stats_now();
+  uint64_t origin;
+
+  if (link->mac_received) {
+    llcp_histogram_record(&link->histograms[LLC_STAGE_MAC_TURNAROUND], now - link->mac_received);
+    link->mac_received = 0;
+  }
+
+  if (dequeued && stamps_pop(&link->down_stamps, &origin) && origin)
+    llcp_histogram_record(&link->histograms[LLC_STAGE_RESPONSE], now - origin);
+}
+
+uint64_t
+llc_link_stats_dispatch(struct llc_link *link)
+{
+  uint64_t origin;
+  uint64_t stamp = stamps_pop(&link->up_stamps, &origin);
+
+  if (stamp)
+    llcp_histogram_record(&link->histograms[LLC_STAGE_LLC_DISPATCH], stats_now() - stamp);
+
+  return origin;
+}
+
+int
+llc_link_stats_deliver(struct llc_connection *connection, uint64_t origin)
+{
+  if (origin && !connection->request_origin)
+    connection->request_origin = origin;
+
+  return stamps_push(&connection->up_stamps, stats_now(), origin);
+}
+
+void
+llc_link_stats_pickup(struct llc_connection *connection)
+{
+  uint64_t origin;
+  uint64_t stamp = stamps_pop(&connection->up_stamps, &origin);
+
+  if (stamp)
+    llcp_histogram_record(&connection->link->histograms[LLC_STAGE_SERVICE_PICKUP], stats_now() - stamp);
+}
+
+int
+llc_link_stats_respond(struct llc_link *link, uint64_t origin)
+{
+  return stamps_push(&link->down_stamps, stats_now(), origin);
+}
+
 void
 llc_link_deactivate(struct llc_link *link)
 {
@@ -388,6 +1197,14 @@ llc_link_deactivate(struct llc_link *link)
   LLC_LINK_MSG(LLC_PRIORITY_INFO, "Deactivating LLC Link");
 
   link->status = LL_DEACTIVATED;
+  LLCP_PROBE1(link__deactivate, link);
+
+  pthread_mutex_lock(&link->resolve_mutex);
+  pthread_cond_broadcast(&link->resolve_cond);
+  pthread_mutex_unlock(&link->resolve_mutex);
+  llc_link_resolve_cache_prune(link, link->resolve_cache_mode == LLC_RESOLVE_CACHE_PEER);
+  memset(link->peer_nfcid3, 0, sizeof(link->peer_nfcid3));
+  link->settle_timeout = 0;
 
   if (link->mac_link) {
     LLC_LINK_MSG(LLC_PRIORITY_DEBUG, "The LLC Link has an active MAC link");
@@ -407,28 +1224,18 @@ llc_link_deactivate(struct llc_link *link)
     }
   }
 
-  uint8_t local_sap;
-  uint8_t remote_sap;
+  link->sdp = NULL;
+  for (;;) {
+    pthread_mutex_lock(&link->connections_mutex);
+    struct llc_connection *connection = link->connection_count ? link->connections[link->connection_count - 1] : NULL;
+    pthread_mutex_unlock(&link->connections_mutex);
+    if (!connection)
+      break;
 
-  for (int i = 0; i <= MAX_LOGICAL_DATA_LINK; i++) {
-    if (link->datagram_handlers[i]) {
-      remote_sap = link->datagram_handlers[i]->remote_sap;
-      local_sap = link->datagram_handlers[i]->local_sap;
-      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Stopping Logical Data Link [%d -> %d]", local_sap, remote_sap);
-      llc_connection_stop(link->datagram_handlers[i]);
-      llc_connection_free(link->datagram_handlers[i]);
-      link->datagram_handlers[i] = NULL;
-      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Logical Data Link [%d -> %d] stopped", local_sap, remote_sap);
-    }
-  }
-  for (int i = 0; i <= MAX_LLC_LINK_SERVICE; i++) {
-    if (link->transmission_handlers[i]) {
-      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Stopping Data Link Connection [%d -> %d]", local_sap, remote_sap);
-      llc_connection_stop(link->transmission_handlers[i]);
-      llc_connection_free(link->transmission_handlers[i]);
-      link->transmission_handlers[i] = NULL;
-      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Data Link Connection [%d -> %d] stopped", local_sap, remote_sap);
-    }
+    LLC_LINK_LOG(LLC_PRIORITY_INFO, "Stopping %s [%d -> %d]", (connection->type == LLC_LOGICAL_DATA_LINK) ? "Logical Data Link" : "Data Link Connection", connection->local_sap, connection->remote_sap);
+    llc_connection_stop(connection);
+    LLC_LINK_LOG(LLC_PRIORITY_INFO, "%s [%d -> %d] stopped", (connection->type == LLC_LOGICAL_DATA_LINK) ? "Logical Data Link" : "Data Link Connection", connection->local_sap, connection->remote_sap);
+    llc_connection_free(connection);
   }
 
   if (link->llc_up != (mqd_t) - 1)
@@ -451,6 +1258,8 @@ llc_link_free(struct llc_link *link)
 {
   assert(link);
 
+  llc_connection_pool_flush(link, MAX_LLC_LINK_SERVICE + 1);
+
   for (int i = MAX_LLC_LINK_SERVICE; i >= 0; i--) {
     if (link->available_services[i]) {
       LLC_LINK_LOG(LLC_PRIORITY_INFO, "Freeing service %d", i);
@@ -459,6 +1268,15 @@ llc_link_free(struct llc_link *link)
     }
   }
 
+  for (int i = 0; i < LLC_LINK_URI_INDEX_SIZE; i++)
+    free((char *) link->uri_index[i].uri);
+  for (int i = 0; i < LLC_LINK_RESOLVE_CACHE_SIZE; i++)
+    free(link->resolve_cache[i].uri);
+  pthread_mutex_destroy(&link->resolve_mutex);
+  pthread_cond_destroy(&link->resolve_cond);
+  pthread_mutex_destroy(&link->pool_mutex);
+  pthread_mutex_destroy(&link->connections_mutex);
+
   free(link->mq_up_name);
   free(link->mq_down_name);
 
@@ -25,6 +25,7 @@
 #include <mqueue.h>
 #include <stdint.h>
 
+#include "llcp_histogram.h"
 #include "llcp_pdu.h"
 #include "llcp.h"
 
@@ -32,6 +33,101 @@
 extern  "C" {
 #endif /* __cplusplus */
 
+/*
+ * PDUs carried by AGF PDUs are also counted individually when they are
+ * dispatched, but an AGF PDU is followed by a single turn.  The AGF fill
+ * ratio is agf_bytes / (agf_bundles * local_miu).
+ */
+struct llc_link_stats {
+  uint64_t rx_pdus[16];		/* PDUs received, per PTYPE */
+  uint64_t rx_bytes[16];
+  uint64_t tx_pdus[16];		/* PDUs sent, per PTYPE */
+  uint64_t tx_bytes[16];
+  uint64_t data_turns;		/* Received PDUs followed by a PDU to send */
+  uint64_t symm_turns;		/* Received PDUs followed by nothing to send */
+  uint64_t agf_bundles;		/* AGF PDUs received */
+  uint64_t agf_pdus;		/* PDUs they carried */
+  uint64_t agf_bytes;		/* Size of their information field */
+  uint64_t window_full;		/* I PDUs postponed (send window full) */
+  uint64_t rnr_sent;
+  uint64_t rnr_received;
+  uint64_t frmr_sent;
+  uint64_t frmr_received;
+  uint64_t datagrams_dropped;	/* UI PDUs without a Logical Data Link */
+  uint64_t connections;		/* Data Link Connections established */
+  uint64_t setup_ns;		/* Total time spent establishing them */
+  uint64_t setup_ns_max;
+  uint64_t disconnections;	/* Data Link Connections torn down */
+  uint64_t teardown_ns;		/* Total time spent tearing them down */
+  uint64_t teardown_ns_max;
+  uint64_t pool_hits;		/* Connections taken from a service pool */
+  uint64_t pool_misses;		/* Connections created while a service pool was empty */
+};
+
+/*
+ * Latency histograms of the stages a PDU goes through:
+ *
+ *   LLC_STAGE_MAC_TURNAROUND	PDU received by the MAC Link to the next PDU it sends
+ *   LLC_STAGE_LLC_DISPATCH	PDU received by the MAC Link to the LLC Link thread
+ *   LLC_STAGE_SERVICE_PICKUP	PDU delivered by the LLC Link to the service
+ *   LLC_STAGE_RESPONSE		I PDU received by the MAC Link to the first I PDU
+ *				sent by the MAC Link on the same connection
+ */
+enum llc_link_stage {
+  LLC_STAGE_MAC_TURNAROUND,
+  LLC_STAGE_LLC_DISPATCH,
+  LLC_STAGE_SERVICE_PICKUP,
+  LLC_STAGE_RESPONSE,
+  LLC_STAGES
+};
+
+/*
+ * Service name index: the URIs of services bound to advertised SAPs are
+ * interned in an open-addressing hash table.  Entries are never removed (the
+ * URI of an unbound service maps to SAP 0) and interned URIs live as long as
+ * the link, so llc_link_find_sap_by_uri() needs no lock while services are
+ * bound or unbound.  A service URI is indexed when the service is bound.
+ */
+#define LLC_LINK_URI_INDEX_SIZE 128
+
+struct llc_link_uri {
+  const char *uri;
+  uint32_t hash;
+  uint8_t sap;
+};
+
+/*
+ * Service name resolution (see llc_link_resolve()): SDREQ parameters are
+ * batched in SNL PDUs sent to the peer SDP, and the URIs it resolves are
+ * cached for the current activation of the link or, with
+ * LLC_RESOLVE_CACHE_PEER, for as long as the link is activated with a peer
+ * of the same NFCID3.  URIs the peer does not provide are only cached for
+ * the current activation.
+ */
+#define LLC_RESOLVE_CACHE_LINK 0
+#define LLC_RESOLVE_CACHE_PEER 1
+
+#define LLC_LINK_RESOLVE_BATCH 64	/* Most SDREQs awaiting an answer per call */
+#define LLC_LINK_RESOLVE_CACHE_SIZE 32
+#define LLC_LINK_RESOLVE_TIMEOUT 1000	/* ms */
+
+struct llc_link_resolution {
+  char *uri;
+  uint8_t sap;
+  uint8_t nfcid3[10];		/* Peer the URI was resolved on */
+};
+
+struct llc_link_resolve_request;
+
+/*
+ * Active connections (data link connections and logical data links) are
+ * packed at the beginning of llc_link.connections so that the LLC Link thread
+ * only walks those, and connection_index maps the local SAP of a data link
+ * connection to its position in that array (-1 when the SAP is not used by
+ * any).  Removing a connection moves the last one in its place.
+ */
+#define LLC_LINK_MAX_CONNECTIONS (MAX_LLC_LINK_SERVICE + 1 + MAX_LOGICAL_DATA_LINK)
+
 struct llc_link {
   uint8_t role;
   enum {
@@ -42,21 +138,48 @@ struct llc_link {
   uint16_t local_miu;
   uint16_t remote_miu;
   uint16_t remote_wks;
+  int remote_wks_received;	/* The peer sent a WKS parameter */
   struct timeval local_lto;
   struct timeval remote_lto;
   uint8_t local_lsc;
   uint8_t remote_lsc;
   uint8_t opt;
+  uint8_t peer_nfcid3[10];	/* Set by the MAC Link, zero when unknown */
 
   pthread_t thread;
   char *mq_up_name;
   char *mq_down_name;
   mqd_t llc_up;
   mqd_t llc_down;
+  unsigned down_waiters;		/* The LLC thread waits for room in llc_down */
+  uint32_t settle_timeout;	/* us, see llc_link_settle() */
 
   struct llc_service *available_services[MAX_LLC_LINK_SERVICE + 1];
-  struct llc_connection *datagram_handlers[MAX_LOGICAL_DATA_LINK];
-  struct llc_connection *transmission_handlers[MAX_LLC_LINK_SERVICE + 1];
+  pthread_mutex_t connections_mutex;	/* Recursive, protects the 3 fields below */
+  int8_t connection_index[MAX_LLC_LINK_SERVICE + 1];
+  int connection_count;
+  struct llc_connection *connections[LLC_LINK_MAX_CONNECTIONS];
+  pthread_mutex_t pool_mutex;
+  struct llc_connection *pool;	/* Idle connections, see llc_service_set_pool_size() */
+  struct llc_connection *sdp;	/* Resident Service Discovery Protocol */
+  struct llc_link_uri uri_index[LLC_LINK_URI_INDEX_SIZE];
+  int uri_index_full;		/* Some URIs could not be indexed */
+
+  pthread_mutex_t resolve_mutex;
+  pthread_cond_t resolve_cond;
+  struct llc_link_resolve_request *resolve_requests;
+  uint8_t resolve_tid;
+  int resolve_cache_mode;
+  struct llc_link_resolution resolve_cache[LLC_LINK_RESOLVE_CACHE_SIZE];
+  size_t resolve_cache_next;
+
+  struct llc_link_stats stats;
+  struct llcp_histogram histograms[LLC_STAGES];
+  struct llcp_stamps up_stamps;
+  struct llcp_stamps down_stamps;
+  uint64_t mac_received;
+  uint64_t first_data;		/* First I or UI PDU since activation, 0 if none */
+  uint64_t last_data;		/* Last I or UI PDU since activation */
 
   /* Unit tests metadata */
   void *cut_test_context;
@@ -70,8 +193,27 @@ int		 llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *par
 int		 llc_link_configure(struct llc_link *link, const uint8_t *parameters, size_t length);
 int		 llc_link_encode_parameters(const struct llc_link *link, uint8_t *parameters, size_t length);
 uint8_t		 llc_link_find_sap_by_uri(const struct llc_link *link, const char *uri);
+uint8_t		 llc_link_find_sap_by_sn(const struct llc_link *link, const char *sn, size_t len);
+int		 llc_link_resolve(struct llc_link *link, const char *uri);
+int		 llc_link_resolve_many(struct llc_link *link, const char *uris[], int saps[], size_t count);
+int		 llc_link_resolve_cached(struct llc_link *link, const char *uri);
+int		 llc_link_peer_provides_sap(const struct llc_link *link, uint8_t sap);
+int		 llc_link_peer_provides(struct llc_link *link, const char *uri);
+void		 llc_link_resolved(struct llc_link *link, uint8_t tid, uint8_t sap);
+void		 llc_link_set_resolve_cache(struct llc_link *link, int mode);
+void		 llc_link_resolve_flush(struct llc_link *link);
+int		 llc_link_add_connection(struct llc_link *link, struct llc_connection *connection);
+void		 llc_link_remove_connection(struct llc_link *link, struct llc_connection *connection);
+struct llc_connection *llc_link_find_connection(struct llc_link *link, uint8_t local_sap);
+int		 llc_link_idle(struct llc_link *link);
+int		 llc_link_settle(struct llc_link *link, uint32_t timeout_us);
 int		 llc_link_send_pdu(struct llc_link *link, const struct pdu *pdu);
+int		 llc_link_send_packed(struct llc_link *link, const uint8_t *buffer, size_t len);
 int		 llc_link_send_data(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap, const uint8_t *data, size_t len);
+void		 llc_link_get_stats(const struct llc_link *link, struct llc_link_stats *stats);
+void		 llc_link_get_histogram(const struct llc_link *link, enum llc_link_stage stage, struct llcp_histogram *histogram);
+int		 llc_link_dump_histograms(const struct llc_link *link, const char *filename);
+const char	*llc_link_stage_name(enum llc_link_stage stage);
 void		 llc_link_deactivate(struct llc_link *link);
 void		 llc_link_free(struct llc_link *link);
 
@@ -59,6 +59,9 @@ llc_service_new_with_uri(void * (*accept_routine)(void *), void * (*thread_routi
     service->accept_routine = accept_routine;
     service->thread_routine = thread_routine;
     service->miu = LLCP_DEFAULT_MIU;
+    service->rw = LLCP_DEFAULT_RW;
+    service->queue_depth = 0;
+    service->pool_size = 0;
     service->user_data = user_data;
   }
 
@@ -76,7 +79,7 @@ void
 llc_service_set_miu(struct llc_service *service, uint16_t miu)
 {
   assert(service);
-  assert(((miu - 128) & 0xfc00) == 0x0000);
+  assert((miu >= LLCP_DEFAULT_MIU) && (miu <= LLCP_MAX_MIU));
   service->miu = miu;
 }
 
@@ -92,6 +95,47 @@ llc_service_set_rw(struct llc_service *service, uint8_t rw)
   service->rw = rw;
 }
 
+long
+llc_service_get_queue_depth(const struct llc_service *service)
+{
+  assert(service);
+  return service->queue_depth;
+}
+
+/*
+ * Override the depth of the message queues of the service's connections.
+ * By default, they hold two receive windows worth of PDUs so that the
+ * window stays full while the service or the LLC Link lag behind.
+ */
+void
+llc_service_set_queue_depth(struct llc_service *service, long depth)
+{
+  assert(service);
+  assert(depth >= 0);
+  service->queue_depth = depth;
+}
+
+unsigned
+llc_service_get_pool_size(const struct llc_service *service)
+{
+  assert(service);
+  return service->pool_size;
+}
+
+/*
+ * Keep size connections of the service started and idle on each LLC Link it
+ * is bound to, so that accepting or establishing a connection does not
+ * create its message queues.  Terminated connections are reset and returned
+ * to the pool rather than freed.  The pool is filled when the service is
+ * bound and when the LLC Link is activated.
+ */
+void
+llc_service_set_pool_size(struct llc_service *service, unsigned size)
+{
+  assert(service);
+  service->pool_size = size;
+}
+
 const char *
 llc_service_get_uri(const struct llc_service *service)
 {
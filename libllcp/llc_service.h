@@ -36,6 +36,8 @@ struct llc_service {
   int8_t sap;
   uint8_t rw;
   uint16_t miu;
+  long queue_depth;	/* PDUs per connection queue, 0 to size them from RW */
+  unsigned pool_size;	/* Idle connections kept ready */
   void *user_data;
 };
 
@@ -45,6 +47,10 @@ uint16_t	 llc_service_get_miu(const struct llc_service *service);
 void		 llc_service_set_miu(struct llc_service *service, uint16_t miu);
 uint8_t		 llc_service_get_rw(const struct llc_service *service);
 void		 llc_service_set_rw(struct llc_service *service, uint8_t rw);
+long		 llc_service_get_queue_depth(const struct llc_service *service);
+void		 llc_service_set_queue_depth(struct llc_service *service, long depth);
+unsigned	 llc_service_get_pool_size(const struct llc_service *service);
+void		 llc_service_set_pool_size(struct llc_service *service, unsigned size);
 const char	*llc_service_get_uri(const struct llc_service *service);
 const char	*llc_service_set_uri(struct llc_service *service, const char *uri);
 void		 llc_service_free(struct llc_service *service);
@@ -40,6 +40,9 @@
 #include "llc_connection.h"
 #include "llcp_log.h"
 #include "llcp_pdu.h"
+#include "llcp_probes.h"
+#include "llcp_stats.h"
+#include "llcp_trace.h"
 #include "llc_service.h"
 #include "mac.h"
 
@@ -49,6 +52,18 @@
 
 #define INC_MOD_16(x) x = (x + 1) % 16
 
+/*
+ * Stopping a connection waits for its thread to terminate, and that thread
+ * may be waiting for connections_mutex: PDUs dispatched while the lock is
+ * held only record what to stop, which is done once it is released.
+ */
+struct llc_service_llc_stops {
+  int link;			/* The peer deactivated the LLC Link */
+  int count;
+  struct llc_connection *connections[LLC_LINK_MAX_CONNECTIONS];
+  uint8_t ptypes[LLC_LINK_MAX_CONNECTIONS];	/* PDU_DISC or PDU_DM */
+};
+
 void
 llc_service_llc_thread_cleanup(void *arg)
 {
@@ -69,6 +84,405 @@ llc_service_llc_thread_cleanup(void *arg)
   link->llc_down = (mqd_t) - 1;
 }
 
+/*
+ * Logical Data Link threads flag their termination, however they terminate,
+ * so that the LLC Link can join them and garbage-collect the link.
+ */
+static void
+llc_service_llc_ldl_exited(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *)arg;
+
+  __atomic_store_n(&connection->thread_exited, 1, __ATOMIC_RELEASE);
+}
+
+static void *
+llc_service_llc_ldl_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *)arg;
+  void *(*thread_routine)(void *) = connection->link->available_services[connection->service_sap]->thread_routine;
+  void *res;
+
+  pthread_cleanup_push(llc_service_llc_ldl_exited, connection);
+  res = thread_routine(connection);
+  pthread_cleanup_pop(1);
+
+  return res;
+}
+
+/*
+ * I PDUs of the connection can be sent: the send window is open and the peer
+ * is not busy.  Otherwise, they wait in the connection down queue.
+ */
+static int
+llc_service_llc_can_send(struct llc_link *link, struct llc_connection *connection)
+{
+  struct mq_attr attr;
+
+  if (connection->tx_peer_busy)
+    return 0;
+
+  if (connection->state.s != (connection->state.sa + connection->rwr) % 16)
+    return 1;
+
+  if ((mq_getattr(connection->llc_down, &attr) == 0) && attr.mq_curmsgs) {
+    llcp_trace(LLCP_TRACE_WINDOW_FULL, connection->remote_sap, connection->local_sap, connection->state.s);
+    LLCP_PROBE3(window__full, connection, connection->local_sap, connection->remote_sap);
+    STATS_INC(connection->stats.window_full);
+    STATS_INC(link->stats.window_full);
+  }
+  return 0;
+}
+
+/*
+ * Record that connection is to be stopped on behalf of a PDU of type ptype.
+ */
+static void
+llc_service_llc_stop_later(struct llc_service_llc_stops *stops, struct llc_connection *connection, uint8_t ptype)
+{
+  for (int i = 0; i < stops->count; i++)
+    if (stops->connections[i] == connection)
+      return;
+
+  stops->connections[stops->count] = connection;
+  stops->ptypes[stops->count] = ptype;
+  stops->count++;
+}
+
+/*
+ * Stop the connections recorded while dispatching.  Must be called without
+ * holding connections_mutex.
+ */
+static void
+llc_service_llc_stop_now(struct llc_link *link, struct llc_service_llc_stops *stops)
+{
+  for (int i = 0; i < stops->count; i++) {
+    struct llc_connection *connection = stops->connections[i];
+
+    llc_connection_stop(connection);
+    switch (stops->ptypes[i]) {
+      case PDU_DISC:
+        llc_link_stats_teardown(link, connection);
+        llc_connection_free(connection);
+        break;
+      case PDU_DM:
+        connection->status = DLC_REJECTED;
+        LLCP_PROBE4(connection__state, connection, connection->local_sap, connection->remote_sap, DLC_REJECTED);
+        break;
+    }
+  }
+  stops->count = 0;
+}
+
+/*
+ * Dispatch a PDU received from the peer.  The PDUs carried by an AGF PDU are
+ * dispatched in turn, in place: buffer is never modified.  Called with
+ * connections_mutex held: connections to stop are recorded in stops.
+ */
+static void
+llc_service_llc_dispatch(struct llc_link *link, mqd_t llc_down, const uint8_t *buffer, size_t len, uint64_t origin, struct llc_service_llc_stops *stops)
+{
+  struct pdu view, *pdu = &view;
+  struct llc_connection *connection;
+  uint8_t reply[2 + 4];
+  int res, stamp;
+#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
+  char *thread_name;
+#endif
+
+  if (pdu_view(pdu, buffer, len) < 0) {
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Ignoring malformed PDU (%zu bytes)", len);
+    return;
+  }
+  LLCP_PROBE5(llc__dispatch, link, pdu->ptype, pdu->dsap, pdu->ssap, len);
+  switch (pdu->ptype) {
+    case PDU_SYMM:
+      assert(!pdu->dsap);
+      assert(!pdu->ssap);
+      break;
+    case PDU_PAX:
+      assert(!pdu->dsap);
+      assert(!pdu->ssap);
+      assert(0 == llc_link_configure(link, pdu->information, pdu->information_size));
+      break;
+    case PDU_AGF:
+      assert(!pdu->dsap);
+      assert(!pdu->ssap);
+      STATS_INC(link->stats.agf_bundles);
+      STATS_ADD(link->stats.agf_bytes, pdu->information_size);
+
+      /* Check the whole AGF PDU before dispatching any of its PDUs */
+      const uint8_t *aggregated;
+      size_t aggregated_len, offset = 0;
+      while ((res = pdu_agf_next(pdu, &offset, &aggregated, &aggregated_len)) > 0)
+        ;
+      if (res < 0) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Invalid AGF PDU");
+        break;
+      }
+
+      offset = 0;
+      while (!stops->link && (pdu_agf_next(pdu, &offset, &aggregated, &aggregated_len) > 0)) {
+        STATS_INC(link->stats.agf_pdus);
+        llcp_trace_pdu(LLCP_TRACE_LLC_RECEIVE, aggregated, aggregated_len);
+        llc_link_stats_rx(link, aggregated, aggregated_len);
+        llc_service_llc_dispatch(link, llc_down, aggregated, aggregated_len, origin, stops);
+      }
+      break;
+    case PDU_SNL:
+      if (!((link->version.major == 1) && (link->version.minor >= 1))) {
+        /*
+         * Even if we negociate LLCP 1.0, some LLCP implementation will
+         * use LLCP 1.1 SNL to discover available services so warn
+         * about this problem but perform th operation anyway.
+         */
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ALERT, "SNL PDU (LLCP 1.1) received on LLCP %d.%d link", link->version.major, link->version.minor);
+      }
+      if ((pdu->dsap == LLCP_SDP_SAP) && link->sdp) {
+        connection = link->sdp;
+        goto deliver_logical_data_link;
+      }
+      goto spawn_logical_data_link;
+
+    case PDU_UI:
+spawn_logical_data_link:
+      if (!link->available_services[pdu->dsap]) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "No service bound to SAP %d", pdu->dsap);
+        break;
+      }
+
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Spawning Logical Data Link [%d -> %d]", pdu->ssap, pdu->dsap);
+      if (!(connection = llc_logical_data_link_new(link, pdu))) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot establish Logical Data Link [%d -> %d]", pdu->ssap, pdu->dsap);
+        STATS_INC(link->stats.datagrams_dropped);
+        break;
+      }
+
+      connection->user_data = link->available_services[pdu->dsap]->user_data;
+      if (pthread_create(&connection->thread, NULL, llc_service_llc_ldl_thread, connection) < 0) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot launch Logical Data Link [%d -> %d] thread", connection->local_sap, connection->remote_sap);
+        break;
+      }
+#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
+      asprintf(&thread_name, "LDL on SAP %d", connection->service_sap);
+      pthread_set_name_np(connection->thread, thread_name);
+      free(thread_name);
+#endif
+      if ((pdu->ptype == PDU_SNL) && (pdu->dsap == LLCP_SDP_SAP))
+        link->sdp = connection;
+
+deliver_logical_data_link:
+      stamp = llc_link_stats_deliver(connection, origin);
+      if (mq_send(connection->llc_up, (const char *) buffer, len, 0) < 0) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot send data to Logical Data Link [%d -> %d]", connection->local_sap, connection->remote_sap);
+        stamps_void(&connection->up_stamps, stamp);
+        break;
+      }
+      STATS_INC(connection->rx_queued);
+
+      break;
+    case PDU_RR:
+      connection = llc_link_find_connection(link, pdu->dsap);
+      assert(connection);
+      llc_connection_stats_ack(connection, pdu->nr);
+      connection->state.sa = pdu->nr;
+      connection->tx_peer_busy = 0;
+      STATS_INC(connection->stats.rr_received);
+      break;
+    case PDU_RNR:
+      /*
+       * The remote side is busy but still acknowledges the I PDUs it
+       * received so far.  Hold off I PDUs until a RR is received.
+       */
+      connection = llc_link_find_connection(link, pdu->dsap);
+      assert(connection);
+      llc_connection_stats_ack(connection, pdu->nr);
+      connection->state.sa = pdu->nr;
+      connection->tx_peer_busy = 1;
+      STATS_INC(connection->stats.rnr_received);
+      STATS_INC(link->stats.rnr_received);
+      break;
+    case PDU_CONNECT:
+      if (!link->available_services[pdu->dsap]) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "No service bound to SAP %d", pdu->dsap);
+        int reply_len;
+        uint8_t reason = 0x02;    // 0x02 ==> no service bound to the specified target SAP
+        reply_len = pdu_pack_dm(pdu->ssap, pdu->dsap, reason, reply, sizeof(reply));
+        stamp = llc_link_stats_respond(link, 0);
+        if (mq_send(llc_down, (char *) reply, reply_len, 0) < 0) {
+          stamps_void(&link->down_stamps, stamp);
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Cannot reject connection");
+        } else {
+          llc_link_stats_tx(link, reply, reply_len);
+        }
+        break;
+      }
+
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Spawning Data Link Connection [%d -> %d] accept routine", pdu->ssap, pdu->dsap);
+      int error;
+      if (!(connection = llc_data_link_connection_new(link, pdu, &error))) {
+        int reply_len;
+
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot establish Data Link Connection [%d -> %d] (reason = %02x)", pdu->ssap, pdu->dsap, error);
+        reply_len = pdu_pack_dm(pdu->ssap, pdu->dsap, error, reply, sizeof(reply));
+        stamp = llc_link_stats_respond(link, 0);
+        if (mq_send(llc_down, (char *) reply, reply_len, 0) < 0) {
+          stamps_void(&link->down_stamps, stamp);
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't Reject connection");
+        } else {
+          llc_link_stats_tx(link, reply, reply_len);
+        }
+        break;
+      }
+      if (!link->available_services[connection->service_sap]->accept_routine) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Data Link Connection [%d -> %d] accepted (no accept routine provided)", connection->local_sap, connection->remote_sap);
+        connection->status = DLC_ACCEPTED;
+      } else if (pthread_create(&connection->thread, NULL, link->available_services[connection->service_sap]->accept_routine, connection) < 0) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot launch Data Link Connection [%d -> %d] accept routine", connection->local_sap, connection->remote_sap);
+        break;
+      }
+#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
+      asprintf(&thread_name, "DLC Accept on SAP %d", connection->service_sap);
+      pthread_set_name_np(connection->thread, thread_name);
+      free(thread_name);
+#endif
+
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accept routine launched (service %d)", connection->local_sap, connection->remote_sap, connection->service_sap);
+      break;
+    case PDU_DISC:
+      if (!pdu->dsap && !pdu->ssap) {
+        stops->link = 1;
+        break;
+      } else {
+        if ((connection = llc_link_find_connection(link, pdu->dsap)))
+          llc_service_llc_stop_later(stops, connection, PDU_DISC);
+
+        int reply_len = pdu_pack_dm(pdu->ssap, pdu->dsap, 0x00, reply, sizeof(reply));
+        stamp = llc_link_stats_respond(link, 0);
+        if (mq_send(llc_down, (char *) reply, reply_len, 0) < 0) {
+          stamps_void(&link->down_stamps, stamp);
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send DM");
+        } else {
+          llc_link_stats_tx(link, reply, reply_len);
+        }
+      }
+      break;
+    case PDU_CC:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Connection Complete PDU");
+      connection = llc_link_find_connection(link, pdu->dsap);
+      assert(connection);
+      connection->remote_sap = pdu->ssap;
+      if (llc_connection_complete(connection, pdu->information, pdu->information_size) < 0)
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Cannot apply Connection Complete parameters");
+      connection->status = DLC_RECEIVED_CC;
+      llc_link_stats_setup(link, connection);
+      LLCP_PROBE4(connection__state, connection, connection->local_sap, connection->remote_sap, DLC_RECEIVED_CC);
+      break;
+    case PDU_DM:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Disconnected Mode PDU");
+      connection = llc_link_find_connection(link, pdu->dsap);
+      assert(connection);
+      llc_service_llc_stop_later(stops, connection, PDU_DM);
+      break;
+    case PDU_I:
+      connection = llc_link_find_connection(link, pdu->dsap);
+      assert(connection);
+#if defined(HAVE_DEBUG)
+      struct mq_attr attr;
+      mq_getattr(connection->llc_up, &attr);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "MQ: %d / %d x %d bytes", attr.mq_curmsgs, attr.mq_maxmsg, attr.mq_msgsize);
+#endif
+      if (pdu->ns != connection->state.r) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Invalid N(S)");
+        llcp_trace(LLCP_TRACE_INVALID_NS, pdu->ssap, pdu->dsap, connection->state.r);
+        int reply_len = pdu_pack_frmr(pdu->ssap, pdu->dsap, pdu, connection, FRMR_S, reply, sizeof(reply));
+        stamp = llc_link_stats_respond(link, 0);
+        if (mq_send(llc_down, (char *) reply, reply_len, 0) < 0) {
+          stamps_void(&link->down_stamps, stamp);
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send FRMR");
+        } else {
+          llc_link_stats_tx(link, reply, reply_len);
+          STATS_INC(connection->stats.frmr_sent);
+          STATS_INC(link->stats.frmr_sent);
+        }
+
+        break;
+      }
+
+      if (pdu->information_size > connection->local_miu) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "Information PDU too long: %d (MIU: %d)", pdu->information_size, connection->local_miu);
+        int reply_len = pdu_pack_frmr(pdu->ssap, pdu->dsap, pdu, connection, FRMR_I, reply, sizeof(reply));
+        stamp = llc_link_stats_respond(link, 0);
+        if (mq_send(llc_down, (char *) reply, reply_len, 0) < 0) {
+          stamps_void(&link->down_stamps, stamp);
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send FRMR");
+        } else {
+          llc_link_stats_tx(link, reply, reply_len);
+          STATS_INC(connection->stats.frmr_sent);
+          STATS_INC(link->stats.frmr_sent);
+        }
+
+        break;
+      }
+
+      INC_MOD_16(connection->state.r);
+      llc_connection_stats_ack(connection, pdu->nr);
+      connection->state.sa = pdu->nr;
+
+      STATS_INC(connection->stats.rx_pdus);
+      STATS_ADD(connection->stats.rx_bytes, pdu->information_size);
+      stamp = llc_link_stats_deliver(connection, origin);
+      if (mq_send(connection->llc_up, (const char *) buffer, len, 0) < 0) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Error sending %zu bytes to service %d", len, pdu->dsap);
+        stamps_void(&connection->up_stamps, stamp);
+      } else {
+        STATS_INC(connection->rx_queued);
+        STATS_ADD(connection->rx_bytes_queued, len);
+        stats_max(&connection->stats.rx_queue_hwm, connection->rx_queued - STATS_GET(connection->rx_dequeued));
+      }
+      break;
+    case PDU_FRMR:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Frame Reject PDU");
+      assert(pdu->information_size == 4);
+      STATS_INC(link->stats.frmr_received);
+      if ((connection = llc_link_find_connection(link, pdu->dsap)))
+        STATS_INC(connection->stats.frmr_received);
+      if (pdu->information[0] & 0x80) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU was invalid or malformed");
+      } else {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU was valid and wellformed");
+      }
+      if (pdu->information[0] & 0x40) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU has incorect or unexpected information field");
+      } else {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU has no incorect or unexpected information field");
+      }
+      if (pdu->information[0] & 0x20) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU contains an invalid receive sequence number N(R)");
+      } else {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU contains a valid receive sequence number N(R)");
+      }
+      if (pdu->information[0] & 0x10) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU contains an invalid send sequence number N(S)");
+      } else {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU contains a valid send sequence number N(S)");
+      }
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Rejected frame informations:");
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  PDU type: %d", pdu->information[0] & 0x0F);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  Sequence: %02x", pdu->information[1]);
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Receiver status:");
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(S):  %02x", pdu->information[2] >> 4);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(R):  %02x", pdu->information[2] & 0x0F);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(SA): %02x", pdu->information[3] >> 4);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(RA): %02x", pdu->information[3] & 0x0F);
+
+      break;
+    default:
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_WARN, "Unsupported LLC PDU: 0x%02x", pdu->ptype);
+      abort();
+  }
+}
+
 void *
 llc_service_llc_thread(void *arg)
 {
@@ -76,6 +490,7 @@ llc_service_llc_thread(void *arg)
   mqd_t llc_up, llc_down;
 
   int old_cancelstate;
+  struct llc_service_llc_stops stops = { 0 };
 #if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
   char *thread_name;
 #endif
@@ -90,20 +505,28 @@ llc_service_llc_thread(void *arg)
   if (llc_down == (mqd_t) - 1)
     LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "mq_open(%s)", link->mq_down_name);
 
+  /*
+   * Received PDUs are at most 3 + local_miu bytes long, PDUs to send at most
+   * 3 + remote_miu bytes long (the connections MIUs do not exceed the link
+   * ones).
+   */
+  size_t buffer_size = 3 + MAX(link->local_miu, link->remote_miu);
+
   pthread_cleanup_push(llc_service_llc_thread_cleanup, arg);
   pthread_setcancelstate(old_cancelstate, NULL);
   LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Link activated");
   for (;;) {
     int res;
-    uint8_t buffer[1024];
-    LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "mq_receive+");
+    uint8_t buffer[buffer_size];
+    struct llc_connection *connection;
     pthread_testcancel();
     res = mq_receive(llc_up, (char *) buffer, sizeof(buffer), NULL);
     pthread_testcancel();
     if (res < 0) {
       pthread_testcancel();
     }
-    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Received %d bytes", res);
+    uint64_t origin = (res < 0) ? 0 : llc_link_stats_dispatch(link);
+    int stamp;
 
     if (res < 2) {
       /* FIXME: Maybe we'd rather quit */
@@ -111,268 +534,63 @@ llc_service_llc_thread(void *arg)
       buffer[0] = buffer[1] = '\0';
       res = 2;
     }
+    llcp_trace_pdu(LLCP_TRACE_LLC_RECEIVE, buffer, res);
+    llc_link_stats_rx(link, buffer, res);
 
-    struct pdu *pdu;
-    struct pdu **pdus, **p;
-    struct llc_connection *connection;
+    /*
+     * Other threads add and remove connections: hold the connections lock
+     * until a PDU to send has been picked.
+     */
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
-    pdu = pdu_unpack((uint8_t *) buffer, res);
-    switch (pdu->ptype) {
-      case PDU_SYMM:
-        assert(!pdu->dsap);
-        assert(!pdu->ssap);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Symmetry PDU");
-        break;
-      case PDU_PAX:
-        assert(!pdu->dsap);
-        assert(!pdu->ssap);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Parameter Exchange PDU");
-        assert(0 == llc_link_configure(link, pdu->information, pdu->information_size));
-        break;
-      case PDU_AGF:
-        assert(!pdu->dsap);
-        assert(!pdu->ssap);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Aggregated Frame PDU");
-        p = pdus = pdu_dispatch(pdu);
-        while (*p) {
-          uint8_t buffer[BUFSIZ];
-          ssize_t length = pdu_pack(*p, buffer, sizeof(buffer));
-          mq_send(link->llc_up, (char *) buffer, length, 1);
-          pdu_free(*p);
-          p++;
-        }
-
-        free(pdus);
-        break;
-      case PDU_SNL:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Service Name Lookup PDU");
-        if (!((link->version.major == 1) && (link->version.minor >= 1))) {
-          /*
-           * Even if we negociate LLCP 1.0, some LLCP implementation will
-           * use LLCP 1.1 SNL to discover available services so warn
-           * about this problem but perform th operation anyway.
-           */
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ALERT, "SNL PDU (LLCP 1.1) received on LLCP %d.%d link", link->version.major, link->version.minor);
-        }
-        goto spawn_logical_data_link;
-
-      case PDU_UI:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Unnumbered Information PDU");
-spawn_logical_data_link:
-        if (!link->available_services[pdu->dsap]) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "No service bound to SAP %d", pdu->dsap);
-          break;
-        }
-
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Spawning Logical Data Link [%d -> %d]", pdu->ssap, pdu->dsap);
-        if (!(connection = llc_logical_data_link_new(link, pdu))) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot establish Logical Data Link [%d -> %d]", pdu->ssap, pdu->dsap);
-          break;
-        }
-
-        connection->user_data = link->available_services[pdu->dsap]->user_data;
-        if (pthread_create(&connection->thread, NULL, link->available_services[pdu->dsap]->thread_routine, connection) < 0) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot launch Logical Data Link [%d -> %d] thread", connection->local_sap, connection->remote_sap);
-          break;
-        }
-#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
-        asprintf(&thread_name, "LDL on SAP %d", connection->service_sap);
-        pthread_set_name_np(connection->thread, thread_name);
-        free(thread_name);
-#endif
-
-        if (mq_send(connection->llc_up, (char *) buffer, res, 0) < 0) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot send data to Logical Data Link [%d -> %d]", connection->local_sap, connection->remote_sap);
-          break;
-        }
-
-        break;
-      case PDU_RR:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Receive Ready PDU");
-
-        assert(link->transmission_handlers[pdu->dsap]);
-        link->transmission_handlers[pdu->dsap]->state.sa = pdu->nr;
-        break;
-      case PDU_CONNECT:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Connect PDU");
-        if (!link->available_services[pdu->dsap]) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "No service bound to SAP %d", pdu->dsap);
-          struct pdu *reply;
-          int len;
-          uint8_t reason[] = { 0x02 };    // 0x02 ==> no service bound to the specified target SAP
-          reply = pdu_new_dm(pdu->ssap, pdu->dsap, reason);
-          len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Cannot reject connection");
-          }
-          break;
-        }
-
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Spawning Data Link Connection [%d -> %d] accept routine", pdu->ssap, pdu->dsap);
-        int error;
-        if (!(connection = llc_data_link_connection_new(link, pdu, &error))) {
-          struct pdu *reply;
-          int len;
-          uint8_t reason[] = { error };
-
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot establish Data Link Connection [%d -> %d] (reason = %02x)", pdu->ssap, pdu->dsap, error);
-          reply = pdu_new_dm(pdu->ssap, pdu->dsap, reason);
-          len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't Reject connection");
-          }
-          break;
-        }
-        if (!link->available_services[connection->service_sap]->accept_routine) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Data Link Connection [%d -> %d] accepted (no accept routine provided)", connection->local_sap, connection->remote_sap);
-          connection->status = DLC_ACCEPTED;
-        } else if (pthread_create(&connection->thread, NULL, link->available_services[connection->service_sap]->accept_routine, connection) < 0) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot launch Data Link Connection [%d -> %d] accept routine", connection->local_sap, connection->remote_sap);
-          break;
-        }
-#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
-        asprintf(&thread_name, "DLC Accept on SAP %d", connection->service_sap);
-        pthread_set_name_np(connection->thread, thread_name);
-        free(thread_name);
-#endif
-
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accept routine launched (service %d)", connection->local_sap, connection->remote_sap, connection->service_sap);
-        break;
-      case PDU_DISC:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Disconnect PDU");
-        if (!pdu->dsap && !pdu->ssap) {
-          link->status = LL_DEACTIVATED;
-          pthread_exit((void *) 2);
-          break;
-        } else {
-          struct pdu *reply;
-
-          llc_connection_stop(link->transmission_handlers[pdu->dsap]);
-          llc_connection_free(link->transmission_handlers[pdu->dsap]);
-          link->transmission_handlers[pdu->dsap] = NULL;
-
-          uint8_t reason[1] = { 0x00 };
-          reply = pdu_new_dm(pdu->ssap, pdu->dsap, reason);
-          int len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send DM");
-          }
-        }
-        break;
-      case PDU_CC:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Connection Complete PDU");
-        connection = link->transmission_handlers[pdu->dsap];
-        connection->remote_sap = pdu->ssap;
-        connection->status = DLC_RECEIVED_CC;
-        break;
-      case PDU_DM:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Disconnected Mode PDU");
-        llc_connection_stop(link->transmission_handlers[pdu->dsap]);
-        link->transmission_handlers[pdu->dsap]->status = DLC_REJECTED;
-        break;
-      case PDU_I:
-        assert(link->transmission_handlers[pdu->dsap]);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Information PDU");
-#if defined(HAVE_DEBUG)
-        struct mq_attr attr;
-        mq_getattr(link->transmission_handlers[pdu->dsap]->llc_up, &attr);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "MQ: %d / %d x %d bytes", attr.mq_curmsgs, attr.mq_maxmsg, attr.mq_msgsize);
-#endif
-        if (pdu->ns != link->transmission_handlers[pdu->dsap]->state.r) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Invalid N(S)");
-          struct pdu *reply = pdu_new_frmr(pdu->ssap, pdu->dsap, pdu, link->transmission_handlers[pdu->dsap], FRMR_S);
-          int len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send FRMR");
-          }
-
-          break;
-        }
-
-        if (pdu->information_size > link->transmission_handlers[pdu->dsap]->local_miu) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "Information PDU too long: %d (MIU: %d)", pdu->information_size, link->transmission_handlers[pdu->dsap]->local_miu);
-          struct pdu *reply = pdu_new_frmr(pdu->ssap, pdu->dsap, pdu, link->transmission_handlers[pdu->dsap], FRMR_I);
-          int len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send FRMR");
-          }
-
-          break;
-        }
-
-        INC_MOD_16(link->transmission_handlers[pdu->dsap]->state.r);
-        link->transmission_handlers[pdu->dsap]->state.sa = pdu->nr;
-
-        if (mq_send(link->transmission_handlers[pdu->dsap]->llc_up, (char *) buffer, res, 0) < 0) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Error sending %d bytes to service %d", res, pdu->dsap);
-        } else {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_INFO, "Send %d bytes to service %d", res, pdu->dsap);
-        }
-        break;
-      case PDU_FRMR:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Frame Reject PDU");
-        assert(pdu->information_size == 4);
-        if (pdu->information[0] & 0x80) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU was invalid or malformed");
-        } else {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU was valid and wellformed");
-        }
-        if (pdu->information[0] & 0x40) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU has incorect or unexpected information field");
-        } else {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU has no incorect or unexpected information field");
-        }
-        if (pdu->information[0] & 0x20) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU contains an invalid receive sequence number N(R)");
-        } else {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU contains a valid receive sequence number N(R)");
-        }
-        if (pdu->information[0] & 0x10) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU contains an invalid send sequence number N(S)");
-        } else {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU contains a valid send sequence number N(S)");
-        }
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Rejected frame informations:");
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  PDU type: %d", pdu->information[0] & 0x0F);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  Sequence: %02x", pdu->information[1]);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Receiver status:");
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(S):  %02x", pdu->information[2] >> 4);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(R):  %02x", pdu->information[2] & 0x0F);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(SA): %02x", pdu->information[3] >> 4);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(RA): %02x", pdu->information[3] & 0x0F);
+    pthread_mutex_lock(&link->connections_mutex);
+    llc_service_llc_dispatch(link, llc_down, buffer, res, origin, &stops);
+    if (stops.count || stops.link) {
+      pthread_mutex_unlock(&link->connections_mutex);
+      llc_service_llc_stop_now(link, &stops);
+      if (stops.link) {
+        link->status = LL_DEACTIVATED;
+        LLCP_PROBE1(link__deactivate, link);
+        pthread_exit((void *) 2);
+      }
+      pthread_mutex_lock(&link->connections_mutex);
+    }
 
-        break;
-      default:
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_WARN, "Unsupported LLC PDU: 0x%02x", pdu->ptype);
-        abort();
+    if (link->settle_timeout) {
+      pthread_mutex_unlock(&link->connections_mutex);
+      llc_link_settle(link, link->settle_timeout);
+      pthread_mutex_lock(&link->connections_mutex);
     }
-    pdu_free(pdu);
-    pthread_setcancelstate(old_cancelstate, NULL);
 
     /* ---------------- */
 
     ssize_t length = 0;
-    for (int i = 0; i <= MAX_LOGICAL_DATA_LINK; i++) {
-      if (link->datagram_handlers[i]) {
-        pthread_t thread = link->datagram_handlers[i]->thread;
-        length = mq_receive(link->datagram_handlers[i]->llc_down, (char *) buffer, sizeof(buffer), NULL);
-        if (length > 0)
+    uint64_t response_origin = 0;
+    for (int i = 0; i < link->connection_count; i++) {
+      connection = link->connections[i];
+      if (connection->type == LLC_LOGICAL_DATA_LINK) {
+        pthread_t thread = connection->thread;
+        length = mq_receive(connection->llc_down, (char *) buffer, sizeof(buffer), NULL);
+        if (length > 0) {
+          STATS_INC(connection->tx_dequeued);
           break;
+        }
         switch (errno) {
           case EAGAIN:
+            if (thread && __atomic_load_n(&connection->thread_exited, __ATOMIC_ACQUIRE)) {
+              pthread_join(thread, NULL);
+              connection->thread = thread = 0;
+            }
             if (!thread) {
               /*
                * The service is not running anymore and it's down
                * queue is empty.  It can be garbage collected.
                */
-              LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Garbage-collecting Logical Data Link [%d -> %d]", link->datagram_handlers[i]->local_sap, link->datagram_handlers[i]->remote_sap);
-              llc_connection_free(link->datagram_handlers[i]);
-              link->datagram_handlers[i] = NULL;
+              LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Garbage-collecting Logical Data Link [%d -> %d]", connection->local_sap, connection->remote_sap);
+              llcp_trace(LLCP_TRACE_CONNECTION_GC, connection->remote_sap, connection->local_sap, 0);
+              if (connection == link->sdp)
+                link->sdp = NULL;
+              llc_connection_free(connection);
+              i--;
             }
             /* FALLTHROUGH */
           case EINTR:
@@ -380,43 +598,58 @@ spawn_logical_data_link:
             /* NOOP */
             break;
           default:
-            LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Can' read from service %d message queue", i);
+            LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Can' read from service %d message queue", connection->local_sap);
             break;
         }
       }
     }
-    for (int i = 1; i <= MAX_LLC_LINK_SERVICE; i++) {
-      if (link->transmission_handlers[i]) {
-        pthread_t thread = link->transmission_handlers[i]->thread;
-        length = mq_receive(link->transmission_handlers[i]->llc_down, (char *) buffer, sizeof(buffer), NULL);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Read %d bytes from service %d", length, i);
+    for (int i = 0; (length <= 0) && (i < link->connection_count); i++) {
+      connection = link->connections[i];
+      if (connection->type == LLC_DATA_LINK_CONNECTION) {
+        pthread_t thread = connection->thread;
+        int busy = thread ? llc_connection_rx_busy(connection) : 0;
+        if ((busy != connection->rx_busy_sent) || !llc_service_llc_can_send(link, connection)) {
+          /* Notify the peer of a busy condition change before sending more I PDUs */
+          length = -1;
+          errno = EAGAIN;
+        } else {
+          length = mq_receive(connection->llc_down, (char *) buffer, sizeof(buffer), NULL);
+          if ((length < 0) && (errno == EAGAIN) && connection->tx_buffer)
+            length = llc_connection_coalesced(connection, buffer, sizeof(buffer));
+        }
         if (length > 0) {
 #if defined(HAVE_DEBUG)
           LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "%d %d %d %d",
-                              link->transmission_handlers[i]->state.s,
-                              link->transmission_handlers[i]->state.sa,
-                              link->transmission_handlers[i]->state.r,
-                              link->transmission_handlers[i]->state.ra
+                              connection->state.s,
+                              connection->state.sa,
+                              connection->state.r,
+                              connection->state.ra
                              );
 #endif
-          struct pdu *pdu = pdu_unpack(buffer, length);
+          struct pdu view, *pdu = &view;
+          if (pdu_view(pdu, buffer, length) < 0) {
+            LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Dropping malformed PDU from service %d", connection->local_sap);
+            llc_connection_tx_dequeued(connection);
+            length = -1;
+            continue;
+          }
 
           if (pdu->ptype == PDU_I) {
-            if (link->transmission_handlers[i]->state.s == link->transmission_handlers[i]->state.sa + link->transmission_handlers[i]->rwr) {
-              /*
-               * We can't send data now
-               */
-              LLC_SERVICE_LLC_LOG(LLC_PRIORITY_WARN, "Data Link Connection [%d -> %d] send-window is full.  Postponing message delivery", link->transmission_handlers[i]->local_sap, link->transmission_handlers[i]->remote_sap);
-              mq_send(link->transmission_handlers[i]->llc_down, (char *) buffer, length, 1);
-              length = -1;
-              continue;
-            }
+            /*
+             * Sequence numbers are assigned when the PDU is actually sent,
+             * not when the service enqueued it: update the sequence field
+             * in place.
+             */
+            buffer[2] = (connection->state.s << 4) | connection->state.r;
+            connection->state.ra = connection->state.r;
+            llc_connection_stats_sent(connection);
+            INC_MOD_16(connection->state.s);
+            response_origin = connection->request_origin;
+            connection->request_origin = 0;
+            STATS_INC(connection->stats.tx_pdus);
+            STATS_ADD(connection->stats.tx_bytes, pdu->information_size);
           }
-          struct pdu *reply = pdu_new_i(pdu->dsap, pdu->ssap, link->transmission_handlers[i], pdu->information, pdu->information_size);
-          length = pdu_pack(pdu, buffer, sizeof(buffer));
-          free(reply);
-          pdu_free(pdu);
-          INC_MOD_16(link->transmission_handlers[i]->state.s);
+          llc_connection_tx_dequeued(connection);
           break;
         }
         switch (errno) {
@@ -427,33 +660,32 @@ spawn_logical_data_link:
                */
 #if defined(HAVE_DEBUG)
               LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "%d %d %d %d",
-                                  link->transmission_handlers[i]->state.s,
-                                  link->transmission_handlers[i]->state.sa,
-                                  link->transmission_handlers[i]->state.r,
-                                  link->transmission_handlers[i]->state.ra
+                                  connection->state.s,
+                                  connection->state.sa,
+                                  connection->state.r,
+                                  connection->state.ra
                                  );
 #endif
 
-              if (link->transmission_handlers[i]->state.ra != link->transmission_handlers[i]->state.r) {
-                LLC_SERVICE_LLC_MSG(LLC_PRIORITY_WARN, "Send acknoledgment for received data");
-                struct pdu *reply;
-                struct mq_attr attr;
-                mq_getattr(link->transmission_handlers[i]->llc_up, &attr);
-                if (attr.mq_curmsgs == attr.mq_maxmsg) {
-                  LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Message queue is full");
-                  reply = pdu_new_rnr(link->transmission_handlers[i]);
+              if ((connection->state.ra != connection->state.r) ||
+                  (busy != connection->rx_busy_sent)) {
+                if (busy) {
+                  LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Receive budget exhausted");
+                  length = pdu_pack_rnr(connection, buffer, sizeof(buffer));
+                  LLCP_PROBE3(rnr__send, connection, connection->local_sap, connection->remote_sap);
+                  STATS_INC(connection->stats.rnr_sent);
+                  STATS_INC(link->stats.rnr_sent);
                 } else {
-                  reply = pdu_new_rr(link->transmission_handlers[i]);
+                  length = pdu_pack_rr(connection, buffer, sizeof(buffer));
+                  STATS_INC(connection->stats.rr_sent);
                 }
-                length = pdu_pack(reply, buffer, sizeof(buffer));
-                pdu_free(reply);
-                link->transmission_handlers[i]->state.ra = link->transmission_handlers[i]->state.r;
+                connection->state.ra = connection->state.r;
+                connection->rx_busy_sent = busy;
                 break;
               }
             } else {
-              struct pdu *reply;
-              uint8_t reason[] = { 0x00 };
-              switch (link->transmission_handlers[i]->status) {
+              uint8_t reason = 0x00;
+              switch (connection->status) {
                 case DLC_NEW:
                 case DLC_CONNECTED:
                   /*
@@ -463,15 +695,16 @@ spawn_logical_data_link:
                   break;
                 case DLC_ACCEPTED:
                   LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accepted (service %d).  Sending CC", connection->local_sap, connection->remote_sap, connection->service_sap);
-                  reply = pdu_new_cc(connection);
-                  length = pdu_pack(reply, buffer, sizeof(buffer));
-                  pdu_free(reply);
+                  length = pdu_pack_cc(connection, buffer, sizeof(buffer));
+                  llc_link_stats_setup(link, connection);
                   /* FALLTHROUGH */
                 case DLC_RECEIVED_CC:
                   connection->user_data = link->available_services[connection->service_sap]->user_data;
+                  /* The thread may send as soon as it starts */
+                  connection->status = DLC_CONNECTED;
                   if (pthread_create(&connection->thread, NULL, connection->link->available_services[connection->service_sap]->thread_routine, connection) < 0) {
                     LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Cannot start Data Link Connection thread");
-                    link->transmission_handlers[i]->status = DLC_DISCONNECTED;
+                    connection->status = DLC_DISCONNECTED;
                     break;
                   }
 #if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
@@ -479,26 +712,28 @@ spawn_logical_data_link:
                   pthread_set_name_np(connection->thread, thread_name);
                   free(thread_name);
 #endif
-                  link->transmission_handlers[i]->status = DLC_CONNECTED;
+                  llcp_trace(LLCP_TRACE_CONNECTION_STATE, connection->remote_sap, connection->local_sap, DLC_CONNECTED);
+                  LLCP_PROBE4(connection__state, connection, connection->local_sap, connection->remote_sap, DLC_CONNECTED);
                   break;
                 case DLC_REJECTED:
-                  reason[0] = 0x03;
-                  link->transmission_handlers[i]->status = DLC_DISCONNECTED;
+                  reason = 0x03;
+                  connection->status = DLC_DISCONNECTED;
                   /* FALLTHROUGH */
                 case DLC_DISCONNECTED:
-                  reply = pdu_new_dm(connection->remote_sap, connection->local_sap, reason);
-                  length = pdu_pack(reply, buffer, sizeof(buffer));
-                  pdu_free(reply);
-                  link->transmission_handlers[i]->status = DLC_TERMINATED;
+                  length = pdu_pack_dm(connection->remote_sap, connection->local_sap, reason, buffer, sizeof(buffer));
+                  connection->status = DLC_TERMINATED;
+                  LLCP_PROBE4(connection__state, connection, connection->local_sap, connection->remote_sap, DLC_TERMINATED);
                   /* FALLTHROUGH */
                 case DLC_TERMINATED:
                   /*
                    * The service is not running anymore and it's down
                    * queue is empty.  It can be garbage collected.
                    */
-                  LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Garbage-collecting Data Link Connection [%d -> %d]", link->transmission_handlers[i]->local_sap, link->transmission_handlers[i]->remote_sap);
-                  llc_connection_free(link->transmission_handlers[i]);
-                  link->transmission_handlers[i] = NULL;
+                  LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Garbage-collecting Data Link Connection [%d -> %d]", connection->local_sap, connection->remote_sap);
+                  llcp_trace(LLCP_TRACE_CONNECTION_GC, connection->remote_sap, connection->local_sap, 0);
+                  llc_link_stats_teardown(link, connection);
+                  llc_connection_free(connection);
+                  i--;
                   break;
               }
             }
@@ -508,27 +743,38 @@ spawn_logical_data_link:
             /* NOOP */
             break;
           default:
-            LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Can't read from service %d message queue", i);
+            LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Can't read from service %d message queue", connection->local_sap);
             break;
         }
       }
     }
 
-    LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "mq_send+");
+    pthread_mutex_unlock(&link->connections_mutex);
+    pthread_setcancelstate(old_cancelstate, NULL);
     pthread_testcancel();
 
     if (length <= 0) {
-      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Nothing to send");
+      STATS_INC(link->stats.symm_turns);
       continue;
     }
 
+    llcp_trace_pdu(LLCP_TRACE_LLC_SEND, buffer, length);
+    LLCP_PROBE3(llc__send, link, buffer, length);
+    stamp = llc_link_stats_respond(link, response_origin);
+    __atomic_add_fetch(&link->down_waiters, 1, __ATOMIC_SEQ_CST);
     res = mq_send(llc_down, (char *) buffer, length, 0);
+    __atomic_sub_fetch(&link->down_waiters, 1, __ATOMIC_SEQ_CST);
+    /* Counted once the PDU is enqueued: the simulated MAC Link waits for it */
+    STATS_INC(link->stats.data_turns);
     pthread_testcancel();
+    if (res == 0)
+      llc_link_stats_tx(link, buffer, length);
+    else
+      stamps_void(&link->down_stamps, stamp);
 
     if (res < 0) {
       pthread_testcancel();
     }
-    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Sent %d bytes", length);
   }
   pthread_cleanup_pop(1);
   return NULL;
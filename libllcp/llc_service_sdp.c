@@ -21,10 +21,13 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <mqueue.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "llcp.h"
 #include "llcp_log.h"
@@ -33,6 +36,9 @@
 #include "llc_service.h"
 #include "llc_service_sdp.h"
 #include "llcp_parameters.h"
+#include "llcp_pdu.h"
+#include "llcp_stats.h"
+#include "llcp_trace.h"
 
 #define LOG_LLC_SDP "libllcp.llc.sdp"
 #define LLC_SDP_MSG(priority, message) llcp_log_log (LOG_LLC_SDP, priority, "(%p) %s", pthread_self (), message)
@@ -40,76 +46,133 @@
 
 /* Service Discovery Protocol */
 
+/*
+ * The SDP service is resident: the LLC Link spawns its Logical Data Link for
+ * the first SNL PDU addressed to the SDP SAP and hands it all the following
+ * ones (see llc_service_llc_thread()).  All the SDREQ parameters of an SNL PDU
+ * are answered with as few SNL PDUs as the MIU allows, and SDRES parameters
+ * are handed to llc_link_resolved().
+ */
+
+struct sdp_buffers {
+  uint8_t *request;
+  uint8_t *response;
+};
+
 void
 llc_service_sdp_thread_cleanup(void *arg)
 {
-  struct llc_connection *connection = (struct llc_connection *) arg;
+  struct sdp_buffers *buffers = (struct sdp_buffers *) arg;
+
+  free(buffers->request);
+  free(buffers->response);
+}
+
+static int
+llc_service_sdp_send(struct llc_connection *connection, const uint8_t *buffer, size_t len)
+{
+  struct timespec delay = { 0, 1000000 };
+
+  while (mq_send(connection->llc_down, (const char *) buffer, len, 0) < 0) {
+    if (errno != EAGAIN) {
+      LLC_SDP_LOG(LLC_PRIORITY_ERROR, "mq_send: %s", strerror(errno));
+      return -1;
+    }
+    nanosleep(&delay, NULL);
+  }
+  STATS_INC(connection->tx_queued);
 
-  (void) connection;
+  return 0;
 }
 
 void *
 llc_service_sdp_thread(void *arg)
 {
   struct llc_connection *connection = (struct llc_connection *) arg;
-  mqd_t llc_up, llc_down;
+  struct sdp_buffers buffers;
+  size_t request_size = 3 + connection->local_miu;
+  size_t response_size = 2 + connection->remote_miu;
 
   int old_cancelstate;
 
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
 
-  llc_up   = mq_open(connection->mq_up_name, O_RDONLY);
-  llc_down = mq_open(connection->mq_down_name, O_WRONLY);
+  buffers.request = malloc(request_size);
+  buffers.response = malloc(response_size);
 
-  if (llc_up == (mqd_t) - 1)
-    LLC_SDP_LOG(LLC_PRIORITY_ERROR, "mq_open(%s)", connection->mq_up_name);
-  if (llc_down == (mqd_t) - 1)
-    LLC_SDP_LOG(LLC_PRIORITY_ERROR, "mq_open(%s)", connection->mq_down_name);
-
-  pthread_cleanup_push(llc_service_sdp_thread_cleanup, arg);
+  pthread_cleanup_push(llc_service_sdp_thread_cleanup, &buffers);
   pthread_setcancelstate(old_cancelstate, NULL);
-  LLC_SDP_MSG(LLC_PRIORITY_INFO, "Service Discovery Protocol started");
-
-  int res;
 
-  uint8_t buffer[1024];
-  LLC_SDP_MSG(LLC_PRIORITY_TRACE, "mq_receive+");
-  pthread_testcancel();
-  res = mq_receive(llc_up, (char *) buffer, sizeof(buffer), NULL);
-  pthread_testcancel();
-  if (res < 0) {
-    pthread_testcancel();
+  if (!buffers.request || !buffers.response) {
+    LLC_SDP_MSG(LLC_PRIORITY_FATAL, "Cannot allocate memory");
+    goto error;
   }
-  LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Received %d bytes", res);
 
-  uint8_t tid;
-  char *uri;
-
-  switch (buffer[2]) {
-    case LLCP_PARAMETER_SDREQ:
-      if (parameter_decode_sdreq(buffer + 2, res - 2, &tid, &uri) < 0) {
-        LLC_SDP_MSG(LLC_PRIORITY_ERROR, "Ignoring PDU");
-      } else {
-        LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Service Discovery Request #0x%02x for '%s'", tid, uri);
+  LLC_SDP_MSG(LLC_PRIORITY_INFO, "Service Discovery Protocol started");
 
-        uint8_t sap = llc_link_find_sap_by_uri(connection->link, uri);
+  uint8_t *request = buffers.request;
+  uint8_t *response = buffers.response;
+
+  for (;;) {
+    __atomic_add_fetch(&connection->rx_waiters, 1, __ATOMIC_SEQ_CST);
+    ssize_t res = mq_receive(connection->llc_up, (char *) request, request_size, NULL);
+    __atomic_sub_fetch(&connection->rx_waiters, 1, __ATOMIC_SEQ_CST);
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      LLC_SDP_LOG(LLC_PRIORITY_ERROR, "mq_receive: %s", strerror(errno));
+      break;
+    }
+    STATS_INC(connection->rx_dequeued);
+    llc_link_stats_pickup(connection);
+
+    if (res < 2)
+      continue;
+
+    /* Answer to the SSAP of the request */
+    uint8_t ssap = request[1] & 0x3F;
+    struct pdu_builder snl;
+    pdu_builder_begin(&snl, response, response_size, ssap, PDU_SNL, LLCP_SDP_SAP, 0, 0);
+
+    struct parameter_iterator iterator;
+    struct parameter p;
+    int res_next;
+
+    parameter_iterator_init(&iterator, request + 2, res - 2);
+    while ((res_next = parameter_next(&iterator, &p)) > 0) {
+      if (p.type == LLCP_PARAMETER_SDRES) {
+        /* Answer to llc_link_resolve_many() */
+        llc_link_resolved(connection->link, p.tid, p.sap);
+        continue;
+      }
+      if (p.type != LLCP_PARAMETER_SDREQ) {
+        LLC_SDP_LOG(LLC_PRIORITY_ERROR, "Ignoring parameter type 0x%02x", p.type);
+        continue;
+      }
 
-        if (!sap) {
-          LLC_SDP_LOG(LLC_PRIORITY_ERROR, "No registered service provide '%s'", uri);
-        }
-        buffer[0] = 0x06;
-        buffer[1] = 0x41;
-        int n = parameter_encode_sdres(buffer + 2, sizeof(buffer) - 2, tid, sap);
+      LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Service Discovery Request #0x%02x for '%.*s'", p.tid, (int) p.sn_len, p.sn);
+      llcp_trace(LLCP_TRACE_SDP_REQUEST, ssap, connection->local_sap, p.tid);
 
-        mq_send(llc_down, (char *) buffer, n + 2, 0);
-        LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Sent %d bytes", n + 2);
+      uint8_t sap = llc_link_find_sap_by_sn(connection->link, p.sn, p.sn_len);
+      if (!sap) {
+        LLC_SDP_LOG(LLC_PRIORITY_ERROR, "No registered service provide '%.*s'", (int) p.sn_len, p.sn);
+      }
 
+      if (snl.length + 4 > snl.size) {
+        if (llc_service_sdp_send(connection, response, pdu_builder_commit(&snl)) < 0)
+          goto error;
+        pdu_builder_begin(&snl, response, response_size, ssap, PDU_SNL, LLCP_SDP_SAP, 0, 0);
       }
+      pdu_builder_tlv_sdres(&snl, p.tid, sap);
+    }
+    if (res_next < 0)
+      LLC_SDP_LOG(LLC_PRIORITY_ERROR, "Ignoring end of SNL PDU: %s", parameter_strerror(res_next));
+
+    if ((snl.length > 2) && (llc_service_sdp_send(connection, response, pdu_builder_commit(&snl)) < 0))
       break;
-    default:
-      LLC_SDP_MSG(LLC_PRIORITY_ERROR, "Invalid parameter type");
   }
 
+error:
   pthread_cleanup_pop(1);
   llc_connection_stop(connection);
   return NULL;
@@ -36,6 +36,7 @@
 #include "llc_link.h"
 #include "llcp_log.h"
 #include "llcp_pdu.h"
+#include "llcp_trace.h"
 #include "llc_service.h"
 
 #define LOG_LLCP "libllcp"
@@ -58,13 +59,21 @@ llcp_init(void)
   if (sigaction(SIGUSR1, &sa, NULL) < 0)
     return -1;
 
+  if (llcp_trace_init() < 0)
+    return -1;
+
   return llcp_log_init();
 }
 
 int
 llcp_fini(void)
 {
-  return llcp_log_fini();
+  int res = llcp_trace_fini();
+
+  if (llcp_log_fini() < 0)
+    res = -1;
+
+  return res;
 }
 
 int
@@ -101,6 +110,9 @@ llcp_threadslayer(pthread_t thread)
    * sending a signal to it so that it gets a chance to see the
    * cancelation state.  However, if send too early in the thread's life,
    * the signal may be missed.  So loop on pthread_kill() until it fails.
+   * Some pthread implementations keep on accepting signals for threads
+   * that have terminated but have not been joined yet, so also try to join
+   * the thread on each iteration where possible.
    *
    * XXX This is a dirty hack.
    */
@@ -109,6 +121,10 @@ llcp_threadslayer(pthread_t thread)
     .tv_nsec = 10000000,
   };
   while (0 == pthread_kill(thread, SIGUSR1)) {
+#if defined(HAVE_PTHREAD_TRYJOIN_NP)
+    if (0 == pthread_tryjoin_np(thread, NULL))
+      return;
+#endif
     nanosleep(&delay, NULL);
   }
 
@@ -119,9 +135,11 @@ int
 llcp_disconnect(struct llc_link *link)
 {
   assert(link);
-  struct pdu *pdu = pdu_new(0, PDU_DISC, 0, 0, 0, NULL, 0);
-  int res = llc_link_send_pdu(link, pdu);
-  pdu_free(pdu);
+  uint8_t buffer[2];
+  struct pdu_builder disc;
+
+  pdu_builder_begin(&disc, buffer, sizeof(buffer), 0, PDU_DISC, 0, 0, 0);
+  int res = llc_link_send_packed(link, buffer, pdu_builder_commit(&disc));
 
   llc_link_deactivate(link);
 
@@ -22,6 +22,8 @@
 #ifndef _LLCP_H
 #define _LLCP_H
 
+#include <sys/types.h>
+
 #include <pthread.h>
 #include <stdint.h>
 
@@ -54,6 +56,9 @@ int		 llcp_version_agreement(struct llc_link *link, struct llcp_version version)
 
 void		 llcp_threadslayer(pthread_t thread);
 
+int		 llcp_set_queue_budget(size_t bytes);
+size_t		 llcp_get_queue_usage(void);
+
 int		 llcp_disconnect(struct llc_link *link);
 
 #define MAX_LOGICAL_DATA_LINK 8
@@ -74,6 +79,10 @@ int		 llcp_disconnect(struct llc_link *link);
 
 #define LLCP_DEFAULT_RW 1
 #define LLCP_DEFAULT_MIU 128
+#define LLCP_MAX_MIU (LLCP_DEFAULT_MIU + 0x07FF)
+
+/* Largest PDU: an I PDU header followed by LLCP_MAX_MIU bytes */
+#define LLCP_MAX_PDU_SIZE (3 + LLCP_MAX_MIU)
 
 /*
  * http://www.nfc-forum.org/specs/nfc_forum_assigned_numbers_register
@@ -0,0 +1,329 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+/*
+ * LLCP traffic capture.
+ *
+ * PDUs exchanged by MAC Links are written to a pcapng file using the
+ * LINKTYPE_NFC_LLCP link type, so that Wireshark can decode them.  Each
+ * packet starts with the pseudo-header used by the Linux kernel LLCP raw
+ * sockets: one byte for the adapter index and one byte of flags, bit 0 being
+ * set for transmitted PDUs.  The direction is also recorded in the pcapng
+ * packet flags.
+ *
+ * Capturing must never slow down the PDU exchange loop, which runs under
+ * LTO constraints: PDUs are copied to a lock-free bounded ring (Dmitry
+ * Vyukov's MPMC queue, used here with multiple producers and one consumer)
+ * and written to disk by a background thread.  When the ring is full, PDUs
+ * are dropped and counted rather than waited for.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "llcp_capture.h"
+#include "llcp_log.h"
+
+#define LOG_LLC_CAPTURE "libllcp.mac.capture"
+#define LLC_CAPTURE_MSG(priority, message) llcp_log_log (LOG_LLC_CAPTURE, priority, "%s", message)
+#define LLC_CAPTURE_LOG(priority, format, ...) llcp_log_log (LOG_LLC_CAPTURE, priority, format, __VA_ARGS__)
+
+#define CAPTURE_RING_SIZE	256	/* Must be a power of 2 */
+#define CAPTURE_SNAPLEN		(2 + 3 + 2175)	/* pseudo-header + largest PDU */
+#define CAPTURE_DRAIN_DELAY	5000000	/* ns */
+
+/* pcapng block types and options */
+#define PCAPNG_SHB		0x0A0D0D0A
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC	0x1A2B3C4D
+#define PCAPNG_OPT_ENDOFOPT	0
+#define PCAPNG_OPT_IF_TSRESOL	9
+#define PCAPNG_OPT_EPB_FLAGS	2
+#define PCAPNG_EPB_INBOUND	0x00000001
+#define PCAPNG_EPB_OUTBOUND	0x00000002
+
+struct capture_slot {
+  uint32_t sequence;
+  uint32_t len;
+  uint32_t original_len;
+  uint64_t timestamp;		/* ns since the epoch */
+  uint8_t data[CAPTURE_SNAPLEN];
+};
+
+struct llcp_capture {
+  FILE *file;
+  struct capture_slot *slots;
+  uint32_t enqueue_pos;
+  uint32_t dequeue_pos;
+  size_t dropped;
+  int adapters;
+
+  uint64_t epoch;		/* Wall-clock time when the capture started (ns) */
+  struct timespec start;	/* Monotonic time when the capture started */
+
+  pthread_t thread;
+  volatile int stop;
+};
+
+static uint64_t
+timespec_to_ns(const struct timespec *ts)
+{
+  return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static int
+capture_write_header(FILE *file)
+{
+  const uint32_t shb[] = {
+    PCAPNG_SHB, 28, PCAPNG_BYTE_ORDER_MAGIC,
+    1 | (0 << 16),		/* Version 1.0 */
+    0xFFFFFFFF, 0xFFFFFFFF,	/* Section length not specified */
+    28,
+  };
+  const uint32_t idb[] = {
+    PCAPNG_IDB, 32,
+    LINKTYPE_NFC_LLCP,		/* Link type, reserved */
+    CAPTURE_SNAPLEN,
+    PCAPNG_OPT_IF_TSRESOL | (1 << 16), 9, /* Nanosecond resolution */
+    PCAPNG_OPT_ENDOFOPT,
+    32,
+  };
+
+  if ((fwrite(shb, sizeof(shb), 1, file) != 1) ||
+      (fwrite(idb, sizeof(idb), 1, file) != 1))
+    return -1;
+
+  return 0;
+}
+
+static int
+capture_write_packet(FILE *file, const struct capture_slot *slot)
+{
+  static const uint8_t padding[3] = { 0, 0, 0 };
+  const size_t padded_len = (slot->len + 3) & ~3u;
+  const uint32_t total = 28 + padded_len + 8 + 4 + 4;
+  const uint32_t flags = (slot->data[1] & LLCP_CAPTURE_TX) ? PCAPNG_EPB_OUTBOUND : PCAPNG_EPB_INBOUND;
+
+  const uint32_t header[] = {
+    PCAPNG_EPB, total,
+    0,				/* Interface ID */
+    slot->timestamp >> 32, slot->timestamp & 0xFFFFFFFF,
+    slot->len, slot->original_len,
+  };
+  const uint32_t trailer[] = {
+    PCAPNG_OPT_EPB_FLAGS | (4 << 16), flags,
+    PCAPNG_OPT_ENDOFOPT,
+    total,
+  };
+
+  if ((fwrite(header, sizeof(header), 1, file) != 1) ||
+      (fwrite(slot->data, slot->len, 1, file) != 1) ||
+      (fwrite(padding, padded_len - slot->len, 1, file) != 1 && padded_len != slot->len) ||
+      (fwrite(trailer, sizeof(trailer), 1, file) != 1))
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Write queued PDUs to the capture file.  Returns the number of PDUs
+ * written.
+ */
+static size_t
+capture_drain(struct llcp_capture *capture)
+{
+  size_t n = 0;
+
+  for (;;) {
+    struct capture_slot *slot = &capture->slots[capture->dequeue_pos & (CAPTURE_RING_SIZE - 1)];
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+    if ((int32_t)(sequence - (capture->dequeue_pos + 1)) < 0)
+      break;
+
+    if (capture_write_packet(capture->file, slot) < 0)
+      LLC_CAPTURE_MSG(LLC_PRIORITY_ERROR, "Cannot write to capture file");
+
+    __atomic_store_n(&slot->sequence, capture->dequeue_pos + CAPTURE_RING_SIZE, __ATOMIC_RELEASE);
+    capture->dequeue_pos++;
+    n++;
+  }
+
+  if (n)
+    fflush(capture->file);
+
+  return n;
+}
+
+static void *
+capture_thread(void *arg)
+{
+  struct llcp_capture *capture = (struct llcp_capture *)arg;
+  const struct timespec delay = { 0, CAPTURE_DRAIN_DELAY };
+
+  while (!capture->stop) {
+    if (!capture_drain(capture))
+      nanosleep(&delay, NULL);
+  }
+  capture_drain(capture);
+
+  return NULL;
+}
+
+struct llcp_capture *
+llcp_capture_open(const char *filename) {
+  struct llcp_capture *capture;
+
+  if (!(capture = malloc(sizeof(*capture))))
+    return NULL;
+
+  memset(capture, 0, sizeof(*capture));
+
+  if (!(capture->slots = malloc(CAPTURE_RING_SIZE * sizeof(*capture->slots)))) {
+    free(capture);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < CAPTURE_RING_SIZE; i++)
+    capture->slots[i].sequence = i;
+
+  if (!(capture->file = fopen(filename, "wb"))) {
+    LLC_CAPTURE_LOG(LLC_PRIORITY_ERROR, "Cannot open capture file %s", filename);
+    goto error;
+  }
+
+  if (capture_write_header(capture->file) < 0) {
+    LLC_CAPTURE_MSG(LLC_PRIORITY_ERROR, "Cannot write capture file header");
+    goto error;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  capture->epoch = timespec_to_ns(&now);
+  clock_gettime(CLOCK_MONOTONIC, &capture->start);
+
+  if (pthread_create(&capture->thread, NULL, capture_thread, capture) != 0) {
+    LLC_CAPTURE_MSG(LLC_PRIORITY_ERROR, "Cannot create capture thread");
+    goto error;
+  }
+#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
+  pthread_set_name_np(capture->thread, "LLCP capture");
+#endif
+
+  return capture;
+
+error:
+  if (capture->file)
+    fclose(capture->file);
+  free(capture->slots);
+  free(capture);
+  return NULL;
+}
+
+int
+llcp_capture_new_adapter(struct llcp_capture *capture)
+{
+  int adapter = __atomic_fetch_add(&capture->adapters, 1, __ATOMIC_RELAXED);
+
+  if (adapter > UINT8_MAX) {
+    LLC_CAPTURE_MSG(LLC_PRIORITY_ERROR, "Too many adapters");
+    return -1;
+  }
+
+  return adapter;
+}
+
+/*
+ * Queue a PDU for capture.  The timestamp is the time elapsed since the
+ * capture was opened, or the current time if elapsed is NULL.  Returns 0 on
+ * success, and -1 if the PDU was dropped.
+ */
+int
+llcp_capture_pdu(struct llcp_capture *capture, uint8_t adapter, int direction, const struct timespec *elapsed, const void *pdu, size_t len)
+{
+  struct capture_slot *slot;
+  uint64_t timestamp;
+
+  if (elapsed) {
+    timestamp = capture->epoch + timespec_to_ns(elapsed);
+  } else {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timestamp = capture->epoch + timespec_to_ns(&now) - timespec_to_ns(&capture->start);
+  }
+
+  uint32_t pos = __atomic_load_n(&capture->enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &capture->slots[pos & (CAPTURE_RING_SIZE - 1)];
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    int32_t diff = (int32_t)(sequence - pos);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&capture->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      /* The ring is full */
+      __atomic_fetch_add(&capture->dropped, 1, __ATOMIC_RELAXED);
+      return -1;
+    } else {
+      pos = __atomic_load_n(&capture->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  size_t captured = len < CAPTURE_SNAPLEN - 2 ? len : CAPTURE_SNAPLEN - 2;
+  slot->timestamp = timestamp;
+  slot->original_len = 2 + len;
+  slot->len = 2 + captured;
+  slot->data[0] = adapter;
+  slot->data[1] = direction;
+  memcpy(slot->data + 2, pdu, captured);
+
+  __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+size_t
+llcp_capture_dropped(const struct llcp_capture *capture)
+{
+  return __atomic_load_n(&capture->dropped, __ATOMIC_RELAXED);
+}
+
+void
+llcp_capture_close(struct llcp_capture *capture)
+{
+  if (capture) {
+    capture->stop = 1;
+    pthread_join(capture->thread, NULL);
+    if (capture->dropped)
+      LLC_CAPTURE_LOG(LLC_PRIORITY_WARN, "%d PDUs dropped from capture", (int) capture->dropped);
+    fclose(capture->file);
+    free(capture->slots);
+    free(capture);
+  }
+}
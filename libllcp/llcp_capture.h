@@ -0,0 +1,52 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#ifndef _LLCP_CAPTURE_H
+#define _LLCP_CAPTURE_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern  "C" {
+#endif /* __cplusplus */
+
+struct llcp_capture;
+
+/* http://www.tcpdump.org/linktypes.html */
+#define LINKTYPE_NFC_LLCP 245
+
+#define LLCP_CAPTURE_RX 0x00
+#define LLCP_CAPTURE_TX 0x01
+
+struct llcp_capture *llcp_capture_open(const char *filename);
+int		 llcp_capture_new_adapter(struct llcp_capture *capture);
+int		 llcp_capture_pdu(struct llcp_capture *capture, uint8_t adapter, int direction, const struct timespec *elapsed, const void *pdu, size_t len);
+size_t		 llcp_capture_dropped(const struct llcp_capture *capture);
+void		 llcp_capture_close(struct llcp_capture *capture);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_LLCP_CAPTURE_H */
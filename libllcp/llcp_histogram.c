@@ -0,0 +1,128 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include "llcp_histogram.h"
+#include "llcp_stats.h"
+
+#define SUB_BUCKETS      (1 << LLCP_HISTOGRAM_SUB_BITS)
+#define HALF_SUB_BUCKETS (SUB_BUCKETS / 2)
+
+void
+llcp_histogram_reset(struct llcp_histogram *histogram)
+{
+  memset(histogram, 0, sizeof(*histogram));
+  histogram->min = UINT64_MAX;
+}
+
+size_t
+llcp_histogram_bucket(uint64_t value)
+{
+  if (value < SUB_BUCKETS)
+    return value;
+
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - (LLCP_HISTOGRAM_SUB_BITS - 1);
+  size_t bucket = HALF_SUB_BUCKETS * shift + (value >> shift);
+
+  if (bucket >= LLCP_HISTOGRAM_BUCKETS)
+    bucket = LLCP_HISTOGRAM_BUCKETS - 1;
+
+  return bucket;
+}
+
+uint64_t
+llcp_histogram_bucket_min(size_t bucket)
+{
+  assert(bucket < LLCP_HISTOGRAM_BUCKETS);
+
+  if (bucket < SUB_BUCKETS)
+    return bucket;
+
+  int shift = bucket / HALF_SUB_BUCKETS - 1;
+  return (uint64_t)(bucket - HALF_SUB_BUCKETS * shift) << shift;
+}
+
+uint64_t
+llcp_histogram_bucket_max(size_t bucket)
+{
+  assert(bucket < LLCP_HISTOGRAM_BUCKETS);
+
+  if (bucket == LLCP_HISTOGRAM_BUCKETS - 1)
+    return UINT64_MAX;
+
+  return llcp_histogram_bucket_min(bucket + 1) - 1;
+}
+
+void
+llcp_histogram_record(struct llcp_histogram *histogram, uint64_t value)
+{
+  STATS_INC(histogram->buckets[llcp_histogram_bucket(value)]);
+  STATS_ADD(histogram->sum, value);
+  stats_max(&histogram->max, value);
+  stats_min(&histogram->min, value);
+  STATS_INC(histogram->count);
+}
+
+void
+llcp_histogram_copy(struct llcp_histogram *dst, const struct llcp_histogram *src)
+{
+  stats_copy(dst, src, sizeof(*dst));
+}
+
+/*
+ * Return the upper bound of the bucket holding the given percentile (0 to
+ * 100) of the recorded values, or 0 if the histogram is empty.
+ */
+uint64_t
+llcp_histogram_percentile(const struct llcp_histogram *histogram, double percentile)
+{
+  uint64_t total = 0;
+
+  for (size_t i = 0; i < LLCP_HISTOGRAM_BUCKETS; i++)
+    total += histogram->buckets[i];
+
+  if (!total)
+    return 0;
+
+  uint64_t rank = (uint64_t)(percentile * total / 100.0 + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > total)
+    rank = total;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < LLCP_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      uint64_t value = llcp_histogram_bucket_max(i);
+      return (value < histogram->max) ? value : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
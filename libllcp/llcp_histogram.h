@@ -0,0 +1,92 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#ifndef _LLCP_HISTOGRAM_H
+#define _LLCP_HISTOGRAM_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histograms (in the spirit of HdrHistogram).
+ *
+ * Values below 2^LLCP_HISTOGRAM_SUB_BITS are counted exactly; above, each
+ * power of two is split in 2^(LLCP_HISTOGRAM_SUB_BITS - 1) buckets, which
+ * bounds the relative error to about 6%.  Values are in nanoseconds, and
+ * values over about 4 hours are accounted in the last bucket.
+ */
+#define LLCP_HISTOGRAM_SUB_BITS 5
+#define LLCP_HISTOGRAM_BUCKETS  656
+
+struct llcp_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[LLCP_HISTOGRAM_BUCKETS];
+};
+
+void		 llcp_histogram_reset(struct llcp_histogram *histogram);
+void		 llcp_histogram_record(struct llcp_histogram *histogram, uint64_t value);
+void		 llcp_histogram_copy(struct llcp_histogram *dst, const struct llcp_histogram *src);
+uint64_t	 llcp_histogram_percentile(const struct llcp_histogram *histogram, double percentile);
+size_t		 llcp_histogram_bucket(uint64_t value);
+uint64_t	 llcp_histogram_bucket_min(size_t bucket);
+uint64_t	 llcp_histogram_bucket_max(size_t bucket);
+
+/*
+ * Histograms dump file format: a header followed by header.count records.
+ */
+#define LLCP_HISTOGRAM_MAGIC   "LLCPHST"
+#define LLCP_HISTOGRAM_VERSION 1
+
+struct llcp_histogram_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t buckets;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+struct llcp_histogram_record {
+  char name[32];
+  struct llcp_histogram histogram;
+};
+
+/*
+ * Timestamps of the PDUs waiting in a message queue (internal use).
+ *
+ * A timestamp is pushed by the producer before each PDU it enqueues and
+ * popped by the (only) consumer after each PDU it dequeues.  The origin is
+ * the time the PDU (or the request it answers) was received by the MAC
+ * Link.
+ */
+#define LLCP_STAMPS 32
+
+struct llcp_stamps {
+  uint64_t stamp[LLCP_STAMPS];
+  uint64_t origin[LLCP_STAMPS];
+  uint64_t head;
+  uint64_t tail;
+};
+
+#endif /* !_LLCP_HISTOGRAM_H */
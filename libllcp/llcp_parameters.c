@@ -33,6 +33,7 @@
 
 #define LOG_LLC_TLV "libllcp.llc.tlv"
 #define LLC_TLV_MSG(priority, message) llcp_log_log (LOG_LLC_TLV, priority, "%s",  message)
+#define LLC_TLV_LOG(priority, format, ...) llcp_log_log (LOG_LLC_TLV, priority, format, __VA_ARGS__)
 
 /*
  * Parameters management for LLCP TLV parameters.
@@ -386,7 +387,7 @@ parameter_decode_sdreq(const uint8_t buffer[], size_t buffer_len, uint8_t *tid,
     return -1;
   }
   *tid = buffer[2];
-  if ((*uri = malloc(buffer[1] - 1))) {
+  if ((*uri = malloc(buffer[1]))) {
     memcpy(*uri, buffer + 3, buffer[1] - 1);
     *(*uri + buffer[1] - 1) = '\0';
   } else {
@@ -438,3 +439,192 @@ parameter_decode_sdres(const uint8_t buffer[], size_t buffer_len, uint8_t *tid,
 
   return 0;
 }
+
+/*
+ * Single-pass decoding of parameter lists.
+ *
+ * parameter_next() checks each TLV field against the table below and
+ * decodes its value in place, without copying nor allocating memory.
+ * parameters_decode() collects the link and connection parameters of a whole
+ * list.  Both return PARAMETER_E* error codes on failure.
+ */
+
+static void
+decode_version(struct parameter *p)
+{
+  p->version.major = p->value[0] >> 4;
+  p->version.minor = p->value[0] & 0x0F;
+}
+
+static void
+decode_miux(struct parameter *p)
+{
+  p->miux = (p->value[0] << 8 | p->value[1]) & 0x07FF;
+}
+
+static void
+decode_wks(struct parameter *p)
+{
+  p->wks = (p->value[0] << 8 | p->value[1]) | 0x01;
+}
+
+static void
+decode_lto(struct parameter *p)
+{
+  p->lto = p->value[0];
+}
+
+static void
+decode_rw(struct parameter *p)
+{
+  p->rw = p->value[0];
+}
+
+static void
+decode_sn(struct parameter *p)
+{
+  p->sn = (const char *) p->value;
+  p->sn_len = p->length;
+}
+
+static void
+decode_opt(struct parameter *p)
+{
+  p->opt = p->value[0];
+}
+
+static void
+decode_sdreq(struct parameter *p)
+{
+  p->tid = p->value[0];
+  p->sn = (const char *) p->value + 1;
+  p->sn_len = p->length - 1;
+}
+
+static void
+decode_sdres(struct parameter *p)
+{
+  p->tid = p->value[0];
+  p->sap = p->value[1];
+}
+
+static const struct {
+  uint8_t min_length;
+  uint8_t max_length;
+  void (*decode)(struct parameter *p);
+} parameter_types[] = {
+  [LLCP_PARAMETER_VERSION] = { 1, 1,   decode_version },
+  [LLCP_PARAMETER_MIUX]    = { 2, 2,   decode_miux },
+  [LLCP_PARAMETER_WKS]     = { 2, 2,   decode_wks },
+  [LLCP_PARAMETER_LTO]     = { 1, 1,   decode_lto },
+  [LLCP_PARAMETER_RW]      = { 1, 1,   decode_rw },
+  [LLCP_PARAMETER_SN]      = { 0, 255, decode_sn },
+  [LLCP_PARAMETER_OPT]     = { 1, 1,   decode_opt },
+  [LLCP_PARAMETER_SDREQ]   = { 2, 255, decode_sdreq },
+  [LLCP_PARAMETER_SDRES]   = { 2, 2,   decode_sdres },
+};
+
+void
+parameter_iterator_init(struct parameter_iterator *iterator, const uint8_t buffer[], size_t buffer_len)
+{
+  iterator->buffer = buffer;
+  iterator->length = buffer_len;
+  iterator->offset = 0;
+}
+
+/*
+ * Decode the next parameter of the list.  Returns 1 if a parameter was
+ * decoded, 0 at the end of the list, and a PARAMETER_E* error code
+ * otherwise.  Parameters of unknown types are returned undecoded.
+ */
+int
+parameter_next(struct parameter_iterator *iterator, struct parameter *parameter)
+{
+  size_t left = iterator->length - iterator->offset;
+  const uint8_t *tlv = iterator->buffer + iterator->offset;
+
+  if (!left)
+    return 0;
+  if ((left < 2) || (left < 2u + tlv[1])) {
+    LLC_TLV_LOG(LLC_PRIORITY_ERROR, "Incomplete TLV field at offset %zu", iterator->offset);
+    return PARAMETER_ETRUNCATED;
+  }
+
+  parameter->type = tlv[0];
+  parameter->length = tlv[1];
+  parameter->value = tlv + 2;
+
+  if ((parameter->type < sizeof(parameter_types) / sizeof(*parameter_types)) && parameter_types[parameter->type].decode) {
+    if ((parameter->length < parameter_types[parameter->type].min_length) ||
+        (parameter->length > parameter_types[parameter->type].max_length)) {
+      LLC_TLV_LOG(LLC_PRIORITY_ERROR, "Invalid length %d for TLV type 0x%02x", parameter->length, parameter->type);
+      return PARAMETER_ELENGTH;
+    }
+    parameter_types[parameter->type].decode(parameter);
+  }
+
+  iterator->offset += 2 + parameter->length;
+  return 1;
+}
+
+int
+parameters_decode(const uint8_t buffer[], size_t buffer_len, struct parameters *parameters)
+{
+  struct parameter_iterator iterator;
+  struct parameter p;
+  int res;
+
+  parameters->present = 0;
+  parameter_iterator_init(&iterator, buffer, buffer_len);
+
+  while ((res = parameter_next(&iterator, &p)) > 0) {
+    switch (p.type) {
+      case LLCP_PARAMETER_VERSION:
+        parameters->version = p.version;
+        break;
+      case LLCP_PARAMETER_MIUX:
+        parameters->miux = p.miux;
+        break;
+      case LLCP_PARAMETER_WKS:
+        parameters->wks = p.wks;
+        break;
+      case LLCP_PARAMETER_LTO:
+        parameters->lto = p.lto;
+        break;
+      case LLCP_PARAMETER_RW:
+        parameters->rw = p.rw;
+        break;
+      case LLCP_PARAMETER_SN:
+        parameters->sn = p.sn;
+        parameters->sn_len = p.sn_len;
+        break;
+      case LLCP_PARAMETER_OPT:
+        parameters->opt = p.opt;
+        break;
+      case LLCP_PARAMETER_SDREQ:
+      case LLCP_PARAMETER_SDRES:
+        /* May be repeated: walk the list with parameter_next() */
+        continue;
+      default:
+        LLC_TLV_LOG(LLC_PRIORITY_INFO, "Unknown TLV Field 0x%02x (length: %d)", p.type, p.length);
+        continue;
+    }
+    parameters->present |= 1 << p.type;
+  }
+
+  return res;
+}
+
+const char *
+parameter_strerror(int error)
+{
+  switch (error) {
+    case 0:
+      return "Success";
+    case PARAMETER_ETRUNCATED:
+      return "Incomplete TLV field in parameters list";
+    case PARAMETER_ELENGTH:
+      return "Invalid TLV field length";
+  }
+  return "Unknown error";
+}
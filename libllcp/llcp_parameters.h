@@ -56,4 +56,60 @@ int	 parameter_decode_sdreq(const uint8_t buffer[], size_t buffer_len, uint8_t *
 int	 parameter_encode_sdres(uint8_t buffer[], size_t buffer_len, uint8_t tid, uint8_t sap);
 int	 parameter_decode_sdres(const uint8_t buffer[], size_t buffer_len, uint8_t *tid, uint8_t *sap);
 
+/*
+ * Single-pass decoding of parameter lists
+ */
+
+#define PARAMETER_ETRUNCATED -1	/* A TLV field overruns the parameter list */
+#define PARAMETER_ELENGTH    -2	/* Invalid length for the parameter type */
+
+/*
+ * A decoded parameter.  Only the fields of its type are meaningful; sn and
+ * uri point into the parameter list and are not NUL-terminated.
+ */
+struct parameter {
+  uint8_t type;
+  uint8_t length;
+  const uint8_t *value;
+
+  struct llcp_version version;
+  uint16_t miux;
+  uint16_t wks;
+  uint8_t lto;
+  uint8_t rw;
+  uint8_t opt;
+  const char *sn;		/* SN, and URI of SDREQ */
+  size_t sn_len;
+  uint8_t tid;			/* SDREQ, SDRES */
+  uint8_t sap;			/* SDRES */
+};
+
+struct parameter_iterator {
+  const uint8_t *buffer;
+  size_t length;
+  size_t offset;
+};
+
+/*
+ * Link and connection parameters, as found in a parameter list.
+ */
+struct parameters {
+  uint16_t present;		/* Bit (1 << LLCP_PARAMETER_*) per parameter found */
+  struct llcp_version version;
+  uint16_t miux;
+  uint16_t wks;
+  uint8_t lto;
+  uint8_t rw;
+  uint8_t opt;
+  const char *sn;
+  size_t sn_len;
+};
+
+#define PARAMETER_PRESENT(parameters, type) ((parameters)->present & (1 << (type)))
+
+void	 parameter_iterator_init(struct parameter_iterator *iterator, const uint8_t buffer[], size_t buffer_len);
+int	 parameter_next(struct parameter_iterator *iterator, struct parameter *parameter);
+int	 parameters_decode(const uint8_t buffer[], size_t buffer_len, struct parameters *parameters);
+const char *parameter_strerror(int error);
+
 #endif /* !_LLCP_PARAMETERS_H */
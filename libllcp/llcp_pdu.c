@@ -99,7 +99,7 @@ pdu_new_cc(const struct llc_connection *connection) {
   uint8_t buffer[BUFSIZ];
   int len = 0, r;
 
-  r = parameter_encode_miux(buffer + len, sizeof(buffer) - len, connection->local_miu);
+  r = parameter_encode_miux(buffer + len, sizeof(buffer) - len, connection->local_miu - LLCP_DEFAULT_MIU);
   if (r >= 0)
     len += r;
   r = parameter_encode_rw(buffer + len, sizeof(buffer) - len, connection->rwl);
@@ -170,6 +170,70 @@ pdu_unpack(const uint8_t *buffer, size_t len) {
   return pdu;
 }
 
+/*
+ * Decode the PDU in buffer without copying it: the information field of pdu
+ * points into buffer, which must outlive it.  pdu must not be freed.
+ */
+int
+pdu_view(struct pdu *pdu, const uint8_t *buffer, size_t len)
+{
+  if (len < 2) {
+    LLC_PDU_MSG(LLC_PRIORITY_ERROR, "PDU too short");
+    return -1;
+  }
+
+  pdu->dsap = buffer[0] >> 2;
+  pdu->ptype = ((buffer[0] & 0x03) << 2) | (buffer[1] >> 6);
+  pdu->ssap = buffer[1] & 0x3F;
+  pdu->nr = pdu->ns = 0;
+
+  size_t n = 2;
+
+  if (pdu_has_sequence_field(pdu)) {
+    if (len < 3) {
+      LLC_PDU_MSG(LLC_PRIORITY_ERROR, "Missing sequence field");
+      return -1;
+    }
+    pdu->ns = buffer[n] >> 4;
+    pdu->nr = buffer[n++] & 0x0F;
+  }
+
+  pdu->information_size = len - n;
+  pdu->information = pdu->information_size ? (uint8_t *) buffer + n : NULL;
+
+  return 0;
+}
+
+/*
+ * Iterate over the PDUs carried by an AGF PDU.  Stores the location of the
+ * next PDU in the information field of agf in buffer and len, and returns 1,
+ * 0 after the last PDU, or -1 if the AGF PDU is malformed.  offset shall be 0
+ * on the first call.
+ */
+int
+pdu_agf_next(const struct pdu *agf, size_t *offset, const uint8_t **buffer, size_t *len)
+{
+  if (*offset == agf->information_size)
+    return 0;
+
+  if (*offset + 2 > agf->information_size) {
+    LLC_PDU_MSG(LLC_PRIORITY_ERROR, "Incomplete TLV field");
+    return -1;
+  }
+
+  size_t pdu_length = agf->information[*offset] << 8 | agf->information[*offset + 1];
+  if ((pdu_length < 2) || (*offset + 2 + pdu_length > agf->information_size)) {
+    LLC_PDU_MSG(LLC_PRIORITY_ERROR, "Invalid aggregated PDU length");
+    return -1;
+  }
+
+  *buffer = agf->information + *offset + 2;
+  *len = pdu_length;
+  *offset += 2 + pdu_length;
+
+  return 1;
+}
+
 int
 pdu_size(struct pdu *pdu)
 {
@@ -264,3 +328,151 @@ pdu_free(struct pdu *pdu)
   free(pdu->information);
   free(pdu);
 }
+
+int
+pdu_builder_begin(struct pdu_builder *builder, uint8_t *buffer, size_t size, uint8_t dsap, uint8_t ptype, uint8_t ssap, uint8_t nr, uint8_t ns)
+{
+  size_t n = 0;
+
+  if (size < 2u + _pdu_ptype_sequence_field[ptype]) {
+    LLC_PDU_MSG(LLC_PRIORITY_ERROR, "Insuficient buffer space");
+    return -1;
+  }
+
+  buffer[n++] = (dsap << 2) | (ptype >> 2);
+  buffer[n++] = (ptype << 6) | ssap;
+  if (_pdu_ptype_sequence_field[ptype])
+    buffer[n++] = (ns << 4) | nr;
+
+  builder->buffer = buffer;
+  builder->size = size;
+  builder->length = n;
+
+  return 0;
+}
+
+int
+pdu_builder_bytes(struct pdu_builder *builder, const uint8_t *data, size_t len)
+{
+  if (builder->size - builder->length < len) {
+    LLC_PDU_MSG(LLC_PRIORITY_ERROR, "Insuficient buffer space");
+    return -1;
+  }
+
+  memcpy(builder->buffer + builder->length, data, len);
+  builder->length += len;
+
+  return 0;
+}
+
+/*
+ * Account for a parameter encoded at the end of the PDU.  The
+ * parameter_encode_*() functions leave the buffer untouched on failure.
+ */
+static int
+pdu_builder_tlv(struct pdu_builder *builder, int encoded)
+{
+  if (encoded < 0)
+    return -1;
+
+  builder->length += encoded;
+  return 0;
+}
+
+#define BUILDER_TAIL(builder) (builder)->buffer + (builder)->length, (builder)->size - (builder)->length
+
+int
+pdu_builder_tlv_miux(struct pdu_builder *builder, uint16_t miux)
+{
+  return pdu_builder_tlv(builder, parameter_encode_miux(BUILDER_TAIL(builder), miux));
+}
+
+int
+pdu_builder_tlv_rw(struct pdu_builder *builder, uint8_t rw)
+{
+  return pdu_builder_tlv(builder, parameter_encode_rw(BUILDER_TAIL(builder), rw));
+}
+
+int
+pdu_builder_tlv_sn(struct pdu_builder *builder, const char *sn)
+{
+  return pdu_builder_tlv(builder, parameter_encode_sn(BUILDER_TAIL(builder), sn));
+}
+
+int
+pdu_builder_tlv_sdreq(struct pdu_builder *builder, uint8_t tid, const char *uri)
+{
+  return pdu_builder_tlv(builder, parameter_encode_sdreq(BUILDER_TAIL(builder), tid, uri));
+}
+
+int
+pdu_builder_tlv_sdres(struct pdu_builder *builder, uint8_t tid, uint8_t sap)
+{
+  return pdu_builder_tlv(builder, parameter_encode_sdres(BUILDER_TAIL(builder), tid, sap));
+}
+
+int
+pdu_builder_commit(struct pdu_builder *builder)
+{
+  return builder->length;
+}
+
+int
+pdu_pack_cc(const struct llc_connection *connection, uint8_t *buffer, size_t len)
+{
+  struct pdu_builder builder;
+
+  if (pdu_builder_begin(&builder, buffer, len, connection->remote_sap, PDU_CC, connection->local_sap, 0, 0) < 0)
+    return -1;
+  pdu_builder_tlv_miux(&builder, connection->local_miu - LLCP_DEFAULT_MIU);
+  pdu_builder_tlv_rw(&builder, connection->rwl);
+
+  return pdu_builder_commit(&builder);
+}
+
+int
+pdu_pack_dm(uint8_t dsap, uint8_t ssap, uint8_t reason, uint8_t *buffer, size_t len)
+{
+  struct pdu_builder builder;
+
+  if ((pdu_builder_begin(&builder, buffer, len, dsap, PDU_DM, ssap, 0, 0) < 0) ||
+      (pdu_builder_bytes(&builder, &reason, 1) < 0))
+    return -1;
+
+  return pdu_builder_commit(&builder);
+}
+
+int
+pdu_pack_rr(const struct llc_connection *connection, uint8_t *buffer, size_t len)
+{
+  struct pdu_builder builder;
+
+  if (pdu_builder_begin(&builder, buffer, len, connection->remote_sap, PDU_RR, connection->local_sap, connection->state.r, connection->state.s) < 0)
+    return -1;
+
+  return pdu_builder_commit(&builder);
+}
+
+int
+pdu_pack_rnr(const struct llc_connection *connection, uint8_t *buffer, size_t len)
+{
+  struct pdu_builder builder;
+
+  if (pdu_builder_begin(&builder, buffer, len, connection->remote_sap, PDU_RNR, connection->local_sap, connection->state.r, connection->state.s) < 0)
+    return -1;
+
+  return pdu_builder_commit(&builder);
+}
+
+int
+pdu_pack_frmr(uint8_t dsap, uint8_t ssap, const struct pdu *pdu, const struct llc_connection *connection, int reason, uint8_t *buffer, size_t len)
+{
+  struct pdu_builder builder;
+  uint8_t info[] = { reason | pdu->ptype, pdu_has_sequence_field(pdu) ? (pdu->nr << 4 | pdu->ns) : 0, connection->state.s << 4 | connection->state.r, connection->state.sa << 4 | connection->state.ra };
+
+  if ((pdu_builder_begin(&builder, buffer, len, dsap, PDU_FRMR, ssap, 0, 0) < 0) ||
+      (pdu_builder_bytes(&builder, info, sizeof(info)) < 0))
+    return -1;
+
+  return pdu_builder_commit(&builder);
+}
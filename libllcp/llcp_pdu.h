@@ -75,11 +75,43 @@ struct pdu	*pdu_new_cc(const struct llc_connection *connction);
 struct pdu	*pdu_new_frmr(uint8_t dsap, uint8_t ssap, struct pdu *pdu, struct llc_connection *connection, int reason);
 int		 pdu_pack(const struct pdu *pdu, uint8_t *buffer, size_t len);
 struct pdu	*pdu_unpack(const uint8_t *buffer, size_t len);
+int		 pdu_view(struct pdu *pdu, const uint8_t *buffer, size_t len);
+int		 pdu_agf_next(const struct pdu *agf, size_t *offset, const uint8_t **buffer, size_t *len);
 int		 pdu_size(struct pdu *pdu);
 struct pdu	*pdu_aggregate(struct pdu **pdus);
 struct pdu     **pdu_dispatch(struct pdu *pdu);
 void		 pdu_free(struct pdu *pdu);
 
+/*
+ * PDU builder
+ *
+ * Control PDUs are written directly in the buffer handed to mq_send(): no
+ * struct pdu is allocated and the PDU is copied only once, by the message
+ * queue.  Parameters are appended in turn and pdu_builder_commit() returns
+ * the length of the PDU.  Functions fail without altering the PDU when the
+ * buffer is too small.
+ */
+struct pdu_builder {
+  uint8_t *buffer;
+  size_t size;
+  size_t length;
+};
+
+int		 pdu_builder_begin(struct pdu_builder *builder, uint8_t *buffer, size_t size, uint8_t dsap, uint8_t ptype, uint8_t ssap, uint8_t nr, uint8_t ns);
+int		 pdu_builder_bytes(struct pdu_builder *builder, const uint8_t *data, size_t len);
+int		 pdu_builder_tlv_miux(struct pdu_builder *builder, uint16_t miux);
+int		 pdu_builder_tlv_rw(struct pdu_builder *builder, uint8_t rw);
+int		 pdu_builder_tlv_sn(struct pdu_builder *builder, const char *sn);
+int		 pdu_builder_tlv_sdreq(struct pdu_builder *builder, uint8_t tid, const char *uri);
+int		 pdu_builder_tlv_sdres(struct pdu_builder *builder, uint8_t tid, uint8_t sap);
+int		 pdu_builder_commit(struct pdu_builder *builder);
+
+int		 pdu_pack_cc(const struct llc_connection *connection, uint8_t *buffer, size_t len);
+int		 pdu_pack_dm(uint8_t dsap, uint8_t ssap, uint8_t reason, uint8_t *buffer, size_t len);
+int		 pdu_pack_rr(const struct llc_connection *connection, uint8_t *buffer, size_t len);
+int		 pdu_pack_rnr(const struct llc_connection *connection, uint8_t *buffer, size_t len);
+int		 pdu_pack_frmr(uint8_t dsap, uint8_t ssap, const struct pdu *pdu, const struct llc_connection *connection, int reason, uint8_t *buffer, size_t len);
+
 #define pdu_new_i(dsap, ssap, conn, info, len) pdu_new (dsap, PDU_I, ssap, conn->state.r, conn->state.s, info, len)
 //#define pdu_new_rr(dsap, ssap, conn) pdu_new (dsap, PDU_RR, ssap, conn->state.r, conn->state.s, NULL, 0)
 #define pdu_new_rr(conn) pdu_new (conn->remote_sap, PDU_RR, conn->local_sap, conn->state.r, conn->state.s, NULL, 0)
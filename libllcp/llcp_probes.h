@@ -0,0 +1,70 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+/*
+ * USDT (SystemTap / DTrace) static probes.
+ *
+ * When <sys/sdt.h> is available, the following probes are compiled in the
+ * "libllcp" provider.  A probe which is not attached costs a single NOP.
+ *
+ *   mac__send(mac_link, pdu, length)		PDU sent by the MAC Link
+ *   mac__receive(mac_link, pdu, length)	PDU received by the MAC Link
+ *   llc__dispatch(link, ptype, dsap, ssap, length)
+ *						PDU dispatched by the LLC Link
+ *   llc__send(link, pdu, length)		PDU sent by the LLC Link
+ *   connection__state(connection, local_sap, remote_sap, status)
+ *						Data Link Connection status change
+ *   window__full(connection, local_sap, remote_sap)
+ *						I PDU postponed (send window full)
+ *   rnr__send(connection, local_sap, remote_sap)
+ *						RNR PDU sent (receive queue full)
+ *   link__activate(link, role)			LLC Link activated
+ *   link__deactivate(link)			LLC Link deactivated
+ *
+ * For example, to count dispatched PDUs per type with bpftrace:
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libllcp.so:libllcp:llc__dispatch { @[arg1] = count(); }'
+ */
+
+#ifndef _LLCP_PROBES_H
+#define _LLCP_PROBES_H
+
+#if defined(HAVE_SYS_SDT_H)
+
+#  include <sys/sdt.h>
+
+#  define LLCP_PROBE1(name, a) DTRACE_PROBE1(libllcp, name, a)
+#  define LLCP_PROBE2(name, a, b) DTRACE_PROBE2(libllcp, name, a, b)
+#  define LLCP_PROBE3(name, a, b, c) DTRACE_PROBE3(libllcp, name, a, b, c)
+#  define LLCP_PROBE4(name, a, b, c, d) DTRACE_PROBE4(libllcp, name, a, b, c, d)
+#  define LLCP_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(libllcp, name, a, b, c, d, e)
+
+#else /* HAVE_SYS_SDT_H */
+
+#  define LLCP_PROBE1(name, a) do {} while (0)
+#  define LLCP_PROBE2(name, a, b) do {} while (0)
+#  define LLCP_PROBE3(name, a, b, c) do {} while (0)
+#  define LLCP_PROBE4(name, a, b, c, d) do {} while (0)
+#  define LLCP_PROBE5(name, a, b, c, d, e) do {} while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* !_LLCP_PROBES_H */
@@ -0,0 +1,196 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "llcp.h"
+#include "llcp_log.h"
+#include "llcp_queue.h"
+
+#define LOG_LLCP_QUEUE "libllcp.queue"
+#define LLCP_QUEUE_MSG(priority, message) llcp_log_log (LOG_LLCP_QUEUE, priority, "%s", message)
+#define LLCP_QUEUE_LOG(priority, format, ...) llcp_log_log (LOG_LLCP_QUEUE, priority, format, __VA_ARGS__)
+
+/* Kernel bookkeeping per message, approximately */
+#define LLCP_QUEUE_MSG_OVERHEAD 64
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t queue_budget;	/* 0: RLIMIT_MSGQUEUE */
+static size_t queue_usage;
+
+static size_t
+llcp_queue_cost(long depth, long msgsize)
+{
+  return depth * (msgsize + LLCP_QUEUE_MSG_OVERHEAD);
+}
+
+/*
+ * Bound the memory the message queues of all LLC connections may use, in
+ * bytes.  Queues which would not fit get fewer PDUs (but at least
+ * LLCP_QUEUE_MIN_DEPTH).  0 (the default) uses the RLIMIT_MSGQUEUE limit
+ * the kernel enforces anyway.
+ */
+int
+llcp_set_queue_budget(size_t bytes)
+{
+  pthread_mutex_lock(&queue_mutex);
+  queue_budget = bytes;
+  pthread_mutex_unlock(&queue_mutex);
+
+  return 0;
+}
+
+size_t
+llcp_get_queue_usage(void)
+{
+  size_t res;
+
+  pthread_mutex_lock(&queue_mutex);
+  res = queue_usage;
+  pthread_mutex_unlock(&queue_mutex);
+
+  return res;
+}
+
+static size_t
+llcp_queue_budget(void)
+{
+  struct rlimit rlimit;
+
+  if (queue_budget)
+    return queue_budget;
+  if ((getrlimit(RLIMIT_MSGQUEUE, &rlimit) < 0) || (rlimit.rlim_cur == RLIM_INFINITY))
+    return SIZE_MAX;
+  return rlimit.rlim_cur;
+}
+
+/*
+ * Value of a fs.mqueue sysctl (Linux), -1 if unknown.
+ */
+static long
+llcp_queue_sysctl(const char *name)
+{
+  char path[64];
+  long res = -1;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/proc/sys/fs/mqueue/%s", name);
+  if ((f = fopen(path, "r"))) {
+    if (fscanf(f, "%ld", &res) != 1)
+      res = -1;
+    fclose(f);
+  }
+
+  return res;
+}
+
+static void
+llcp_queue_release(long depth, long msgsize)
+{
+  pthread_mutex_lock(&queue_mutex);
+  queue_usage -= MIN(queue_usage, llcp_queue_cost(depth, msgsize));
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+/*
+ * Create a message queue of *depth PDUs of msgsize bytes, or fewer if the
+ * queue budget or fs.mqueue.msg_max do not allow that many.  *depth is set
+ * to the depth actually granted.
+ */
+mqd_t
+llcp_queue_open(const char *name, int oflag, long *depth, long msgsize)
+{
+  long granted = MAX(*depth, LLCP_QUEUE_MIN_DEPTH);
+  long msg_max;
+  mqd_t res;
+
+  pthread_mutex_lock(&queue_mutex);
+  size_t budget = llcp_queue_budget();
+  if ((granted > LLCP_QUEUE_MIN_DEPTH) && (queue_usage + llcp_queue_cost(granted, msgsize) > budget)) {
+    long fit = (budget > queue_usage) ? (budget - queue_usage) / llcp_queue_cost(1, msgsize) : 0;
+    granted = MAX(fit, LLCP_QUEUE_MIN_DEPTH);
+    LLCP_QUEUE_LOG(LLC_PRIORITY_WARN, "Queue budget exhausted: '%s' gets %ld PDUs instead of %ld", name, granted, *depth);
+  }
+  queue_usage += llcp_queue_cost(granted, msgsize);
+  pthread_mutex_unlock(&queue_mutex);
+
+  struct mq_attr attr = {
+    .mq_maxmsg  = granted,
+    .mq_msgsize = msgsize,
+  };
+
+  res = mq_open(name, oflag | O_CREAT, 0666, &attr);
+  if ((res == (mqd_t) - 1) && (errno == EINVAL) && ((msg_max = llcp_queue_sysctl("msg_max")) >= LLCP_QUEUE_MIN_DEPTH) && (granted > msg_max)) {
+    LLCP_QUEUE_LOG(LLC_PRIORITY_WARN, "'%s' needs %ld PDUs but fs.mqueue.msg_max is %ld: raise it to keep the window full", name, granted, msg_max);
+    llcp_queue_release(granted - msg_max, msgsize);
+    attr.mq_maxmsg = granted = msg_max;
+    res = mq_open(name, oflag | O_CREAT, 0666, &attr);
+  }
+
+  if (res == (mqd_t) - 1) {
+    int error = errno;
+    long msgsize_max = llcp_queue_sysctl("msgsize_max");
+
+    if ((error == EINVAL) && (msgsize_max > 0) && (msgsize > msgsize_max))
+      LLCP_QUEUE_LOG(LLC_PRIORITY_ERROR, "Cannot open message queue '%s': %ld bytes PDUs exceed fs.mqueue.msgsize_max (%ld)", name, msgsize, msgsize_max);
+    else if (error == EMFILE)
+      LLCP_QUEUE_LOG(LLC_PRIORITY_ERROR, "Cannot open message queue '%s' (%ld x %ld bytes): RLIMIT_MSGQUEUE reached", name, granted, msgsize);
+    else if (error == ENOSPC)
+      LLCP_QUEUE_LOG(LLC_PRIORITY_ERROR, "Cannot open message queue '%s': fs.mqueue.queues_max reached", name);
+    else
+      LLCP_QUEUE_LOG(LLC_PRIORITY_ERROR, "Cannot open message queue '%s' (%ld x %ld bytes): %s", name, granted, msgsize, strerror(error));
+    llcp_queue_release(granted, msgsize);
+    errno = error;
+  }
+
+  *depth = granted;
+  return res;
+}
+
+/*
+ * Close and unlink a message queue opened with llcp_queue_open().
+ */
+void
+llcp_queue_close(mqd_t mqd, const char *name)
+{
+  struct mq_attr attr;
+
+  if (mqd == (mqd_t) - 1)
+    return;
+
+  if (mq_getattr(mqd, &attr) == 0)
+    llcp_queue_release(attr.mq_maxmsg, attr.mq_msgsize);
+  mq_close(mqd);
+  if (name)
+    mq_unlink(name);
+}
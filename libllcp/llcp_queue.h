@@ -0,0 +1,41 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#ifndef _LLCP_QUEUE_H
+#define _LLCP_QUEUE_H
+
+#include <sys/types.h>
+
+#include <mqueue.h>
+
+/*
+ * POSIX message queues of the LLC connections.  Their depth is bounded by
+ * fs.mqueue.msg_max and their memory by the process-wide queue budget (see
+ * llcp_set_queue_budget()).
+ */
+
+/* Depth which is always granted */
+#define LLCP_QUEUE_MIN_DEPTH 2
+
+mqd_t		 llcp_queue_open(const char *name, int oflag, long *depth, long msgsize);
+void		 llcp_queue_close(mqd_t mqd, const char *name);
+
+#endif /* !_LLCP_QUEUE_H */
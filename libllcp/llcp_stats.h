@@ -0,0 +1,147 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#ifndef _LLCP_STATS_H
+#define _LLCP_STATS_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "llcp_histogram.h"
+
+/*
+ * Statistics counters are updated and read with relaxed atomic operations:
+ * readers never block the LLC Link thread, and counters never tear, but
+ * distinct counters of a snapshot may be slightly out of sync.
+ */
+
+#define STATS_INC(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+#define STATS_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STATS_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+static inline void
+stats_max(uint64_t *counter, uint64_t value)
+{
+  uint64_t current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+  while ((value > current) &&
+         !__atomic_compare_exchange_n(counter, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static inline void
+stats_min(uint64_t *counter, uint64_t value)
+{
+  uint64_t current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+  while ((value < current) &&
+         !__atomic_compare_exchange_n(counter, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * Copy a statistics structure made of uint64_t counters only.
+ */
+static inline void
+stats_copy(void *dst, const void *src, size_t size)
+{
+  uint64_t *d = (uint64_t *) dst;
+  const uint64_t *s = (const uint64_t *) src;
+
+  for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+    d[i] = __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+stats_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Stage timestamps (see struct llcp_stamps).  The message queue operations
+ * order the accesses of the producer(s) and the consumer.
+ */
+static inline int
+stamps_push(struct llcp_stamps *stamps, uint64_t stamp, uint64_t origin)
+{
+  uint64_t tail = __atomic_load_n(&stamps->tail, __ATOMIC_RELAXED);
+
+  do {
+    if (tail - __atomic_load_n(&stamps->head, __ATOMIC_RELAXED) >= LLCP_STAMPS)
+      return -1;
+  } while (!__atomic_compare_exchange_n(&stamps->tail, &tail, tail + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  stamps->stamp[tail % LLCP_STAMPS] = stamp;
+  stamps->origin[tail % LLCP_STAMPS] = origin;
+  return tail % LLCP_STAMPS;
+}
+
+/*
+ * Forget a timestamp whose PDU could not be enqueued.
+ */
+static inline void
+stamps_void(struct llcp_stamps *stamps, int slot)
+{
+  if (slot >= 0)
+    stamps->stamp[slot] = 0;
+}
+
+static inline uint64_t
+stamps_pop(struct llcp_stamps *stamps, uint64_t *origin)
+{
+  uint64_t head = __atomic_load_n(&stamps->head, __ATOMIC_RELAXED);
+
+  while (head != __atomic_load_n(&stamps->tail, __ATOMIC_RELAXED)) {
+    uint64_t stamp = stamps->stamp[head % LLCP_STAMPS];
+    *origin = stamps->origin[head % LLCP_STAMPS];
+    __atomic_store_n(&stamps->head, ++head, __ATOMIC_RELAXED);
+    if (stamp)
+      return stamp;
+  }
+
+  *origin = 0;
+  return 0;
+}
+
+struct llc_connection;
+struct llc_link;
+
+void		 llc_link_stats_rx(struct llc_link *link, const uint8_t *pdu, size_t len);
+void		 llc_link_stats_tx(struct llc_link *link, const uint8_t *pdu, size_t len);
+void		 llc_link_stats_setup(struct llc_link *link, struct llc_connection *connection);
+void		 llc_link_stats_teardown(struct llc_link *link, struct llc_connection *connection);
+
+void		 llc_link_stats_mac_receive(struct llc_link *link);
+void		 llc_link_stats_mac_send(struct llc_link *link, int dequeued);
+uint64_t	 llc_link_stats_dispatch(struct llc_link *link);
+int		 llc_link_stats_deliver(struct llc_connection *connection, uint64_t origin);
+void		 llc_link_stats_pickup(struct llc_connection *connection);
+int		 llc_link_stats_respond(struct llc_link *link, uint64_t origin);
+
+void		 llc_connection_stats_sent(struct llc_connection *connection);
+void		 llc_connection_stats_ack(struct llc_connection *connection, uint8_t nr);
+
+#endif /* !_LLCP_STATS_H */
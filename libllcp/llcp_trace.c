@@ -0,0 +1,274 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+/*
+ * Binary event tracing.
+ *
+ * Each thread records fixed-size events in its own ring, so recording an
+ * event takes neither a lock nor a system call: it is a clock read and a
+ * few stores.  Rings are flight recorders: the oldest events are
+ * overwritten, and llcp_trace_dump() writes what is left to a file which
+ * the llcp-trace tool decodes.
+ *
+ * Rings of terminated threads are recycled by new threads, so memory usage
+ * is bounded by the number of threads running at the same time.  Events
+ * keep the index of the thread that recorded them.
+ *
+ * Setting the LLCP_TRACE environment variable to a file name enables tracing
+ * in llcp_init() and dumps the trace in llcp_fini().
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "llcp_log.h"
+#include "llcp_pdu.h"
+#include "llcp_trace.h"
+
+#define LOG_LLC_TRACE "libllcp.trace"
+#define LLC_TRACE_MSG(priority, message) llcp_log_log (LOG_LLC_TRACE, priority, "%s", message)
+#define LLC_TRACE_LOG(priority, format, ...) llcp_log_log (LOG_LLC_TRACE, priority, format, __VA_ARGS__)
+
+#define TRACE_RING_SIZE 1024	/* Must be a power of 2 */
+
+struct trace_ring {
+  struct trace_ring *next;	/* All rings */
+  struct trace_ring *next_free;	/* Rings of terminated threads */
+  uint32_t thread;
+  uint32_t head;		/* Number of events ever recorded */
+  struct llcp_trace_event events[TRACE_RING_SIZE];
+};
+
+int llcp_trace_enabled = 0;
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings = NULL;
+static struct trace_ring *free_rings = NULL;
+static uint32_t threads = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static __thread struct trace_ring *ring = NULL;
+
+static char *dump_filename = NULL;
+
+static void
+trace_ring_release(void *arg)
+{
+  struct trace_ring *r = (struct trace_ring *)arg;
+
+  pthread_mutex_lock(&rings_mutex);
+  r->next_free = free_rings;
+  free_rings = r;
+  pthread_mutex_unlock(&rings_mutex);
+}
+
+static void
+trace_key_create(void)
+{
+  pthread_key_create(&key, trace_ring_release);
+}
+
+static struct trace_ring *
+trace_ring_get(void) {
+  if (ring)
+    return ring;
+
+  pthread_once(&key_once, trace_key_create);
+
+  pthread_mutex_lock(&rings_mutex);
+  if ((ring = free_rings)) {
+    free_rings = ring->next_free;
+  } else if ((ring = malloc(sizeof(*ring)))) {
+    memset(ring, 0, sizeof(*ring));
+    ring->next = rings;
+    rings = ring;
+  }
+  if (ring)
+    ring->thread = threads++;
+  pthread_mutex_unlock(&rings_mutex);
+
+  if (ring)
+    pthread_setspecific(key, ring);
+
+  return ring;
+}
+
+static struct llcp_trace_event *
+trace_event_new(uint16_t event) {
+  struct trace_ring *r;
+  struct timespec now;
+
+  if (!(r = trace_ring_get()))
+    return NULL;
+
+  struct llcp_trace_event *e = &r->events[r->head & (TRACE_RING_SIZE - 1)];
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  e->timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  e->thread = r->thread;
+  e->event = event;
+
+  return e;
+}
+
+static void
+trace_event_commit(void)
+{
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Record an event about a packed PDU.  Only the PDU header is decoded.
+ */
+void
+llcp_trace_record_pdu(uint16_t event, const uint8_t *pdu, size_t len)
+{
+  struct llcp_trace_event *e;
+
+  if (!(e = trace_event_new(event)))
+    return;
+
+  e->value = 0;
+  e->length = len;
+  if (len >= 2) {
+    e->dsap = pdu[0] >> 2;
+    e->ptype = ((pdu[0] & 0x03) << 2) | (pdu[1] >> 6);
+    e->ssap = pdu[1] & 0x3F;
+  } else {
+    e->dsap = e->ptype = e->ssap = 0;
+  }
+  if ((len >= 3) && ((e->ptype == PDU_I) || (e->ptype == PDU_RR) || (e->ptype == PDU_RNR))) {
+    e->ns = pdu[2] >> 4;
+    e->nr = pdu[2] & 0x0F;
+  } else {
+    e->ns = e->nr = 0;
+  }
+
+  trace_event_commit();
+}
+
+void
+llcp_trace_record(uint16_t event, uint8_t dsap, uint8_t ssap, int32_t value)
+{
+  struct llcp_trace_event *e;
+
+  if (!(e = trace_event_new(event)))
+    return;
+
+  e->value = value;
+  e->length = 0;
+  e->ptype = 0;
+  e->dsap = dsap;
+  e->ssap = ssap;
+  e->ns = e->nr = 0;
+
+  trace_event_commit();
+}
+
+void
+llcp_trace_enable(int enable)
+{
+  __atomic_store_n(&llcp_trace_enabled, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write the recorded events to filename.  Threads may keep on recording
+ * events meanwhile, in which case the oldest events of their rings may be
+ * inconsistent.
+ */
+int
+llcp_trace_dump(const char *filename)
+{
+  FILE *f;
+  struct llcp_trace_header header;
+  int res = 0;
+
+  if (!(f = fopen(filename, "wb"))) {
+    LLC_TRACE_LOG(LLC_PRIORITY_ERROR, "Cannot open trace file %s", filename);
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LLCP_TRACE_MAGIC, sizeof(LLCP_TRACE_MAGIC));
+  header.version = LLCP_TRACE_VERSION;
+  header.event_size = sizeof(struct llcp_trace_event);
+
+  if (fwrite(&header, sizeof(header), 1, f) != 1)
+    res = -1;
+
+  pthread_mutex_lock(&rings_mutex);
+  for (struct trace_ring *r = rings; r && !res; r = r->next) {
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+    for (uint32_t i = first; i != head; i++) {
+      if (fwrite(&r->events[i & (TRACE_RING_SIZE - 1)], sizeof(struct llcp_trace_event), 1, f) != 1) {
+        res = -1;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&rings_mutex);
+
+  if (fclose(f) != 0)
+    res = -1;
+
+  if (res < 0)
+    LLC_TRACE_LOG(LLC_PRIORITY_ERROR, "Cannot write trace file %s", filename);
+
+  return res;
+}
+
+int
+llcp_trace_init(void)
+{
+  const char *filename;
+
+  if ((filename = getenv("LLCP_TRACE")) && *filename) {
+    free(dump_filename);
+    if (!(dump_filename = strdup(filename)))
+      return -1;
+    llcp_trace_enable(1);
+  }
+
+  return 0;
+}
+
+int
+llcp_trace_fini(void)
+{
+  int res = 0;
+
+  if (dump_filename) {
+    llcp_trace_enable(0);
+    res = llcp_trace_dump(dump_filename);
+    free(dump_filename);
+    dump_filename = NULL;
+  }
+
+  return res;
+}
@@ -0,0 +1,104 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#ifndef _LLCP_TRACE_H
+#define _LLCP_TRACE_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern  "C" {
+#endif /* __cplusplus */
+
+/* Trace events */
+#define LLCP_TRACE_MAC_SEND		0x01	/* PDU handed to the NFC device */
+#define LLCP_TRACE_MAC_RECEIVE		0x02	/* PDU received from the NFC device */
+#define LLCP_TRACE_LLC_RECEIVE		0x03	/* PDU dispatched by the LLC Link */
+#define LLCP_TRACE_LLC_SEND		0x04	/* PDU sent by the LLC Link */
+#define LLCP_TRACE_WINDOW_FULL		0x05	/* I PDU postponed (send window full) */
+#define LLCP_TRACE_INVALID_NS		0x06	/* I PDU rejected (unexpected N(S)) */
+#define LLCP_TRACE_CONNECTION_STATE	0x07	/* value: new connection status */
+#define LLCP_TRACE_CONNECTION_GC	0x08	/* Connection garbage-collected */
+#define LLCP_TRACE_SDP_REQUEST		0x09	/* value: SDREQ transaction identifier */
+
+#define LLCP_TRACE_MAGIC	"LLCPTRC"
+#define LLCP_TRACE_VERSION	1
+
+/*
+ * Trace files start with this header, followed by the events of each thread
+ * in chronological order.
+ */
+struct llcp_trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t event_size;
+};
+
+/*
+ * PDU events describe the PDU header.  For other events, dsap and ssap are
+ * the remote and local SAPs of the connection.
+ */
+struct llcp_trace_event {
+  uint64_t timestamp;		/* CLOCK_MONOTONIC, in ns */
+  uint32_t thread;		/* Index of the thread that recorded the event */
+  int32_t value;		/* Event specific */
+  uint16_t event;
+  uint16_t length;		/* PDU length */
+  uint8_t ptype;
+  uint8_t dsap;
+  uint8_t ssap;
+  uint8_t ns;
+  uint8_t nr;
+  uint8_t reserved[7];
+};
+
+extern int llcp_trace_enabled;
+
+int		 llcp_trace_init(void);
+void		 llcp_trace_enable(int enable);
+int		 llcp_trace_dump(const char *filename);
+int		 llcp_trace_fini(void);
+
+void		 llcp_trace_record_pdu(uint16_t event, const uint8_t *pdu, size_t len);
+void		 llcp_trace_record(uint16_t event, uint8_t dsap, uint8_t ssap, int32_t value);
+
+/*
+ * Only test a global flag when tracing is disabled, so that trace points can
+ * stay in hot paths.
+ */
+#define llcp_trace_pdu(event, pdu, len) \
+  do { \
+    if (__builtin_expect(llcp_trace_enabled, 0)) \
+      llcp_trace_record_pdu(event, pdu, len); \
+  } while (0)
+#define llcp_trace(event, dsap, ssap, value) \
+  do { \
+    if (__builtin_expect(llcp_trace_enabled, 0)) \
+      llcp_trace_record(event, dsap, ssap, value); \
+  } while (0)
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_LLCP_TRACE_H */
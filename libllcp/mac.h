@@ -24,20 +24,54 @@
 
 #include <sys/types.h>
 
+#include <stdint.h>
+
 #include <nfc/nfc.h>
 
+#include "llcp.h"
+
 #ifdef __cplusplus
 extern  "C" {
 #endif /* __cplusplus */
 
+struct llcp_capture;
+struct mac_sim;
+
 struct mac_link {
   enum { MAC_LINK_UNSET, MAC_LINK_INITIATOR, MAC_LINK_TARGET } mode;
   nfc_device *device;
+  struct mac_sim *sim;		/* Non-NULL for simulated links (see mac_sim.h) */
   struct llc_link *llc_link;
+  struct llcp_capture *capture;	/* PDUs are captured when non-NULL (see llcp_capture.h) */
+  uint8_t capture_adapter;
   uint8_t nfcid[10];
-  uint8_t buffer[BUFSIZ];
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
   size_t buffer_size;
   pthread_t *__restrict__ exchange_pdus_thread;
+  uint8_t general_bytes[48];	/* ATR general bytes kept by mac_link_serve() */
+  size_t general_bytes_len;	/* 0 to encode them on each activation */
+  volatile int serving;
+  volatile int armed;		/* nfc_target_init() waits for an initiator */
+};
+
+/*
+ * Timing of a tap served by mac_link_serve(), in nanoseconds of the
+ * monotonic clock.
+ */
+struct mac_link_tap {
+  unsigned number;		/* Taps served before this one */
+  uint64_t armed;		/* The target waits for an initiator */
+  uint64_t activation;		/* The LLC Link is activated */
+  uint64_t first_data;		/* First I or UI PDU exchanged, 0 if none */
+  uint64_t last_data;		/* Last I or UI PDU exchanged, 0 if none */
+  uint64_t release;		/* The MAC Link is released */
+};
+
+struct mac_link_serve_policy {
+  unsigned taps;		/* Taps to serve, 0 to serve until mac_link_serve_stop() */
+  unsigned max_failures;	/* Failed activations in a row before giving up, 0 for no limit */
+  void (*tap_done)(struct mac_link *mac_link, const struct mac_link_tap *tap, void *user_data);
+  void *user_data;
 };
 
 struct mac_link	*mac_link_new(nfc_device *device, struct llc_link *llc_link);
@@ -45,6 +79,9 @@ struct mac_link	*mac_link_new(nfc_device *device, struct llc_link *llc_link);
 int		 mac_link_activate(struct mac_link *mac_link);
 int		 mac_link_activate_as_initiator(struct mac_link *mac_link);
 int		 mac_link_activate_as_target(struct mac_link *mac_link);
+int		 mac_link_set_capture(struct mac_link *mac_link, struct llcp_capture *capture);
+int		 mac_link_serve(struct mac_link *mac_link, const struct mac_link_serve_policy *policy);
+void		 mac_link_serve_stop(struct mac_link *mac_link);
 
 ssize_t		 pdu_send(struct mac_link *link, const void *buf, size_t nbytes);
 ssize_t		 pdu_receive(struct mac_link *link, void *buf, size_t nbytes);
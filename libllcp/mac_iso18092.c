@@ -38,15 +38,24 @@
 #include <nfc/nfc.h>
 
 #include "llcp.h"
+#include "llcp_capture.h"
 #include "llcp_log.h"
+#include "llcp_probes.h"
+#include "llcp_stats.h"
+#include "llcp_trace.h"
 #include "llc_service.h"
 #include "llc_link.h"
 #include "mac.h"
+#include "mac_sim.h"
 
 #define LOG_MAC_LINK "libllcp.mac.link"
 #define MAC_LINK_MSG(priority, message) llcp_log_log (LOG_MAC_LINK, priority, "%s", message)
 #define MAC_LINK_LOG(priority, format, ...) llcp_log_log (LOG_MAC_LINK, priority, format, __VA_ARGS__)
 
+/* Delay before re-arming after a failed activation, doubled on each failure */
+#define SERVE_BACKOFF_MIN	10	/* ms */
+#define SERVE_BACKOFF_MAX	1000	/* ms */
+
 static uint8_t llcp_magic_number[] = { 0x46, 0x66, 0x6D };
 
 static uint8_t defaultid[10] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09 };
@@ -64,9 +73,14 @@ mac_link_new(nfc_device *device, struct llc_link *llc_link) {
   if ((res = malloc(sizeof(*res)))) {
     res->mode = MAC_LINK_UNSET;
     res->device = device;
+    res->sim = NULL;
+    res->capture = NULL;
     res->llc_link = llc_link;
     res->llc_link->mac_link = res;
     res->exchange_pdus_thread = NULL;
+    res->general_bytes_len = 0;
+    res->serving = 0;
+    res->armed = 0;
 
     memcpy(res->nfcid, defaultid, sizeof(defaultid));
   }
@@ -97,6 +111,9 @@ mac_link_activate_as_initiator(struct mac_link *mac_link)
 {
   assert(mac_link);
 
+  if (mac_link->sim)
+    return mac_sim_activate(mac_link, MAC_LINK_INITIATOR);
+
   int res = 0;
   nfc_target nt;
 
@@ -126,6 +143,7 @@ mac_link_activate_as_initiator(struct mac_link *mac_link)
         MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) LLCP Link activated (initiator)", nfc_device_get_name(mac_link->device));
 
         mac_link->mode = MAC_LINK_INITIATOR;
+        memcpy(mac_link->llc_link->peer_nfcid3, nt.nti.ndi.abtNFCID3, sizeof(mac_link->llc_link->peer_nfcid3));
         if (llc_link_activate(mac_link->llc_link, LLC_INITIATOR | LLC_PAX_PDU_PROHIBITED, NULL, 0) < 0) {
           MAC_LINK_MSG(LLC_PRIORITY_FATAL, "Error activating LLC Link");
           res = -1;
@@ -150,15 +168,36 @@ mac_link_activate_as_initiator(struct mac_link *mac_link)
   return res;
 }
 
-int
-mac_link_activate_as_target(struct mac_link *mac_link)
+/*
+ * The LLCP magic number followed by the LLC Link parameters.
+ */
+static ssize_t
+mac_link_encode_general_bytes(const struct mac_link *mac_link, uint8_t *gb, size_t len)
 {
-  assert(mac_link);
+  uint8_t params[BUFSIZ];
+  int params_len = llc_link_encode_parameters(mac_link->llc_link, params, sizeof(params));
 
-  nfc_target nt;
+  if ((params_len < 0) || (sizeof(llcp_magic_number) + params_len > len)) {
+    MAC_LINK_MSG(LLC_PRIORITY_ERROR, "LLC Link parameters do not fit in ATR general bytes");
+    return -1;
+  }
 
-  uint8_t params[BUFSIZ];
-  size_t params_len = llc_link_encode_parameters(mac_link->llc_link, params, sizeof(params));
+  memcpy(gb, llcp_magic_number, sizeof(llcp_magic_number));
+  memcpy(gb + sizeof(llcp_magic_number), params, params_len);
+
+  return sizeof(llcp_magic_number) + params_len;
+}
+
+/*
+ * Returns 1 on success, NFC_ETIMEOUT if no initiator showed up, -1 otherwise.
+ */
+static int
+mac_link_target_activate(struct mac_link *mac_link)
+{
+  if (mac_link->sim)
+    return mac_sim_activate(mac_link, MAC_LINK_TARGET);
+
+  nfc_target nt;
 
   /* Wait as a target for a device to establish a connection */
   nt.nm.nmt = NMT_DEP;
@@ -175,15 +214,24 @@ mac_link_activate_as_target(struct mac_link *mac_link)
 #endif
 
   memcpy(nt.nti.ndi.abtNFCID3, mac_link->nfcid, sizeof(mac_link->nfcid));
-  memcpy(nt.nti.ndi.abtGB, llcp_magic_number, sizeof(llcp_magic_number));
-  memcpy(nt.nti.ndi.abtGB + sizeof(llcp_magic_number), params, params_len);
-  nt.nti.ndi.szGB = sizeof(llcp_magic_number) + params_len;
+  if (mac_link->general_bytes_len) {
+    memcpy(nt.nti.ndi.abtGB, mac_link->general_bytes, mac_link->general_bytes_len);
+    nt.nti.ndi.szGB = mac_link->general_bytes_len;
+  } else {
+    ssize_t gb_len = mac_link_encode_general_bytes(mac_link, nt.nti.ndi.abtGB, sizeof(nt.nti.ndi.abtGB));
+    if (gb_len < 0)
+      return -1;
+    nt.nti.ndi.szGB = gb_len;
+  }
 
   int res = 0;
   uint8_t data[BUFSIZ];
 
   MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) Attempting to activate LLCP Link as target (blocking)", nfc_device_get_name(mac_link->device));
-  if ((res = nfc_target_init(mac_link->device, &nt, data, sizeof(data), 5000)) >= 0) {
+  mac_link->armed = 1;
+  res = nfc_target_init(mac_link->device, &nt, data, sizeof(data), 5000);
+  mac_link->armed = 0;
+  if (res >= 0) {
     MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) LLCP Link activated (target)", nfc_device_get_name(mac_link->device));
     mac_link->mode = MAC_LINK_TARGET;
     if (res < 20) {
@@ -192,20 +240,52 @@ mac_link_activate_as_target(struct mac_link *mac_link)
     } else if (memcmp(data + 17, llcp_magic_number, sizeof(llcp_magic_number))) {
       MAC_LINK_MSG(LLC_PRIORITY_ERROR, "LLCP Magic Number not found");
       res = -1;
-    } else if (llc_link_activate(mac_link->llc_link, LLC_TARGET | LLC_PAX_PDU_PROHIBITED, data + 20, res - 20) < 0) {
-      MAC_LINK_MSG(LLC_PRIORITY_FATAL, "Error activating LLC Link");
-      res = -1;
     } else {
-      res = mac_link_run(mac_link);
+      /* The ATR_REQ carries the initiator NFCID3 after the command bytes */
+      memcpy(mac_link->llc_link->peer_nfcid3, data + 3, sizeof(mac_link->llc_link->peer_nfcid3));
+      if (llc_link_activate(mac_link->llc_link, LLC_TARGET | LLC_PAX_PDU_PROHIBITED, data + 20, res - 20) < 0) {
+        MAC_LINK_MSG(LLC_PRIORITY_FATAL, "Error activating LLC Link");
+        res = -1;
+      } else {
+        res = mac_link_run(mac_link);
+      }
     }
   } else {
     MAC_LINK_MSG(LLC_PRIORITY_ERROR, "Cannot establish LLCP Link");
-    res = -1;
+    res = (res == NFC_ETIMEOUT) ? NFC_ETIMEOUT : -1;
   }
 
   return res;
 }
 
+int
+mac_link_activate_as_target(struct mac_link *mac_link)
+{
+  assert(mac_link);
+
+  int res = mac_link_target_activate(mac_link);
+
+  return (res < 0) ? -1 : res;
+}
+
+/*
+ * Record PDUs exchanged on this MAC Link to capture.  Each MAC Link sharing
+ * a capture is given its own adapter index in the pseudo-header.
+ */
+int
+mac_link_set_capture(struct mac_link *mac_link, struct llcp_capture *capture)
+{
+  if (capture) {
+    int adapter;
+    if ((adapter = llcp_capture_new_adapter(capture)) < 0)
+      return -1;
+    mac_link->capture_adapter = adapter;
+  }
+  mac_link->capture = capture;
+
+  return 0;
+}
+
 void *
 mac_link_exchange_pdus(void *arg)
 {
@@ -218,16 +298,16 @@ mac_link_exchange_pdus(void *arg)
       return NULL;
   }
 
-  uint8_t buffer[BUFSIZ];
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
   for (;;) {
     ssize_t len = pdu_receive(link, buffer, sizeof(buffer));
     if (len < 0) {
       MAC_LINK_LOG(LLC_PRIORITY_WARN, "pdu_receive returned %d", len);
       break;
     }
-    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Received %d PDU bytes", (int) len);
 
     if (LL_ACTIVATED == link->llc_link->status) {
+      llc_link_stats_mac_receive(link->llc_link);
       if (mq_send(link->llc_link->llc_up, (char *) buffer, len, 0) < 0) {
         MAC_LINK_LOG(LLC_PRIORITY_FATAL, "Can't send data to LLC Link: %s", strerror(errno));
         break;
@@ -247,6 +327,7 @@ mac_link_exchange_pdus(void *arg)
     }
 
     len = mq_timedreceive(link->llc_link->llc_down, (char *) buffer, sizeof(buffer), NULL, &ts);
+    int dequeued = (len >= 0);
 
     if (len < 0) {
       switch (errno) {
@@ -263,7 +344,7 @@ mac_link_exchange_pdus(void *arg)
       break;
     }
 
-    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Sending %d bytes", len);
+    llc_link_stats_mac_send(link->llc_link, dequeued);
     if ((len = pdu_send(link, buffer, len)) < 0) {
       MAC_LINK_LOG(LLC_PRIORITY_WARN, "pdu_send returned %d", len);
       break;
@@ -289,7 +370,7 @@ mac_link_drain(void *arg)
 {
   struct mac_link *link = (struct mac_link *)arg;
 
-  uint8_t buffer[BUFSIZ];
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
   uint8_t sym_pdu[] = { 0x00, 0x00 };
 
   for (;;) {
@@ -335,9 +416,13 @@ int
 mac_link_wait(struct mac_link *link, void **value_ptr)
 {
   assert(link);
-  assert(link->exchange_pdus_thread);
   assert(value_ptr);
 
+  if (link->sim)
+    return mac_sim_wait(link, value_ptr);
+
+  assert(link->exchange_pdus_thread);
+
   *value_ptr = NULL;
 
   MAC_LINK_MSG(LLC_PRIORITY_TRACE, "Waiting for MAC Link PDU exchange thread to exit");
@@ -351,6 +436,10 @@ int
 mac_link_deactivate(struct mac_link *link, intptr_t reason)
 {
   assert(link);
+
+  if (link->sim)
+    return mac_sim_deactivate(link, reason);
+
   assert((link->exchange_pdus_thread == NULL) || (*link->exchange_pdus_thread != pthread_self()));
 
   MAC_LINK_LOG(LLC_PRIORITY_INFO, "MAC Link deactivation requested (reason: %d)", reason);
@@ -408,6 +497,104 @@ mac_link_deactivate(struct mac_link *link, intptr_t reason)
   }
 }
 
+/*
+ * Serve taps as a target, re-arming as soon as the MAC Link is released,
+ * until policy->taps taps have been served or mac_link_serve_stop() is
+ * called.  The LLC Link, its services and their connection pools are kept
+ * from one tap to the next, and the ATR general bytes are only encoded
+ * once.  The timing of each tap is reported to policy->tap_done().
+ *
+ * Waiting for an initiator is retried forever.  Other activation failures
+ * delay re-arming, longer on each failure in a row.
+ *
+ * Returns the number of taps served, or -1 on error, including
+ * policy->max_failures activation failures in a row.
+ */
+int
+mac_link_serve(struct mac_link *mac_link, const struct mac_link_serve_policy *policy)
+{
+  assert(mac_link);
+  assert(policy);
+
+  struct llc_link *llc_link = mac_link->llc_link;
+  unsigned taps = 0;
+  unsigned failures = 0;
+  long backoff = SERVE_BACKOFF_MIN;
+
+  if (!mac_link->sim) {
+    ssize_t len = mac_link_encode_general_bytes(mac_link, mac_link->general_bytes, sizeof(mac_link->general_bytes));
+    if (len < 0)
+      return -1;
+    mac_link->general_bytes_len = len;
+  }
+
+  mac_link->serving = 1;
+  while (mac_link->serving && (!policy->taps || (taps < policy->taps))) {
+    struct mac_link_tap tap = { .number = taps };
+    void *reason;
+    int res;
+
+    tap.armed = stats_now();
+    if ((res = mac_link_target_activate(mac_link)) == NFC_ETIMEOUT)
+      continue;
+    if (res < 0) {
+      /* Release whatever the failed activation left behind */
+      llc_link_deactivate(llc_link);
+      llc_link->mac_link = mac_link;
+      /* mac_link_serve_stop() aborted the wait for an initiator */
+      if (!mac_link->serving)
+        break;
+      if (++failures == policy->max_failures) {
+        MAC_LINK_LOG(LLC_PRIORITY_ERROR, "Giving up after %u failed activations", failures);
+        mac_link->general_bytes_len = 0;
+        return -1;
+      }
+      struct timespec delay = { backoff / 1000, (backoff % 1000) * 1000000 };
+      nanosleep(&delay, NULL);
+      backoff = MIN(2 * backoff, SERVE_BACKOFF_MAX);
+      continue;
+    }
+    failures = 0;
+    backoff = SERVE_BACKOFF_MIN;
+    tap.activation = stats_now();
+
+    mac_link_wait(mac_link, &reason);
+    tap.release = stats_now();
+    if (mac_link->exchange_pdus_thread) {
+      free(mac_link->exchange_pdus_thread);
+      mac_link->exchange_pdus_thread = NULL;
+    }
+    MAC_LINK_LOG(LLC_PRIORITY_INFO, "Tap %u released (reason: %d)", taps, (int)(intptr_t) reason);
+
+    tap.first_data = STATS_GET(llc_link->first_data);
+    tap.last_data = STATS_GET(llc_link->last_data);
+    llc_link_deactivate(llc_link);
+    llc_link->mac_link = mac_link;
+
+    taps++;
+    if (policy->tap_done)
+      policy->tap_done(mac_link, &tap, policy->user_data);
+  }
+
+  mac_link->general_bytes_len = 0;
+
+  return taps;
+}
+
+/*
+ * Make mac_link_serve() return once the current tap is released.  A wait for
+ * an initiator is aborted, and does not count as a failed activation.
+ */
+void
+mac_link_serve_stop(struct mac_link *mac_link)
+{
+  assert(mac_link);
+
+  mac_link->serving = 0;
+  if (mac_link->device && mac_link->armed)
+    nfc_abort_command(mac_link->device);
+}
+
 int timeval_to_ms(const struct timeval tv)
 {
   return ((tv.tv_sec * 1000) + (tv.tv_usec / 1000));
@@ -420,9 +607,9 @@ pdu_send(struct mac_link *link, const void *buf, size_t nbytes)
   int oldstate;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 
-  MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Sending %d bytes", nbytes);
+  llcp_trace_pdu(LLCP_TRACE_MAC_SEND, buf, nbytes);
+  LLCP_PROBE3(mac__send, link, buf, nbytes);
   if (link->mode == MAC_LINK_INITIATOR) {
-    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "LTOs: %d ms (local), %d ms (remote)", timeval_to_ms(link->llc_link->local_lto), timeval_to_ms(link->llc_link->remote_lto));
     const int timeout = timeval_to_ms(link->llc_link->local_lto) + timeval_to_ms(link->llc_link->remote_lto);
     res = nfc_initiator_transceive_bytes(link->device, buf, nbytes, link->buffer, sizeof(link->buffer), timeout);
     link->buffer_size = (res < 0) ? 0 : res;
@@ -432,6 +619,8 @@ pdu_send(struct mac_link *link, const void *buf, size_t nbytes)
 
   if (res < 0)
     MAC_LINK_LOG(LLC_PRIORITY_FATAL, "Could not send %d bytes", nbytes);
+  else if (link->capture)
+    llcp_capture_pdu(link->capture, link->capture_adapter, LLCP_CAPTURE_TX, NULL, buf, nbytes);
   pthread_setcancelstate(oldstate, NULL);
 
   return res;
@@ -445,23 +634,29 @@ pdu_receive(struct mac_link *link, void *buf, size_t nbytes)
 
   if (link->mode == MAC_LINK_INITIATOR) {
     res = MIN(nbytes, link->buffer_size);
-    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Received %d bytes (Requested %d, buffer size %d)", res, nbytes, link->buffer_size);
     memcpy(buf, link->buffer, res);
-    return res;
   } else {
-    if ((res = nfc_target_receive_bytes(link->device, buf, nbytes, timeout + 2000)) >= 0) {
-      MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Received %d bytes", res);
-      return res;
+    if ((res = nfc_target_receive_bytes(link->device, buf, nbytes, timeout + 2000)) < 0) {
+      MAC_LINK_LOG(LLC_PRIORITY_FATAL, "MAC Level error on PDU reception (%d)", res);
+      return -1;
     }
   }
-  MAC_LINK_LOG(LLC_PRIORITY_FATAL, "MAC Level error on PDU reception (%d)", res);
-  return -1;
+  llcp_trace_pdu(LLCP_TRACE_MAC_RECEIVE, buf, res);
+  LLCP_PROBE3(mac__receive, link, buf, res);
+
+  if (link->capture)
+    llcp_capture_pdu(link->capture, link->capture_adapter, LLCP_CAPTURE_RX, NULL, buf, res);
+
+  return res;
 }
 
 void
 mac_link_free(struct mac_link *mac_link)
 {
   if (mac_link) {
+    if (mac_link->sim)
+      mac_sim_detach(mac_link);
+
     if (mac_link->exchange_pdus_thread)
       free(mac_link->exchange_pdus_thread);
 
@@ -0,0 +1,704 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+/*
+ * Simulated MAC Link.
+ *
+ * Two LLC Links (one initiator and one target) are connected through a
+ * simulated NFC-DEP transport.  A single thread hands PDUs from one LLC
+ * Link to the other, half-duplex, the way the initiator's transceive and
+ * the target's send / receive calls would, and charges each transceive to a
+ * virtual clock:
+ *
+ *  - air time at the selected bit rate, including DEP framing overhead;
+ *  - chaining of PDUs larger than the DEP frame size (each extra frame also
+ *    costs an ACK from the peer);
+ *  - a fixed turnaround latency plus uniformly distributed jitter;
+ *  - lost frames, retransmitted after RWT, which break the link with
+ *    NFC_ETIMEOUT when retries are exhausted;
+ *  - the target leaving the field (NFC_ETGRELEASED).
+ *
+ * Random draws come from a seeded generator and only depend on the sequence
+ * of exchanged frames.  That sequence does not depend on thread scheduling
+ * either: the exchange thread hands a PDU to an LLC Link, waits for it to
+ * take its turn, and only then looks for a PDU to send back, or sends a SYMM
+ * PDU.  Before each frame, it also waits for the services of both links to
+ * be idle (see llc_link_idle()), and so does the LLC thread before picking
+ * the PDU it answers with (see llc_link_settle()).  Runs with the same seed
+ * are thus reproducible, as long as services only wait for the LLC Link.
+ * Services waiting for something else are given the turn timeout to settle.
+ * Wall-clock time is only spent waiting for the LLC Links and their
+ * services, so simulations run much faster than real time.
+ */
+
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#if defined(HAVE_PTHREAD_NP_H)
+#  include <pthread_np.h>
+#endif
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nfc/nfc.h>
+
+#include "llcp.h"
+#include "llcp_capture.h"
+#include "llcp_log.h"
+#include "llcp_probes.h"
+#include "llcp_stats.h"
+#include "llcp_trace.h"
+#include "llc_link.h"
+#include "mac.h"
+#include "mac_sim.h"
+
+#define LOG_MAC_SIM "libllcp.mac.sim"
+#define MAC_SIM_MSG(priority, message) llcp_log_log (LOG_MAC_SIM, priority, "%s", message)
+#define MAC_SIM_LOG(priority, format, ...) llcp_log_log (LOG_MAC_SIM, priority, format, __VA_ARGS__)
+
+#define DEFAULT_BITRATE		424
+#define DEFAULT_FRAME_SIZE	254
+#define DEFAULT_TURNAROUND	500	/* us */
+#define DEFAULT_RWT		77000	/* us, WT = 8 */
+#define DEFAULT_MAX_RETRIES	2
+#define DEFAULT_TURN_TIMEOUT	10000	/* us */
+#define ACTIVATION_TIMEOUT	5	/* s */
+
+/* DEP header bytes in each frame: CMD0, CMD1 and PFB */
+#define DEP_HEADER_SIZE 3
+
+struct mac_sim {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  /* Radio model */
+  int bitrate;
+  size_t frame_size;
+  uint32_t turnaround_us;
+  uint32_t jitter_us;
+  uint32_t rwt_us;
+  int max_retries;
+  double drop_rate;
+  double release_rate;
+  uint32_t turn_timeout_us;
+  uint32_t rng;
+
+  /* Endpoints */
+  struct mac_link *initiator;
+  struct mac_link *target;
+  uint8_t initiator_parameters[BUFSIZ];
+  int initiator_parameters_len;
+  int target_present;
+  int initiator_ready;
+  int target_activated;
+
+  /* Exchange thread */
+  pthread_t thread;
+  int thread_joinable;
+  int running;
+  volatile int stop;
+  intptr_t reason;
+
+  uint64_t now;			/* Virtual time (ns) */
+  struct mac_sim_stats stats;
+};
+
+struct mac_sim *
+mac_sim_new(unsigned int seed) {
+  struct mac_sim *sim;
+
+  if ((sim = malloc(sizeof(*sim)))) {
+    memset(sim, 0, sizeof(*sim));
+    pthread_mutex_init(&sim->mutex, NULL);
+    pthread_cond_init(&sim->cond, NULL);
+    sim->bitrate = DEFAULT_BITRATE;
+    sim->frame_size = DEFAULT_FRAME_SIZE;
+    sim->turnaround_us = DEFAULT_TURNAROUND;
+    sim->rwt_us = DEFAULT_RWT;
+    sim->max_retries = DEFAULT_MAX_RETRIES;
+    sim->turn_timeout_us = DEFAULT_TURN_TIMEOUT;
+    /* xorshift32 gets stuck on 0 */
+    sim->rng = seed ? seed : 0x2545F491;
+    sim->initiator_parameters_len = -1;
+  }
+
+  return sim;
+}
+
+int
+mac_sim_set_bitrate(struct mac_sim *sim, int kbps)
+{
+  switch (kbps) {
+    case 106:
+    case 212:
+    case 424:
+      sim->bitrate = kbps;
+      return 0;
+  }
+
+  MAC_SIM_LOG(LLC_PRIORITY_ERROR, "Unsupported bit rate: %d kbps", kbps);
+  return -1;
+}
+
+int
+mac_sim_set_frame_size(struct mac_sim *sim, size_t frame_size)
+{
+  switch (frame_size) {
+    case 64:
+    case 128:
+    case 192:
+    case 254:
+      sim->frame_size = frame_size;
+      return 0;
+  }
+
+  MAC_SIM_LOG(LLC_PRIORITY_ERROR, "Unsupported DEP frame size: %d", (int) frame_size);
+  return -1;
+}
+
+void
+mac_sim_set_latency(struct mac_sim *sim, uint32_t turnaround_us, uint32_t jitter_us)
+{
+  sim->turnaround_us = turnaround_us;
+  sim->jitter_us = jitter_us;
+}
+
+int
+mac_sim_set_errors(struct mac_sim *sim, double drop_rate, double release_rate)
+{
+  if ((drop_rate < 0) || (drop_rate > 1) || (release_rate < 0) || (release_rate > 1)) {
+    MAC_SIM_MSG(LLC_PRIORITY_ERROR, "Error rates must be in [0, 1]");
+    return -1;
+  }
+
+  sim->drop_rate = drop_rate;
+  sim->release_rate = release_rate;
+  return 0;
+}
+
+void
+mac_sim_set_turn_timeout(struct mac_sim *sim, uint32_t timeout_us)
+{
+  sim->turn_timeout_us = timeout_us;
+}
+
+void
+mac_sim_gettime(struct mac_sim *sim, struct timespec *ts)
+{
+  pthread_mutex_lock(&sim->mutex);
+  ts->tv_sec = sim->now / 1000000000;
+  ts->tv_nsec = sim->now % 1000000000;
+  pthread_mutex_unlock(&sim->mutex);
+}
+
+void
+mac_sim_get_stats(struct mac_sim *sim, struct mac_sim_stats *stats)
+{
+  pthread_mutex_lock(&sim->mutex);
+  *stats = sim->stats;
+  stats->elapsed.tv_sec = sim->now / 1000000000;
+  stats->elapsed.tv_nsec = sim->now % 1000000000;
+  pthread_mutex_unlock(&sim->mutex);
+}
+
+/*
+ * Radio model
+ */
+
+static uint32_t
+mac_sim_random(struct mac_sim *sim)
+{
+  uint32_t x = sim->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return sim->rng = x;
+}
+
+static int
+mac_sim_happens(struct mac_sim *sim, double probability)
+{
+  if (probability <= 0)
+    return 0;
+  return (mac_sim_random(sim) >> 8) < probability * (1 << 24);
+}
+
+static uint64_t
+mac_sim_air_time(const struct mac_sim *sim, size_t payload)
+{
+  size_t bytes, bits_per_byte;
+
+  if (sim->bitrate == 106) {
+    /* ISO/IEC 14443-A framing: start byte, length, CRC, and a parity bit per byte */
+    bytes = 1 + 1 + DEP_HEADER_SIZE + payload + 2;
+    bits_per_byte = 9;
+  } else {
+    /* FeliCa framing: preamble, sync code, length and CRC */
+    bytes = 6 + 2 + 1 + DEP_HEADER_SIZE + payload + 2;
+    bits_per_byte = 8;
+  }
+
+  return (uint64_t) bytes * bits_per_byte * 1000000 / sim->bitrate;
+}
+
+static uint64_t
+mac_sim_latency(struct mac_sim *sim)
+{
+  uint64_t latency = (uint64_t) sim->turnaround_us * 1000;
+  if (sim->jitter_us)
+    latency += mac_sim_random(sim) % ((uint64_t) sim->jitter_us * 1000 + 1);
+  return latency;
+}
+
+/*
+ * Charge the transmission of a PDU to the virtual clock.  Returns 0 on
+ * success and a libnfc error code when the transceive failed.
+ */
+static int
+mac_sim_transmit(struct mac_sim *sim, size_t len)
+{
+  const size_t payload = sim->frame_size - DEP_HEADER_SIZE;
+  uint64_t elapsed = 0;
+  size_t retransmissions = 0;
+  int res = 0;
+
+  size_t remaining = len;
+  do {
+    size_t chunk = MIN(remaining, payload);
+    remaining -= chunk;
+
+    for (int tries = 0; ; tries++) {
+      elapsed += mac_sim_air_time(sim, chunk) + mac_sim_latency(sim);
+      if (!mac_sim_happens(sim, sim->drop_rate))
+        break;
+      /* The frame was lost: wait for RWT to expire, then send it again */
+      elapsed += (uint64_t) sim->rwt_us * 1000;
+      if (tries == sim->max_retries) {
+        res = NFC_ETIMEOUT;
+        break;
+      }
+      retransmissions++;
+    }
+    if (res)
+      break;
+
+    if (remaining) {
+      /* Chained frame: the peer acknowledges it before we go on */
+      elapsed += mac_sim_air_time(sim, 0) + mac_sim_latency(sim);
+    }
+  } while (remaining);
+
+  if (!res && mac_sim_happens(sim, sim->release_rate))
+    res = NFC_ETGRELEASED;
+
+  pthread_mutex_lock(&sim->mutex);
+  sim->now += elapsed;
+  sim->stats.frames++;
+  sim->stats.bytes += len;
+  sim->stats.retransmissions += retransmissions;
+  if (len == 2)
+    sim->stats.symm++;
+  pthread_mutex_unlock(&sim->mutex);
+
+  return res;
+}
+
+/*
+ * Exchange thread
+ */
+
+/*
+ * Turns taken by an LLC Link: each PDU delivered to it gives it one.
+ */
+static uint64_t
+mac_sim_turns(struct llc_link *link)
+{
+  return STATS_GET(link->stats.symm_turns) + STATS_GET(link->stats.data_turns);
+}
+
+/*
+ * The LLC Link picked a PDU but waits for room in its down queue: it took its
+ * turn as far as the MAC Link is concerned.
+ */
+static int
+mac_sim_down_blocked(struct llc_link *link)
+{
+  struct mq_attr attr;
+
+  return __atomic_load_n(&link->down_waiters, __ATOMIC_SEQ_CST) &&
+         (mq_getattr(link->llc_down, &attr) == 0) && (attr.mq_curmsgs == attr.mq_maxmsg);
+}
+
+static void
+mac_sim_pause(unsigned *spins)
+{
+  static const struct timespec delay = { 0, 10000 };
+
+  if ((*spins)++ < 100)
+    sched_yield();
+  else
+    nanosleep(&delay, NULL);
+}
+
+static int
+mac_sim_settled(struct llc_link *link)
+{
+  if (LL_ACTIVATED != link->status)
+    return 1;
+  if (__atomic_load_n(&link->down_waiters, __ATOMIC_SEQ_CST) && !mac_sim_down_blocked(link))
+    return 0;
+  return llc_link_idle(link);
+}
+
+/*
+ * Wait for the LLC Links and their services to be done with the last turn,
+ * so that neither the next PDU nor the virtual time they read depend on
+ * scheduling.
+ */
+static void
+mac_sim_settle(struct mac_sim *sim)
+{
+  uint64_t deadline = stats_now() + (uint64_t) sim->turn_timeout_us * 1000;
+  unsigned spins = 0;
+
+  while (!(mac_sim_settled(sim->initiator->llc_link) && mac_sim_settled(sim->target->llc_link)) &&
+         !sim->stop && (stats_now() < deadline))
+    mac_sim_pause(&spins);
+}
+
+static ssize_t
+mac_sim_next_pdu(struct llc_link *from, uint8_t *buffer, size_t len)
+{
+  static const struct timespec now = { 0, 0 };
+  ssize_t res;
+
+  if (LL_ACTIVATED != from->status) {
+    MAC_SIM_MSG(LLC_PRIORITY_INFO, "LLC Link deactivated");
+    return -1;
+  }
+
+  /* The LLC Link took its turn: what it had to send is already there */
+  if ((res = mq_timedreceive(from->llc_down, (char *) buffer, len, NULL, &now)) < 0) {
+    if ((errno != ETIMEDOUT) && (errno != EAGAIN)) {
+      MAC_SIM_LOG(LLC_PRIORITY_FATAL, "Can't receive data from LLC Link: %s", strerror(errno));
+      return -1;
+    }
+    buffer[0] = buffer[1] = 0x00;
+    res = 2;
+    llc_link_stats_mac_send(from, 0);
+  } else {
+    llc_link_stats_mac_send(from, 1);
+  }
+
+  return res;
+}
+
+static int
+mac_sim_deliver(struct mac_sim *sim, struct llc_link *to, const uint8_t *buffer, size_t len)
+{
+  unsigned spins = 0;
+
+  if (LL_ACTIVATED != to->status)
+    return 0;
+
+  uint64_t turns = mac_sim_turns(to);
+  llc_link_stats_mac_receive(to);
+
+  /* The LLC Link up queue is non-blocking: give its thread time to catch up */
+  while (mq_send(to->llc_up, (const char *) buffer, len, 0) < 0) {
+    if ((errno != EAGAIN) || sim->stop) {
+      MAC_SIM_LOG(LLC_PRIORITY_FATAL, "Can't send data to LLC Link: %s", strerror(errno));
+      return -1;
+    }
+    mac_sim_pause(&spins);
+  }
+
+  while ((mac_sim_turns(to) == turns) && !mac_sim_down_blocked(to) &&
+         (LL_ACTIVATED == to->status) && !sim->stop)
+    mac_sim_pause(&spins);
+
+  mac_sim_settle(sim);
+
+  return 0;
+}
+
+/*
+ * Capture a PDU that went through, timestamped with the virtual clock.
+ */
+static void
+mac_sim_capture(struct mac_sim *sim, struct mac_link *from, struct mac_link *to, const uint8_t *buffer, size_t len)
+{
+  const struct timespec now = { sim->now / 1000000000, sim->now % 1000000000 };
+
+  if (from->capture)
+    llcp_capture_pdu(from->capture, from->capture_adapter, LLCP_CAPTURE_TX, &now, buffer, len);
+  if (to->capture)
+    llcp_capture_pdu(to->capture, to->capture_adapter, LLCP_CAPTURE_RX, &now, buffer, len);
+}
+
+static void *
+mac_sim_exchange_pdus(void *arg)
+{
+  struct mac_sim *sim = (struct mac_sim *)arg;
+  struct mac_link *from = sim->initiator;
+  struct mac_link *to = sim->target;
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
+  ssize_t len;
+  int error = 0;
+
+  /* Bootstrap the LLC communication sending a SYMM PDU */
+  buffer[0] = buffer[1] = 0x00;
+  len = 2;
+
+  while (!sim->stop) {
+    mac_sim_settle(sim);
+    llcp_trace_pdu(LLCP_TRACE_MAC_SEND, buffer, len);
+    if ((error = mac_sim_transmit(sim, len))) {
+      MAC_SIM_LOG(LLC_PRIORITY_WARN, "Simulated transceive failed (%d)", error);
+      break;
+    }
+    LLCP_PROBE3(mac__send, from, buffer, len);
+    LLCP_PROBE3(mac__receive, to, buffer, len);
+    mac_sim_capture(sim, from, to, buffer, len);
+    if (mac_sim_deliver(sim, to->llc_link, buffer, len) < 0)
+      break;
+
+    struct mac_link *tmp = from;
+    from = to;
+    to = tmp;
+
+    if ((len = mac_sim_next_pdu(from->llc_link, buffer, sizeof(buffer))) < 0)
+      break;
+  }
+
+  pthread_mutex_lock(&sim->mutex);
+  sim->stats.error = error;
+  sim->reason = (error == NFC_ETGRELEASED) ? MAC_DEACTIVATE_ON_FAILURE : MAC_DEACTIVATE_ON_REQUEST;
+  sim->running = 0;
+  /* Both ends may activate again */
+  sim->target_present = 0;
+  sim->initiator_ready = 0;
+  sim->target_activated = 0;
+  pthread_cond_broadcast(&sim->cond);
+  pthread_mutex_unlock(&sim->mutex);
+
+  return (void *) sim->reason;
+}
+
+/*
+ * mac_link backend
+ */
+
+struct mac_link *
+mac_link_new_simulated(struct mac_sim *sim, struct llc_link *llc_link) {
+  assert(sim);
+  assert(llc_link);
+  assert(!llc_link->mac_link);
+
+  struct mac_link *res;
+
+  if ((res = malloc(sizeof(*res)))) {
+    memset(res, 0, sizeof(*res));
+    res->mode = MAC_LINK_UNSET;
+    res->device = NULL;
+    res->sim = sim;
+    res->llc_link = llc_link;
+    res->llc_link->mac_link = res;
+    res->exchange_pdus_thread = NULL;
+  }
+
+  return res;
+}
+
+static int
+mac_sim_wait_for(struct mac_sim *sim, const int *condition)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ACTIVATION_TIMEOUT;
+
+  while (!*condition) {
+    if (pthread_cond_timedwait(&sim->cond, &sim->mutex, &ts) == ETIMEDOUT)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Returns 1 on success, NFC_ETIMEOUT if no initiator showed up for a target,
+ * -1 otherwise.
+ */
+int
+mac_sim_activate(struct mac_link *mac_link, int mode)
+{
+  struct mac_sim *sim = mac_link->sim;
+  int res = -1;
+
+  pthread_mutex_lock(&sim->mutex);
+
+  /* Let the services react to each PDU before the LLC Link answers it */
+  mac_link->llc_link->settle_timeout = sim->turn_timeout_us;
+
+  if (mode == MAC_LINK_TARGET) {
+    MAC_SIM_MSG(LLC_PRIORITY_INFO, "Attempting to activate LLCP Link as target (blocking)");
+    sim->target = mac_link;
+    sim->target_present = 1;
+    pthread_cond_broadcast(&sim->cond);
+
+    if (mac_sim_wait_for(sim, &sim->initiator_ready) < 0) {
+      MAC_SIM_MSG(LLC_PRIORITY_ERROR, "Cannot establish LLCP Link");
+      sim->target = NULL;
+      sim->target_present = 0;
+      res = NFC_ETIMEOUT;
+    } else if (llc_link_activate(mac_link->llc_link, LLC_TARGET | LLC_PAX_PDU_PROHIBITED, sim->initiator_parameters, sim->initiator_parameters_len) < 0) {
+      MAC_SIM_MSG(LLC_PRIORITY_FATAL, "Error activating LLC Link");
+      sim->target = NULL;
+      sim->target_present = 0;
+    } else {
+      MAC_SIM_MSG(LLC_PRIORITY_INFO, "LLCP Link activated (target)");
+      mac_link->mode = MAC_LINK_TARGET;
+      memcpy(mac_link->llc_link->peer_nfcid3, sim->initiator->nfcid, sizeof(sim->initiator->nfcid));
+      sim->target_activated = 1;
+      /* The initiator starts the exchange thread: mac_sim_wait() waits for it */
+      sim->running = 1;
+      res = 1;
+    }
+    pthread_cond_broadcast(&sim->cond);
+  } else {
+    MAC_SIM_MSG(LLC_PRIORITY_INFO, "Attempting to activate LLCP Link as initiator");
+    uint8_t parameters[BUFSIZ];
+    int len;
+    if (mac_sim_wait_for(sim, &sim->target_present) < 0) {
+      MAC_SIM_MSG(LLC_PRIORITY_INFO, "No DEP target available.");
+    } else if ((len = llc_link_encode_parameters(sim->target->llc_link, parameters, sizeof(parameters))) < 0) {
+      MAC_SIM_MSG(LLC_PRIORITY_FATAL, "Cannot encode target parameters");
+    } else if (llc_link_activate(mac_link->llc_link, LLC_INITIATOR | LLC_PAX_PDU_PROHIBITED, parameters, len) < 0) {
+      MAC_SIM_MSG(LLC_PRIORITY_FATAL, "Error activating LLC Link");
+    } else if ((sim->initiator_parameters_len = llc_link_encode_parameters(mac_link->llc_link, sim->initiator_parameters, sizeof(sim->initiator_parameters))) < 0) {
+      MAC_SIM_MSG(LLC_PRIORITY_FATAL, "Cannot encode initiator parameters");
+    } else {
+      sim->initiator = mac_link;
+      sim->initiator_ready = 1;
+      mac_link->mode = MAC_LINK_INITIATOR;
+      memcpy(mac_link->llc_link->peer_nfcid3, sim->target->nfcid, sizeof(sim->target->nfcid));
+      pthread_cond_broadcast(&sim->cond);
+
+      if (mac_sim_wait_for(sim, &sim->target_activated) < 0) {
+        MAC_SIM_MSG(LLC_PRIORITY_ERROR, "Target did not activate");
+      } else {
+        /* The previous exchange thread has terminated */
+        if (sim->thread_joinable) {
+          pthread_join(sim->thread, NULL);
+          sim->thread_joinable = 0;
+        }
+        sim->running = 1;
+        sim->stop = 0;
+        if (pthread_create(&sim->thread, NULL, mac_sim_exchange_pdus, sim) != 0) {
+          MAC_SIM_MSG(LLC_PRIORITY_FATAL, "Cannot create PDU exchanging thread");
+          sim->running = 0;
+        } else {
+#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
+          pthread_set_name_np(sim->thread, "MAC Link (simulated)");
+#endif
+          MAC_SIM_MSG(LLC_PRIORITY_INFO, "LLCP Link activated (initiator)");
+          sim->thread_joinable = 1;
+          res = 1;
+        }
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&sim->mutex);
+
+  return res;
+}
+
+int
+mac_sim_wait(struct mac_link *mac_link, void **value_ptr)
+{
+  struct mac_sim *sim = mac_link->sim;
+
+  pthread_mutex_lock(&sim->mutex);
+  while (sim->running)
+    pthread_cond_wait(&sim->cond, &sim->mutex);
+  *value_ptr = (void *) sim->reason;
+  pthread_mutex_unlock(&sim->mutex);
+
+  return 0;
+}
+
+static void
+mac_sim_stop(struct mac_sim *sim)
+{
+  pthread_mutex_lock(&sim->mutex);
+  int joinable = sim->thread_joinable;
+  sim->stop = 1;
+  sim->thread_joinable = 0;
+  pthread_mutex_unlock(&sim->mutex);
+
+  if (joinable)
+    pthread_join(sim->thread, NULL);
+}
+
+int
+mac_sim_deactivate(struct mac_link *mac_link, intptr_t reason)
+{
+  MAC_SIM_LOG(LLC_PRIORITY_INFO, "MAC Link deactivation requested (reason: %d)", reason);
+
+  mac_sim_stop(mac_link->sim);
+
+  MAC_SIM_MSG(LLC_PRIORITY_INFO, "MAC Link deactivated");
+  return 0;
+}
+
+void
+mac_sim_detach(struct mac_link *mac_link)
+{
+  struct mac_sim *sim = mac_link->sim;
+
+  /* The exchange thread holds pointers to both MAC Links */
+  mac_sim_stop(sim);
+
+  pthread_mutex_lock(&sim->mutex);
+  if (sim->initiator == mac_link)
+    sim->initiator = NULL;
+  if (sim->target == mac_link)
+    sim->target = NULL;
+  pthread_mutex_unlock(&sim->mutex);
+}
+
+void
+mac_sim_free(struct mac_sim *sim)
+{
+  if (sim) {
+    mac_sim_stop(sim);
+    pthread_cond_destroy(&sim->cond);
+    pthread_mutex_destroy(&sim->mutex);
+    free(sim);
+  }
+}
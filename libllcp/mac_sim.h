@@ -0,0 +1,69 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#ifndef _MAC_SIM_H
+#define _MAC_SIM_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern  "C" {
+#endif /* __cplusplus */
+
+struct llc_link;
+struct mac_link;
+struct mac_sim;
+
+struct mac_sim_stats {
+  struct timespec elapsed;	/* Virtual time since activation */
+  size_t frames;		/* DEP frames exchanged (chained frames count for one each) */
+  size_t symm;			/* SYMM PDUs among them */
+  size_t bytes;			/* LLCP PDU bytes exchanged */
+  size_t retransmissions;	/* Frames lost and sent again */
+  int error;			/* NFC error that broke the link, 0 if none */
+};
+
+struct mac_sim	*mac_sim_new(unsigned int seed);
+int		 mac_sim_set_bitrate(struct mac_sim *sim, int kbps);
+int		 mac_sim_set_frame_size(struct mac_sim *sim, size_t frame_size);
+void		 mac_sim_set_latency(struct mac_sim *sim, uint32_t turnaround_us, uint32_t jitter_us);
+int		 mac_sim_set_errors(struct mac_sim *sim, double drop_rate, double release_rate);
+void		 mac_sim_set_turn_timeout(struct mac_sim *sim, uint32_t timeout_us);
+void		 mac_sim_gettime(struct mac_sim *sim, struct timespec *ts);
+void		 mac_sim_get_stats(struct mac_sim *sim, struct mac_sim_stats *stats);
+void		 mac_sim_free(struct mac_sim *sim);
+
+struct mac_link	*mac_link_new_simulated(struct mac_sim *sim, struct llc_link *llc_link);
+
+/* Backend entry points used by the mac_link API for simulated links */
+int		 mac_sim_activate(struct mac_link *mac_link, int mode);
+int		 mac_sim_wait(struct mac_link *mac_link, void **value_ptr);
+int		 mac_sim_deactivate(struct mac_link *mac_link, intptr_t reason);
+void		 mac_sim_detach(struct mac_link *mac_link);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_MAC_SIM_H */
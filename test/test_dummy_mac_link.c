@@ -84,7 +84,7 @@ echo_service(void *arg)
   pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
   for (;;) {
-    char buffer[1024];
+    char buffer[LLCP_MAX_PDU_SIZE];
     int res = mq_receive(llc_up, buffer, sizeof(buffer), NULL);
     pthread_testcancel();
     cut_assert_equal_int(7, res, cut_message("Invalid message length"));
@@ -98,7 +98,7 @@ void
 dummy_mac_transport(struct llc_link *initiator, struct llc_link *target)
 {
   int n;
-  char buffer[1024];
+  char buffer[LLCP_MAX_PDU_SIZE];
 
   for (;;) {
     struct timespec ts = {
@@ -166,7 +166,7 @@ test_dummy_mac_link(void)
   res = llc_link_activate(target, LLC_TARGET | LLC_PAX_PDU_PROHIBITED, NULL, 0);
   cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
 
-  char buffer[1024];
+  char buffer[LLCP_MAX_PDU_SIZE];
 
   pthread_t transport;
   struct dummy_mac_transport_endpoints eps = {
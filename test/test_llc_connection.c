@@ -24,14 +24,41 @@
 #include <sys/types.h>
 
 #include <cutter.h>
+#include <errno.h>
+#include <mqueue.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include <nfc/nfc.h>
 
 #include "llc_connection.h"
 #include "llc_link.h"
 #include "llc_service.h"
 #include "llcp_pdu.h"
+#include "mac.h"
+#include "mac_sim.h"
 
 struct llc_link *llc_link;
 
+static struct mac_sim *sim;
+static struct llc_link *llc_links[2];
+static struct mac_link *mac_links[2];
+static volatile int vectored_ok;
+static uint8_t coalesced[32];
+static volatile size_t coalesced_len;
+static volatile int coalesced_pdus;
+static volatile int flow_gate;
+static volatile int flow_timedout;
+static volatile int flow_received;
+static volatile uint64_t flow_budget_full;
+static struct llc_connection *volatile server_connection;
+static volatile int large_echoed;
+
+#define INITIATOR 0
+#define TARGET    1
+
 void *
 void_thread(void *arg)
 {
@@ -47,12 +74,31 @@ cut_setup(void)
 
   llc_link = llc_link_new();
   cut_assert_not_null(llc_link, cut_message("llc_link()"));
+  sim = NULL;
+  vectored_ok = 0;
+  coalesced_len = 0;
+  coalesced_pdus = 0;
+  flow_gate = 0;
+  flow_timedout = 0;
+  flow_received = 0;
+  flow_budget_full = 0;
+  server_connection = NULL;
+  large_echoed = 0;
 }
 
 void
 cut_teardown(void)
 {
+  if (sim) {
+    for (int i = 0; i < 2; i++) {
+      llc_link_deactivate(llc_links[i]);
+      mac_link_free(mac_links[i]);
+      llc_link_free(llc_links[i]);
+    }
+    mac_sim_free(sim);
+  }
   llc_link_free(llc_link);
+  llcp_set_queue_budget(0);
 
   llcp_fini();
 }
@@ -109,6 +155,49 @@ test_llc_data_link_connection_new(void)
   pdu_free(pdu);
 }
 
+void
+test_llc_data_link_connection_sap(void)
+{
+  struct llc_connection *connections[3];
+  int reason;
+  struct pdu *pdu;
+
+  uint8_t connect_pdu[] = { 0x45, 0x20 };
+
+  cut_assert_equal_int(17, llc_link_service_bind(llc_link, llc_service_new(NULL, void_thread, NULL), 17));
+  cut_assert_equal_int(18, llc_link_service_bind(llc_link, llc_service_new(NULL, void_thread, NULL), 18));
+
+  /* A second connection to SAP 17 skips the SAP bound to the other service */
+  pdu = pdu_unpack(connect_pdu, sizeof(connect_pdu));
+  cut_assert_not_null(pdu);
+  connections[0] = llc_data_link_connection_new(llc_link, pdu, &reason);
+  cut_assert_not_null(connections[0]);
+  connections[1] = llc_data_link_connection_new(llc_link, pdu, &reason);
+  cut_assert_not_null(connections[1]);
+  cut_assert_equal_int(17, connections[0]->local_sap);
+  cut_assert_equal_int(19, connections[1]->local_sap);
+  pdu_free(pdu);
+
+  /* Which remains available to the other service */
+  connections[2] = llc_outgoing_data_link_connection_new(llc_link, 18, 0x10);
+  cut_assert_not_null(connections[2]);
+  cut_assert_null(llc_outgoing_data_link_connection_new(llc_link, 18, 0x11));
+  cut_assert_equal_int(3, llc_link->connection_count);
+  for (int i = 0; i < 3; i++)
+    cut_assert_true(connections[i] == llc_link_find_connection(llc_link, connections[i]->local_sap));
+
+  /* Freeing a connection keeps the others reachable */
+  llc_connection_free(connections[0]);
+  cut_assert_equal_int(2, llc_link->connection_count);
+  cut_assert_null(llc_link_find_connection(llc_link, 17));
+  cut_assert_true(connections[1] == llc_link_find_connection(llc_link, 19));
+  cut_assert_true(connections[2] == llc_link_find_connection(llc_link, 18));
+
+  llc_connection_free(connections[1]);
+  llc_connection_free(connections[2]);
+  cut_assert_equal_int(0, llc_link->connection_count);
+}
+
 void
 test_llc_logical_data_link_new(void)
 {
@@ -259,3 +348,708 @@ test_llc_connection_reject(void)
 
   llc_service_free(service);
 }
+
+void *
+target_thread(void *arg)
+{
+  struct mac_link *link = (struct mac_link *) arg;
+
+  return (void *)(intptr_t) mac_link_activate_as_target(link);
+}
+
+/*
+ * Receive a 6 bytes header and a body in distinct buffers, and send them back
+ * swapped.
+ */
+void *
+vectored_echo_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t header[6], body[16];
+  struct iovec iov[] = {
+    { header, sizeof(header) },
+    { body, sizeof(body) },
+  };
+  int len;
+
+  while ((len = llc_connection_recvv(connection, iov, 2, NULL, NULL)) >= 0) {
+    struct iovec reply[] = {
+      { body, len - sizeof(header) },
+      { header, sizeof(header) },
+    };
+    while (llc_connection_sendv(connection, reply, 2) < 0)
+      sched_yield();
+  }
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void *
+vectored_client_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t header[] = { 0x10, 0x02, 0x00, 0x00, 0x00, 0x05 };
+  uint8_t buffer[128], small[4];
+  struct iovec iov[] = {
+    { header, sizeof(header) },
+    { NULL, 0 },
+    { "Hello", 5 },
+  };
+  struct iovec truncated = { small, sizeof(small) };
+  int discarded = 0;
+
+  while (llc_connection_sendv(connection, iov, 3) < 0)
+    sched_yield();
+  if ((llc_connection_recv(connection, buffer, sizeof(buffer), NULL) == 11) &&
+      (0 == memcmp(buffer, "Hello", 5)) &&
+      (0 == memcmp(buffer + 5, header, sizeof(header))))
+    vectored_ok++;
+
+  /* Data which does not fit is discarded */
+  while (llc_connection_sendv(connection, iov, 3) < 0)
+    sched_yield();
+  if ((llc_connection_recvv(connection, &truncated, 1, NULL, &discarded) == 4) &&
+      (1 == discarded) &&
+      (0 == memcmp(small, "Hell", 4)) &&
+      (1 == connection->stats.rx_truncated))
+    vectored_ok++;
+
+  /* Borrowed PDUs are not copied */
+  const uint8_t *data, *again;
+  uint8_t ssap = 0;
+  while (llc_connection_sendv(connection, iov, 3) < 0)
+    sched_yield();
+  if ((llc_connection_recv_borrow(connection, &data, &ssap) == 11) &&
+      (0 == memcmp(data, "Hello", 5)) &&
+      (0x10 == ssap) &&
+      (llc_connection_recv_borrow(connection, &again, NULL) < 0))
+    vectored_ok++;
+  llc_connection_release(connection);
+
+  /* Wait for the LLC Link to be deactivated */
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0);
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void
+test_llc_connection_vectored(void)
+{
+  pthread_t target;
+  struct llc_connection *client;
+  struct timespec delay = { 0, 50000000 };
+
+  sim = mac_sim_new(1);
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+  }
+  cut_assert_equal_int(0x10, llc_link_service_bind(llc_links[TARGET], llc_service_new(NULL, vectored_echo_thread, NULL), 0x10));
+  cut_assert_equal_int(0x20, llc_link_service_bind(llc_links[INITIATOR], llc_service_new(NULL, vectored_client_thread, NULL), 0x20));
+
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[TARGET]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[INITIATOR]));
+  pthread_join(target, NULL);
+
+  client = llc_outgoing_data_link_connection_new(llc_links[INITIATOR], 0x20, 0x10);
+  cut_assert_not_null(client);
+  cut_assert_equal_int(0, llc_connection_connect(client));
+  for (int i = 0; (vectored_ok < 3) && (i < 100); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(3, vectored_ok);
+}
+
+void *
+coalescing_sink_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[128];
+  int len;
+
+  while ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) >= 0) {
+    if (coalesced_len + len > sizeof(coalesced))
+      break;
+    memcpy(coalesced + coalesced_len, buffer, len);
+    coalesced_pdus++;
+    coalesced_len += len;
+  }
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void *
+coalescing_client_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[128];
+
+  /* Only a flush may send a partial I PDU while the first one is not acknowledged */
+  if (llc_connection_set_coalescing(connection, 1, 10000000) < 0)
+    llc_connection_stop(connection);
+  for (uint8_t i = 0; i < sizeof(coalesced); i++) {
+    while (llc_connection_send(connection, &i, 1) < 0)
+      sched_yield();
+  }
+  while (llc_connection_flush(connection) < 0)
+    sched_yield();
+
+  /* Wait for the LLC Link to be deactivated */
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0);
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void
+test_llc_connection_coalescing(void)
+{
+  pthread_t target;
+  struct llc_connection *client;
+  struct llc_connection_stats stats;
+  struct timespec delay = { 0, 50000000 };
+
+  sim = mac_sim_new(1);
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+  }
+  cut_assert_equal_int(0x10, llc_link_service_bind(llc_links[TARGET], llc_service_new(NULL, coalescing_sink_thread, NULL), 0x10));
+  cut_assert_equal_int(0x20, llc_link_service_bind(llc_links[INITIATOR], llc_service_new(NULL, coalescing_client_thread, NULL), 0x20));
+
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[TARGET]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[INITIATOR]));
+  pthread_join(target, NULL);
+
+  client = llc_outgoing_data_link_connection_new(llc_links[INITIATOR], 0x20, 0x10);
+  cut_assert_not_null(client);
+  cut_assert_equal_int(0, llc_connection_connect(client));
+  for (int i = 0; (coalesced_len < sizeof(coalesced)) && (i < 100); i++)
+    nanosleep(&delay, NULL);
+
+  /* Every byte arrives, in order, in fewer I PDUs than sends */
+  cut_assert_equal_int(sizeof(coalesced), coalesced_len);
+  for (size_t i = 0; i < sizeof(coalesced); i++)
+    cut_assert_equal_int(i, coalesced[i]);
+  cut_assert_operator_int(coalesced_pdus, <, sizeof(coalesced));
+  llc_connection_get_stats(client, &stats);
+  cut_assert_equal_int(coalesced_pdus, stats.tx_pdus);
+  cut_assert_equal_int(sizeof(coalesced) - coalesced_pdus, stats.tx_coalesced);
+}
+
+#define FLOW_MESSAGES 20
+
+/*
+ * Don't read anything until the client is blocked, then check that every
+ * message arrives in order.
+ */
+void *
+flow_sink_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  struct timespec delay = { 0, 10000000 };
+  uint32_t message;
+
+  while (!flow_gate)
+    nanosleep(&delay, NULL);
+  for (uint32_t i = 0; i < FLOW_MESSAGES; i++) {
+    if ((llc_connection_recv(connection, (uint8_t *) &message, sizeof(message), NULL) != sizeof(message)) || (message != i))
+      break;
+    flow_received++;
+  }
+  flow_budget_full = connection->stats.rx_budget_full;
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void *
+flow_client_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[128];
+  uint32_t i = 0;
+
+  /* The peer stops us with a RNR PDU and the connection down queue fills up */
+  llc_connection_set_send_timeout(connection, 100);
+  while ((i < FLOW_MESSAGES) && (llc_connection_send(connection, (uint8_t *) &i, sizeof(i)) == 0))
+    i++;
+  if ((i < FLOW_MESSAGES) && (errno == ETIMEDOUT) &&
+      (llc_connection_wait_writable(connection, 0) < 0) && (errno == EAGAIN))
+    flow_timedout = 1;
+
+  flow_gate = 1;
+  llc_connection_set_send_timeout(connection, -1);
+  for (; i < FLOW_MESSAGES; i++) {
+    if (llc_connection_send(connection, (uint8_t *) &i, sizeof(i)) < 0)
+      break;
+  }
+
+  /* Wait for the LLC Link to be deactivated */
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0);
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void
+test_llc_connection_flow_control(void)
+{
+  pthread_t target;
+  struct llc_connection *client;
+  struct llc_connection_stats stats;
+  struct timespec delay = { 0, 50000000 };
+
+  sim = mac_sim_new(1);
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+  }
+  cut_assert_equal_int(0x10, llc_link_service_bind(llc_links[TARGET], llc_service_new(NULL, flow_sink_thread, NULL), 0x10));
+  cut_assert_equal_int(0x20, llc_link_service_bind(llc_links[INITIATOR], llc_service_new(NULL, flow_client_thread, NULL), 0x20));
+
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[TARGET]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[INITIATOR]));
+  pthread_join(target, NULL);
+
+  client = llc_outgoing_data_link_connection_new(llc_links[INITIATOR], 0x20, 0x10);
+  cut_assert_not_null(client);
+  cut_assert_equal_int(0, llc_connection_connect(client));
+  for (int i = 0; (flow_received < FLOW_MESSAGES) && (i < 100); i++)
+    nanosleep(&delay, NULL);
+
+  cut_assert_true(flow_timedout);
+  cut_assert_equal_int(FLOW_MESSAGES, flow_received);
+  cut_assert_operator_int(0, <, flow_budget_full);
+
+  llc_connection_get_stats(client, &stats);
+  cut_assert_equal_int(FLOW_MESSAGES, stats.tx_pdus);
+  cut_assert_operator_int(0, <, stats.rnr_received);
+  cut_assert_operator_int(0, <, stats.tx_blocked);
+}
+
+void *
+idle_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[128];
+
+  if (connection->link == llc_links[TARGET])
+    server_connection = connection;
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0);
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+static long
+queue_depth(mqd_t mqd)
+{
+  struct mq_attr attr;
+
+  cut_assert_equal_int(0, mq_getattr(mqd, &attr));
+  return attr.mq_maxmsg;
+}
+
+void
+test_llc_connection_queue_depth(void)
+{
+  pthread_t target;
+  struct llc_connection *client;
+  struct llc_service *server, *idle;
+  struct timespec delay = { 0, 50000000 };
+
+  sim = mac_sim_new(1);
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+  }
+  server = llc_service_new(NULL, idle_thread, NULL);
+  llc_service_set_rw(server, 3);
+  cut_assert_equal_int(0x10, llc_link_service_bind(llc_links[TARGET], server, 0x10));
+  idle = llc_service_new(NULL, idle_thread, NULL);
+  llc_service_set_rw(idle, 4);
+  cut_assert_equal_int(0x20, llc_link_service_bind(llc_links[INITIATOR], idle, 0x20));
+
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[TARGET]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[INITIATOR]));
+  pthread_join(target, NULL);
+
+  client = llc_outgoing_data_link_connection_new(llc_links[INITIATOR], 0x20, 0x10);
+  cut_assert_not_null(client);
+  cut_assert_equal_int(0, llc_connection_connect(client));
+  for (int i = 0; (client->status != DLC_CONNECTED) && (i < 100); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(DLC_CONNECTED, client->status);
+  for (int i = 0; !server_connection && (i < 100); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_not_null(server_connection);
+
+  /* Each side queues two windows of the receiver of the queue */
+  cut_assert_equal_int(3, client->rwr);
+  cut_assert_equal_int(4, server_connection->rwr);
+  cut_assert_equal_int(8, queue_depth(client->llc_up));
+  cut_assert_equal_int(6, queue_depth(client->llc_down));
+  cut_assert_equal_int(6, queue_depth(server_connection->llc_up));
+  cut_assert_equal_int(8, queue_depth(server_connection->llc_down));
+}
+
+void
+test_llc_connection_queue_budget(void)
+{
+  struct llc_service *service;
+  struct llc_connection *connection;
+  size_t usage = llcp_get_queue_usage();
+
+  service = llc_service_new(NULL, void_thread, NULL);
+  llc_service_set_queue_depth(service, 8);
+  cut_assert_equal_int(0x20, llc_link_service_bind(llc_link, service, 0x20));
+
+  /* The override applies when the budget allows it */
+  connection = llc_outgoing_data_link_connection_new(llc_link, 0x20, 0x10);
+  cut_assert_not_null(connection);
+  cut_assert_equal_int(8, queue_depth(connection->llc_up));
+  cut_assert_equal_int(8, queue_depth(connection->llc_down));
+  cut_assert_equal_int(0, connection->stats.queue_limited);
+  cut_assert_operator_int(usage, <, llcp_get_queue_usage());
+  llc_connection_free(connection);
+  cut_assert_equal_int(usage, llcp_get_queue_usage());
+
+  /* Past the budget, queues get the minimum depth */
+  llcp_set_queue_budget(usage + 1);
+  connection = llc_outgoing_data_link_connection_new(llc_link, 0x20, 0x10);
+  cut_assert_not_null(connection);
+  cut_assert_equal_int(2, queue_depth(connection->llc_up));
+  cut_assert_equal_int(2, queue_depth(connection->llc_down));
+  cut_assert_equal_int(2, connection->stats.queue_limited);
+  llc_connection_free(connection);
+  cut_assert_equal_int(usage, llcp_get_queue_usage());
+
+  llc_link_service_unbind(llc_link, 0x20);
+  llc_service_free(service);
+}
+
+#define LARGE_MESSAGES 3
+
+void *
+large_echo_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[LLCP_MAX_MIU];
+  int len;
+
+  server_connection = connection;
+  llc_connection_set_send_timeout(connection, -1);
+  while ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) >= 0) {
+    if (llc_connection_send(connection, buffer, len) < 0)
+      break;
+  }
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void *
+large_client_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t message[LLCP_MAX_MIU];
+  uint8_t buffer[LLCP_MAX_MIU];
+
+  llc_connection_set_send_timeout(connection, -1);
+  for (int i = 0; i < LARGE_MESSAGES; i++) {
+    for (size_t n = 0; n < sizeof(message); n++)
+      message[n] = n * 7 + i;
+    if (llc_connection_send(connection, message, sizeof(message)) < 0)
+      break;
+    if (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) != sizeof(buffer))
+      break;
+    if (memcmp(message, buffer, sizeof(buffer)))
+      break;
+    large_echoed++;
+  }
+
+  /* Wait for the LLC Link to be deactivated */
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0);
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void
+test_llc_connection_large_miu(void)
+{
+  pthread_t target;
+  struct llc_connection *client;
+  struct llc_service *server, *large;
+  struct timespec delay = { 0, 50000000 };
+  struct mq_attr attr;
+
+  sim = mac_sim_new(1);
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    llc_links[i]->local_miu = LLCP_MAX_MIU;
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+  }
+  server = llc_service_new(NULL, large_echo_thread, NULL);
+  llc_service_set_miu(server, LLCP_MAX_MIU);
+  cut_assert_equal_int(0x10, llc_link_service_bind(llc_links[TARGET], server, 0x10));
+  large = llc_service_new(NULL, large_client_thread, NULL);
+  llc_service_set_miu(large, LLCP_MAX_MIU);
+  cut_assert_equal_int(0x20, llc_link_service_bind(llc_links[INITIATOR], large, 0x20));
+
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[TARGET]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[INITIATOR]));
+  pthread_join(target, NULL);
+  cut_assert_equal_int(LLCP_MAX_MIU, llc_links[INITIATOR]->remote_miu);
+  cut_assert_equal_int(LLCP_MAX_MIU, llc_links[TARGET]->remote_miu);
+
+  client = llc_outgoing_data_link_connection_new(llc_links[INITIATOR], 0x20, 0x10);
+  cut_assert_not_null(client);
+  cut_assert_equal_int(0, llc_connection_connect(client));
+  for (int i = 0; (large_echoed < LARGE_MESSAGES) && (i < 100); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(LARGE_MESSAGES, large_echoed);
+
+  /* Both sides learnt the other MIU from the CONNECT and CC PDUs */
+  cut_assert_equal_int(LLCP_MAX_MIU, client->remote_miu);
+  cut_assert_not_null(server_connection);
+  cut_assert_equal_int(LLCP_MAX_MIU, server_connection->remote_miu);
+  cut_assert_equal_int(0, mq_getattr(client->llc_down, &attr));
+  cut_assert_equal_int(LLCP_MAX_PDU_SIZE, attr.mq_msgsize);
+  cut_assert_equal_int(0, mq_getattr(server_connection->llc_up, &attr));
+  cut_assert_equal_int(LLCP_MAX_PDU_SIZE, attr.mq_msgsize);
+  cut_assert_equal_int(0, client->stats.rx_truncated);
+}
+
+void
+test_llc_connection_miu_clamped(void)
+{
+  struct llc_service *service;
+  struct llc_connection *connection;
+  struct pdu *pdu;
+  int reason;
+
+  /* A MIUX of 0x7FF in a CONNECT PDU */
+  uint8_t connect_pdu[] = { 0x45, 0x20, 0x02, 0x02, 0x07, 0xFF };
+
+  service = llc_service_new(NULL, void_thread, NULL);
+  llc_service_set_miu(service, LLCP_MAX_MIU);
+  cut_assert_equal_int(0x11, llc_link_service_bind(llc_link, service, 0x11));
+
+  /* Connection MIUs never exceed the link ones */
+  pdu = pdu_unpack(connect_pdu, sizeof(connect_pdu));
+  cut_assert_not_null(pdu);
+  connection = llc_data_link_connection_new(llc_link, pdu, &reason);
+  cut_assert_not_null(connection);
+  cut_assert_equal_int(LLCP_DEFAULT_MIU, connection->local_miu);
+  cut_assert_equal_int(LLCP_DEFAULT_MIU, connection->remote_miu);
+  llc_connection_free(connection);
+
+  llc_link->local_miu = LLCP_MAX_MIU;
+  llc_link->remote_miu = LLCP_MAX_MIU;
+  connection = llc_data_link_connection_new(llc_link, pdu, &reason);
+  cut_assert_not_null(connection);
+  cut_assert_equal_int(LLCP_MAX_MIU, connection->local_miu);
+  cut_assert_equal_int(LLCP_MAX_MIU, connection->remote_miu);
+  llc_connection_free(connection);
+
+  pdu_free(pdu);
+  llc_link_service_unbind(llc_link, 0x11);
+  llc_service_free(service);
+}
+
+static unsigned
+pool_count(const struct llc_link *link)
+{
+  unsigned count = 0;
+
+  for (const struct llc_connection *c = link->pool; c; c = c->pool_next)
+    count++;
+
+  return count;
+}
+
+void
+test_llc_connection_pool(void)
+{
+  struct llc_service *service;
+  struct llc_connection *connection, *pooled;
+  struct llc_link_stats stats;
+  struct pdu *pdu;
+  int reason;
+  size_t usage = llcp_get_queue_usage();
+
+  uint8_t connect_pdu[] = { 0x45, 0x20 };
+  /* The same with a RW of 4 */
+  uint8_t connect_rw_pdu[] = { 0x45, 0x20, 0x05, 0x01, 0x04 };
+
+  /* Binding the service starts its pooled connections */
+  service = llc_service_new(NULL, void_thread, NULL);
+  llc_service_set_pool_size(service, 2);
+  cut_assert_equal_int(0x11, llc_link_service_bind(llc_link, service, 0x11));
+  cut_assert_equal_int(2, pool_count(llc_link));
+  size_t pooled_usage = llcp_get_queue_usage();
+  cut_assert_operator_int(usage, <, pooled_usage);
+
+  /* Incoming connections take them without opening queues */
+  pooled = llc_link->pool;
+  pdu = pdu_unpack(connect_pdu, sizeof(connect_pdu));
+  cut_assert_not_null(pdu);
+  connection = llc_data_link_connection_new(llc_link, pdu, &reason);
+  pdu_free(pdu);
+  cut_assert_true(connection == pooled);
+  cut_assert_equal_int(0x11, connection->local_sap);
+  cut_assert_equal_int(0x20, connection->remote_sap);
+  cut_assert_true(connection == llc_link_find_connection(llc_link, 0x11));
+  cut_assert_equal_int(1, pool_count(llc_link));
+  cut_assert_equal_int(pooled_usage, llcp_get_queue_usage());
+  llc_link_get_stats(llc_link, &stats);
+  cut_assert_equal_int(1, stats.pool_hits);
+  cut_assert_equal_int(0, stats.pool_misses);
+
+  /* Freed connections return to the pool, emptied and reset */
+  cut_assert_equal_int(0, mq_send(connection->llc_up, "\x44\x44\x00", 3, 0));
+  connection->status = DLC_CONNECTED;
+  connection->state.s = 3;
+  llc_connection_free(connection);
+  cut_assert_equal_int(2, pool_count(llc_link));
+  cut_assert_null(llc_link_find_connection(llc_link, 0x11));
+  cut_assert_equal_int(DLC_DISCONNECTED, connection->status);
+  cut_assert_equal_int(0, connection->state.s);
+  struct mq_attr attr;
+  cut_assert_equal_int(0, mq_getattr(connection->llc_up, &attr));
+  cut_assert_equal_int(0, attr.mq_curmsgs);
+  cut_assert_equal_int(pooled_usage, llcp_get_queue_usage());
+
+  /* A larger remote window reopens the down queue only */
+  pdu = pdu_unpack(connect_rw_pdu, sizeof(connect_rw_pdu));
+  cut_assert_not_null(pdu);
+  connection = llc_data_link_connection_new(llc_link, pdu, &reason);
+  pdu_free(pdu);
+  cut_assert_true(connection == pooled);
+  cut_assert_equal_int(2, queue_depth(connection->llc_up));
+  cut_assert_equal_int(8, queue_depth(connection->llc_down));
+  llc_connection_free(connection);
+  cut_assert_equal_int(2, pool_count(llc_link));
+
+  /* Unbinding the service frees them */
+  llc_link_service_unbind(llc_link, 0x11);
+  cut_assert_equal_int(0, pool_count(llc_link));
+  cut_assert_equal_int(usage, llcp_get_queue_usage());
+  llc_service_free(service);
+}
+
+#define CHURN_THREADS 4
+
+static volatile int churned;
+
+static void *
+churn_thread(void *arg)
+{
+  uint8_t sap = (uint8_t)(intptr_t) arg;
+  void *res = NULL;
+
+  for (int i = 0; !res && (i < 20000); i++) {
+    struct llc_connection *connection = llc_outgoing_data_link_connection_new(llc_link, sap, 0x10);
+    if (!connection || (connection != llc_link_find_connection(llc_link, sap)))
+      res = (void *) 1;
+    if (connection)
+      llc_connection_free(connection);
+  }
+
+  __atomic_add_fetch(&churned, 1, __ATOMIC_RELAXED);
+  return res;
+}
+
+void
+test_llc_connection_table_concurrency(void)
+{
+  pthread_t threads[CHURN_THREADS];
+  struct timespec delay = { 0, 1000000 };
+  uint8_t ui[] = { 0x40, 0xE0, 'U', 'I' };
+
+  churned = 0;
+  cut_assert_equal_int(0x10, llc_link_service_bind(llc_link, llc_service_new(NULL, void_thread, NULL), 0x10));
+  for (int i = 0; i < CHURN_THREADS; i++)
+    cut_assert_equal_int(0x20 + i, llc_link_service_bind(llc_link, llc_service_new(NULL, void_thread, NULL), 0x20 + i));
+  cut_assert_equal_int(0, llc_link_activate(llc_link, LLC_INITIATOR, NULL, 0));
+
+  /* Services add and free connections while the LLC Link collects Logical Data Links */
+  for (int i = 0; i < CHURN_THREADS; i++)
+    cut_assert_equal_int(0, pthread_create(&threads[i], NULL, churn_thread, (void *)(intptr_t)(0x20 + i)));
+  while (churned < CHURN_THREADS)
+    mq_send(llc_link->llc_up, (char *) ui, sizeof(ui), 0);
+  for (int i = 0; i < CHURN_THREADS; i++) {
+    void *res;
+    pthread_join(threads[i], &res);
+    cut_assert_null(res);
+  }
+
+  /* SYMM PDUs give the LLC Link a chance to collect the last ones */
+  uint8_t symm[] = { 0x00, 0x00 };
+  for (int i = 0; llc_link->connection_count && (i < 100); i++) {
+    mq_send(llc_link->llc_up, (char *) symm, sizeof(symm), 0);
+    nanosleep(&delay, NULL);
+  }
+  cut_assert_equal_int(0, llc_link->connection_count);
+  for (int sap = 0; sap <= MAX_LLC_LINK_SERVICE; sap++)
+    cut_assert_equal_int(-1, llc_link->connection_index[sap]);
+
+  llc_link_deactivate(llc_link);
+}
+
+static void *
+contended_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+
+  server_connection = connection;
+  for (;;) {
+    struct llc_connection *other = llc_outgoing_data_link_connection_new(connection->link, 0x30, 0x10);
+    if (other)
+      llc_connection_free(other);
+    pthread_testcancel();
+  }
+  return NULL;
+}
+
+static void
+drain_pdus(mqd_t mqd)
+{
+  char buffer[LLCP_MAX_PDU_SIZE];
+  struct timespec deadline = { 0, 0 };
+
+  while (mq_timedreceive(mqd, buffer, sizeof(buffer), NULL, &deadline) >= 0)
+    ;
+}
+
+void
+test_llc_connection_stop_contended(void)
+{
+  struct timespec delay = { 0, 1000000 };
+  uint8_t connect[] = { 0x41, 0x20 };
+  uint8_t disc[] = { 0x41, 0x60 };
+  uint8_t symm[] = { 0x00, 0x00 };
+
+  cut_assert_equal_int(0x10, llc_link_service_bind(llc_link, llc_service_new(NULL, contended_thread, NULL), 0x10));
+  cut_assert_equal_int(0x30, llc_link_service_bind(llc_link, llc_service_new(NULL, void_thread, NULL), 0x30));
+  cut_assert_equal_int(0, llc_link_activate(llc_link, LLC_INITIATOR, NULL, 0));
+
+  /* The service keeps taking the connections lock while the peer disconnects it */
+  for (int round = 0; round < 20; round++) {
+    server_connection = NULL;
+    while (mq_send(llc_link->llc_up, (char *) connect, sizeof(connect), 0) < 0)
+      nanosleep(&delay, NULL);
+    for (int i = 0; !server_connection && (i < 1000); i++) {
+      mq_send(llc_link->llc_up, (char *) symm, sizeof(symm), 0);
+      drain_pdus(llc_link->llc_down);
+      nanosleep(&delay, NULL);
+    }
+    cut_assert_not_null(server_connection);
+
+    while (mq_send(llc_link->llc_up, (char *) disc, sizeof(disc), 0) < 0)
+      nanosleep(&delay, NULL);
+    for (int i = 0; (llc_link->connection_index[0x10] >= 0) && (i < 1000); i++) {
+      mq_send(llc_link->llc_up, (char *) symm, sizeof(symm), 0);
+      drain_pdus(llc_link->llc_down);
+      nanosleep(&delay, NULL);
+    }
+    cut_assert_equal_int(-1, llc_link->connection_index[0x10]);
+  }
+
+  llc_link_deactivate(llc_link);
+}
@@ -22,9 +22,18 @@
 #include "config.h"
 
 #include <cutter.h>
+#include <mqueue.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
+#include "llc_connection.h"
 #include "llc_link.h"
 #include "llc_service.h"
+#include "llcp_pdu.h"
+
+static uint8_t datagram[LLCP_MAX_MIU];
+static volatile int datagram_len;
 
 void *
 void_service(void *arg)
@@ -40,6 +49,7 @@ cut_setup(void)
 
   /* Void service is never called */
   void_service(NULL);
+  datagram_len = 0;
 }
 
 void
@@ -183,3 +193,228 @@ test_llc_link_find_sap_by_uri(void)
   llc_service_free(service);
   llc_link_free(link);
 }
+
+void
+test_llc_link_find_sap_by_uri_index(void)
+{
+  struct llc_link *link;
+  char uri[32];
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  cut_assert_equal_int(LLCP_SDP_SAP, llc_link_find_sap_by_uri(link, "urn:nfc:sn:sdp"));
+
+  for (int sap = 2; sap <= MAX_LLC_LINK_ADVERTISED_SERVICE; sap++) {
+    snprintf(uri, sizeof(uri), "urn:nfc:xsn:vendor.com:%d", sap);
+    struct llc_service *service = llc_service_new_with_uri(NULL, void_service, uri, NULL);
+    cut_assert_equal_int(sap, llc_link_service_bind(link, service, sap));
+  }
+  for (int sap = 2; sap <= MAX_LLC_LINK_ADVERTISED_SERVICE; sap++) {
+    snprintf(uri, sizeof(uri), "urn:nfc:xsn:vendor.com:%d", sap);
+    cut_assert_equal_int(sap, llc_link_find_sap_by_uri(link, uri));
+  }
+  cut_assert_equal_int(0, llc_link_find_sap_by_uri(link, "urn:nfc:xsn:vendor.com:1"));
+
+  /* Services bound beyond the advertised SAPs are not found by name */
+  struct llc_service *hidden = llc_service_new_with_uri(NULL, void_service, "urn:nfc:xsn:hidden", NULL);
+  cut_assert_equal_int(0x20, llc_link_service_bind(link, hidden, 0x20));
+  cut_assert_equal_int(0, llc_link_find_sap_by_uri(link, "urn:nfc:xsn:hidden"));
+
+  /* A URI bound to several SAPs resolves to the lowest one */
+  struct llc_service *service = link->available_services[0x12];
+  llc_link_service_unbind(link, 0x12);
+  llc_service_free(service);
+  service = llc_service_new_with_uri(NULL, void_service, "urn:nfc:xsn:vendor.com:17", NULL);
+  cut_assert_equal_int(0x12, llc_link_service_bind(link, service, 0x12));
+  cut_assert_equal_int(0x11, llc_link_find_sap_by_uri(link, "urn:nfc:xsn:vendor.com:17"));
+  service = link->available_services[0x11];
+  llc_link_service_unbind(link, 0x11);
+  llc_service_free(service);
+  cut_assert_equal_int(0x12, llc_link_find_sap_by_uri(link, "urn:nfc:xsn:vendor.com:17"));
+  cut_assert_equal_int(0, llc_link_find_sap_by_uri(link, "urn:nfc:xsn:vendor.com:18"));
+
+  llc_link_free(link);
+}
+
+void
+test_llc_link_find_sap_by_uri_index_full(void)
+{
+  struct llc_link *link;
+  char uri[32];
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  /* URIs outlive their services: bind more than the index can hold */
+  for (int i = 0; i < 2 * LLC_LINK_URI_INDEX_SIZE; i++) {
+    snprintf(uri, sizeof(uri), "urn:nfc:xsn:vendor.com:%d", i);
+    struct llc_service *service = llc_service_new_with_uri(NULL, void_service, uri, NULL);
+    cut_assert_equal_int(0x10, llc_link_service_bind(link, service, 0x10));
+    cut_assert_equal_int(0x10, llc_link_find_sap_by_uri(link, uri));
+    llc_link_service_unbind(link, 0x10);
+    cut_assert_equal_int(0, llc_link_find_sap_by_uri(link, uri));
+    llc_service_free(service);
+  }
+
+  llc_link_free(link);
+}
+
+void
+test_llc_link_agf(void)
+{
+  struct llc_link *link;
+  struct llc_link_stats stats;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+  cut_assert_equal_int(0, llc_link_activate(link, LLC_INITIATOR, NULL, 0));
+
+  /* More CONNECT PDUs to unbound SAPs than the LLC Link message queue holds */
+  uint8_t agf[] = {
+    0x00, 0x80,
+    0x00, 0x02, 0x41, 0x20,
+    0x00, 0x02, 0x45, 0x20,
+    0x00, 0x02, 0x49, 0x20,
+    0x00, 0x02, 0x4D, 0x20,
+  };
+  cut_assert_equal_int(0, mq_send(link->llc_up, (char *) agf, sizeof(agf), 0));
+
+  /* Each one is rejected, in order */
+  for (int i = 0; i < 4; i++) {
+    char buffer[1024];
+    uint8_t dm[] = { 0x81, 0xD0 | (0x10 + i), 0x02 };
+    int res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+    cut_assert_equal_memory(dm, sizeof(dm), buffer, res);
+  }
+
+  struct timespec delay = { 0, 50000000 };
+  nanosleep(&delay, NULL);
+  llc_link_get_stats(link, &stats);
+  cut_assert_equal_int(1, stats.agf_bundles);
+  cut_assert_equal_int(4, stats.agf_pdus);
+  cut_assert_equal_int(1, stats.rx_pdus[PDU_AGF]);
+  cut_assert_equal_int(4, stats.rx_pdus[PDU_CONNECT]);
+  cut_assert_equal_int(4, stats.tx_pdus[PDU_DM]);
+
+  /* A malformed AGF PDU is dropped as a whole */
+  uint8_t bad_agf[] = {
+    0x00, 0x80,
+    0x00, 0x02, 0x41, 0x20,
+    0x00, 0x05, 0x45, 0x20,
+  };
+  cut_assert_equal_int(0, mq_send(link->llc_up, (char *) bad_agf, sizeof(bad_agf), 0));
+  nanosleep(&delay, NULL);
+  llc_link_get_stats(link, &stats);
+  cut_assert_equal_int(2, stats.agf_bundles);
+  cut_assert_equal_int(4, stats.agf_pdus);
+  cut_assert_equal_int(4, stats.tx_pdus[PDU_DM]);
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+void *
+datagram_service(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  int len;
+
+  if ((len = llc_connection_recv(connection, datagram, sizeof(datagram), NULL)) >= 0)
+    datagram_len = len;
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void
+test_llc_link_agf_max_size(void)
+{
+  struct llc_link *link;
+  struct llc_link_stats stats;
+  struct llc_service *service;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+  link->local_miu = LLCP_MAX_MIU;
+  service = llc_service_new(NULL, datagram_service, NULL);
+  cut_assert_equal_int(0x20, llc_link_service_bind(link, service, 0x20));
+  cut_assert_equal_int(0, llc_link_activate(link, LLC_INITIATOR, NULL, 0));
+
+  /* An AGF PDU filling the link MIU with a single UI PDU */
+  static uint8_t agf[2 + LLCP_MAX_MIU];
+  size_t information_size = LLCP_MAX_MIU - 2 - 2;
+  agf[0] = 0x00;
+  agf[1] = 0x80;
+  agf[2] = (2 + information_size) >> 8;
+  agf[3] = (2 + information_size) & 0xFF;
+  agf[4] = 0x80;
+  agf[5] = 0xD0;
+  for (size_t i = 0; i < information_size; i++)
+    agf[6 + i] = i * 7;
+  cut_assert_equal_int(0, mq_send(link->llc_up, (char *) agf, sizeof(agf), 0));
+
+  struct timespec delay = { 0, 50000000 };
+  for (int i = 0; !datagram_len && (i < 20); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_memory(agf + 6, information_size, datagram, datagram_len);
+
+  llc_link_get_stats(link, &stats);
+  cut_assert_equal_int(1, stats.agf_bundles);
+  cut_assert_equal_int(LLCP_MAX_MIU, stats.agf_bytes);
+  cut_assert_equal_int(1, stats.rx_pdus[PDU_UI]);
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+static volatile int datagrams;
+
+void *
+counting_service(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[LLCP_MAX_MIU];
+
+  if (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0)
+    datagrams++;
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void
+test_llc_link_logical_data_link_gc(void)
+{
+  struct llc_link *link;
+  struct llc_link_stats stats;
+  struct llc_service *service;
+  struct timespec delay = { 0, 10000000 };
+
+  datagrams = 0;
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+  service = llc_service_new(NULL, counting_service, NULL);
+  cut_assert_equal_int(0x20, llc_link_service_bind(link, service, 0x20));
+  cut_assert_equal_int(0, llc_link_activate(link, LLC_INITIATOR, NULL, 0));
+
+  /* Logical Data Links whose thread terminated make room for new ones */
+  uint8_t ui[] = { 0x80, 0xD0, 'U', 'I' };
+  for (int n = 1; n <= 4 * MAX_LOGICAL_DATA_LINK; n++) {
+    cut_assert_equal_int(0, mq_send(link->llc_up, (char *) ui, sizeof(ui), 0));
+    for (int i = 0; (datagrams < n) && (i < 100); i++)
+      nanosleep(&delay, NULL);
+    cut_assert_equal_int(n, datagrams);
+  }
+
+  /* A SYMM PDU gives the LLC Link a chance to collect the last one */
+  uint8_t symm[] = { 0x00, 0x00 };
+  cut_assert_equal_int(0, mq_send(link->llc_up, (char *) symm, sizeof(symm), 0));
+  for (int i = 0; link->connection_count && (i < 100); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(0, link->connection_count);
+
+  llc_link_get_stats(link, &stats);
+  cut_assert_equal_int(0, stats.datagrams_dropped);
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
@@ -0,0 +1,326 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <cutter.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <nfc/nfc.h>
+
+#include "llc_connection.h"
+#include "llc_link.h"
+#include "llc_service.h"
+#include "llcp_parameters.h"
+#include "llcp_pdu.h"
+#include "mac.h"
+#include "mac_sim.h"
+
+#define ECHO_SAP   0x10
+#define OTHER_SAP  0x11
+#define CLIENT_SAP 0x20
+
+static struct mac_sim *sim;
+static struct llc_link *llc_links[2];
+static struct mac_link *mac_links[2];
+static uint8_t responses[2][128];
+static volatile int response_sizes[2];
+static volatile int nresponses;
+
+#define INITIATOR 0
+#define TARGET    1
+
+void
+cut_setup(void)
+{
+  if (llcp_init())
+    cut_fail("llcp_init() failed");
+  sim = NULL;
+  nresponses = 0;
+}
+
+void
+cut_teardown(void)
+{
+  if (sim) {
+    for (int i = 0; i < 2; i++) {
+      llc_link_deactivate(llc_links[i]);
+      mac_link_free(mac_links[i]);
+      llc_link_free(llc_links[i]);
+    }
+    mac_sim_free(sim);
+  }
+  llcp_fini();
+}
+
+void *
+target_thread(void *arg)
+{
+  struct mac_link *link = (struct mac_link *) arg;
+
+  return (void *)(intptr_t) mac_link_activate_as_target(link);
+}
+
+void *
+idle_thread(void *arg)
+{
+  (void) arg;
+
+  return NULL;
+}
+
+void *
+client_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[128];
+  int len;
+
+  /* Each SNL PDU spawns a Logical Data Link: record its information field */
+  if ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) >= 0) {
+    int n = __atomic_load_n(&nresponses, __ATOMIC_RELAXED);
+    if (n < 2) {
+      memcpy(responses[n], buffer, len);
+      response_sizes[n] = len;
+      __atomic_store_n(&nresponses, n + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  /* Wait for the LLC Link to be deactivated */
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0);
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+static void
+service_bind(struct llc_link *link, int sap, const char *uri, void *(*thread_routine)(void *))
+{
+  struct llc_service *service = llc_service_new_with_uri(NULL, thread_routine, uri, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new_with_uri()"));
+  cut_assert_equal_int(sap, llc_link_service_bind(link, service, sap));
+}
+
+static void
+simulated_link_activate(void)
+{
+  pthread_t target;
+
+  sim = mac_sim_new(1);
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+  }
+  service_bind(llc_links[TARGET], ECHO_SAP, "urn:nfc:sn:echo", idle_thread);
+  service_bind(llc_links[TARGET], OTHER_SAP, "urn:nfc:sn:other", idle_thread);
+  service_bind(llc_links[INITIATOR], CLIENT_SAP, NULL, client_thread);
+
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[TARGET]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[INITIATOR]));
+  pthread_join(target, NULL);
+}
+
+static void
+send_snl(const char **uris, size_t count, uint8_t first_tid)
+{
+  uint8_t buffer[128];
+  size_t len = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    int n = parameter_encode_sdreq(buffer + len, sizeof(buffer) - len, first_tid + i, uris[i]);
+    cut_assert_operator_int(0, <, n);
+    len += n;
+  }
+
+  struct pdu *pdu = pdu_new(LLCP_SDP_SAP, PDU_SNL, CLIENT_SAP, 0, 0, buffer, len);
+  cut_assert_equal_int(0, llc_link_send_pdu(llc_links[INITIATOR], pdu));
+  pdu_free(pdu);
+}
+
+static void
+wait_responses(int n)
+{
+  struct timespec delay = { 0, 50000000 };
+
+  for (int i = 0; (__atomic_load_n(&nresponses, __ATOMIC_ACQUIRE) < n) && (i < 100); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(n, nresponses);
+}
+
+static void
+assert_sdres(const uint8_t *buffer, uint8_t tid, uint8_t sap)
+{
+  uint8_t res_tid, res_sap;
+
+  cut_assert_equal_int(0, parameter_decode_sdres(buffer, 4, &res_tid, &res_sap));
+  cut_assert_equal_int(tid, res_tid);
+  cut_assert_equal_int(sap, res_sap);
+}
+
+void
+test_llc_sdp_batch(void)
+{
+  const char *uris[] = { "urn:nfc:sn:echo", "urn:nfc:sn:none", "urn:nfc:sn:other" };
+
+  simulated_link_activate();
+
+  /* All SDREQs are answered in a single SNL PDU */
+  send_snl(uris, 3, 1);
+  wait_responses(1);
+  cut_assert_equal_int(3 * 4, response_sizes[0]);
+  assert_sdres(responses[0] + 0, 1, ECHO_SAP);
+  assert_sdres(responses[0] + 4, 2, 0);
+  assert_sdres(responses[0] + 8, 3, OTHER_SAP);
+
+  /* The same resident Logical Data Link answers the next SNL PDU */
+  struct llc_connection *sdp = llc_links[TARGET]->sdp;
+  cut_assert_not_null(sdp);
+
+  send_snl(uris + 2, 1, 4);
+  wait_responses(2);
+  cut_assert_equal_int(4, response_sizes[1]);
+  assert_sdres(responses[1], 4, OTHER_SAP);
+
+  cut_assert_true(sdp == llc_links[TARGET]->sdp);
+  int handlers = 0;
+  for (int i = 0; i < llc_links[TARGET]->connection_count; i++)
+    if (llc_links[TARGET]->connections[i]->type == LLC_LOGICAL_DATA_LINK)
+      handlers++;
+  cut_assert_equal_int(1, handlers);
+}
+
+void
+test_llc_sdp_resolve(void)
+{
+  const char *uris[] = { "urn:nfc:sn:echo", "urn:nfc:sn:none", "urn:nfc:sn:other" };
+  int saps[3];
+  struct llc_link_stats stats;
+
+  simulated_link_activate();
+
+  /* All lookups are sent in a single SNL PDU */
+  cut_assert_equal_int(0, llc_link_resolve_many(llc_links[INITIATOR], uris, saps, 3));
+  cut_assert_equal_int(ECHO_SAP, saps[0]);
+  cut_assert_equal_int(0, saps[1]);
+  cut_assert_equal_int(OTHER_SAP, saps[2]);
+  llc_link_get_stats(llc_links[INITIATOR], &stats);
+  cut_assert_equal_int(1, stats.tx_pdus[PDU_SNL]);
+
+  /* Resolved URIs are served from the cache */
+  cut_assert_equal_int(ECHO_SAP, llc_link_resolve(llc_links[INITIATOR], "urn:nfc:sn:echo"));
+  cut_assert_equal_int(OTHER_SAP, llc_link_resolve_cached(llc_links[INITIATOR], "urn:nfc:sn:other"));
+  llc_link_get_stats(llc_links[INITIATOR], &stats);
+  cut_assert_equal_int(1, stats.tx_pdus[PDU_SNL]);
+
+  /* Connecting by name goes straight to the resolved SAP */
+  struct llc_connection *connection = llc_outgoing_data_link_connection_new_by_uri(llc_links[INITIATOR], CLIENT_SAP, "urn:nfc:sn:echo");
+  cut_assert_not_null(connection);
+  cut_assert_equal_int(ECHO_SAP, connection->remote_sap);
+
+  /* So are services the peer does not provide */
+  cut_assert_equal_int(0, llc_link_resolve(llc_links[INITIATOR], "urn:nfc:sn:none"));
+  cut_assert_equal_int(-1, llc_link_resolve_cached(llc_links[INITIATOR], "urn:nfc:sn:unknown"));
+  llc_link_get_stats(llc_links[INITIATOR], &stats);
+  cut_assert_equal_int(1, stats.tx_pdus[PDU_SNL]);
+
+  llc_link_resolve_flush(llc_links[INITIATOR]);
+  cut_assert_equal_int(-1, llc_link_resolve_cached(llc_links[INITIATOR], "urn:nfc:sn:echo"));
+}
+
+void
+test_llc_sdp_peer_provides(void)
+{
+  struct llc_link_stats stats;
+
+  simulated_link_activate();
+
+  /* The target advertises its SDP only */
+  cut_assert_equal_int(1, llc_link_peer_provides_sap(llc_links[INITIATOR], LLCP_SDP_SAP));
+  cut_assert_equal_int(0, llc_link_peer_provides_sap(llc_links[INITIATOR], LLCP_SNEP_SAP));
+  cut_assert_equal_int(-1, llc_link_peer_provides_sap(llc_links[INITIATOR], ECHO_SAP));
+  cut_assert_equal_int(0, llc_link_peer_provides(llc_links[INITIATOR], LLCP_SNEP_URI));
+  cut_assert_equal_int(1, llc_link_peer_provides(llc_links[INITIATOR], "urn:nfc:sn:echo"));
+  cut_assert_equal_int(0, llc_link_peer_provides(llc_links[INITIATOR], "urn:nfc:sn:none"));
+
+  /* Connecting to a service known to be absent fails without a round trip */
+  struct llc_connection *connection = llc_outgoing_data_link_connection_new(llc_links[INITIATOR], CLIENT_SAP, LLCP_SNEP_SAP);
+  cut_assert_not_null(connection);
+  cut_assert_equal_int(LLC_CONNECTION_NO_SERVICE, llc_connection_connect(connection));
+  llc_connection_free(connection);
+
+  connection = llc_outgoing_data_link_connection_new_by_uri(llc_links[INITIATOR], CLIENT_SAP, "urn:nfc:sn:none");
+  cut_assert_not_null(connection);
+  cut_assert_equal_int(LLC_CONNECTION_NO_SERVICE, llc_connection_connect(connection));
+
+  llc_link_get_stats(llc_links[INITIATOR], &stats);
+  cut_assert_equal_int(0, stats.tx_pdus[PDU_CONNECT]);
+}
+
+static int
+resolve_cache_entries(const struct llc_link *link)
+{
+  int n = 0;
+
+  for (int i = 0; i < LLC_LINK_RESOLVE_CACHE_SIZE; i++)
+    if (link->resolve_cache[i].uri)
+      n++;
+  return n;
+}
+
+void
+test_llc_sdp_resolve_cache_peer(void)
+{
+  sim = mac_sim_new(1);
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+  }
+  mac_links[TARGET]->nfcid[0] = 0x42;
+  service_bind(llc_links[TARGET], ECHO_SAP, "urn:nfc:sn:echo", idle_thread);
+  llc_link_set_resolve_cache(llc_links[INITIATOR], LLC_RESOLVE_CACHE_PEER);
+  llc_link_set_resolve_cache(llc_links[TARGET], LLC_RESOLVE_CACHE_PEER);
+
+  pthread_t target;
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[TARGET]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[INITIATOR]));
+  pthread_join(target, NULL);
+
+  cut_assert_equal_int(0x42, llc_links[INITIATOR]->peer_nfcid3[0]);
+  cut_assert_equal_int(ECHO_SAP, llc_link_resolve(llc_links[INITIATOR], "urn:nfc:sn:echo"));
+
+  /* The initiator knows its peer: the resolution outlives the activation */
+  for (int i = 0; i < 2; i++)
+    llc_link_deactivate(llc_links[i]);
+  cut_assert_equal_int(1, resolve_cache_entries(llc_links[INITIATOR]));
+  cut_assert_equal_int(0x42, llc_links[INITIATOR]->resolve_cache[0].nfcid3[0]);
+
+  llc_link_set_resolve_cache(llc_links[INITIATOR], LLC_RESOLVE_CACHE_LINK);
+  llc_link_deactivate(llc_links[INITIATOR]);
+  cut_assert_equal_int(0, resolve_cache_entries(llc_links[INITIATOR]));
+
+  for (int i = 0; i < 2; i++) {
+    mac_link_free(mac_links[i]);
+    llc_link_free(llc_links[i]);
+  }
+  mac_sim_free(sim);
+  sim = NULL;
+}
@@ -86,3 +86,20 @@ test_llc_service_miu(void)
   miu = llc_service_get_miu(service);
   cut_assert_equal_int(1024, miu, cut_message("MIU not changed"));
 }
+
+void
+test_llc_service_queue_depth(void)
+{
+  struct llc_service *service;
+
+  service = llc_service_new(NULL, void_thread, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+
+  cut_assert_equal_int(1, llc_service_get_rw(service), cut_message("Wrong default RW"));
+  cut_assert_equal_int(0, llc_service_get_queue_depth(service), cut_message("Queue depth not automatic"));
+
+  llc_service_set_queue_depth(service, 8);
+  cut_assert_equal_int(8, llc_service_get_queue_depth(service), cut_message("Queue depth not changed"));
+
+  llc_service_free(service);
+}
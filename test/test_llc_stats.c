@@ -0,0 +1,237 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <cutter.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include <nfc/nfc.h>
+
+#include "llc_connection.h"
+#include "llc_link.h"
+#include "llc_service.h"
+#include "llcp_pdu.h"
+#include "mac.h"
+#include "mac_sim.h"
+
+#define SERVER_SAP 0x10
+#define CLIENT_SAP 0x20
+#define MESSAGES   5
+
+static struct mac_sim *sim;
+static struct llc_link *llc_links[2];
+static struct mac_link *mac_links[2];
+static volatile int echoed;
+static struct llc_connection_stats client_stats;
+static struct llcp_histogram client_rtt;
+
+#define INITIATOR 0
+#define TARGET    1
+
+void
+cut_setup(void)
+{
+  if (llcp_init())
+    cut_fail("llcp_init() failed");
+  sim = NULL;
+  echoed = 0;
+}
+
+void
+cut_teardown(void)
+{
+  if (sim) {
+    for (int i = 0; i < 2; i++) {
+      llc_link_deactivate(llc_links[i]);
+      mac_link_free(mac_links[i]);
+      llc_link_free(llc_links[i]);
+    }
+    mac_sim_free(sim);
+  }
+  llcp_fini();
+}
+
+void *
+target_thread(void *arg)
+{
+  struct mac_link *link = (struct mac_link *) arg;
+
+  return (void *)(intptr_t) mac_link_activate_as_target(link);
+}
+
+void *
+echo_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[1024];
+  int len;
+
+  while ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) >= 0) {
+    while (llc_connection_send(connection, buffer, len) < 0)
+      sched_yield();
+  }
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void *
+client_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[1024];
+
+  for (int i = 0; i < MESSAGES; i++) {
+    while (llc_connection_send(connection, (const uint8_t *) "Hello", 5) < 0)
+      sched_yield();
+    if (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) != 5)
+      break;
+    if (i == MESSAGES - 1) {
+      llc_connection_get_stats(connection, &client_stats);
+      llc_connection_get_rtt_histogram(connection, &client_rtt);
+    }
+    echoed++;
+  }
+
+  /* Wait for the LLC Link to be deactivated */
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0);
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+static void
+service_bind(struct llc_link *link, int sap, void *(*thread_routine)(void *))
+{
+  struct llc_service *service = llc_service_new(NULL, thread_routine, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  cut_assert_equal_int(sap, llc_link_service_bind(link, service, sap));
+}
+
+static void
+simulated_link_activate(void)
+{
+  pthread_t target;
+
+  sim = mac_sim_new(1);
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+  }
+  service_bind(llc_links[TARGET], SERVER_SAP, echo_thread);
+  service_bind(llc_links[INITIATOR], CLIENT_SAP, client_thread);
+
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[TARGET]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[INITIATOR]));
+  pthread_join(target, NULL);
+}
+
+void
+test_llc_stats_new(void)
+{
+  struct llc_link *link = llc_link_new();
+  struct llc_link_stats stats;
+
+  memset(&stats, 0xFF, sizeof(stats));
+  llc_link_get_stats(link, &stats);
+  for (size_t i = 0; i < sizeof(stats) / sizeof(uint64_t); i++)
+    cut_assert_equal_int(0, ((uint64_t *) &stats)[i]);
+
+  llc_link_free(link);
+}
+
+void
+test_llc_stats_connection(void)
+{
+  struct llc_link_stats link_stats[2];
+  struct llc_connection *client;
+  struct timespec delay = { 0, 50000000 };
+
+  simulated_link_activate();
+
+  client = llc_outgoing_data_link_connection_new(llc_links[INITIATOR], CLIENT_SAP, SERVER_SAP);
+  cut_assert_not_null(client);
+  cut_assert_equal_int(0, llc_connection_connect(client));
+  for (int i = 0; (echoed < MESSAGES) && (i < 100); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(MESSAGES, echoed);
+
+  struct llc_connection_stats *stats = &client_stats;
+  cut_assert_equal_int(MESSAGES, stats->tx_pdus);
+  cut_assert_equal_int(MESSAGES * 5, stats->tx_bytes);
+  cut_assert_equal_int(MESSAGES, stats->rx_pdus);
+  cut_assert_equal_int(MESSAGES * 5, stats->rx_bytes);
+  cut_assert_operator_int(1, <=, stats->tx_queue_hwm);
+  cut_assert_operator_int(1, <=, stats->rx_queue_hwm);
+  cut_assert_operator_int(0, <, stats->setup_ns);
+
+  /* Each echo acknowledges the I PDU it answers */
+  cut_assert_equal_int(MESSAGES, stats->rtt_samples);
+  cut_assert_equal_int(MESSAGES, client_rtt.count);
+  cut_assert_operator_int(client_rtt.min, <=, stats->rtt_ewma_ns);
+  cut_assert_operator_int(stats->rtt_ewma_ns, <=, client_rtt.max);
+  cut_assert_operator_int(client_rtt.min, <=, llcp_histogram_percentile(&client_rtt, 50));
+
+  /* One I PDU at a time is in flight, which fills the default window */
+  cut_assert_operator_int(0, <, stats->window_ns);
+  cut_assert_operator_int(0, <, stats->window_occupancy_ns);
+  cut_assert_operator_int(stats->window_occupancy_ns, <=, stats->window_ns);
+  cut_assert_equal_int(stats->window_occupancy_ns, stats->window_full_ns);
+
+  nanosleep(&delay, NULL);
+
+  for (int i = 0; i < 2; i++)
+    llc_link_get_stats(llc_links[i], &link_stats[i]);
+
+  /* Both sides see the connection established */
+  cut_assert_equal_int(1, link_stats[INITIATOR].connections);
+  cut_assert_equal_int(1, link_stats[TARGET].connections);
+  cut_assert_operator_int(link_stats[INITIATOR].setup_ns, <=, link_stats[INITIATOR].setup_ns_max * link_stats[INITIATOR].connections);
+
+  /* What one side sends, the other receives */
+  cut_assert_equal_int(1, link_stats[INITIATOR].tx_pdus[PDU_CONNECT]);
+  cut_assert_equal_int(1, link_stats[TARGET].rx_pdus[PDU_CONNECT]);
+  cut_assert_equal_int(1, link_stats[TARGET].tx_pdus[PDU_CC]);
+  cut_assert_equal_int(1, link_stats[INITIATOR].rx_pdus[PDU_CC]);
+  cut_assert_equal_int(MESSAGES, link_stats[INITIATOR].tx_pdus[PDU_I]);
+  cut_assert_equal_int(MESSAGES, link_stats[TARGET].rx_pdus[PDU_I]);
+  cut_assert_equal_int(MESSAGES * (3 + 5), link_stats[TARGET].rx_bytes[PDU_I]);
+
+  /* Every received PDU is either answered with data or with a SYMM PDU */
+  uint64_t received = 0;
+  for (int i = 0; i < 16; i++)
+    received += link_stats[TARGET].rx_pdus[i];
+  cut_assert_equal_int(received, link_stats[TARGET].data_turns + link_stats[TARGET].symm_turns);
+  cut_assert_operator_int(0, <, link_stats[TARGET].symm_turns);
+
+  cut_assert_equal_int(0, link_stats[INITIATOR].frmr_sent);
+  cut_assert_equal_int(0, link_stats[TARGET].frmr_sent);
+
+  /* Each echoed I PDU is a request answered by the server */
+  struct llcp_histogram histogram;
+  llc_link_get_histogram(llc_links[TARGET], LLC_STAGE_SERVICE_PICKUP, &histogram);
+  cut_assert_equal_int(MESSAGES, histogram.count);
+  llc_link_get_histogram(llc_links[TARGET], LLC_STAGE_RESPONSE, &histogram);
+  cut_assert_equal_int(MESSAGES, histogram.count);
+  cut_assert_operator_int(0, <, histogram.min);
+}
@@ -0,0 +1,209 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <cutter.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nfc/nfc.h>
+
+#include "llc_link.h"
+#include "llcp_capture.h"
+#include "mac.h"
+#include "mac_sim.h"
+
+static char filename[] = "/tmp/test_llcp_capture.XXXXXX";
+static uint8_t contents[65536];
+static size_t contents_len;
+
+void
+cut_setup(void)
+{
+  int fd;
+
+  if (llcp_init())
+    cut_fail("llcp_init() failed");
+
+  if ((fd = mkstemp(filename)) < 0)
+    cut_fail("mkstemp() failed");
+  close(fd);
+}
+
+void
+cut_teardown(void)
+{
+  unlink(filename);
+  llcp_fini();
+}
+
+static void
+read_capture(void)
+{
+  FILE *f = fopen(filename, "rb");
+  cut_assert_not_null(f, cut_message("Cannot open capture file"));
+  contents_len = fread(contents, 1, sizeof(contents), f);
+  fclose(f);
+}
+
+static uint32_t
+u32(size_t offset)
+{
+  uint32_t res;
+  memcpy(&res, contents + offset, sizeof(res));
+  return res;
+}
+
+/*
+ * Return the offset of the n-th Enhanced Packet Block, or 0 if not found.
+ */
+static size_t
+packet(int n)
+{
+  size_t offset = 0;
+
+  while (offset + 12 <= contents_len) {
+    if ((u32(offset) == 0x00000006) && (n-- == 0))
+      return offset;
+    offset += u32(offset + 4);
+  }
+
+  return 0;
+}
+
+void
+test_llcp_capture_file(void)
+{
+  struct llcp_capture *capture = llcp_capture_open(filename);
+  cut_assert_not_null(capture, cut_message("llcp_capture_open()"));
+
+  cut_assert_equal_int(0, llcp_capture_new_adapter(capture));
+
+  const uint8_t connect[] = { 0x11, 0x20, 0x02, 0x02, 0x07, 0xFF };
+  const uint8_t symm[] = { 0x00, 0x00 };
+  struct timespec t0 = { 1, 0 };
+  struct timespec t1 = { 1, 250000 };
+
+  cut_assert_equal_int(0, llcp_capture_pdu(capture, 0, LLCP_CAPTURE_TX, &t0, connect, sizeof(connect)));
+  cut_assert_equal_int(0, llcp_capture_pdu(capture, 0, LLCP_CAPTURE_RX, &t1, symm, sizeof(symm)));
+  llcp_capture_close(capture);
+
+  read_capture();
+
+  /* Section Header Block */
+  cut_assert_equal_int(0x0A0D0D0A, u32(0));
+  cut_assert_equal_int(0x1A2B3C4D, u32(8));
+
+  /* Interface Description Block */
+  size_t idb = u32(4);
+  cut_assert_equal_int(0x00000001, u32(idb));
+  cut_assert_equal_int(LINKTYPE_NFC_LLCP, u32(idb + 8) & 0xFFFF);
+
+  size_t p0 = packet(0);
+  size_t p1 = packet(1);
+  cut_assert_not_equal_int(0, p0);
+  cut_assert_not_equal_int(0, p1);
+  cut_assert_equal_int(0, packet(2));
+
+  /* Pseudo-header and PDU */
+  cut_assert_equal_int(2 + sizeof(connect), u32(p0 + 20));
+  cut_assert_equal_int(2 + sizeof(connect), u32(p0 + 24));
+  cut_assert_equal_int(0x00, contents[p0 + 28]);
+  cut_assert_equal_int(LLCP_CAPTURE_TX, contents[p0 + 29]);
+  cut_assert_equal_memory(connect, sizeof(connect), contents + p0 + 30, sizeof(connect));
+
+  cut_assert_equal_int(2 + sizeof(symm), u32(p1 + 20));
+  cut_assert_equal_int(LLCP_CAPTURE_RX, contents[p1 + 29]);
+  cut_assert_equal_memory(symm, sizeof(symm), contents + p1 + 30, sizeof(symm));
+
+  /* Timestamps are in nanoseconds */
+  uint64_t ts0 = ((uint64_t) u32(p0 + 12) << 32) | u32(p0 + 16);
+  uint64_t ts1 = ((uint64_t) u32(p1 + 12) << 32) | u32(p1 + 16);
+  cut_assert_equal_int(250000, (int)(ts1 - ts0));
+
+  /* Block lengths are repeated at the end of each block */
+  cut_assert_equal_int(u32(p0 + 4), u32(p0 + u32(p0 + 4) - 4));
+  cut_assert_equal_int(u32(p1 + 4), u32(p1 + u32(p1 + 4) - 4));
+
+  cut_assert_equal_int(0, contents_len - (p1 + u32(p1 + 4)));
+}
+
+void *
+target_thread(void *arg)
+{
+  struct mac_link *link = (struct mac_link *) arg;
+
+  return (void *)(intptr_t) mac_link_activate_as_target(link);
+}
+
+void
+test_llcp_capture_simulated_link(void)
+{
+  struct mac_sim *sim = mac_sim_new(1);
+  struct llc_link *llc_links[2];
+  struct mac_link *mac_links[2];
+  struct timespec delay = { 0, 50000000 };
+  pthread_t target;
+
+  struct llcp_capture *capture = llcp_capture_open(filename);
+  cut_assert_not_null(capture, cut_message("llcp_capture_open()"));
+
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+    cut_assert_equal_int(0, mac_link_set_capture(mac_links[i], capture));
+  }
+
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[1]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[0]));
+  pthread_join(target, NULL);
+
+  nanosleep(&delay, NULL);
+
+  for (int i = 0; i < 2; i++) {
+    llc_link_deactivate(llc_links[i]);
+    mac_link_free(mac_links[i]);
+    llc_link_free(llc_links[i]);
+  }
+  mac_sim_free(sim);
+  llcp_capture_close(capture);
+
+  read_capture();
+
+  /* Each PDU is seen sent by one adapter and received by the other */
+  size_t tx = packet(0);
+  size_t rx = packet(1);
+  cut_assert_not_equal_int(0, tx);
+  cut_assert_not_equal_int(0, rx);
+  cut_assert_equal_int(0x00, contents[tx + 28]);
+  cut_assert_equal_int(LLCP_CAPTURE_TX, contents[tx + 29]);
+  cut_assert_equal_int(0x01, contents[rx + 28]);
+  cut_assert_equal_int(LLCP_CAPTURE_RX, contents[rx + 29]);
+
+  /* The link is bootstrapped with a SYMM PDU */
+  cut_assert_equal_int(4, u32(tx + 20));
+  cut_assert_equal_int(0x00, contents[tx + 30]);
+  cut_assert_equal_int(0x00, contents[tx + 31]);
+}
@@ -0,0 +1,174 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <cutter.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nfc/nfc.h>
+
+#include "llc_link.h"
+#include "llcp_histogram.h"
+#include "mac.h"
+#include "mac_sim.h"
+
+static char filename[] = "/tmp/test_llcp_histogram.XXXXXX";
+
+void
+cut_setup(void)
+{
+  int fd;
+
+  if (llcp_init())
+    cut_fail("llcp_init() failed");
+
+  if ((fd = mkstemp(filename)) < 0)
+    cut_fail("mkstemp() failed");
+  close(fd);
+}
+
+void
+cut_teardown(void)
+{
+  unlink(filename);
+  llcp_fini();
+}
+
+void
+test_llcp_histogram_buckets(void)
+{
+  /* Small values are counted exactly */
+  for (uint64_t v = 0; v < 32; v++) {
+    cut_assert_equal_int(v, llcp_histogram_bucket(v));
+    cut_assert_equal_int(v, llcp_histogram_bucket_min(v));
+    cut_assert_equal_int(v, llcp_histogram_bucket_max(v));
+  }
+
+  /* Buckets are contiguous and values fall within their bucket bounds */
+  for (size_t i = 1; i < LLCP_HISTOGRAM_BUCKETS - 1; i++)
+    cut_assert_equal_int(llcp_histogram_bucket_max(i - 1) + 1, llcp_histogram_bucket_min(i));
+
+  uint64_t values[] = { 32, 33, 63, 64, 1000, 123456, 1000000007ULL, 1ULL << 40 };
+  for (size_t i = 0; i < sizeof(values) / sizeof(*values); i++) {
+    size_t bucket = llcp_histogram_bucket(values[i]);
+    cut_assert_operator_int(llcp_histogram_bucket_min(bucket), <=, values[i]);
+    cut_assert_operator_int(values[i], <=, llcp_histogram_bucket_max(bucket));
+    /* Relative error is bounded */
+    cut_assert_operator_int((llcp_histogram_bucket_max(bucket) - llcp_histogram_bucket_min(bucket)) * 16, <=, values[i]);
+  }
+
+  cut_assert_equal_int(LLCP_HISTOGRAM_BUCKETS - 1, llcp_histogram_bucket(UINT64_MAX));
+}
+
+void
+test_llcp_histogram_percentile(void)
+{
+  struct llcp_histogram histogram;
+
+  llcp_histogram_reset(&histogram);
+  cut_assert_equal_int(0, llcp_histogram_percentile(&histogram, 50.0));
+
+  for (uint64_t v = 1; v <= 1000; v++)
+    llcp_histogram_record(&histogram, v * 1000);
+
+  cut_assert_equal_int(1000, histogram.count);
+  cut_assert_equal_int(1000, histogram.min);
+  cut_assert_equal_int(1000000, histogram.max);
+  cut_assert_equal_int(500500000, histogram.sum);
+
+  uint64_t p50 = llcp_histogram_percentile(&histogram, 50.0);
+  cut_assert_operator_int(500000, <=, p50);
+  cut_assert_operator_int(p50, <=, 500000 + 500000 / 16);
+
+  uint64_t p99 = llcp_histogram_percentile(&histogram, 99.0);
+  cut_assert_operator_int(990000, <=, p99);
+  cut_assert_operator_int(p99, <=, 990000 + 990000 / 16);
+
+  cut_assert_equal_int(1000000, llcp_histogram_percentile(&histogram, 100.0));
+}
+
+void *
+target_thread(void *arg)
+{
+  struct mac_link *link = (struct mac_link *) arg;
+
+  return (void *)(intptr_t) mac_link_activate_as_target(link);
+}
+
+void
+test_llcp_histogram_stages(void)
+{
+  struct mac_sim *sim = mac_sim_new(1);
+  struct llc_link *llc_links[2];
+  struct mac_link *mac_links[2];
+  struct timespec delay = { 0, 50000000 };
+  pthread_t target;
+
+  for (int i = 0; i < 2; i++) {
+    llc_links[i] = llc_link_new();
+    mac_links[i] = mac_link_new_simulated(sim, llc_links[i]);
+  }
+
+  cut_assert_equal_int(0, pthread_create(&target, NULL, target_thread, mac_links[1]));
+  cut_assert_equal_int(1, mac_link_activate_as_initiator(mac_links[0]));
+  pthread_join(target, NULL);
+
+  nanosleep(&delay, NULL);
+
+  struct llcp_histogram histogram;
+  llc_link_get_histogram(llc_links[1], LLC_STAGE_LLC_DISPATCH, &histogram);
+  cut_assert_operator_int(0, <, histogram.count, cut_message("No PDU dispatched"));
+  llc_link_get_histogram(llc_links[1], LLC_STAGE_MAC_TURNAROUND, &histogram);
+  cut_assert_operator_int(0, <, histogram.count, cut_message("No MAC turnaround"));
+  cut_assert_operator_int(histogram.min, <=, histogram.max);
+
+  /* An idle link only exchanges SYMM PDUs */
+  llc_link_get_histogram(llc_links[1], LLC_STAGE_RESPONSE, &histogram);
+  cut_assert_equal_int(0, histogram.count);
+
+  cut_assert_equal_int(0, llc_link_dump_histograms(llc_links[1], filename));
+
+  for (int i = 0; i < 2; i++) {
+    llc_link_deactivate(llc_links[i]);
+    mac_link_free(mac_links[i]);
+    llc_link_free(llc_links[i]);
+  }
+  mac_sim_free(sim);
+
+  FILE *f = fopen(filename, "rb");
+  struct llcp_histogram_header header;
+  struct llcp_histogram_record record;
+
+  cut_assert_not_null(f);
+  cut_assert_equal_int(1, fread(&header, sizeof(header), 1, f));
+  cut_assert_equal_string(LLCP_HISTOGRAM_MAGIC, header.magic);
+  cut_assert_equal_int(LLC_STAGES, header.count);
+  for (int i = 0; i < LLC_STAGES; i++) {
+    cut_assert_equal_int(1, fread(&record, sizeof(record), 1, f));
+    cut_assert_equal_string(llc_link_stage_name(i), record.name);
+  }
+  fclose(f);
+}
@@ -241,3 +241,89 @@ test_llcp_parameter_sdres(void)
   cut_assert_equal_int(42, tid, cut_message("Wrong TID"));
   cut_assert_equal_int(12, sap, cut_message("Wrong SAP"));
 }
+
+void
+test_llcp_parameters_decode(void)
+{
+  struct parameters p;
+  uint8_t buffer[] = {
+    0x01, 0x01, 0x11,		/* VERSION 1.1 */
+    0x02, 0x02, 0x00, 0x80,	/* MIUX 128 */
+    0x03, 0x02, 0x00, 0x12,	/* WKS */
+    0x04, 0x01, 0x0A,		/* LTO */
+    0x42, 0x01, 0x00,		/* Unknown */
+    0x06, 0x03, 'f', 'o', 'o',	/* SN */
+  };
+
+  cut_assert_equal_int(0, parameters_decode(buffer, sizeof(buffer), &p));
+  cut_assert_true(PARAMETER_PRESENT(&p, LLCP_PARAMETER_VERSION));
+  cut_assert_true(PARAMETER_PRESENT(&p, LLCP_PARAMETER_MIUX));
+  cut_assert_true(PARAMETER_PRESENT(&p, LLCP_PARAMETER_WKS));
+  cut_assert_true(PARAMETER_PRESENT(&p, LLCP_PARAMETER_LTO));
+  cut_assert_true(PARAMETER_PRESENT(&p, LLCP_PARAMETER_SN));
+  cut_assert_false(PARAMETER_PRESENT(&p, LLCP_PARAMETER_RW));
+  cut_assert_false(PARAMETER_PRESENT(&p, LLCP_PARAMETER_OPT));
+
+  cut_assert_equal_int(1, p.version.major);
+  cut_assert_equal_int(1, p.version.minor);
+  cut_assert_equal_int(128, p.miux);
+  cut_assert_equal_int(0x13, p.wks);
+  cut_assert_equal_int(10, p.lto);
+  cut_assert_equal_memory("foo", 3, p.sn, p.sn_len);
+  cut_assert_true(p.sn == (const char *) buffer + sizeof(buffer) - 3, cut_message("SN not decoded in place"));
+
+  cut_assert_equal_int(0, parameters_decode(NULL, 0, &p));
+  cut_assert_equal_int(0, p.present);
+}
+
+void
+test_llcp_parameters_decode_errors(void)
+{
+  struct parameters p;
+  uint8_t truncated_header[] = { 0x04, 0x01, 0x0A, 0x05 };
+  uint8_t truncated_value[]  = { 0x06, 0x04, 'f', 'o', 'o' };
+  uint8_t bad_length[]       = { 0x05, 0x02, 0x00, 0x02 };
+  uint8_t bad_sdres[]        = { 0x09, 0x01, 0x2A };
+
+  cut_assert_equal_int(PARAMETER_ETRUNCATED, parameters_decode(truncated_header, sizeof(truncated_header), &p));
+  cut_assert_equal_int(PARAMETER_ETRUNCATED, parameters_decode(truncated_value, sizeof(truncated_value), &p));
+  cut_assert_equal_int(PARAMETER_ELENGTH, parameters_decode(bad_length, sizeof(bad_length), &p));
+  cut_assert_equal_int(PARAMETER_ELENGTH, parameters_decode(bad_sdres, sizeof(bad_sdres), &p));
+  cut_assert_equal_string("Invalid TLV field length", parameter_strerror(PARAMETER_ELENGTH));
+}
+
+void
+test_llcp_parameter_next(void)
+{
+  struct parameter_iterator iterator;
+  struct parameter p;
+  uint8_t buffer[] = {
+    0x08, 0x04, 0x01, 'f', 'o', 'o',	/* SDREQ #1 'foo' */
+    0x09, 0x02, 0x02, 0x10,		/* SDRES #2 SAP 16 */
+    0x08, 0x04, 0x03, 'b', 'a', 'r',	/* SDREQ #3 'bar' */
+    0x08,
+  };
+
+  parameter_iterator_init(&iterator, buffer, sizeof(buffer));
+
+  cut_assert_equal_int(1, parameter_next(&iterator, &p));
+  cut_assert_equal_int(LLCP_PARAMETER_SDREQ, p.type);
+  cut_assert_equal_int(1, p.tid);
+  cut_assert_equal_memory("foo", 3, p.sn, p.sn_len);
+
+  cut_assert_equal_int(1, parameter_next(&iterator, &p));
+  cut_assert_equal_int(LLCP_PARAMETER_SDRES, p.type);
+  cut_assert_equal_int(2, p.tid);
+  cut_assert_equal_int(16, p.sap);
+
+  cut_assert_equal_int(1, parameter_next(&iterator, &p));
+  cut_assert_equal_int(3, p.tid);
+  cut_assert_equal_memory("bar", 3, p.sn, p.sn_len);
+
+  cut_assert_equal_int(PARAMETER_ETRUNCATED, parameter_next(&iterator, &p));
+
+  parameter_iterator_init(&iterator, buffer, sizeof(buffer) - 1);
+  for (int i = 0; i < 3; i++)
+    cut_assert_equal_int(1, parameter_next(&iterator, &p));
+  cut_assert_equal_int(0, parameter_next(&iterator, &p));
+}
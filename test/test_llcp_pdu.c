@@ -25,7 +25,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "llc_connection.h"
 #include "llcp.h"
+#include "llcp_parameters.h"
 #include "llcp_pdu.h"
 
 struct pdu *sample_i_pdu;
@@ -176,3 +178,61 @@ test_llcp_pdu_dispatch(void)
 
   free(pdus);
 }
+
+void
+test_llcp_pdu_builder(void)
+{
+  uint8_t buffer[BUFSIZ];
+  uint8_t expected[BUFSIZ];
+  uint8_t sn[] = { LLCP_PARAMETER_SN, 0x0F, 'u', 'r', 'n', ':', 'n', 'f', 'c', ':', 's', 'n', ':', 's', 'n', 'e', 'p' };
+  struct pdu_builder builder;
+
+  struct pdu *pdu = pdu_new(0x01, PDU_CONNECT, 0x20, 0, 0, sn, sizeof(sn));
+  int len = pdu_pack(pdu, expected, sizeof(expected));
+  pdu_free(pdu);
+
+  cut_assert_equal_int(0, pdu_builder_begin(&builder, buffer, sizeof(buffer), 0x01, PDU_CONNECT, 0x20, 0, 0));
+  cut_assert_equal_int(0, pdu_builder_tlv_sn(&builder, "urn:nfc:sn:snep"));
+  cut_assert_equal_memory(expected, len, buffer, pdu_builder_commit(&builder));
+
+  /* Parameters which do not fit are not appended */
+  cut_assert_equal_int(0, pdu_builder_begin(&builder, buffer, 6, 0x01, PDU_CONNECT, 0x20, 0, 0));
+  cut_assert_equal_int(0, pdu_builder_tlv_miux(&builder, 0x80));
+  cut_assert_equal_int(-1, pdu_builder_tlv_rw(&builder, 4));
+  cut_assert_equal_int(6, pdu_builder_commit(&builder));
+
+  cut_assert_equal_int(-1, pdu_builder_begin(&builder, buffer, 2, 0x10, PDU_I, 0x20, 0, 0));
+}
+
+void
+test_llcp_pdu_pack_control(void)
+{
+  uint8_t buffer[BUFSIZ];
+  struct llc_connection connection;
+
+  memset(&connection, 0, sizeof(connection));
+  connection.local_sap = 0x20;
+  connection.remote_sap = 0x10;
+  connection.local_miu = LLCP_DEFAULT_MIU + 0x80;
+  connection.rwl = 4;
+  connection.state.s = 3;
+  connection.state.r = 5;
+
+  uint8_t cc[] = { 0x41, 0xA0, LLCP_PARAMETER_MIUX, 0x02, 0x00, 0x80, LLCP_PARAMETER_RW, 0x01, 0x04 };
+  cut_assert_equal_memory(cc, sizeof(cc), buffer, pdu_pack_cc(&connection, buffer, sizeof(buffer)));
+
+  uint8_t rr[] = { 0x43, 0x60, 0x35 };
+  cut_assert_equal_memory(rr, sizeof(rr), buffer, pdu_pack_rr(&connection, buffer, sizeof(buffer)));
+
+  uint8_t rnr[] = { 0x43, 0xA0, 0x35 };
+  cut_assert_equal_memory(rnr, sizeof(rnr), buffer, pdu_pack_rnr(&connection, buffer, sizeof(buffer)));
+
+  uint8_t dm[] = { 0x41, 0xE0, 0x02 };
+  cut_assert_equal_memory(dm, sizeof(dm), buffer, pdu_pack_dm(0x10, 0x20, 0x02, buffer, sizeof(buffer)));
+  cut_assert_equal_int(-1, pdu_pack_dm(0x10, 0x20, 0x02, buffer, 2));
+
+  struct pdu *i = pdu_new(0x20, PDU_I, 0x10, 2, 4, NULL, 0);
+  uint8_t frmr[] = { 0x42, 0x20, FRMR_S | PDU_I, 0x24, 0x35, 0x00 };
+  cut_assert_equal_memory(frmr, sizeof(frmr), buffer, pdu_pack_frmr(0x10, 0x20, i, &connection, FRMR_S, buffer, sizeof(buffer)));
+  pdu_free(i);
+}
@@ -0,0 +1,197 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <cutter.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "llcp.h"
+#include "llcp_pdu.h"
+#include "llcp_trace.h"
+
+#define THREADS		4
+#define EVENTS		2000
+#define RING_SIZE	1024
+
+static char filename[] = "/tmp/test_llcp_trace.XXXXXX";
+static struct llcp_trace_event *events;
+static size_t events_count;
+
+void
+cut_setup(void)
+{
+  int fd;
+
+  if (llcp_init())
+    cut_fail("llcp_init() failed");
+
+  if ((fd = mkstemp(filename)) < 0)
+    cut_fail("mkstemp() failed");
+  close(fd);
+
+  events = NULL;
+  events_count = 0;
+}
+
+void
+cut_teardown(void)
+{
+  llcp_trace_enable(0);
+  free(events);
+  unlink(filename);
+  llcp_fini();
+}
+
+static void
+read_trace(void)
+{
+  struct llcp_trace_header header;
+  FILE *f;
+
+  cut_assert_equal_int(0, llcp_trace_dump(filename));
+
+  f = fopen(filename, "rb");
+  cut_assert_not_null(f);
+  cut_assert_equal_int(1, fread(&header, sizeof(header), 1, f));
+  cut_assert_equal_string(LLCP_TRACE_MAGIC, header.magic);
+  cut_assert_equal_int(LLCP_TRACE_VERSION, header.version);
+  cut_assert_equal_int(sizeof(struct llcp_trace_event), header.event_size);
+
+  long start = ftell(f);
+  fseek(f, 0, SEEK_END);
+  events_count = (ftell(f) - start) / sizeof(struct llcp_trace_event);
+  fseek(f, start, SEEK_SET);
+
+  events = malloc((events_count + 1) * sizeof(*events));
+  cut_assert_equal_int(events_count, fread(events, sizeof(*events), events_count, f));
+  fclose(f);
+}
+
+/*
+ * Events from previous tests may be in the trace: only count those with
+ * the given value.
+ */
+static size_t
+count_events(int32_t value)
+{
+  size_t n = 0;
+  for (size_t i = 0; i < events_count; i++)
+    if (events[i].value == value)
+      n++;
+  return n;
+}
+
+void
+test_llcp_trace_disabled(void)
+{
+  llcp_trace_enable(0);
+  llcp_trace(LLCP_TRACE_WINDOW_FULL, 0x10, 0x20, 0x1234);
+
+  read_trace();
+  cut_assert_equal_int(0, count_events(0x1234));
+}
+
+void
+test_llcp_trace_pdu(void)
+{
+  /* I PDU, DSAP 0x10, SSAP 0x20, N(S) 3, N(R) 1 */
+  const uint8_t i_pdu[] = { 0x43, 0x20, 0x31, 'a', 'b', 'c' };
+
+  llcp_trace_enable(1);
+  llcp_trace_pdu(LLCP_TRACE_LLC_SEND, i_pdu, sizeof(i_pdu));
+  llcp_trace(LLCP_TRACE_SDP_REQUEST, 0x01, 0x01, 0x4242);
+  llcp_trace_enable(0);
+
+  read_trace();
+
+  struct llcp_trace_event *e = NULL;
+  for (size_t i = 0; i < events_count; i++)
+    if (events[i].event == LLCP_TRACE_LLC_SEND)
+      e = &events[i];
+  cut_assert_not_null(e);
+
+  cut_assert_equal_int(PDU_I, e->ptype);
+  cut_assert_equal_int(0x10, e->dsap);
+  cut_assert_equal_int(0x20, e->ssap);
+  cut_assert_equal_int(3, e->ns);
+  cut_assert_equal_int(1, e->nr);
+  cut_assert_equal_int(sizeof(i_pdu), e->length);
+
+  cut_assert_equal_int(1, count_events(0x4242));
+  cut_assert_operator_int(e->timestamp, <=, (e + 1)->timestamp);
+  cut_assert_equal_int(e->thread, (e + 1)->thread);
+}
+
+static pthread_barrier_t barrier;
+
+static void *
+trace_thread(void *arg)
+{
+  int32_t marker = (intptr_t) arg;
+
+  for (int i = 0; i < EVENTS; i++)
+    llcp_trace(LLCP_TRACE_WINDOW_FULL, 0x10, 0x20, marker + i);
+
+  /* Keep all rings in use until every thread is done */
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+void
+test_llcp_trace_threads(void)
+{
+  pthread_t threads[THREADS];
+
+  llcp_trace_enable(1);
+  pthread_barrier_init(&barrier, NULL, THREADS);
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], NULL, trace_thread, (void *)(intptr_t)((i + 1) << 16));
+  for (int i = 0; i < THREADS; i++)
+    pthread_join(threads[i], NULL);
+  pthread_barrier_destroy(&barrier);
+  llcp_trace_enable(0);
+
+  read_trace();
+
+  for (int t = 0; t < THREADS; t++) {
+    int32_t marker = (t + 1) << 16;
+    int32_t expected = marker + EVENTS - RING_SIZE;
+    uint32_t thread = 0;
+    size_t n = 0;
+
+    /* Rings keep the most recent events, in order */
+    for (size_t i = 0; i < events_count; i++) {
+      if ((events[i].event != LLCP_TRACE_WINDOW_FULL) || ((events[i].value & ~0xFFFF) != marker))
+        continue;
+      if (n == 0)
+        thread = events[i].thread;
+      cut_assert_equal_int(expected++, events[i].value);
+      cut_assert_equal_int(thread, events[i].thread);
+      n++;
+    }
+    cut_assert_equal_int(RING_SIZE, n);
+  }
+}
@@ -0,0 +1,439 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <cutter.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include <nfc/nfc.h>
+
+#include "llc_connection.h"
+#include "llc_link.h"
+#include "llc_service.h"
+#include "mac.h"
+#include "mac_sim.h"
+
+struct simulated_link {
+  struct mac_sim *sim;
+  struct llc_link *llc_links[2];
+  struct mac_link *mac_links[2];
+  pthread_t target;
+};
+
+#define INITIATOR 0
+#define TARGET    1
+
+void
+cut_setup(void)
+{
+  if (llcp_init())
+    cut_fail("llcp_init() failed");
+}
+
+void
+cut_teardown(void)
+{
+  llcp_fini();
+}
+
+void *
+target_thread(void *arg)
+{
+  struct mac_link *link = (struct mac_link *) arg;
+
+  return (void *)(intptr_t) mac_link_activate_as_target(link);
+}
+
+static void
+simulated_link_activate(struct simulated_link *link)
+{
+  for (int i = 0; i < 2; i++) {
+    link->llc_links[i] = llc_link_new();
+    cut_assert_not_null(link->llc_links[i], cut_message("llc_link_new()"));
+    link->mac_links[i] = mac_link_new_simulated(link->sim, link->llc_links[i]);
+    cut_assert_not_null(link->mac_links[i], cut_message("mac_link_new_simulated()"));
+  }
+
+  cut_assert_equal_int(0, pthread_create(&link->target, NULL, target_thread, link->mac_links[TARGET]));
+
+  int res = mac_link_activate_as_initiator(link->mac_links[INITIATOR]);
+  cut_assert_equal_int(1, res, cut_message("mac_link_activate_as_initiator()"));
+
+  void *target_res;
+  pthread_join(link->target, &target_res);
+  cut_assert_equal_int(1, (intptr_t) target_res, cut_message("mac_link_activate_as_target()"));
+}
+
+static void
+simulated_link_free(struct simulated_link *link)
+{
+  for (int i = 0; i < 2; i++) {
+    struct mac_link *mac_link = link->mac_links[i];
+    llc_link_deactivate(link->llc_links[i]);
+    mac_link_free(mac_link);
+    llc_link_free(link->llc_links[i]);
+  }
+  mac_sim_free(link->sim);
+}
+
+void
+test_mac_sim_settings(void)
+{
+  struct mac_sim *sim = mac_sim_new(1);
+  cut_assert_not_null(sim, cut_message("mac_sim_new()"));
+
+  cut_assert_equal_int(0, mac_sim_set_bitrate(sim, 106));
+  cut_assert_equal_int(0, mac_sim_set_bitrate(sim, 212));
+  cut_assert_equal_int(0, mac_sim_set_bitrate(sim, 424));
+  cut_assert_equal_int(-1, mac_sim_set_bitrate(sim, 848));
+
+  cut_assert_equal_int(0, mac_sim_set_frame_size(sim, 64));
+  cut_assert_equal_int(-1, mac_sim_set_frame_size(sim, 100));
+
+  cut_assert_equal_int(0, mac_sim_set_errors(sim, 0.1, 0.0));
+  cut_assert_equal_int(-1, mac_sim_set_errors(sim, 1.5, 0.0));
+  cut_assert_equal_int(-1, mac_sim_set_errors(sim, 0.0, -1.0));
+
+  mac_sim_free(sim);
+}
+
+void
+test_mac_sim_exchange(void)
+{
+  struct simulated_link link;
+  struct mac_sim_stats stats;
+  struct timespec delay = { 0, 50000000 };
+
+  link.sim = mac_sim_new(1);
+  simulated_link_activate(&link);
+
+  cut_assert_equal_int(LL_ACTIVATED, link.llc_links[INITIATOR]->status);
+  cut_assert_equal_int(LL_ACTIVATED, link.llc_links[TARGET]->status);
+
+  nanosleep(&delay, NULL);
+
+  mac_sim_get_stats(link.sim, &stats);
+  cut_assert_operator_int(0, <, stats.frames, cut_message("No frame exchanged"));
+  cut_assert_equal_int(stats.frames, stats.symm, cut_message("Idle link should only exchange SYMM PDUs"));
+  cut_assert_equal_int(0, stats.error);
+  cut_assert_true(stats.elapsed.tv_sec || stats.elapsed.tv_nsec, cut_message("Virtual time did not advance"));
+
+  simulated_link_free(&link);
+}
+
+void
+test_mac_sim_target_released(void)
+{
+  struct simulated_link link;
+  struct mac_sim_stats stats;
+  void *reason;
+
+  link.sim = mac_sim_new(1);
+  mac_sim_set_errors(link.sim, 0.0, 1.0);
+  simulated_link_activate(&link);
+
+  cut_assert_equal_int(0, mac_link_wait(link.mac_links[INITIATOR], &reason));
+  cut_assert_equal_int(MAC_DEACTIVATE_ON_FAILURE, (intptr_t) reason);
+
+  mac_sim_get_stats(link.sim, &stats);
+  cut_assert_equal_int(NFC_ETGRELEASED, stats.error);
+  cut_assert_equal_int(1, stats.frames);
+
+  /* A SYMM PDU at 424 kbps: 16 bytes with FeliCa framing, plus turnaround */
+  cut_assert_equal_int(0, stats.elapsed.tv_sec);
+  cut_assert_equal_int(16 * 8 * 1000000 / 424 + 500000, stats.elapsed.tv_nsec);
+
+  simulated_link_free(&link);
+}
+
+void
+test_mac_sim_timeout(void)
+{
+  struct simulated_link link;
+  struct mac_sim_stats stats;
+  void *reason;
+
+  link.sim = mac_sim_new(1);
+  mac_sim_set_errors(link.sim, 1.0, 0.0);
+  simulated_link_activate(&link);
+
+  cut_assert_equal_int(0, mac_link_wait(link.mac_links[TARGET], &reason));
+  cut_assert_equal_int(MAC_DEACTIVATE_ON_REQUEST, (intptr_t) reason);
+
+  mac_sim_get_stats(link.sim, &stats);
+  cut_assert_equal_int(NFC_ETIMEOUT, stats.error);
+  cut_assert_equal_int(2, stats.retransmissions);
+  cut_assert_operator_int(3 * 77, <=, stats.elapsed.tv_nsec / 1000000, cut_message("RWT not accounted for"));
+
+  simulated_link_free(&link);
+}
+
+void
+test_mac_sim_deterministic(void)
+{
+  struct mac_sim_stats stats[2];
+
+  for (int i = 0; i < 2; i++) {
+    struct simulated_link link;
+    void *reason;
+
+    link.sim = mac_sim_new(42);
+    mac_sim_set_latency(link.sim, 500, 300);
+    mac_sim_set_errors(link.sim, 0.3, 0.01);
+    simulated_link_activate(&link);
+
+    mac_link_wait(link.mac_links[INITIATOR], &reason);
+    mac_sim_get_stats(link.sim, &stats[i]);
+
+    simulated_link_free(&link);
+  }
+
+  cut_assert_not_equal_int(0, stats[0].error);
+  cut_assert_equal_int(stats[0].error, stats[1].error);
+  cut_assert_equal_int(stats[0].frames, stats[1].frames);
+  cut_assert_equal_int(stats[0].retransmissions, stats[1].retransmissions);
+  cut_assert_equal_int(stats[0].elapsed.tv_sec, stats[1].elapsed.tv_sec);
+  cut_assert_equal_int(stats[0].elapsed.tv_nsec, stats[1].elapsed.tv_nsec);
+}
+
+#define PINGS 20
+
+static volatile int pongs;
+
+static void *
+pong_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[1024];
+  int len;
+
+  llc_connection_set_send_timeout(connection, -1);
+  while ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) >= 0) {
+    if (llc_connection_send(connection, buffer, len) < 0)
+      break;
+  }
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+static void *
+ping_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  const uint8_t disc[] = { 0x01, 0x40 };
+  uint8_t buffer[1024];
+
+  llc_connection_set_send_timeout(connection, -1);
+  for (int i = 0; i < PINGS; i++) {
+    memset(buffer, i, 10 + i);
+    if (llc_connection_send(connection, buffer, 10 + i) < 0)
+      break;
+    if (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) != 10 + i)
+      break;
+    pongs++;
+  }
+
+  /* Tear the LLC Link down, which ends the exchange */
+  llc_link_send_packed(connection->link, disc, sizeof(disc));
+
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0);
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+void
+test_mac_sim_deterministic_traffic(void)
+{
+  struct mac_sim_stats stats[2];
+  int echoes[2];
+
+  for (int i = 0; i < 2; i++) {
+    struct simulated_link link;
+    struct llc_connection *connection;
+    void *res;
+
+    pongs = 0;
+    link.sim = mac_sim_new(7);
+    mac_sim_set_latency(link.sim, 500, 300);
+    mac_sim_set_errors(link.sim, 0.1, 0.0);
+    mac_sim_set_turn_timeout(link.sim, 1000000);
+    for (int j = 0; j < 2; j++) {
+      link.llc_links[j] = llc_link_new();
+      link.mac_links[j] = mac_link_new_simulated(link.sim, link.llc_links[j]);
+    }
+    cut_assert_equal_int(0x10, llc_link_service_bind(link.llc_links[TARGET], llc_service_new(NULL, pong_thread, NULL), 0x10));
+    cut_assert_equal_int(0x20, llc_link_service_bind(link.llc_links[INITIATOR], llc_service_new(NULL, ping_thread, NULL), 0x20));
+
+    /* The exchange waits for the lock between turns: connect at the same point of each run */
+    pthread_mutex_lock(&link.llc_links[INITIATOR]->connections_mutex);
+    cut_assert_equal_int(0, pthread_create(&link.target, NULL, target_thread, link.mac_links[TARGET]));
+    cut_assert_equal_int(1, mac_link_activate_as_initiator(link.mac_links[INITIATOR]));
+    pthread_join(link.target, &res);
+    cut_assert_equal_int(1, (intptr_t) res);
+    connection = llc_outgoing_data_link_connection_new(link.llc_links[INITIATOR], 0x20, 0x10);
+    cut_assert_not_null(connection);
+    cut_assert_equal_int(0, llc_connection_connect(connection));
+    pthread_mutex_unlock(&link.llc_links[INITIATOR]->connections_mutex);
+
+    mac_link_wait(link.mac_links[INITIATOR], &res);
+    mac_sim_get_stats(link.sim, &stats[i]);
+    echoes[i] = pongs;
+
+    simulated_link_free(&link);
+  }
+
+  cut_assert_equal_int(PINGS, echoes[0]);
+  cut_assert_equal_int(PINGS, echoes[1]);
+  cut_assert_equal_int(0, stats[0].error);
+  cut_assert_operator_int(0, <, stats[0].retransmissions, cut_message("No frame dropped"));
+  cut_assert_equal_int(stats[0].frames, stats[1].frames);
+  cut_assert_equal_int(stats[0].symm, stats[1].symm);
+  cut_assert_equal_int(stats[0].bytes, stats[1].bytes);
+  cut_assert_equal_int(stats[0].retransmissions, stats[1].retransmissions);
+  cut_assert_equal_int(stats[0].elapsed.tv_sec, stats[1].elapsed.tv_sec);
+  cut_assert_equal_int(stats[0].elapsed.tv_nsec, stats[1].elapsed.tv_nsec);
+}
+
+#define SERVE_TAPS 3
+
+static struct mac_link_tap served[SERVE_TAPS];
+static volatile int echoed;
+
+static void *
+echo_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[1024];
+  int len;
+
+  while ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) >= 0) {
+    while (llc_connection_send(connection, buffer, len) < 0)
+      sched_yield();
+  }
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+static void *
+hello_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[1024];
+
+  while (llc_connection_send(connection, (const uint8_t *) "Hello", 5) < 0)
+    sched_yield();
+  if (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) == 5)
+    echoed++;
+
+  /* Wait for the LLC Link to be deactivated */
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) >= 0);
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+static void
+tap_done(struct mac_link *mac_link, const struct mac_link_tap *tap, void *user_data)
+{
+  (void) mac_link;
+  (void) user_data;
+
+  if (tap->number < SERVE_TAPS)
+    served[tap->number] = *tap;
+}
+
+static void *
+serve_thread(void *arg)
+{
+  struct mac_link *link = (struct mac_link *) arg;
+  struct mac_link_serve_policy policy = {
+    .taps = SERVE_TAPS,
+    .tap_done = tap_done,
+  };
+
+  return (void *)(intptr_t) mac_link_serve(link, &policy);
+}
+
+void
+test_mac_sim_serve(void)
+{
+  struct simulated_link link;
+  struct llc_service *server, *client;
+  struct llc_link_stats stats;
+  struct timespec delay = { 0, 10000000 };
+  void *taps;
+
+  memset(served, 0, sizeof(served));
+  echoed = 0;
+
+  link.sim = mac_sim_new(1);
+  for (int i = 0; i < 2; i++) {
+    link.llc_links[i] = llc_link_new();
+    link.mac_links[i] = mac_link_new_simulated(link.sim, link.llc_links[i]);
+  }
+  server = llc_service_new(NULL, echo_thread, NULL);
+  llc_service_set_pool_size(server, 1);
+  cut_assert_equal_int(0x10, llc_link_service_bind(link.llc_links[TARGET], server, 0x10));
+  client = llc_service_new(NULL, hello_thread, NULL);
+  cut_assert_equal_int(0x20, llc_link_service_bind(link.llc_links[INITIATOR], client, 0x20));
+
+  cut_assert_equal_int(0, pthread_create(&link.target, NULL, serve_thread, link.mac_links[TARGET]));
+
+  /* The same target serves each tap of the initiator */
+  for (int tap = 0; tap < SERVE_TAPS; tap++) {
+    struct llc_connection *connection;
+
+    cut_assert_equal_int(1, mac_link_activate_as_initiator(link.mac_links[INITIATOR]));
+    connection = llc_outgoing_data_link_connection_new(link.llc_links[INITIATOR], 0x20, 0x10);
+    cut_assert_not_null(connection);
+    cut_assert_equal_int(0, llc_connection_connect(connection));
+    for (int i = 0; (echoed <= tap) && (i < 500); i++)
+      nanosleep(&delay, NULL);
+    cut_assert_equal_int(tap + 1, echoed);
+
+    llc_link_deactivate(link.llc_links[INITIATOR]);
+    link.llc_links[INITIATOR]->mac_link = link.mac_links[INITIATOR];
+  }
+
+  pthread_join(link.target, &taps);
+  cut_assert_equal_int(SERVE_TAPS, (intptr_t) taps);
+
+  for (int tap = 0; tap < SERVE_TAPS; tap++) {
+    cut_assert_equal_int(tap, served[tap].number);
+    cut_assert_operator_int(served[tap].armed, <=, served[tap].activation);
+    cut_assert_operator_int(served[tap].activation, <, served[tap].first_data);
+    cut_assert_operator_int(served[tap].first_data, <=, served[tap].last_data);
+    cut_assert_operator_int(served[tap].last_data, <=, served[tap].release);
+    if (tap)
+      cut_assert_operator_int(served[tap - 1].release, <=, served[tap].armed);
+  }
+
+  /* Connections of the server came from its pool, kept across taps */
+  llc_link_get_stats(link.llc_links[TARGET], &stats);
+  cut_assert_equal_int(SERVE_TAPS, stats.pool_hits);
+  cut_assert_equal_int(0, stats.pool_misses);
+  cut_assert_true(link.mac_links[TARGET] == link.llc_links[TARGET]->mac_link);
+
+  simulated_link_free(&link);
+}
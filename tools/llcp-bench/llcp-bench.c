@@ -0,0 +1,1018 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+/*
+ * End-to-end LLCP benchmark.
+ *
+ * An initiator and a target LLC Link are activated in the same process and
+ * connected back to back by an in-process transport that shuttles PDUs
+ * between their message queues, the way the MAC link does over DEP.  For
+ * each combination of link MIU, connection MIU, RW and number of concurrent
+ * SAPs, the benchmark measures:
+ *
+ *  - Data Link Connection setup time (CONNECT to service thread start);
+ *  - connected (I PDU) throughput, with the acknowledgement round-trip time
+ *    and send window occupancy it ran at;
+ *  - request/response round-trip latency percentiles;
+ *  - connectionless (UI PDU) throughput;
+ *  - CPU time spent per transferred MB.
+ *
+ * The links are either connected through an ideal transport (bit rate 0, the
+ * default) or through the simulated MAC Link (see mac_sim.h), in which case
+ * times are measured against the simulator's virtual clock and reflect the
+ * selected DEP bit rate, frame size, latency and error rate.
+ *
+ * Results are printed as CSV (default) or JSON.  Per-stage latency
+ * histograms of both links can be dumped after each run and decoded with
+ * llcp-histogram.
+ */
+
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <mqueue.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "llc_connection.h"
+#include "llc_link.h"
+#include "llc_service.h"
+#include "llcp_capture.h"
+#include "llcp_stats.h"
+#include "mac.h"
+#include "mac_sim.h"
+
+#define BENCH_SERVER_SAP  0x10
+#define BENCH_CLIENT_SAP  0x20
+#define BENCH_UI_SAP      0x1F
+#define BENCH_MAX_SAPS    0x0F
+
+#define MAX_SWEEP_VALUES  16
+#define UI_IDLE_TIMEOUT   500000
+#define TURN_TIMEOUT      1000
+
+/*
+ * CONNECT PDUs the down queue of an LLC Link holds: the following ones are
+ * sent by the client threads, as connections get established.
+ */
+#define BENCH_CONNECT_BURST 2
+
+static struct llcp_capture *capture;
+static int runs;
+
+struct sweep {
+  int values[MAX_SWEEP_VALUES];
+  size_t count;
+};
+
+struct {
+  size_t bytes;
+  size_t datagrams;
+  size_t pings;
+  size_t ping_size;
+  size_t chunk;
+  long coalesce;
+  long turn_timeout;
+  long run_timeout;
+  struct sweep link_miu;
+  struct sweep miu;
+  struct sweep rw;
+  struct sweep saps;
+  struct sweep bitrate;
+  size_t frame_size;
+  uint32_t turnaround;
+  uint32_t jitter;
+  double drop_rate;
+  unsigned int seed;
+  enum { F_CSV, F_JSON } format;
+  const char *capture;
+  const char *histograms;
+} options = {
+  .bytes = 64 * 1024,
+  .datagrams = 256,
+  .pings = 200,
+  .ping_size = 16,
+  .chunk = 0,
+  .coalesce = -1,
+  .turn_timeout = -1,
+  .run_timeout = 30,
+  .link_miu = { { 128 }, 1 },
+  .miu = { { 128 }, 1 },
+  .rw = { { 1 }, 1 },
+  .saps = { { 1 }, 1 },
+  .bitrate = { { 0 }, 1 },
+  .frame_size = 254,
+  .turnaround = 500,
+  .jitter = 0,
+  .drop_rate = 0.0,
+  .seed = 1,
+  .format = F_CSV,
+};
+
+struct bench_result {
+  int bitrate;
+  int link_miu;
+  int miu;
+  int rw;
+  int saps;
+  int negotiated_miu;
+  int negotiated_rw;
+  int completed;
+  double setup_us;
+  double co_throughput;
+  double co_cpu_per_mb;
+  double ack_rtt;
+  double window_occupancy;
+  double window_full;
+  double rtt_p50;
+  double rtt_p90;
+  double rtt_p99;
+  double rtt_max;
+  size_t ui_sent;
+  size_t ui_received;
+  double ui_throughput;
+};
+
+struct bench_endpoint {
+  struct bench_run *run;
+  struct llc_connection *client;
+  struct timespec connect_start;
+  struct timespec connect_end;
+  struct timespec bulk_end;
+  size_t expected;
+  size_t received;
+  double *rtt;
+  size_t rtt_count;
+};
+
+struct bench_run {
+  struct llc_link *initiator;
+  struct llc_link *target;
+  struct mac_sim *sim;
+  struct mac_link *mac_initiator;
+  struct mac_link *mac_target;
+  int saps;
+  pthread_mutex_t mutex;
+  sem_t co_done;
+  sem_t ui_done;
+  size_t ui_expected;
+  size_t ui_received;
+  size_t ui_bytes;
+  struct timespec ui_end;
+  struct bench_endpoint endpoints[BENCH_MAX_SAPS];
+  volatile int stop;
+};
+
+static const struct timespec poll_delay = {
+  .tv_sec = 0,
+  .tv_nsec = 50000,
+};
+
+static double
+timespec_diff_us(const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+static void
+deadline(struct timespec *ts, long us)
+{
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec  += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+/* Benchmark clock: the simulator's virtual time when there is one */
+static void
+bench_clock(const struct bench_run *run, struct timespec *ts)
+{
+  if (run->sim)
+    mac_sim_gettime(run->sim, ts);
+  else
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static double
+cpu_time_us(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int
+wait_connected(struct llc_connection *connection)
+{
+  while (connection->status != DLC_CONNECTED) {
+    if (connection->status != DLC_NEW && connection->status != DLC_ACCEPTED && connection->status != DLC_RECEIVED_CC)
+      return -1;
+    nanosleep(&poll_delay, NULL);
+  }
+
+  /* Let llc_connection_send() wait for the LLC Link when it is busy */
+  return llc_connection_set_send_timeout(connection, -1);
+}
+
+/*
+ * In-process transport
+ */
+
+static int
+transport_forward(struct llc_link *from, struct llc_link *to, uint8_t *buffer, size_t size)
+{
+  struct timespec ts;
+  ssize_t n;
+
+  deadline(&ts, (options.turn_timeout < 0) ? TURN_TIMEOUT : options.turn_timeout);
+  n = mq_timedreceive(from->llc_down, (char *) buffer, size, NULL, &ts);
+  llc_link_stats_mac_send(from, n >= 0);
+  if (n < 0) {
+    if (errno != ETIMEDOUT)
+      return -1;
+    /* Nothing to send this turn: keep the link alive with a SYMM PDU */
+    buffer[0] = buffer[1] = 0x00;
+    n = 2;
+  }
+
+  llc_link_stats_mac_receive(to);
+
+  /* The LLC Link up queue is non-blocking: retry while it is full */
+  while (mq_send(to->llc_up, (char *) buffer, n, 0) < 0) {
+    if (errno != EAGAIN)
+      return -1;
+    nanosleep(&poll_delay, NULL);
+  }
+
+  return 0;
+}
+
+static void *
+transport_thread(void *arg)
+{
+  struct bench_run *run = (struct bench_run *) arg;
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
+
+  while (!run->stop) {
+    if ((transport_forward(run->initiator, run->target, buffer, sizeof(buffer)) < 0) ||
+        (transport_forward(run->target, run->initiator, buffer, sizeof(buffer)) < 0)) {
+      warn("Transport failure");
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Services
+ */
+
+static void
+bench_connect(struct bench_run *run, int i)
+{
+  struct bench_endpoint *endpoint = &run->endpoints[i];
+
+  bench_clock(run, &endpoint->connect_start);
+  if (llc_connection_connect(endpoint->client) < 0)
+    errx(EXIT_FAILURE, "llc_connection_connect()");
+}
+
+static void *
+server_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  struct bench_run *run = (struct bench_run *) connection->user_data;
+  struct bench_endpoint *endpoint = &run->endpoints[connection->service_sap - BENCH_SERVER_SAP];
+  uint8_t buffer[LLCP_MAX_MIU];
+  int len;
+
+  if (wait_connected(connection) < 0)
+    llc_connection_stop(connection);
+
+  /* Bulk phase: sink everything until the expected byte count is reached */
+  while (endpoint->received < endpoint->expected) {
+    if ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) < 0)
+      llc_connection_stop(connection);
+    endpoint->received += len;
+  }
+  bench_clock(run, &endpoint->bulk_end);
+  sem_post(&run->co_done);
+
+  /* Ping phase: echo requests back */
+  for (;;) {
+    if ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) < 0)
+      break;
+    if (llc_connection_send(connection, buffer, len) < 0)
+      break;
+  }
+
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+static void *
+client_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  struct bench_run *run = (struct bench_run *) connection->user_data;
+  struct bench_endpoint *endpoint = &run->endpoints[connection->service_sap - BENCH_CLIENT_SAP];
+  uint8_t buffer[LLCP_MAX_MIU];
+
+  bench_clock(run, &endpoint->connect_end);
+  if (endpoint + BENCH_CONNECT_BURST < run->endpoints + run->saps)
+    bench_connect(run, endpoint + BENCH_CONNECT_BURST - run->endpoints);
+  sem_post(&run->co_done);
+
+  if (wait_connected(connection) < 0)
+    llc_connection_stop(connection);
+
+  memset(buffer, 0xA5, sizeof(buffer));
+
+  /* Wait for the main thread to start the bulk phase */
+  pthread_mutex_lock(&run->mutex);
+  pthread_mutex_unlock(&run->mutex);
+
+  if ((options.coalesce >= 0) && (llc_connection_set_coalescing(connection, 1, options.coalesce) < 0))
+    llc_connection_stop(connection);
+
+  size_t chunk = MIN(options.chunk ? options.chunk : connection->remote_miu, sizeof(buffer));
+  size_t sent = 0;
+  while (sent < endpoint->expected) {
+    size_t len = MIN(chunk, endpoint->expected - sent);
+    if (llc_connection_send(connection, buffer, len) < 0)
+      llc_connection_stop(connection);
+    sent += len;
+  }
+  if (llc_connection_flush(connection) < 0)
+    llc_connection_stop(connection);
+
+  /* Wait for the main thread to start the ping phase */
+  pthread_mutex_lock(&run->mutex);
+  pthread_mutex_unlock(&run->mutex);
+
+  for (size_t i = 0; i < options.pings; i++) {
+    struct timespec t0, t1;
+    bench_clock(run, &t0);
+    if (llc_connection_send(connection, buffer, options.ping_size) < 0)
+      break;
+    if (llc_connection_recv(connection, buffer, sizeof(buffer), NULL) < 0)
+      break;
+    bench_clock(run, &t1);
+    endpoint->rtt[endpoint->rtt_count++] = timespec_diff_us(&t0, &t1);
+  }
+  sem_post(&run->co_done);
+
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+static void *
+datagram_thread(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  struct bench_run *run = (struct bench_run *) connection->user_data;
+  uint8_t buffer[LLCP_MAX_MIU];
+  int len;
+
+  if ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) >= 0) {
+    pthread_mutex_lock(&run->mutex);
+    run->ui_bytes += len;
+    bench_clock(run, &run->ui_end);
+    if (++run->ui_received == run->ui_expected)
+      sem_post(&run->ui_done);
+    pthread_mutex_unlock(&run->mutex);
+  }
+
+  llc_connection_stop(connection);
+  return NULL;
+}
+
+/*
+ * Benchmark driver
+ */
+
+static int
+sem_wait_for(sem_t *sem, int count)
+{
+  struct timespec ts;
+  deadline(&ts, options.run_timeout * 1000000L);
+
+  for (int i = 0; i < count; i++) {
+    if (sem_timedwait(sem, &ts) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static double
+percentile(const double *sorted, size_t count, double p)
+{
+  if (!count)
+    return 0;
+  size_t i = (size_t)(p * (count - 1) + 0.5);
+  return sorted[i];
+}
+
+static struct llc_link *
+bench_link_new(int link_miu)
+{
+  struct llc_link *link;
+
+  if (!(link = llc_link_new()))
+    errx(EXIT_FAILURE, "llc_link_new()");
+  link->local_miu = link_miu;
+
+  return link;
+}
+
+static void
+bench_bind(struct llc_link *link, int sap, void *(*thread_routine)(void *), struct bench_run *run, int miu, int rw)
+{
+  struct llc_service *service;
+
+  if (!(service = llc_service_new(NULL, thread_routine, run)))
+    errx(EXIT_FAILURE, "llc_service_new()");
+  llc_service_set_miu(service, miu);
+  llc_service_set_rw(service, rw);
+  if (llc_link_service_bind(link, service, sap) != sap)
+    errx(EXIT_FAILURE, "llc_link_service_bind(%d)", sap);
+}
+
+static void
+bench_activate(struct bench_run *run)
+{
+  uint8_t initiator_parameters[BUFSIZ];
+  uint8_t target_parameters[BUFSIZ];
+  int initiator_len, target_len;
+
+  if ((initiator_len = llc_link_encode_parameters(run->initiator, initiator_parameters, sizeof(initiator_parameters))) < 0)
+    errx(EXIT_FAILURE, "llc_link_encode_parameters()");
+  if ((target_len = llc_link_encode_parameters(run->target, target_parameters, sizeof(target_parameters))) < 0)
+    errx(EXIT_FAILURE, "llc_link_encode_parameters()");
+
+  if (llc_link_activate(run->initiator, LLC_INITIATOR | LLC_PAX_PDU_PROHIBITED, target_parameters, target_len) < 0)
+    errx(EXIT_FAILURE, "llc_link_activate(initiator)");
+  if (llc_link_activate(run->target, LLC_TARGET | LLC_PAX_PDU_PROHIBITED, initiator_parameters, initiator_len) < 0)
+    errx(EXIT_FAILURE, "llc_link_activate(target)");
+}
+
+static void *
+simulated_target_thread(void *arg)
+{
+  struct mac_link *mac_link = (struct mac_link *) arg;
+
+  return (void *)(intptr_t) mac_link_activate_as_target(mac_link);
+}
+
+static void
+bench_activate_simulated(struct bench_run *run, int bitrate)
+{
+  pthread_t target;
+  void *res;
+
+  if (!(run->sim = mac_sim_new(options.seed)))
+    errx(EXIT_FAILURE, "mac_sim_new()");
+  if (mac_sim_set_bitrate(run->sim, bitrate) < 0)
+    errx(EXIT_FAILURE, "Unsupported bit rate: %d kbps", bitrate);
+  if (mac_sim_set_frame_size(run->sim, options.frame_size) < 0)
+    errx(EXIT_FAILURE, "Unsupported DEP frame size: %zu", options.frame_size);
+  mac_sim_set_latency(run->sim, options.turnaround, options.jitter);
+  if (mac_sim_set_errors(run->sim, options.drop_rate, 0.0) < 0)
+    errx(EXIT_FAILURE, "Invalid drop rate");
+  if (options.turn_timeout >= 0)
+    mac_sim_set_turn_timeout(run->sim, options.turn_timeout);
+
+  if (!(run->mac_initiator = mac_link_new_simulated(run->sim, run->initiator)) ||
+      !(run->mac_target = mac_link_new_simulated(run->sim, run->target)))
+    errx(EXIT_FAILURE, "mac_link_new_simulated()");
+
+  if (capture &&
+      ((mac_link_set_capture(run->mac_initiator, capture) < 0) ||
+       (mac_link_set_capture(run->mac_target, capture) < 0)))
+    errx(EXIT_FAILURE, "mac_link_set_capture()");
+
+  if (pthread_create(&target, NULL, simulated_target_thread, run->mac_target) != 0)
+    errx(EXIT_FAILURE, "pthread_create()");
+  if (mac_link_activate_as_initiator(run->mac_initiator) < 0)
+    errx(EXIT_FAILURE, "mac_link_activate_as_initiator()");
+  pthread_join(target, &res);
+  if ((intptr_t) res < 0)
+    errx(EXIT_FAILURE, "mac_link_activate_as_target()");
+}
+
+static void
+bench_run(struct bench_result *result)
+{
+  struct bench_run run;
+  pthread_t transport;
+
+  memset(&run, 0, sizeof(run));
+  run.saps = result->saps;
+  pthread_mutex_init(&run.mutex, NULL);
+  sem_init(&run.co_done, 0, 0);
+  sem_init(&run.ui_done, 0, 0);
+
+  run.initiator = bench_link_new(result->link_miu);
+  run.target = bench_link_new(result->link_miu);
+
+  for (int i = 0; i < run.saps; i++) {
+    bench_bind(run.target, BENCH_SERVER_SAP + i, server_thread, &run, result->miu, result->rw);
+    bench_bind(run.initiator, BENCH_CLIENT_SAP + i, client_thread, &run, result->miu, result->rw);
+
+    run.endpoints[i].run = &run;
+    run.endpoints[i].expected = options.bytes / run.saps;
+    if (!(run.endpoints[i].rtt = malloc(options.pings * sizeof(double))))
+      err(EXIT_FAILURE, "malloc");
+  }
+  bench_bind(run.target, BENCH_UI_SAP, datagram_thread, &run, result->miu, result->rw);
+
+  pthread_mutex_lock(&run.mutex);
+  if (result->bitrate) {
+    /*
+     * The simulated MAC Link waits for the connections lock of the initiator
+     * between turns: hold it so that the connections are requested at the
+     * same point of every run.
+     */
+    pthread_mutex_lock(&run.initiator->connections_mutex);
+    bench_activate_simulated(&run, result->bitrate);
+  } else {
+    bench_activate(&run);
+    if (pthread_create(&transport, NULL, transport_thread, &run) != 0)
+      errx(EXIT_FAILURE, "pthread_create()");
+  }
+
+  /* Connection setup */
+  for (int i = 0; i < run.saps; i++) {
+    struct bench_endpoint *endpoint = &run.endpoints[i];
+    if (!(endpoint->client = llc_outgoing_data_link_connection_new(run.initiator, BENCH_CLIENT_SAP + i, BENCH_SERVER_SAP + i)))
+      errx(EXIT_FAILURE, "llc_outgoing_data_link_connection_new()");
+  }
+  for (int i = 0; i < MIN(run.saps, BENCH_CONNECT_BURST); i++)
+    bench_connect(&run, i);
+  if (run.sim)
+    pthread_mutex_unlock(&run.initiator->connections_mutex);
+  if (sem_wait_for(&run.co_done, run.saps) < 0)
+    goto out;
+
+  for (int i = 0; i < run.saps; i++)
+    result->setup_us += timespec_diff_us(&run.endpoints[i].connect_start, &run.endpoints[i].connect_end) / run.saps;
+  result->negotiated_miu = run.endpoints[0].client->remote_miu;
+  result->negotiated_rw = run.endpoints[0].client->rwr;
+
+  /* Connected throughput */
+  struct timespec t0, t1;
+  double cpu0 = cpu_time_us();
+  bench_clock(&run, &t0);
+  pthread_mutex_unlock(&run.mutex);
+  int res = sem_wait_for(&run.co_done, run.saps);
+  double cpu1 = cpu_time_us();
+  pthread_mutex_lock(&run.mutex);
+  if (res < 0)
+    goto out;
+
+  /* The last byte received, not the main thread waking up, ends the phase */
+  t1 = t0;
+  for (int i = 0; i < run.saps; i++) {
+    if (timespec_diff_us(&t1, &run.endpoints[i].bulk_end) > 0)
+      t1 = run.endpoints[i].bulk_end;
+  }
+
+  size_t bytes = run.endpoints[0].expected * run.saps;
+  result->co_throughput = bytes / (timespec_diff_us(&t0, &t1) / 1e6);
+  result->co_cpu_per_mb = (cpu1 - cpu0) / (bytes / 1048576.0);
+
+  uint64_t window_ns = 0, occupancy_ns = 0, full_ns = 0;
+  for (int i = 0; i < run.saps; i++) {
+    struct llc_connection_stats stats;
+    llc_connection_get_stats(run.endpoints[i].client, &stats);
+    result->ack_rtt += stats.rtt_ewma_ns / 1e3 / run.saps;
+    window_ns += stats.window_ns;
+    occupancy_ns += stats.window_occupancy_ns;
+    full_ns += stats.window_full_ns;
+  }
+  if (window_ns) {
+    result->window_occupancy = (double) occupancy_ns / window_ns;
+    result->window_full = 100.0 * full_ns / window_ns;
+  }
+
+  /* Request/response latency */
+  pthread_mutex_unlock(&run.mutex);
+  if (sem_wait_for(&run.co_done, run.saps) < 0)
+    goto out_unlocked;
+
+  size_t rtt_count = 0;
+  double *rtt;
+  if (!(rtt = malloc(run.saps * options.pings * sizeof(double))))
+    err(EXIT_FAILURE, "malloc");
+  for (int i = 0; i < run.saps; i++) {
+    memcpy(rtt + rtt_count, run.endpoints[i].rtt, run.endpoints[i].rtt_count * sizeof(double));
+    rtt_count += run.endpoints[i].rtt_count;
+  }
+  qsort(rtt, rtt_count, sizeof(double), compare_double);
+  result->rtt_p50 = percentile(rtt, rtt_count, 0.50);
+  result->rtt_p90 = percentile(rtt, rtt_count, 0.90);
+  result->rtt_p99 = percentile(rtt, rtt_count, 0.99);
+  result->rtt_max = rtt_count ? rtt[rtt_count - 1] : 0;
+  free(rtt);
+
+  /* Connectionless throughput */
+  uint8_t datagram[LLCP_MAX_MIU];
+  size_t datagram_size = MIN((size_t) run.initiator->remote_miu, sizeof(datagram));
+  memset(datagram, 0x5A, sizeof(datagram));
+  run.ui_expected = options.datagrams;
+  bench_clock(&run, &t0);
+  for (size_t i = 0; i < options.datagrams; i++) {
+    if (llc_link_send_data(run.initiator, BENCH_CLIENT_SAP, BENCH_UI_SAP, datagram, datagram_size) < 0)
+      break;
+    result->ui_sent++;
+  }
+  /* Datagrams may be dropped: stop waiting once no more are delivered */
+  for (size_t last = (size_t) -1; last != run.ui_received; ) {
+    struct timespec ts;
+    last = run.ui_received;
+    deadline(&ts, UI_IDLE_TIMEOUT);
+    if (sem_timedwait(&run.ui_done, &ts) == 0)
+      break;
+  }
+  pthread_mutex_lock(&run.mutex);
+  result->ui_received = run.ui_received;
+  result->ui_throughput = run.ui_received ? run.ui_bytes / (timespec_diff_us(&t0, &run.ui_end) / 1e6) : 0;
+  result->completed = 1;
+
+out:
+  pthread_mutex_unlock(&run.mutex);
+out_unlocked:
+  if (!run.sim) {
+    run.stop = 1;
+    pthread_join(transport, NULL);
+  }
+
+  llc_link_deactivate(run.initiator);
+  llc_link_deactivate(run.target);
+  runs++;
+  if (options.histograms) {
+    char *filename;
+    if (asprintf(&filename, "%s.%d.initiator", options.histograms, runs) < 0)
+      err(EXIT_FAILURE, "asprintf");
+    if (llc_link_dump_histograms(run.initiator, filename) < 0)
+      warnx("Cannot write “%s”", filename);
+    free(filename);
+    if (asprintf(&filename, "%s.%d.target", options.histograms, runs) < 0)
+      err(EXIT_FAILURE, "asprintf");
+    if (llc_link_dump_histograms(run.target, filename) < 0)
+      warnx("Cannot write “%s”", filename);
+    free(filename);
+  }
+  if (run.sim) {
+    mac_link_free(run.mac_initiator);
+    mac_link_free(run.mac_target);
+    mac_sim_free(run.sim);
+  }
+  llc_link_free(run.initiator);
+  llc_link_free(run.target);
+
+  for (int i = 0; i < run.saps; i++)
+    free(run.endpoints[i].rtt);
+  sem_destroy(&run.co_done);
+  sem_destroy(&run.ui_done);
+  pthread_mutex_destroy(&run.mutex);
+}
+
+/*
+ * Output
+ */
+
+static void
+print_csv_header(void)
+{
+  printf("bitrate,link_miu,miu,rw,saps,negotiated_miu,negotiated_rw,completed,"
+         "setup_us,co_bytes_per_s,co_cpu_us_per_mb,"
+         "ack_rtt_us,window_occupancy,window_full_pct,"
+         "rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us,"
+         "ui_sent,ui_received,ui_bytes_per_s\n");
+}
+
+static void
+print_csv(const struct bench_result *r)
+{
+  printf("%d,%d,%d,%d,%d,%d,%d,%d,%.1f,%.0f,%.0f,%.1f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%zu,%zu,%.0f\n",
+         r->bitrate, r->link_miu, r->miu, r->rw, r->saps, r->negotiated_miu, r->negotiated_rw, r->completed,
+         r->setup_us, r->co_throughput, r->co_cpu_per_mb,
+         r->ack_rtt, r->window_occupancy, r->window_full,
+         r->rtt_p50, r->rtt_p90, r->rtt_p99, r->rtt_max,
+         r->ui_sent, r->ui_received, r->ui_throughput);
+}
+
+static void
+print_json(const struct bench_result *r, int first)
+{
+  printf("%s\n  {\"bitrate\": %d, \"link_miu\": %d, \"miu\": %d, \"rw\": %d, \"saps\": %d, "
+         "\"negotiated_miu\": %d, \"negotiated_rw\": %d, \"completed\": %s, "
+         "\"setup_us\": %.1f, \"co_bytes_per_s\": %.0f, \"co_cpu_us_per_mb\": %.0f, "
+         "\"ack_rtt_us\": %.1f, \"window_occupancy\": %.2f, \"window_full_pct\": %.1f, "
+         "\"rtt_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+         "\"ui_sent\": %zu, \"ui_received\": %zu, \"ui_bytes_per_s\": %.0f}",
+         first ? "" : ",",
+         r->bitrate, r->link_miu, r->miu, r->rw, r->saps, r->negotiated_miu, r->negotiated_rw, r->completed ? "true" : "false",
+         r->setup_us, r->co_throughput, r->co_cpu_per_mb,
+         r->ack_rtt, r->window_occupancy, r->window_full,
+         r->rtt_p50, r->rtt_p90, r->rtt_p99, r->rtt_max,
+         r->ui_sent, r->ui_received, r->ui_throughput);
+}
+
+/*
+ * Command line
+ */
+
+static void
+parse_sweep(struct sweep *sweep, const char *arg, int min, int max, const char *name)
+{
+  char *s, *p, *token, *junk;
+
+  if (!(s = strdup(arg)))
+    err(EXIT_FAILURE, "strdup");
+
+  sweep->count = 0;
+  for (p = s; (token = strsep(&p, ",")); ) {
+    long value = strtol(token, &junk, 10);
+    if (*token == '\0' || *junk != '\0' || value < min || value > max)
+      errx(EXIT_FAILURE, "“%s” is not a valid %s value (%d-%d)", token, name, min, max);
+    if (sweep->count == MAX_SWEEP_VALUES)
+      errx(EXIT_FAILURE, "Too many %s values", name);
+    sweep->values[sweep->count++] = value;
+  }
+
+  free(s);
+}
+
+static size_t
+parse_size(const char *arg, const char *name)
+{
+  char *junk;
+  long value = strtol(arg, &junk, 10);
+
+  if (*arg == '\0' || *junk != '\0' || value <= 0)
+    errx(EXIT_FAILURE, "“%s” is not a valid %s", arg, name);
+
+  return value;
+}
+
+static struct option longopts[] = {
+  { "help",         no_argument,       NULL, 'h' },
+  { "bytes",        required_argument, NULL, 'b' },
+  { "datagrams",    required_argument, NULL, 'd' },
+  { "pings",        required_argument, NULL, 'p' },
+  { "ping-size",    required_argument, NULL, 'P' },
+  { "chunk",        required_argument, NULL, 'C' },
+  { "coalesce",     required_argument, NULL, 'N' },
+  { "turn-timeout", required_argument, NULL, 't' },
+  { "timeout",      required_argument, NULL, 'T' },
+  { "link-miu",     required_argument, NULL, 'l' },
+  { "miu",          required_argument, NULL, 'm' },
+  { "rw",           required_argument, NULL, 'w' },
+  { "saps",         required_argument, NULL, 's' },
+  { "bitrate",      required_argument, NULL, 'B' },
+  { "frame-size",   required_argument, NULL, 'F' },
+  { "turnaround",   required_argument, NULL, 'A' },
+  { "jitter",       required_argument, NULL, 'J' },
+  { "drop-rate",    required_argument, NULL, 'D' },
+  { "seed",         required_argument, NULL, 'S' },
+  { "format",       required_argument, NULL, 'f' },
+  { "capture",      required_argument, NULL, 'c' },
+  { "histograms",   required_argument, NULL, 'H' },
+  { NULL,           0,                 NULL, 0 },
+};
+
+static void
+usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options]\n", progname);
+  fprintf(stderr, "\nOptions:\n"
+          "  -h, --help            show this help message and exit\n"
+          "  --bytes=N             bytes transferred per connected run (default: 65536)\n"
+          "  --datagrams=N         UI PDUs sent per run (default: 256)\n"
+          "  --pings=N             request/response exchanges per SAP (default: 200)\n"
+          "  --ping-size=N         request/response payload size (default: 16)\n"
+          "  --chunk=N             bulk phase send size (default: connection MIU)\n"
+          "  --coalesce=USEC       coalesce bulk phase sends, flushing after USEC\n"
+          "  --turn-timeout=USEC   transport wait for a PDU before sending SYMM, or simulated\n"
+          "                        link wait for the services to settle (default: 1000, 10000)\n"
+          "  --timeout=SEC         give up on a run after SEC seconds (default: 30)\n"
+          "  --link-miu=LIST       comma-separated link MIU values to sweep (default: 128)\n"
+          "  --miu=LIST            comma-separated connection MIU values to sweep (default: 128)\n"
+          "  --rw=LIST             comma-separated receive window sizes to sweep (default: 1)\n"
+          "  --saps=LIST           comma-separated concurrent connection counts (default: 1)\n"
+          "  --bitrate=LIST        comma-separated simulated DEP bit rates in kbps, 106, 212\n"
+          "                        or 424, 0 for an ideal transport (default: 0)\n"
+          "  --frame-size=N        simulated DEP frame size, 64, 128, 192 or 254 (default: 254)\n"
+          "  --turnaround=USEC     simulated transceive latency (default: 500)\n"
+          "  --jitter=USEC         simulated transceive latency jitter (default: 0)\n"
+          "  --drop-rate=P         simulated frame loss probability (default: 0)\n"
+          "  --seed=N              simulator random seed (default: 1)\n"
+          "  --format=FORMAT       output format, choices are 'csv' and 'json'\n"
+          "  --capture=FILE        write PDUs exchanged on simulated links to a pcapng file\n"
+          "  --histograms=PREFIX   dump stage latency histograms of the n-th run to\n"
+          "                        PREFIX.n.initiator and PREFIX.n.target\n"
+         );
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ch;
+  char *junk;
+
+  while ((ch = getopt_long(argc, argv, "hb:d:p:P:C:N:t:T:l:m:w:s:B:F:A:J:D:S:f:c:H:", longopts, NULL)) != -1) {
+    switch (ch) {
+      case 'b':
+        options.bytes = parse_size(optarg, "byte count");
+        break;
+      case 'd':
+        options.datagrams = parse_size(optarg, "datagram count");
+        break;
+      case 'p':
+        options.pings = parse_size(optarg, "ping count");
+        break;
+      case 'P':
+        options.ping_size = parse_size(optarg, "ping size");
+        break;
+      case 'C':
+        options.chunk = parse_size(optarg, "chunk size");
+        break;
+      case 'N':
+        options.coalesce = strtol(optarg, &junk, 10);
+        if (*optarg == '\0' || *junk != '\0' || options.coalesce < 0)
+          errx(EXIT_FAILURE, "“%s” is not a valid coalescing delay", optarg);
+        break;
+      case 't':
+        options.turn_timeout = parse_size(optarg, "turn timeout");
+        break;
+      case 'T':
+        options.run_timeout = parse_size(optarg, "timeout");
+        break;
+      case 'l':
+        parse_sweep(&options.link_miu, optarg, 128, 2175, "link MIU");
+        break;
+      case 'm':
+        parse_sweep(&options.miu, optarg, 128, 2175, "connection MIU");
+        break;
+      case 'w':
+        parse_sweep(&options.rw, optarg, 0, 15, "RW");
+        break;
+      case 's':
+        parse_sweep(&options.saps, optarg, 1, BENCH_MAX_SAPS, "SAP count");
+        break;
+      case 'B':
+        parse_sweep(&options.bitrate, optarg, 0, 424, "bit rate");
+        for (size_t i = 0; i < options.bitrate.count; i++) {
+          switch (options.bitrate.values[i]) {
+            case 0:
+            case 106:
+            case 212:
+            case 424:
+              break;
+            default:
+              errx(EXIT_FAILURE, "“%d” is not a supported bit rate", options.bitrate.values[i]);
+          }
+        }
+        break;
+      case 'F':
+        options.frame_size = parse_size(optarg, "frame size");
+        break;
+      case 'A':
+        options.turnaround = strtol(optarg, &junk, 10);
+        if (*optarg == '\0' || *junk != '\0')
+          errx(EXIT_FAILURE, "“%s” is not a valid turnaround", optarg);
+        break;
+      case 'J':
+        options.jitter = strtol(optarg, &junk, 10);
+        if (*optarg == '\0' || *junk != '\0')
+          errx(EXIT_FAILURE, "“%s” is not a valid jitter", optarg);
+        break;
+      case 'D':
+        options.drop_rate = strtod(optarg, &junk);
+        if (*optarg == '\0' || *junk != '\0' || options.drop_rate < 0 || options.drop_rate > 1)
+          errx(EXIT_FAILURE, "“%s” is not a valid drop rate", optarg);
+        break;
+      case 'S':
+        options.seed = strtoul(optarg, &junk, 10);
+        if (*optarg == '\0' || *junk != '\0')
+          errx(EXIT_FAILURE, "“%s” is not a valid seed", optarg);
+        break;
+      case 'f':
+        if (0 == strcasecmp("csv", optarg))
+          options.format = F_CSV;
+        else if (0 == strcasecmp("json", optarg))
+          options.format = F_JSON;
+        else
+          errx(EXIT_FAILURE, "“%s” is not a supported format", optarg);
+        break;
+      case 'c':
+        options.capture = optarg;
+        break;
+      case 'H':
+        options.histograms = optarg;
+        break;
+      case 'h':
+      default:
+        usage(basename(argv[0]));
+        exit(EXIT_FAILURE);
+        break;
+    }
+  }
+
+  if (llcp_init() < 0)
+    errx(EXIT_FAILURE, "llcp_init()");
+
+  if (options.capture && !(capture = llcp_capture_open(options.capture)))
+    errx(EXIT_FAILURE, "Cannot open capture file “%s”", options.capture);
+
+  if (options.format == F_CSV)
+    print_csv_header();
+  else
+    printf("[");
+
+  int first = 1;
+  for (size_t b = 0; b < options.bitrate.count; b++) {
+    for (size_t l = 0; l < options.link_miu.count; l++) {
+      for (size_t m = 0; m < options.miu.count; m++) {
+        for (size_t w = 0; w < options.rw.count; w++) {
+          for (size_t s = 0; s < options.saps.count; s++) {
+            struct bench_result result;
+
+            memset(&result, 0, sizeof(result));
+            result.bitrate = options.bitrate.values[b];
+            result.link_miu = options.link_miu.values[l];
+            result.miu = options.miu.values[m];
+            result.rw = options.rw.values[w];
+            result.saps = options.saps.values[s];
+
+            bench_run(&result);
+
+            if (options.format == F_CSV)
+              print_csv(&result);
+            else
+              print_json(&result, first);
+            fflush(stdout);
+            first = 0;
+          }
+        }
+      }
+    }
+  }
+
+  if (options.format == F_JSON)
+    printf("\n]\n");
+
+  if (capture) {
+    if (llcp_capture_dropped(capture))
+      warnx("%zu PDUs dropped from capture", llcp_capture_dropped(capture));
+    llcp_capture_close(capture);
+  }
+
+  llcp_fini();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,645 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+/*
+ * PDU codec microbenchmark.
+ *
+ * Every codec operation (pdu_pack(), pdu_unpack(), pdu_aggregate(),
+ * pdu_dispatch(), pdu_agf_next(), the PDU builder and the parameter_encode_*() /
+ * parameter_decode_*() family) is run against a set of representative
+ * inputs:
+ *
+ *  - "idle": the SYMM-heavy traffic of an idle link (15 SYMM for 1 RR);
+ *  - "i-128", "i-512", "i-2175": I PDUs carrying a full MIU of data;
+ *  - "agf-2" to "agf-16": AGF PDUs bundling 2 to 16 small PDUs.
+ *
+ * Each operation is repeated until it ran for at least --min-time
+ * milliseconds, and the time and number of heap allocations per operation
+ * are reported (allocations are only counted on GNU libc).
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "llcp.h"
+#include "llcp_parameters.h"
+#include "llcp_pdu.h"
+
+#define MAX_AGF_PDUS 16
+#define MAX_MIU      2175
+#define IDLE_MIX_LEN 16
+
+/*
+ * Allocation counter
+ *
+ * GNU libc allows the application to replace the allocator: route all
+ * allocations through counting wrappers so that libllcp allocations are
+ * accounted for too.
+ */
+#if defined(__GLIBC__)
+#  define HAVE_ALLOCATION_COUNTER 1
+
+extern void	*__libc_malloc(size_t size);
+extern void	*__libc_calloc(size_t nmemb, size_t size);
+extern void	*__libc_realloc(void *ptr, size_t size);
+extern void	 __libc_free(void *ptr);
+
+static size_t allocations;
+
+void *
+malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size) {
+  allocations++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+  __libc_free(ptr);
+}
+#else
+static size_t allocations;
+#endif
+
+struct {
+  long min_time;
+  const char *filter;
+  enum { F_CSV, F_JSON } format;
+} options = {
+  .min_time = 200,
+  .filter = NULL,
+  .format = F_CSV,
+};
+
+/*
+ * Fixtures
+ */
+
+struct pdu_input {
+  struct pdu *pdus[IDLE_MIX_LEN];
+  uint8_t *packed[IDLE_MIX_LEN];
+  size_t packed_len[IDLE_MIX_LEN];
+  size_t count;
+};
+
+struct agf_input {
+  struct pdu *pdus[MAX_AGF_PDUS + 1];
+  struct pdu *agf;
+};
+
+static struct pdu_input idle, i_128, i_512, i_2175;
+static struct agf_input agf_2, agf_4, agf_8, agf_16;
+
+static uint8_t payload[MAX_MIU];
+static uint8_t out[2 * MAX_MIU];
+
+/* Results sink, so that the compiler cannot discard benchmarked calls */
+static volatile int sink;
+
+static void
+pdu_input_add(struct pdu_input *input, struct pdu *pdu)
+{
+  if (!pdu)
+    errx(EXIT_FAILURE, "pdu_new()");
+
+  size_t len = pdu_size(pdu);
+  uint8_t *packed;
+  if (!(packed = malloc(len)))
+    err(EXIT_FAILURE, "malloc");
+  if (pdu_pack(pdu, packed, len) < 0)
+    errx(EXIT_FAILURE, "pdu_pack()");
+
+  input->pdus[input->count] = pdu;
+  input->packed[input->count] = packed;
+  input->packed_len[input->count] = len;
+  input->count++;
+}
+
+static void
+agf_input_init(struct agf_input *input, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    switch (i % 4) {
+      case 0:
+        input->pdus[i] = pdu_new(0x10, PDU_I, 0x20, i % 16, i % 16, payload, 24);
+        break;
+      case 1:
+        input->pdus[i] = pdu_new(0x20, PDU_RR, 0x10, i % 16, 0, NULL, 0);
+        break;
+      case 2:
+        input->pdus[i] = pdu_new(0x11, PDU_UI, 0x21, 0, 0, payload, 8);
+        break;
+      case 3:
+        input->pdus[i] = pdu_new(0x10, PDU_I, 0x20, i % 16, i % 16, payload, 64);
+        break;
+    }
+    if (!input->pdus[i])
+      errx(EXIT_FAILURE, "pdu_new()");
+  }
+  input->pdus[count] = NULL;
+
+  if (!(input->agf = pdu_aggregate(input->pdus)))
+    errx(EXIT_FAILURE, "pdu_aggregate()");
+}
+
+static void
+fixtures_init(void)
+{
+  for (size_t i = 0; i < sizeof(payload); i++)
+    payload[i] = i;
+
+  for (int i = 0; i < IDLE_MIX_LEN - 1; i++)
+    pdu_input_add(&idle, pdu_new(0, PDU_SYMM, 0, 0, 0, NULL, 0));
+  pdu_input_add(&idle, pdu_new(0x10, PDU_RR, 0x20, 3, 0, NULL, 0));
+
+  pdu_input_add(&i_128, pdu_new(0x10, PDU_I, 0x20, 1, 2, payload, 128));
+  pdu_input_add(&i_512, pdu_new(0x10, PDU_I, 0x20, 1, 2, payload, 512));
+  pdu_input_add(&i_2175, pdu_new(0x10, PDU_I, 0x20, 1, 2, payload, 2175));
+
+  agf_input_init(&agf_2, 2);
+  agf_input_init(&agf_4, 4);
+  agf_input_init(&agf_8, 8);
+  agf_input_init(&agf_16, 16);
+}
+
+/*
+ * Benchmarked operations
+ */
+
+static void
+op_pdu_pack(const void *arg, size_t i)
+{
+  const struct pdu_input *input = arg;
+  sink = pdu_pack(input->pdus[i % input->count], out, sizeof(out));
+}
+
+static void
+op_pdu_unpack(const void *arg, size_t i)
+{
+  const struct pdu_input *input = arg;
+  size_t n = i % input->count;
+  struct pdu *pdu = pdu_unpack(input->packed[n], input->packed_len[n]);
+  sink = pdu->ptype;
+  pdu_free(pdu);
+}
+
+static void
+op_pdu_aggregate(const void *arg, size_t i)
+{
+  const struct agf_input *input = arg;
+  struct pdu *pdu = pdu_aggregate((struct pdu **) input->pdus);
+  sink = pdu->information_size;
+  pdu_free(pdu);
+}
+
+static void
+op_pdu_dispatch(const void *arg, size_t i)
+{
+  const struct agf_input *input = arg;
+  struct pdu **pdus = pdu_dispatch(input->agf);
+  for (struct pdu **p = pdus; *p; p++) {
+    sink = (*p)->ptype;
+    pdu_free(*p);
+  }
+  free(pdus);
+}
+
+static void
+op_pdu_agf_next(const void *arg, size_t i)
+{
+  const struct agf_input *input = arg;
+  const uint8_t *buffer;
+  size_t len, offset = 0;
+  struct pdu pdu;
+  while (pdu_agf_next(input->agf, &offset, &buffer, &len) > 0) {
+    pdu_view(&pdu, buffer, len);
+    sink = pdu.ptype;
+  }
+}
+
+static const uint8_t version_tlv[] = { LLCP_PARAMETER_VERSION, 0x01, 0x11 };
+static const uint8_t miux_tlv[]    = { LLCP_PARAMETER_MIUX, 0x02, 0x00, 0x80 };
+static const uint8_t wks_tlv[]     = { LLCP_PARAMETER_WKS, 0x02, 0x00, 0x13 };
+static const uint8_t lto_tlv[]     = { LLCP_PARAMETER_LTO, 0x01, 0x0A };
+static const uint8_t rw_tlv[]      = { LLCP_PARAMETER_RW, 0x01, 0x04 };
+static const uint8_t sn_tlv[]      = { LLCP_PARAMETER_SN, 0x0F, 'u', 'r', 'n', ':', 'n', 'f', 'c', ':', 's', 'n', ':', 's', 'n', 'e', 'p' };
+static const uint8_t opt_tlv[]     = { LLCP_PARAMETER_OPT, 0x01, 0x03 };
+static const uint8_t sdreq_tlv[]   = { LLCP_PARAMETER_SDREQ, 0x10, 0x01, 'u', 'r', 'n', ':', 'n', 'f', 'c', ':', 's', 'n', ':', 's', 'n', 'e', 'p' };
+static const uint8_t sdres_tlv[]   = { LLCP_PARAMETER_SDRES, 0x02, 0x01, 0x04 };
+
+static void
+op_encode_version(const void *arg, size_t i)
+{
+  struct llcp_version version = { 1, 1 };
+  sink = parameter_encode_version(out, sizeof(out), version);
+}
+
+static void
+op_decode_version(const void *arg, size_t i)
+{
+  struct llcp_version version;
+  sink = parameter_decode_version(version_tlv, sizeof(version_tlv), &version);
+}
+
+static void
+op_encode_miux(const void *arg, size_t i)
+{
+  sink = parameter_encode_miux(out, sizeof(out), 0x80);
+}
+
+static void
+op_decode_miux(const void *arg, size_t i)
+{
+  uint16_t miux;
+  sink = parameter_decode_miux(miux_tlv, sizeof(miux_tlv), &miux);
+}
+
+static void
+op_encode_wks(const void *arg, size_t i)
+{
+  sink = parameter_encode_wks(out, sizeof(out), 0x13);
+}
+
+static void
+op_decode_wks(const void *arg, size_t i)
+{
+  uint16_t wks;
+  sink = parameter_decode_wks(wks_tlv, sizeof(wks_tlv), &wks);
+}
+
+static void
+op_encode_lto(const void *arg, size_t i)
+{
+  sink = parameter_encode_lto(out, sizeof(out), 0x0A);
+}
+
+static void
+op_decode_lto(const void *arg, size_t i)
+{
+  uint8_t lto;
+  sink = parameter_decode_lto(lto_tlv, sizeof(lto_tlv), &lto);
+}
+
+static void
+op_encode_rw(const void *arg, size_t i)
+{
+  sink = parameter_encode_rw(out, sizeof(out), 4);
+}
+
+static void
+op_decode_rw(const void *arg, size_t i)
+{
+  uint8_t rw;
+  sink = parameter_decode_rw(rw_tlv, sizeof(rw_tlv), &rw);
+}
+
+static void
+op_encode_sn(const void *arg, size_t i)
+{
+  sink = parameter_encode_sn(out, sizeof(out), "urn:nfc:sn:snep");
+}
+
+static void
+op_decode_sn(const void *arg, size_t i)
+{
+  char sn[BUFSIZ];
+  sink = parameter_decode_sn(sn_tlv, sizeof(sn_tlv), sn, sizeof(sn));
+}
+
+static void
+op_encode_opt(const void *arg, size_t i)
+{
+  sink = parameter_encode_opt(out, sizeof(out), 0x03);
+}
+
+static void
+op_decode_opt(const void *arg, size_t i)
+{
+  uint8_t opt;
+  sink = parameter_decode_opt(opt_tlv, sizeof(opt_tlv), &opt);
+}
+
+static void
+op_encode_sdreq(const void *arg, size_t i)
+{
+  sink = parameter_encode_sdreq(out, sizeof(out), 1, "urn:nfc:sn:snep");
+}
+
+static void
+op_decode_sdreq(const void *arg, size_t i)
+{
+  uint8_t tid;
+  char *uri;
+  sink = parameter_decode_sdreq(sdreq_tlv, sizeof(sdreq_tlv), &tid, &uri);
+  free(uri);
+}
+
+static void
+op_encode_sdres(const void *arg, size_t i)
+{
+  sink = parameter_encode_sdres(out, sizeof(out), 1, 4);
+}
+
+static void
+op_decode_sdres(const void *arg, size_t i)
+{
+  uint8_t tid, sap;
+  sink = parameter_decode_sdres(sdres_tlv, sizeof(sdres_tlv), &tid, &sap);
+}
+
+static void
+op_pdu_new_connect(const void *arg, size_t i)
+{
+  uint8_t sn[2 + 15];
+  int len = parameter_encode_sn(sn, sizeof(sn), "urn:nfc:sn:snep");
+  struct pdu *pdu = pdu_new(0x01, PDU_CONNECT, 0x20, 0, 0, sn, len);
+  sink = pdu_pack(pdu, out, sizeof(out));
+  pdu_free(pdu);
+}
+
+static void
+op_pdu_builder_connect(const void *arg, size_t i)
+{
+  struct pdu_builder builder;
+  pdu_builder_begin(&builder, out, sizeof(out), 0x01, PDU_CONNECT, 0x20, 0, 0);
+  pdu_builder_tlv_sn(&builder, "urn:nfc:sn:snep");
+  sink = pdu_builder_commit(&builder);
+}
+
+static void
+op_pdu_new_dm(const void *arg, size_t i)
+{
+  uint8_t reason = 0x02;
+  struct pdu *pdu = pdu_new_dm(0x10, 0x20, &reason);
+  sink = pdu_pack(pdu, out, sizeof(out));
+  pdu_free(pdu);
+}
+
+static void
+op_pdu_pack_dm(const void *arg, size_t i)
+{
+  sink = pdu_pack_dm(0x10, 0x20, 0x02, out, sizeof(out));
+}
+
+struct codec_bench {
+  const char *operation;
+  const char *input;
+  void (*run)(const void *arg, size_t i);
+  const void *arg;
+};
+
+static const struct codec_bench benchmarks[] = {
+  { "pdu_pack",   "idle",   op_pdu_pack,   &idle },
+  { "pdu_pack",   "i-128",  op_pdu_pack,   &i_128 },
+  { "pdu_pack",   "i-512",  op_pdu_pack,   &i_512 },
+  { "pdu_pack",   "i-2175", op_pdu_pack,   &i_2175 },
+  { "pdu_unpack", "idle",   op_pdu_unpack, &idle },
+  { "pdu_unpack", "i-128",  op_pdu_unpack, &i_128 },
+  { "pdu_unpack", "i-512",  op_pdu_unpack, &i_512 },
+  { "pdu_unpack", "i-2175", op_pdu_unpack, &i_2175 },
+  { "pdu_aggregate", "agf-2",  op_pdu_aggregate, &agf_2 },
+  { "pdu_aggregate", "agf-4",  op_pdu_aggregate, &agf_4 },
+  { "pdu_aggregate", "agf-8",  op_pdu_aggregate, &agf_8 },
+  { "pdu_aggregate", "agf-16", op_pdu_aggregate, &agf_16 },
+  { "pdu_dispatch",  "agf-2",  op_pdu_dispatch,  &agf_2 },
+  { "pdu_dispatch",  "agf-4",  op_pdu_dispatch,  &agf_4 },
+  { "pdu_dispatch",  "agf-8",  op_pdu_dispatch,  &agf_8 },
+  { "pdu_dispatch",  "agf-16", op_pdu_dispatch,  &agf_16 },
+  { "pdu_agf_next",  "agf-2",  op_pdu_agf_next,  &agf_2 },
+  { "pdu_agf_next",  "agf-4",  op_pdu_agf_next,  &agf_4 },
+  { "pdu_agf_next",  "agf-8",  op_pdu_agf_next,  &agf_8 },
+  { "pdu_agf_next",  "agf-16", op_pdu_agf_next,  &agf_16 },
+  { "pdu_new+pdu_pack", "connect", op_pdu_new_connect,     NULL },
+  { "pdu_builder",      "connect", op_pdu_builder_connect, NULL },
+  { "pdu_new+pdu_pack", "dm",      op_pdu_new_dm,          NULL },
+  { "pdu_pack_dm",      "dm",      op_pdu_pack_dm,         NULL },
+  { "parameter_encode_version", "tlv", op_encode_version, NULL },
+  { "parameter_decode_version", "tlv", op_decode_version, NULL },
+  { "parameter_encode_miux",    "tlv", op_encode_miux,    NULL },
+  { "parameter_decode_miux",    "tlv", op_decode_miux,    NULL },
+  { "parameter_encode_wks",     "tlv", op_encode_wks,     NULL },
+  { "parameter_decode_wks",     "tlv", op_decode_wks,     NULL },
+  { "parameter_encode_lto",     "tlv", op_encode_lto,     NULL },
+  { "parameter_decode_lto",     "tlv", op_decode_lto,     NULL },
+  { "parameter_encode_rw",      "tlv", op_encode_rw,      NULL },
+  { "parameter_decode_rw",      "tlv", op_decode_rw,      NULL },
+  { "parameter_encode_sn",      "tlv", op_encode_sn,      NULL },
+  { "parameter_decode_sn",      "tlv", op_decode_sn,      NULL },
+  { "parameter_encode_opt",     "tlv", op_encode_opt,     NULL },
+  { "parameter_decode_opt",     "tlv", op_decode_opt,     NULL },
+  { "parameter_encode_sdreq",   "tlv", op_encode_sdreq,   NULL },
+  { "parameter_decode_sdreq",   "tlv", op_decode_sdreq,   NULL },
+  { "parameter_encode_sdres",   "tlv", op_encode_sdres,   NULL },
+  { "parameter_decode_sdres",   "tlv", op_decode_sdres,   NULL },
+};
+
+/*
+ * Measurement
+ */
+
+struct codec_result {
+  size_t iterations;
+  double ns_per_op;
+  double allocs_per_op;
+};
+
+static double
+elapsed_ns(const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+static void
+measure(const struct codec_bench *bench, struct codec_result *result)
+{
+  struct timespec t0, t1;
+  size_t n = 1;
+  double ns;
+  size_t allocs;
+
+  /* Grow the iteration count until the run lasts long enough */
+  for (;;) {
+    allocs = allocations;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < n; i++)
+      bench->run(bench->arg, i);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    allocs = allocations - allocs;
+    ns = elapsed_ns(&t0, &t1);
+
+    if (ns >= options.min_time * 1e6)
+      break;
+
+    size_t next = (ns > 0) ? n * (options.min_time * 1e6 * 1.2 / ns) : n * 100;
+    if (next > 100 * n)
+      next = 100 * n;
+    if (next <= n)
+      next = n + 1;
+    n = next;
+  }
+
+  result->iterations = n;
+  result->ns_per_op = ns / n;
+  result->allocs_per_op = (double) allocs / n;
+}
+
+/*
+ * Output
+ */
+
+static void
+print_csv_header(void)
+{
+  printf("operation,input,iterations,ns_per_op,allocs_per_op\n");
+}
+
+static void
+print_csv(const struct codec_bench *bench, const struct codec_result *r)
+{
+#if defined(HAVE_ALLOCATION_COUNTER)
+  printf("%s,%s,%zu,%.1f,%.2f\n", bench->operation, bench->input, r->iterations, r->ns_per_op, r->allocs_per_op);
+#else
+  printf("%s,%s,%zu,%.1f,\n", bench->operation, bench->input, r->iterations, r->ns_per_op);
+#endif
+}
+
+static void
+print_json(const struct codec_bench *bench, const struct codec_result *r, int first)
+{
+  printf("%s\n  {\"operation\": \"%s\", \"input\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.1f, ",
+         first ? "" : ",", bench->operation, bench->input, r->iterations, r->ns_per_op);
+#if defined(HAVE_ALLOCATION_COUNTER)
+  printf("\"allocs_per_op\": %.2f}", r->allocs_per_op);
+#else
+  printf("\"allocs_per_op\": null}");
+#endif
+}
+
+/*
+ * Command line
+ */
+
+static struct option longopts[] = {
+  { "help",     no_argument,       NULL, 'h' },
+  { "min-time", required_argument, NULL, 't' },
+  { "filter",   required_argument, NULL, 'F' },
+  { "format",   required_argument, NULL, 'f' },
+  { NULL,       0,                 NULL, 0 },
+};
+
+static void
+usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options]\n", progname);
+  fprintf(stderr, "\nOptions:\n"
+          "  -h, --help            show this help message and exit\n"
+          "  --min-time=MSEC       minimum run time of each benchmark (default: 200)\n"
+          "  --filter=STRING       only run benchmarks whose operation or input contains STRING\n"
+          "  --format=FORMAT       output format, choices are 'csv' and 'json'\n"
+         );
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ch;
+  char *junk;
+
+  while ((ch = getopt_long(argc, argv, "ht:F:f:", longopts, NULL)) != -1) {
+    switch (ch) {
+      case 't':
+        options.min_time = strtol(optarg, &junk, 10);
+        if (*optarg == '\0' || *junk != '\0' || options.min_time <= 0)
+          errx(EXIT_FAILURE, "“%s” is not a valid time", optarg);
+        break;
+      case 'F':
+        options.filter = optarg;
+        break;
+      case 'f':
+        if (0 == strcasecmp("csv", optarg))
+          options.format = F_CSV;
+        else if (0 == strcasecmp("json", optarg))
+          options.format = F_JSON;
+        else
+          errx(EXIT_FAILURE, "“%s” is not a supported format", optarg);
+        break;
+      case 'h':
+      default:
+        usage(basename(argv[0]));
+        exit(EXIT_FAILURE);
+        break;
+    }
+  }
+
+  if (llcp_init() < 0)
+    errx(EXIT_FAILURE, "llcp_init()");
+
+  fixtures_init();
+
+  if (options.format == F_CSV)
+    print_csv_header();
+  else
+    printf("[");
+
+  int first = 1;
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+    const struct codec_bench *bench = &benchmarks[i];
+    struct codec_result result;
+
+    if (options.filter && !strstr(bench->operation, options.filter) && !strstr(bench->input, options.filter))
+      continue;
+
+    measure(bench, &result);
+
+    if (options.format == F_CSV)
+      print_csv(bench, &result);
+    else
+      print_json(bench, &result, first);
+    fflush(stdout);
+    first = 0;
+  }
+
+  if (options.format == F_JSON)
+    printf("\n]\n");
+
+  llcp_fini();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,181 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+/*
+ * Print stage latency histograms dumped by llc_link_dump_histograms():
+ *
+ *   llcp-histogram [--buckets] [--stage=NAME] file...
+ *
+ * For each stage, the number of samples, the minimum, mean and maximum
+ * latency and some percentiles are printed in microseconds.  With
+ * --buckets, the distribution is also plotted.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "llcp_histogram.h"
+
+#define BAR_WIDTH 50
+
+static void
+print_summary(const struct llcp_histogram_record *record)
+{
+  const struct llcp_histogram *h = &record->histogram;
+
+  if (!h->count) {
+    printf("%-16s %10d\n", record->name, 0);
+    return;
+  }
+
+  printf("%-16s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", record->name,
+         (unsigned long long) h->count,
+         h->min / 1e3,
+         (double) h->sum / h->count / 1e3,
+         llcp_histogram_percentile(h, 50.0) / 1e3,
+         llcp_histogram_percentile(h, 90.0) / 1e3,
+         llcp_histogram_percentile(h, 99.0) / 1e3,
+         llcp_histogram_percentile(h, 99.9) / 1e3,
+         h->max / 1e3);
+}
+
+static void
+print_buckets(const struct llcp_histogram_record *record)
+{
+  const struct llcp_histogram *h = &record->histogram;
+  uint64_t highest = 0;
+
+  for (size_t i = 0; i < LLCP_HISTOGRAM_BUCKETS; i++)
+    if (h->buckets[i] > highest)
+      highest = h->buckets[i];
+
+  if (!highest)
+    return;
+
+  printf("\n%s:\n", record->name);
+  for (size_t i = 0; i < LLCP_HISTOGRAM_BUCKETS; i++) {
+    if (!h->buckets[i])
+      continue;
+    int width = (int)((h->buckets[i] * BAR_WIDTH + highest - 1) / highest);
+    printf("  %12.1f .. %-12.1f %10llu  %.*s\n",
+           llcp_histogram_bucket_min(i) / 1e3,
+           (i == LLCP_HISTOGRAM_BUCKETS - 1) ? h->max / 1e3 : llcp_histogram_bucket_max(i) / 1e3,
+           (unsigned long long) h->buckets[i],
+           width, "##################################################");
+  }
+}
+
+static void
+usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options] file...\n", progname);
+  fprintf(stderr, "\nOptions:\n"
+          "  -h, --help            show this help message and exit\n"
+          "  --buckets             plot the latency distribution of each stage\n"
+          "  --stage=NAME          only show the given stage\n"
+         );
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ch;
+  char *progname = basename(argv[0]);
+  int buckets = 0;
+  const char *stage = NULL;
+
+  static struct option longopts[] = {
+    { "help",    no_argument,       NULL, 'h' },
+    { "buckets", no_argument,       NULL, 'b' },
+    { "stage",   required_argument, NULL, 's' },
+    { NULL,      0,                 NULL, 0 },
+  };
+
+  while ((ch = getopt_long(argc, argv, "hbs:", longopts, NULL)) != -1) {
+    switch (ch) {
+      case 'b':
+        buckets = 1;
+        break;
+      case 's':
+        stage = optarg;
+        break;
+      case 'h':
+      default:
+        usage(progname);
+        exit(EXIT_FAILURE);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (argc < 1) {
+    usage(progname);
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < argc; i++) {
+    FILE *f;
+    if (!(f = fopen(argv[i], "rb")))
+      err(EXIT_FAILURE, "%s", argv[i]);
+
+    struct llcp_histogram_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1)
+      errx(EXIT_FAILURE, "%s: Truncated header", argv[i]);
+    if (memcmp(header.magic, LLCP_HISTOGRAM_MAGIC, sizeof(LLCP_HISTOGRAM_MAGIC)) != 0)
+      errx(EXIT_FAILURE, "%s: Not a libllcp histograms dump", argv[i]);
+    if ((header.version != LLCP_HISTOGRAM_VERSION) || (header.buckets != LLCP_HISTOGRAM_BUCKETS))
+      errx(EXIT_FAILURE, "%s: Unsupported histograms version %u", argv[i], (unsigned) header.version);
+
+    struct llcp_histogram_record *records;
+    if (!(records = malloc(header.count * sizeof(*records))))
+      err(EXIT_FAILURE, "malloc");
+    if (fread(records, sizeof(*records), header.count, f) != header.count)
+      errx(EXIT_FAILURE, "%s: Truncated histograms", argv[i]);
+    fclose(f);
+
+    if (argc > 1)
+      printf("%s%s:\n", i ? "\n" : "", argv[i]);
+    printf("%-16s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+           "stage (us)", "count", "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (uint32_t r = 0; r < header.count; r++) {
+      records[r].name[sizeof(records[r].name) - 1] = '\0';
+      if (!stage || (0 == strcmp(stage, records[r].name)))
+        print_summary(&records[r]);
+    }
+    if (buckets) {
+      for (uint32_t r = 0; r < header.count; r++) {
+        if (!stage || (0 == strcmp(stage, records[r].name)))
+          print_buckets(&records[r]);
+      }
+    }
+    free(records);
+  }
+
+  exit(EXIT_SUCCESS);
+}
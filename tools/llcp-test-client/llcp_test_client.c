@@ -276,7 +276,7 @@ test_02_service(void *arg)
 {
   struct llc_connection *connection = (struct llc_connection *) arg;
 
-  uint8_t buffer[1024];
+  uint8_t buffer[LLCP_MAX_MIU];
   uint8_t ssap;
   int len = llc_connection_recv(connection, buffer, sizeof(buffer), &ssap);
   printf("Received %d bytes from %d: %s\n", len, ssap, buffer);
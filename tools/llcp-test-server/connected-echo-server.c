@@ -27,6 +27,7 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "llcp.h"
 #include "llcp_pdu.h"
 #include "llc_connection.h"
 #include "llc_connection.h"
@@ -50,7 +51,7 @@ connected_echo_server_thread(void *arg)
 
   for (;;) {
 
-    uint8_t buffer[1024];
+    uint8_t buffer[LLCP_MAX_MIU];
 
     int len;
     if ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) < 0)
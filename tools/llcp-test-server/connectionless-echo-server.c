@@ -28,6 +28,7 @@
 
 #include "llc_connection.h"
 #include "llc_link.h"
+#include "llcp.h"
 
 #include "connectionless-echo-server.h"
 
@@ -38,7 +39,7 @@ connectionless_echo_server_thread(void *arg)
 
 
   uint8_t remote_sap;
-  uint8_t buffer[1024];
+  uint8_t buffer[LLCP_MAX_MIU];
 
   int len = llc_connection_recv(connection, buffer, sizeof(buffer), &remote_sap);
 
@@ -0,0 +1,231 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+/*
+ * Decode binary traces recorded by libllcp (see llcp_trace.h).
+ *
+ * Run a program with LLCP_TRACE=/path/to/file in its environment, or call
+ * llcp_trace_dump(), then decode the file:
+ *
+ *   llcp-trace /path/to/file
+ *
+ * Events of all threads are merged and printed in chronological order, with
+ * timestamps relative to the first event.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "llcp_pdu.h"
+#include "llcp_trace.h"
+
+const char *pdu_names[] = {
+  "SYMM",
+  "PAX",
+  "AGF",
+  "UI",
+  "CONNECT",
+  "DISC",
+  "CC",
+  "DM",
+  "FRMR",
+  "SNL",
+  "???",
+  "???",
+  "I",
+  "RR",
+  "RNR",
+  "???"
+};
+
+const char *event_names[] = {
+  "???",
+  "MAC_SEND",
+  "MAC_RECEIVE",
+  "LLC_RECEIVE",
+  "LLC_SEND",
+  "WINDOW_FULL",
+  "INVALID_NS",
+  "CONNECTION",
+  "CONNECTION_GC",
+  "SDP_REQUEST",
+};
+
+/* Values of llc_connection->status */
+const char *connection_status_names[] = {
+  "NEW",
+  "ACCEPTED",
+  "REJECTED",
+  "RECEIVED_CC",
+  "CONNECTED",
+  "DISCONNECTED",
+  "TERMINATED",
+};
+
+#define NAME(names, i) (((size_t)(i) < sizeof(names) / sizeof(*names)) ? names[i] : "???")
+
+static int
+compare_events(const void *a, const void *b)
+{
+  const struct llcp_trace_event *e1 = a;
+  const struct llcp_trace_event *e2 = b;
+
+  if (e1->timestamp != e2->timestamp)
+    return (e1->timestamp < e2->timestamp) ? -1 : 1;
+  if (e1->thread != e2->thread)
+    return (e1->thread < e2->thread) ? -1 : 1;
+  return 0;
+}
+
+static void
+print_event(const struct llcp_trace_event *e, uint64_t origin)
+{
+  printf("%12.6f  T%-3u %-14s", (e->timestamp - origin) / 1e9, (unsigned) e->thread, NAME(event_names, e->event));
+
+  switch (e->event) {
+    case LLCP_TRACE_MAC_SEND:
+    case LLCP_TRACE_MAC_RECEIVE:
+    case LLCP_TRACE_LLC_RECEIVE:
+    case LLCP_TRACE_LLC_SEND:
+      printf(" %-8s %2d -> %-2d  %4d bytes", NAME(pdu_names, e->ptype & 0x0F), e->ssap, e->dsap, e->length);
+      switch (e->ptype) {
+        case PDU_I:
+          printf("  N(S)=%d N(R)=%d", e->ns, e->nr);
+          break;
+        case PDU_RR:
+        case PDU_RNR:
+          printf("  N(R)=%d", e->nr);
+          break;
+      }
+      break;
+    case LLCP_TRACE_WINDOW_FULL:
+      printf(" [%d -> %d]  V(S)=%d", e->ssap, e->dsap, e->value);
+      break;
+    case LLCP_TRACE_INVALID_NS:
+      printf(" [%d -> %d]  V(R)=%d", e->ssap, e->dsap, e->value);
+      break;
+    case LLCP_TRACE_CONNECTION_STATE:
+      printf(" [%d -> %d]  %s", e->ssap, e->dsap, NAME(connection_status_names, e->value));
+      break;
+    case LLCP_TRACE_CONNECTION_GC:
+      printf(" [%d -> %d]", e->ssap, e->dsap);
+      break;
+    case LLCP_TRACE_SDP_REQUEST:
+      printf(" [%d -> %d]  TID=0x%02x", e->ssap, e->dsap, e->value);
+      break;
+    default:
+      printf(" value=%d", e->value);
+      break;
+  }
+  printf("\n");
+}
+
+static void
+usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options] file\n", progname);
+  fprintf(stderr, "\nOptions:\n"
+          "  -h, --help            show this help message and exit\n"
+          "  --thread=N            only show events recorded by thread N\n"
+         );
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ch;
+  char *junk;
+  char *progname = basename(argv[0]);
+  long thread = -1;
+
+  static struct option longopts[] = {
+    { "help",   no_argument,       NULL, 'h' },
+    { "thread", required_argument, NULL, 't' },
+    { NULL,     0,                 NULL, 0 },
+  };
+
+  while ((ch = getopt_long(argc, argv, "ht:", longopts, NULL)) != -1) {
+    switch (ch) {
+      case 't':
+        thread = strtol(optarg, &junk, 10);
+        if (*optarg == '\0' || *junk != '\0' || thread < 0)
+          errx(EXIT_FAILURE, "“%s” is not a valid thread", optarg);
+        break;
+      case 'h':
+      default:
+        usage(progname);
+        exit(EXIT_FAILURE);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (argc != 1) {
+    usage(progname);
+    exit(EXIT_FAILURE);
+  }
+
+  FILE *f;
+  if (!(f = fopen(argv[0], "rb")))
+    err(EXIT_FAILURE, "%s", argv[0]);
+
+  struct llcp_trace_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1)
+    errx(EXIT_FAILURE, "%s: Truncated header", argv[0]);
+  if (memcmp(header.magic, LLCP_TRACE_MAGIC, sizeof(LLCP_TRACE_MAGIC)) != 0)
+    errx(EXIT_FAILURE, "%s: Not a libllcp trace", argv[0]);
+  if ((header.version != LLCP_TRACE_VERSION) || (header.event_size != sizeof(struct llcp_trace_event)))
+    errx(EXIT_FAILURE, "%s: Unsupported trace version %u", argv[0], (unsigned) header.version);
+
+  struct llcp_trace_event *events = NULL;
+  size_t count = 0, allocated = 0;
+
+  for (;;) {
+    if (count == allocated) {
+      allocated = allocated ? 2 * allocated : 1024;
+      if (!(events = realloc(events, allocated * sizeof(*events))))
+        err(EXIT_FAILURE, "realloc");
+    }
+    if (fread(&events[count], sizeof(*events), 1, f) != 1)
+      break;
+    if ((thread < 0) || (events[count].thread == thread))
+      count++;
+  }
+  if (ferror(f))
+    err(EXIT_FAILURE, "%s", argv[0]);
+  fclose(f);
+
+  qsort(events, count, sizeof(*events), compare_events);
+
+  for (size_t i = 0; i < count; i++)
+    print_event(&events[i], events[0].timestamp);
+
+  free(events);
+  exit(EXIT_SUCCESS);
+}